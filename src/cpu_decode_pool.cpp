@@ -0,0 +1,693 @@
+/*
+* Copyright 2023 Igalia S.L.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+// Decoding with openh264 on a pool of CPU threads, for the streams the GPUs don't take. Every stream has its own
+// openh264 decoder, which one thread of the pool at a time runs for a few access units, so the pictures of a
+// stream come out in order and a handful of threads serve many streams. The pool is shared by the process and
+// lives while it has streams. libopenh264 is loaded when the pool starts, the build only needs codec_api.h.
+// Compiled into vvb.cpp after the bootstrap.
+
+#include <deque>
+
+#if HAVE_OPENH264
+#include "codec_api.h"
+#else
+class ISVCDecoder;
+#endif
+
+namespace vvb {
+
+// Writes the RBSP of a parameter set, with the Exp-Golomb codes of H.264 9.1.
+struct RbspWriter
+{
+    std::vector<u8> _bytes;
+    u32 _acc { 0 };
+    u32 _num_bits { 0 };
+
+    void Bits(u32 value, u32 n)
+    {
+        for (u32 i = n; i-- > 0;) {
+            _acc = (_acc << 1) | ((value >> i) & 1);
+            if (++_num_bits == 8) {
+                _bytes.push_back((u8)_acc);
+                _acc = 0;
+                _num_bits = 0;
+            }
+        }
+    }
+
+    void Flag(bool value) { Bits(value, 1); }
+
+    void UE(u32 value)
+    {
+        ASSERT(value < UINT32_MAX);
+        u32 code = value + 1;
+        u32 len = std::bit_width(code) - 1;
+        Bits(0, len);
+        Bits(code, len + 1);
+    }
+
+    void SE(i32 value) { UE(value > 0 ? 2 * (u32)value - 1 : 2 * (u32)-value); }
+
+    void TrailingBits()
+    {
+        Flag(true);
+        while (_num_bits)
+            Flag(false);
+    }
+};
+
+// Appends rbsp as a NAL unit behind a 4 byte start code, with emulation prevention bytes.
+static void AppendNalUnit(std::vector<u8>* out, u8 header, const std::vector<u8>& rbsp)
+{
+    out->insert(out->end(), { 0, 0, 0, 1, header });
+    u32 zeros = 0;
+    for (u8 byte : rbsp) {
+        if (zeros == 2 && byte <= 3) {
+            out->push_back(3);
+            zeros = 0;
+        }
+        out->push_back(byte);
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+}
+
+static u32 AvcLevelIdc(StdVideoH264LevelIdc level)
+{
+    static const u8 level_idc[] = { 10, 11, 12, 13, 20, 21, 22, 30, 31, 32, 40, 41, 42, 50, 51, 52, 60, 61, 62 };
+    ASSERT((u32)level < ARRAY_ELEMS(level_idc));
+    return level_idc[level];
+}
+
+static void WriteHrdParameters(RbspWriter* w, const StdVideoH264HrdParameters& hrd)
+{
+    w->UE(hrd.cpb_cnt_minus1);
+    w->Bits(hrd.bit_rate_scale, 4);
+    w->Bits(hrd.cpb_size_scale, 4);
+    for (u32 i = 0; i <= hrd.cpb_cnt_minus1; i++) {
+        w->UE(hrd.bit_rate_value_minus1[i]);
+        w->UE(hrd.cpb_size_value_minus1[i]);
+        w->Flag(hrd.cbr_flag[i]);
+    }
+    w->Bits(hrd.initial_cpb_removal_delay_length_minus1, 5);
+    w->Bits(hrd.cpb_removal_delay_length_minus1, 5);
+    w->Bits(hrd.dpb_output_delay_length_minus1, 5);
+    w->Bits(hrd.time_offset_length, 5);
+}
+
+// Syntax elements StdVideoH264SequenceParameterSetVui has no field for get their inferred values (E.2.1).
+static void WriteVui(RbspWriter* w, const StdVideoH264SequenceParameterSetVui& vui)
+{
+    w->Flag(vui.flags.aspect_ratio_info_present_flag);
+    if (vui.flags.aspect_ratio_info_present_flag) {
+        w->Bits(vui.aspect_ratio_idc, 8);
+        if (vui.aspect_ratio_idc == STD_VIDEO_H264_ASPECT_RATIO_IDC_EXTENDED_SAR) {
+            w->Bits(vui.sar_width, 16);
+            w->Bits(vui.sar_height, 16);
+        }
+    }
+    w->Flag(vui.flags.overscan_info_present_flag);
+    if (vui.flags.overscan_info_present_flag)
+        w->Flag(vui.flags.overscan_appropriate_flag);
+    w->Flag(vui.flags.video_signal_type_present_flag);
+    if (vui.flags.video_signal_type_present_flag) {
+        w->Bits(vui.video_format, 3);
+        w->Flag(vui.flags.video_full_range_flag);
+        w->Flag(vui.flags.color_description_present_flag);
+        if (vui.flags.color_description_present_flag) {
+            w->Bits(vui.colour_primaries, 8);
+            w->Bits(vui.transfer_characteristics, 8);
+            w->Bits(vui.matrix_coefficients, 8);
+        }
+    }
+    w->Flag(vui.flags.chroma_loc_info_present_flag);
+    if (vui.flags.chroma_loc_info_present_flag) {
+        w->UE(vui.chroma_sample_loc_type_top_field);
+        w->UE(vui.chroma_sample_loc_type_bottom_field);
+    }
+    w->Flag(vui.flags.timing_info_present_flag);
+    if (vui.flags.timing_info_present_flag) {
+        w->Bits(vui.num_units_in_tick, 32);
+        w->Bits(vui.time_scale, 32);
+        w->Flag(vui.flags.fixed_frame_rate_flag);
+    }
+    w->Flag(vui.flags.nal_hrd_parameters_present_flag);
+    if (vui.flags.nal_hrd_parameters_present_flag)
+        WriteHrdParameters(w, *vui.pHrdParameters);
+    w->Flag(vui.flags.vcl_hrd_parameters_present_flag);
+    if (vui.flags.vcl_hrd_parameters_present_flag)
+        WriteHrdParameters(w, *vui.pHrdParameters);
+    if (vui.flags.nal_hrd_parameters_present_flag || vui.flags.vcl_hrd_parameters_present_flag)
+        w->Flag(false); // low_delay_hrd_flag
+    w->Flag(false); // pic_struct_present_flag
+    w->Flag(vui.flags.bitstream_restriction_flag);
+    if (vui.flags.bitstream_restriction_flag) {
+        w->Flag(true); // motion_vectors_over_pic_boundaries_flag
+        w->UE(2); // max_bytes_per_pic_denom
+        w->UE(1); // max_bits_per_mb_denom
+        w->UE(16); // log2_max_mv_length_horizontal
+        w->UE(16); // log2_max_mv_length_vertical
+        w->UE(vui.max_num_reorder_frames);
+        w->UE(vui.max_dec_frame_buffering);
+    }
+}
+
+// Scaling matrices are not written, streams that have them carry their own parameter sets.
+static void WriteSps(RbspWriter* w, const StdVideoH264SequenceParameterSet& sps)
+{
+    u32 profile_idc = sps.profile_idc;
+    w->Bits(profile_idc, 8);
+    w->Flag(sps.flags.constraint_set0_flag);
+    w->Flag(sps.flags.constraint_set1_flag);
+    w->Flag(sps.flags.constraint_set2_flag);
+    w->Flag(sps.flags.constraint_set3_flag);
+    w->Flag(sps.flags.constraint_set4_flag);
+    w->Flag(sps.flags.constraint_set5_flag);
+    w->Bits(0, 2); // reserved_zero_2bits
+    w->Bits(AvcLevelIdc(sps.level_idc), 8);
+    w->UE(sps.seq_parameter_set_id);
+    if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 || profile_idc == 244 || profile_idc == 44 ||
+        profile_idc == 83 || profile_idc == 86 || profile_idc == 118 || profile_idc == 128) {
+        w->UE(sps.chroma_format_idc);
+        if (sps.chroma_format_idc == STD_VIDEO_H264_CHROMA_FORMAT_IDC_444)
+            w->Flag(sps.flags.separate_colour_plane_flag);
+        w->UE(sps.bit_depth_luma_minus8);
+        w->UE(sps.bit_depth_chroma_minus8);
+        w->Flag(sps.flags.qpprime_y_zero_transform_bypass_flag);
+        ASSERT(!sps.flags.seq_scaling_matrix_present_flag);
+        w->Flag(false);
+    }
+    w->UE(sps.log2_max_frame_num_minus4);
+    w->UE(sps.pic_order_cnt_type);
+    if (sps.pic_order_cnt_type == STD_VIDEO_H264_POC_TYPE_0) {
+        w->UE(sps.log2_max_pic_order_cnt_lsb_minus4);
+    } else if (sps.pic_order_cnt_type == STD_VIDEO_H264_POC_TYPE_1) {
+        w->Flag(sps.flags.delta_pic_order_always_zero_flag);
+        w->SE(sps.offset_for_non_ref_pic);
+        w->SE(sps.offset_for_top_to_bottom_field);
+        w->UE(sps.num_ref_frames_in_pic_order_cnt_cycle);
+        for (u32 i = 0; i < sps.num_ref_frames_in_pic_order_cnt_cycle; i++)
+            w->SE(sps.pOffsetForRefFrame[i]);
+    }
+    w->UE(sps.max_num_ref_frames);
+    w->Flag(sps.flags.gaps_in_frame_num_value_allowed_flag);
+    w->UE(sps.pic_width_in_mbs_minus1);
+    w->UE(sps.pic_height_in_map_units_minus1);
+    w->Flag(sps.flags.frame_mbs_only_flag);
+    if (!sps.flags.frame_mbs_only_flag)
+        w->Flag(sps.flags.mb_adaptive_frame_field_flag);
+    w->Flag(sps.flags.direct_8x8_inference_flag);
+    w->Flag(sps.flags.frame_cropping_flag);
+    if (sps.flags.frame_cropping_flag) {
+        w->UE(sps.frame_crop_left_offset);
+        w->UE(sps.frame_crop_right_offset);
+        w->UE(sps.frame_crop_top_offset);
+        w->UE(sps.frame_crop_bottom_offset);
+    }
+    w->Flag(sps.flags.vui_parameters_present_flag);
+    if (sps.flags.vui_parameters_present_flag)
+        WriteVui(w, *sps.pSequenceParameterSetVui);
+    w->TrailingBits();
+}
+
+static void WritePps(RbspWriter* w, const StdVideoH264PictureParameterSet& pps)
+{
+    w->UE(pps.pic_parameter_set_id);
+    w->UE(pps.seq_parameter_set_id);
+    w->Flag(pps.flags.entropy_coding_mode_flag);
+    w->Flag(pps.flags.bottom_field_pic_order_in_frame_present_flag);
+    w->UE(0); // num_slice_groups_minus1, there are no slice groups in Vulkan Video
+    w->UE(pps.num_ref_idx_l0_default_active_minus1);
+    w->UE(pps.num_ref_idx_l1_default_active_minus1);
+    w->Flag(pps.flags.weighted_pred_flag);
+    w->Bits(pps.weighted_bipred_idc, 2);
+    w->SE(pps.pic_init_qp_minus26);
+    w->SE(pps.pic_init_qs_minus26);
+    w->SE(pps.chroma_qp_index_offset);
+    w->Flag(pps.flags.deblocking_filter_control_present_flag);
+    w->Flag(pps.flags.constrained_intra_pred_flag);
+    w->Flag(pps.flags.redundant_pic_cnt_present_flag);
+    // The elements added by the High profiles, only when they differ from their inferred values
+    if (pps.flags.transform_8x8_mode_flag || pps.flags.pic_scaling_matrix_present_flag ||
+        pps.second_chroma_qp_index_offset != pps.chroma_qp_index_offset) {
+        w->Flag(pps.flags.transform_8x8_mode_flag);
+        ASSERT(!pps.flags.pic_scaling_matrix_present_flag);
+        w->Flag(false);
+        w->SE(pps.second_chroma_qp_index_offset);
+    }
+    w->TrailingBits();
+}
+
+// The SPS and PPS of ps as Annex B NAL units, for decoders that only take parameter sets in band.
+static std::vector<u8> WriteAvcParameterSets(const AvcParameterSets& ps)
+{
+    RbspWriter sps;
+    WriteSps(&sps, ps._sps);
+    RbspWriter pps;
+    WritePps(&pps, ps._pps);
+    std::vector<u8> out;
+    AppendNalUnit(&out, 0x67, sps._bytes); // nal_ref_idc 3, nal_unit_type 7
+    AppendNalUnit(&out, 0x68, pps._bytes);
+    return out;
+}
+
+// Bit n is set when the Annex B access unit has a NAL unit of type n.
+static u32 NalUnitTypes(const u8* data, size_t size)
+{
+    u32 types = 0;
+    for (size_t i = 0; i + 3 < size; i++) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            types |= 1u << (data[i + 3] & 0x1f);
+            i += 2;
+        }
+    }
+    return types;
+}
+
+constexpr u32 NalUnitSlices = (1u << 1) | (1u << 5);
+constexpr u32 NalUnitIdrSlice = 1u << 5;
+
+// A picture decoded by openh264: I420 in memory of the decoder, valid until the output callback returns.
+struct CpuPicture
+{
+    i64 _pts;
+    u32 _width;
+    u32 _height;
+    const u8* _planes[3];
+    u32 _pitches[3];
+};
+
+// Called on a thread of the pool once for every access unit of a stream, in output order, with its picture or
+// with nullptr when it had no slices or failed to decode. Never for two pictures of a stream at once.
+using CpuOutputFn = void (*)(void* user, const CpuPicture* picture);
+
+struct CpuAccessUnit
+{
+    std::vector<u8> _data;
+    i64 _pts;
+};
+
+struct CpuDecodePool;
+
+struct CpuStream
+{
+    CpuDecodePool* _pool;
+    ISVCDecoder* _decoder;
+    CpuOutputFn _output;
+    void* _user;
+
+    // Guarded by the mutex of the pool
+    std::deque<CpuAccessUnit> _pending;
+    bool _scheduled { false }; // runnable, or being decoded by a thread of the pool
+    bool _flush_requested { false };
+    u32 _flush_token { 0 };
+
+    // Only touched by the thread decoding the stream
+    u32 _held { 0 }; // access units with slices whose picture openh264 has not output yet
+    u32 _decoded { 0 };
+    u32 _failed { 0 };
+    std::atomic<u32> _finished { 0 }; // access units handed to _output
+};
+
+struct OpenH264Library
+{
+    void* _lib { nullptr };
+#if HAVE_OPENH264
+    decltype(&WelsCreateDecoder) _create_decoder { nullptr };
+    decltype(&WelsDestroyDecoder) _destroy_decoder { nullptr };
+#endif
+};
+
+struct CpuDecodePool
+{
+    OpenH264Library _openh264;
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _runnable_cv;
+    std::condition_variable _idle_cv; // a stream is no longer scheduled
+    std::deque<CpuStream*> _runnable;
+    u32 _busy_threads { 0 };
+    u32 _num_streams { 0 };
+    bool _stopping { false };
+
+    u32 _max_streams { 0 };
+    u64 _pictures { 0 };
+    u64 _busy_ns { 0 };
+    util::Timer _lifetime;
+};
+
+// Created by the first stream placed on the CPU, destroyed with the last one.
+static std::mutex cpu_pool_mutex;
+static CpuDecodePool* cpu_pool { nullptr };
+
+// A thread runs a stream for up to this many access units, then lets the other runnable streams go first.
+constexpr u32 CpuStreamQuantum = 4;
+
+#if HAVE_OPENH264
+#ifndef VVB_OPENH264_LIBRARY
+#define VVB_OPENH264_LIBRARY "libopenh264.so.7"
+#endif
+
+static bool LoadOpenH264(OpenH264Library* lib)
+{
+    // The one the environment names, then the one the build names, then the one of the system
+    const char* env_libname = getenv("VVB_OPENH264_LIBRARY");
+    const std::array<const char*, 3> libnames = {
+        env_libname && *env_libname ? env_libname : nullptr,
+        VVB_OPENH264_LIBRARY,
+        "libopenh264.so.7"
+    };
+    for (const char* libname : libnames) {
+        if (!libname)
+            continue;
+        lib->_lib = dlopen(libname, RTLD_NOW | RTLD_LOCAL);
+        if (lib->_lib)
+            break;
+    }
+    if (!lib->_lib) {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+    lib->_create_decoder = (decltype(&WelsCreateDecoder))dlsym(lib->_lib, "WelsCreateDecoder");
+    lib->_destroy_decoder = (decltype(&WelsDestroyDecoder))dlsym(lib->_lib, "WelsDestroyDecoder");
+    if (!lib->_create_decoder || !lib->_destroy_decoder) {
+        dlclose(lib->_lib);
+        lib->_lib = nullptr;
+        return false;
+    }
+    return true;
+}
+
+// Failed pictures are dropped rather than concealed, as on the GPU. The decoder starts with parameter_sets.
+// With num_threads, openh264 decodes up to that many pictures at once on threads of its own, 0 decodes on the
+// calling thread.
+static ISVCDecoder* CreateOpenH264Decoder(const OpenH264Library& lib, const std::vector<u8>& parameter_sets,
+    int num_threads)
+{
+    ISVCDecoder* decoder = nullptr;
+    if (lib._create_decoder(&decoder) != 0 || !decoder)
+        return nullptr;
+    int trace_level = WELS_LOG_ERROR;
+    decoder->SetOption(DECODER_OPTION_NUM_OF_THREADS, &num_threads);
+    decoder->SetOption(DECODER_OPTION_TRACE_LEVEL, &trace_level);
+    SDecodingParam param = {};
+    param.uiTargetDqLayer = (u8)-1;
+    param.eEcActiveIdc = ERROR_CON_DISABLE;
+    param.sVideoProperty.eVideoBsType = VIDEO_BITSTREAM_AVC;
+    if (decoder->Initialize(&param) != cmResultSuccess) {
+        lib._destroy_decoder(decoder);
+        return nullptr;
+    }
+    u8* planes[3] = {};
+    SBufferInfo info = {};
+    decoder->DecodeFrameNoDelay(parameter_sets.data(), (int)parameter_sets.size(), planes, &info);
+    return decoder;
+}
+
+static void DestroyOpenH264Decoder(const OpenH264Library& lib, ISVCDecoder* decoder)
+{
+    decoder->Uninitialize();
+    lib._destroy_decoder(decoder);
+}
+
+// Each picture that comes out accounts for one access unit openh264 holds.
+static void EmitCpuPicture(CpuStream* s, const SBufferInfo& info, u8* const* planes)
+{
+    if (s->_held == 0)
+        return;
+    const SSysMEMBuffer& buffer = info.UsrData.sSystemBuffer;
+    CpuPicture picture;
+    picture._pts = (i64)info.uiOutYuvTimeStamp;
+    picture._width = (u32)buffer.iWidth;
+    picture._height = (u32)buffer.iHeight;
+    for (u32 i = 0; i < 3; i++) {
+        picture._planes[i] = planes[i];
+        picture._pitches[i] = (u32)buffer.iStride[i == 0 ? 0 : 1];
+    }
+    s->_held--;
+    s->_decoded++;
+    s->_finished.fetch_add(1, std::memory_order_release);
+    s->_output(s->_user, &picture);
+}
+
+static void DropCpuAccessUnit(CpuStream* s)
+{
+    s->_finished.fetch_add(1, std::memory_order_release);
+    s->_output(s->_user, nullptr);
+}
+
+static void DecodeCpuAccessUnit(CpuStream* s, const CpuAccessUnit& au)
+{
+    bool has_slices = NalUnitTypes(au._data.data(), au._data.size()) & NalUnitSlices;
+    u8* planes[3] = {};
+    SBufferInfo info = {};
+    info.uiInBsTimeStamp = (unsigned long long)au._pts;
+    DECODING_STATE state = s->_decoder->DecodeFrameNoDelay(au._data.data(), (int)au._data.size(), planes, &info);
+    if (!has_slices) {
+        DropCpuAccessUnit(s);
+        return;
+    }
+    s->_held++;
+    if (info.iBufferStatus == 1) {
+        EmitCpuPicture(s, info, planes);
+    } else if (state != dsErrorFree && state != dsFramePending) {
+        s->_held--;
+        s->_failed++;
+        DropCpuAccessUnit(s);
+    }
+}
+
+// openh264 holds pictures back until it has seen more of the stream, these are the ones it still has.
+static void FlushCpuStream(CpuStream* s)
+{
+    while (s->_held > 0) {
+        u8* planes[3] = {};
+        SBufferInfo info = {};
+        s->_decoder->FlushFrame(planes, &info);
+        if (info.iBufferStatus != 1)
+            break;
+        EmitCpuPicture(s, info, planes);
+    }
+    // Access units that failed while an earlier picture came out
+    for (; s->_held > 0; s->_held--) {
+        s->_failed++;
+        DropCpuAccessUnit(s);
+    }
+}
+#else
+static bool LoadOpenH264(OpenH264Library*)
+{
+    printf("Built without openh264, streams can't be decoded on the CPU\n");
+    return false;
+}
+
+static ISVCDecoder* CreateOpenH264Decoder(const OpenH264Library&, const std::vector<u8>&, int) { return nullptr; }
+static void DestroyOpenH264Decoder(const OpenH264Library&, ISVCDecoder*) {}
+static void DecodeCpuAccessUnit(CpuStream*, const CpuAccessUnit&) {}
+static void FlushCpuStream(CpuStream*) {}
+#endif
+
+static void RunCpuDecodeThread(CpuDecodePool* pool)
+{
+    util::Timer busy;
+    std::unique_lock<std::mutex> lock(pool->_mutex);
+    for (;;)
+    {
+        pool->_runnable_cv.wait(lock, [pool] { return pool->_stopping || !pool->_runnable.empty(); });
+        if (pool->_runnable.empty())
+            break;
+        CpuStream* s = pool->_runnable.front();
+        pool->_runnable.pop_front();
+        pool->_busy_threads++;
+        lock.unlock();
+
+        busy.GetCurrentTime();
+        for (u32 i = 0; i < CpuStreamQuantum; i++) {
+            lock.lock();
+            if (s->_pending.empty()) {
+                lock.unlock();
+                break;
+            }
+            CpuAccessUnit au = std::move(s->_pending.front());
+            s->_pending.pop_front();
+            lock.unlock();
+            DecodeCpuAccessUnit(s, au);
+        }
+        // Unless a picture came out since the flush was requested, its consumer waits for the held ones.
+        lock.lock();
+        if (s->_pending.empty() && s->_flush_requested) {
+            s->_flush_requested = false;
+            if (s->_flush_token == s->_finished.load(std::memory_order_relaxed)) {
+                lock.unlock();
+                FlushCpuStream(s);
+                lock.lock();
+            }
+        }
+        pool->_busy_ns += busy.ElapsedNanoseconds();
+        pool->_busy_threads--;
+        if (s->_pending.empty() && !s->_flush_requested) {
+            s->_scheduled = false;
+            pool->_idle_cv.notify_all();
+        } else {
+            pool->_runnable.push_back(s);
+        }
+    }
+}
+
+// With the mutex of the pool held.
+static void ScheduleCpuStream(CpuDecodePool* pool, CpuStream* s)
+{
+    if (s->_scheduled)
+        return;
+    s->_scheduled = true;
+    pool->_runnable.push_back(s);
+    pool->_runnable_cv.notify_one();
+}
+
+// With cpu_pool_mutex held, once the pool has no streams left.
+static void DestroyCpuDecodePool(CpuDecodePool* pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool->_mutex);
+        pool->_stopping = true;
+    }
+    pool->_runnable_cv.notify_all();
+    for (std::thread& thread : pool->_threads)
+        thread.join();
+    u64 lifetime_ns = pool->_lifetime.ElapsedNanoseconds();
+    printf("CPU decode pool: %zu threads, up to %u streams, %" PRIu64 " pictures, threads busy %5.1f%% of %" PRIu64 " ms\n",
+        pool->_threads.size(), pool->_max_streams, pool->_pictures,
+        lifetime_ns ? 100.0 * pool->_busy_ns / (lifetime_ns * pool->_threads.size()) : 0.0, lifetime_ns / 1000000);
+    if (pool->_openh264._lib)
+        dlclose(pool->_openh264._lib);
+    delete pool;
+}
+
+// Starts the pool with num_threads threads, one per core for 0, when it isn't running. Returns nullptr when
+// openh264 can't be loaded or fails to start. parameter_sets are decoded ahead of the stream.
+static CpuStream* OpenCpuStream(u32 num_threads, const std::vector<u8>& parameter_sets, CpuOutputFn output, void* user)
+{
+    std::lock_guard<std::mutex> pool_lock(cpu_pool_mutex);
+    if (!cpu_pool) {
+        auto* pool = new CpuDecodePool;
+        if (!LoadOpenH264(&pool->_openh264)) {
+            delete pool;
+            return nullptr;
+        }
+        if (num_threads == 0)
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        pool->_lifetime.GetCurrentTime();
+        for (u32 i = 0; i < num_threads; i++)
+            pool->_threads.emplace_back(RunCpuDecodeThread, pool);
+        cpu_pool = pool;
+    }
+
+    // While fewer streams than threads leave cores idle, openh264 decodes the pictures of each on threads of its
+    // own, up to 16. The count is set for the life of the decoder, from the streams open when it starts.
+    u32 pool_threads = (u32)cpu_pool->_threads.size();
+    u32 pool_streams = cpu_pool->_num_streams + 1;
+    int decoder_threads = pool_threads / pool_streams >= 2 ? (int)std::min(pool_threads / pool_streams, 16u) : 0;
+    ISVCDecoder* decoder = CreateOpenH264Decoder(cpu_pool->_openh264, parameter_sets, decoder_threads);
+    if (!decoder) {
+        printf("Could not start an openh264 decoder\n");
+        if (cpu_pool->_num_streams == 0) {
+            DestroyCpuDecodePool(cpu_pool);
+            cpu_pool = nullptr;
+        }
+        return nullptr;
+    }
+    auto* s = new CpuStream;
+    s->_pool = cpu_pool;
+    s->_decoder = decoder;
+    s->_output = output;
+    s->_user = user;
+    std::lock_guard<std::mutex> lock(cpu_pool->_mutex);
+    cpu_pool->_num_streams++;
+    cpu_pool->_max_streams = std::max(cpu_pool->_max_streams, cpu_pool->_num_streams);
+    return s;
+}
+
+// Waits for the pool to be done with s. Access units still pending are dropped without output.
+static void CloseCpuStream(CpuStream* s)
+{
+    std::lock_guard<std::mutex> pool_lock(cpu_pool_mutex);
+    CpuDecodePool* pool = s->_pool;
+    {
+        std::unique_lock<std::mutex> lock(pool->_mutex);
+        s->_pending.clear();
+        s->_flush_requested = false;
+        pool->_idle_cv.wait(lock, [s] { return !s->_scheduled; });
+        pool->_num_streams--;
+        pool->_pictures += s->_decoded;
+    }
+    printf("CPU stream: %u pictures decoded, %u failed\n", s->_decoded, s->_failed);
+    DestroyOpenH264Decoder(pool->_openh264, s->_decoder);
+    delete s;
+    if (pool->_num_streams == 0) {
+        DestroyCpuDecodePool(pool);
+        cpu_pool = nullptr;
+    }
+}
+
+static size_t CpuStreamPending(CpuStream* s)
+{
+    std::lock_guard<std::mutex> lock(s->_pool->_mutex);
+    return s->_pending.size();
+}
+
+static void QueueCpuAccessUnit(CpuStream* s, const void* data, size_t size, i64 pts)
+{
+    CpuAccessUnit au = { std::vector<u8>((const u8*)data, (const u8*)data + size), pts };
+    std::lock_guard<std::mutex> lock(s->_pool->_mutex);
+    s->_pending.push_back(std::move(au));
+    ScheduleCpuStream(s->_pool, s);
+}
+
+// A token for RequestCpuStreamFlush, read before checking for output.
+static u32 CpuStreamFinished(const CpuStream* s)
+{
+    return s->_finished.load(std::memory_order_acquire);
+}
+
+// The consumer of s is about to wait for its next picture without sending anything more. Once the pending access
+// units are decoded, the pictures openh264 holds are flushed, unless one came out since token was read.
+static void RequestCpuStreamFlush(CpuStream* s, u32 token)
+{
+    std::lock_guard<std::mutex> lock(s->_pool->_mutex);
+    s->_flush_requested = true;
+    s->_flush_token = token;
+    ScheduleCpuStream(s->_pool, s);
+}
+
+// Cores left for another stream: the online cores minus the one minute load average, or minus the threads of the
+// pool busy or due to run when that is higher, since the load average lags.
+static float CpuHeadroom()
+{
+    float load = 0.0f;
+    if (FILE* f = fopen("/proc/loadavg", "r")) {
+        if (fscanf(f, "%f", &load) != 1)
+            load = 0.0f;
+        fclose(f);
+    }
+    std::lock_guard<std::mutex> pool_lock(cpu_pool_mutex);
+    if (cpu_pool) {
+        std::lock_guard<std::mutex> lock(cpu_pool->_mutex);
+        load = std::max(load, float(cpu_pool->_busy_threads + cpu_pool->_runnable.size()));
+    }
+    return float(std::thread::hardware_concurrency()) - load;
+}
+
+} // namespace vvb
@@ -14,33 +14,229 @@
 * limitations under the License.
 */
 #include "util.hpp"
-#include "vk.hpp"
+#include "vvb.hpp"
 
+#include <atomic>
+#include <cinttypes>
 #include <string>
-#include <numeric>
+#include <vector>
 
-#include "vulkan_video_bootstrap.cpp"
+#include <fcntl.h>
+#include <unistd.h>
+
+// Writes the planes of a picture without their padding, in one writev(). Planes without padding are one vector
+// each, and a tight frame whose planes follow each other goes out as a single one.
+static bool WritePicture(int fd, const u8* data, const vvb::FramePicture& picture)
+{
+    std::vector<struct iovec> iov;
+    auto append = [&iov](const u8* bytes, size_t size) {
+        if (!iov.empty() && (const u8*)iov.back().iov_base + iov.back().iov_len == bytes)
+            iov.back().iov_len += size;
+        else
+            iov.push_back({ (void*)bytes, size });
+    };
+    for (u32 p = 0; p < picture.num_planes; p++) {
+        const vvb::FramePlane& plane = picture.planes[p];
+        if (plane.pitch == plane.row_bytes) {
+            append(data + plane.offset, size_t(plane.rows) * plane.pitch);
+            continue;
+        }
+        for (u32 row = 0; row < plane.rows; row++)
+            append(data + plane.offset + size_t(row) * plane.pitch, plane.row_bytes);
+    }
+    return util::WriteAllVectors(fd, iov.data(), (int)iov.size());
+}
+
+// A coroutine nobody awaits: it starts right away and frees itself once it returns.
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { abort(); }
+    };
+};
+
+// The access units of an Annex B stream, see util::SplitAccessUnits.
+struct AccessUnits
+{
+    const u8* data;
+    std::vector<size_t> offsets; // the end of the stream last
+
+    size_t Count() const { return offsets.size() - 1; }
+};
+
+// Sends count access units, going back to the first after the last, and outputs every frame, suspended rather than
+// blocked while they are decoded. Runs on the reactor thread of the decoder once resumed, done is set when it returns.
+template<typename OutputFn>
+static Detached DecodeAsync(vvb::Decoder* decoder, const AccessUnits* units, int count, OutputFn* output, std::atomic<bool>* done)
+{
+    for (int i = 0; i < count; i++) {
+        size_t unit = i % units->Count();
+        const u8* data = units->data + units->offsets[unit];
+        size_t size = units->offsets[unit + 1] - units->offsets[unit];
+        while (!vvb::SendAccessUnit(decoder, data, size, i)) {
+            if (vvb::DecodedFrame* frame = co_await vvb::NextFrame(decoder))
+                (*output)(frame);
+        }
+    }
+    while (vvb::DecodedFrame* frame = co_await vvb::NextFrame(decoder))
+        (*output)(frame);
+    done->store(true);
+    done->notify_all();
+}
+
+// A video wall: the access unit is decoded by streams decoders and one frame of each is composited into a mosaic
+// of half size tiles, written to /tmp/vd.yuv.
+static int DecodeWall(vvb::DecoderOptions options, int streams, const u8* data, size_t size)
+{
+    // The decoders share the devices of the process, the mosaic samples the frames of those on the first one's
+    options.all_devices = true;
+    options.mosaic_source = true;
+    options.output = vvb::DECODER_OUTPUT_NV12;
+    std::vector<vvb::Decoder*> decoders;
+    for (int i = 0; i < streams; i++) {
+        vvb::Decoder* decoder = vvb::OpenDecoder(options);
+        if (!decoder)
+            XERROR(1, "Could not open decoder %d\n", i);
+        decoders.push_back(decoder);
+    }
+    std::vector<vvb::DecodedFrame*> frames;
+    // A new decoder has room for it, a refused access unit would leave the tile without a frame
+    for (int i = 0; i < streams; i++) {
+        if (!vvb::SendAccessUnit(decoders[i], data, size, i))
+            XERROR(1, "Decoder %d did not take the access unit\n", i);
+    }
+    for (int i = 0; i < streams; i++) {
+        frames.push_back(vvb::ReceiveFrame(decoders[i], true));
+        if (!frames.back())
+            fprintf(stderr, "Stream %d has no frame, its tile is black\n", i);
+    }
+    if (!frames[0])
+        XERROR(1, "The first stream has no frame\n");
+
+    const vvb::FramePicture& picture = vvb::GetFramePicture(frames[0], 0);
+    vvb::Mosaic* mosaic = vvb::OpenMosaic(decoders[0], streams, picture.width / 2, picture.height / 2);
+    if (!mosaic)
+        XERROR(1, "Could not open a mosaic\n");
+    vvb::DecodedFrame* canvas = vvb::ComposeMosaic(mosaic, frames.data(), frames.size());
+    const vvb::FramePicture& canvas_picture = vvb::GetFramePicture(canvas, 0);
+    int out_fd = open("/tmp/vd.yuv", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0)
+        XERROR(errno, "Could not open /tmp/vd.yuv\n");
+    if (!WritePicture(out_fd, vvb::FrameData(canvas), canvas_picture))
+        XERROR(errno, "Failed to write /tmp/vd.yuv\n");
+    close(out_fd);
+    printf("Wrote a %ux%u mosaic of %u streams\n", canvas_picture.width, canvas_picture.height,
+        vvb::MosaicTileCount(mosaic));
+
+    vvb::ReleaseFrame(canvas);
+    vvb::CloseMosaic(mosaic);
+    for (vvb::DecodedFrame* frame : frames) {
+        if (frame)
+            vvb::ReleaseFrame(frame);
+    }
+    for (vvb::Decoder* decoder : decoders)
+        vvb::CloseDecoder(decoder);
+    return 0;
+}
+
+static u64 ProcessCpuNanoseconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return u64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Decodes the input repeats times in each of streams decoders at once and prints the throughput, overall and per
+// core busy. Frames are received in coroutines, so no thread waits per stream. With --cpu this is the CPU baseline:
+// the streams share the openh264 pool of the process, which takes turns between them.
+static int DecodeStreams(const vvb::DecoderOptions& options, int streams, int repeats, const AccessUnits& units)
+{
+    std::vector<vvb::Decoder*> decoders;
+    for (int i = 0; i < streams; i++) {
+        vvb::Decoder* decoder = vvb::OpenDecoder(options);
+        if (!decoder)
+            XERROR(1, "Could not open decoder %d\n", i);
+        decoders.push_back(decoder);
+    }
+
+    std::atomic<u64> num_frames { 0 };
+    auto count_frame = [&num_frames](vvb::DecodedFrame* frame) {
+        vvb::ReleaseFrame(frame);
+        num_frames++;
+    };
+    std::vector<std::atomic<bool>> done(streams);
+    util::Timer wall;
+    wall.GetCurrentTime();
+    u64 cpu_start = ProcessCpuNanoseconds();
+    int frames = repeats * (int)units.Count();
+    for (int i = 0; i < streams; i++)
+        DecodeAsync(decoders[i], &units, frames, &count_frame, &done[i]);
+    for (std::atomic<bool>& stream_done : done)
+        stream_done.wait(false);
+    u64 wall_ns = wall.ElapsedNanoseconds();
+    u64 cpu_ns = ProcessCpuNanoseconds() - cpu_start;
+
+    for (vvb::Decoder* decoder : decoders)
+        vvb::CloseDecoder(decoder);
+    u64 total = num_frames.load();
+    printf("%d streams of %d frames: %" PRIu64 " frames in %.1f ms, %.1f fps, %.1f fps per core, %.2f cores busy\n",
+        streams, frames, total, wall_ns / 1000000.0, wall_ns ? total * 1e9 / wall_ns : 0.0,
+        cpu_ns ? total * 1e9 / cpu_ns : 0.0, wall_ns ? double(cpu_ns) / wall_ns : 0.0);
+    return total == u64(streams) * frames ? 0 : 1;
+}
 
 int main(int argc, char** argv)
 {
-    bool detect_env = false, enable_validation = VK_FALSE;
-	const char* requested_device_name = nullptr;
-	int device_major = -1, device_minor = -1;
-    int driver_major = -1, driver_minor = -1, driver_patch = -1;
+    vvb::DecoderOptions options;
+    vvb::DecoderOutput convert_output = vvb::DECODER_OUTPUT_NV12;
+    bool checksum = false;
+    const char* mock_driver = nullptr;
+    int bench_frames = 0;
+    bool async = false;
+    int max_first_frame_us = 0;
+    int wall_streams = 0;
+    int streams = 0;
+    const char* input = nullptr;
 
     for (int arg = 1; arg < argc; arg++) {
         if (util::StrEqual(argv[arg], "--help")) {
             printf("Usage: %s [options] <input>\n", argv[0]);
             printf("Options:\n");
             printf("  --help: print this message\n");
-            printf("  --detect: detect devices and capabilities\n");
+            printf("  --detect: list devices, layers, extensions and queue families while starting up, refreshes the capability cache\n");
             printf("  --validate-api-calls: enable vulkan validation layer (EXTRA SLOW!)\n");
             printf("  --device-name=<name> : case-insentive substring search of the reported device name to select (e.g. nvidia or amd)\n");
 			printf("  --device-major-minor=<major>.<minor> : select device by major and minor version (hex)\n");
             printf("    --driver-version=<major>.<minor>.<patch> (e.g. 23.2.99): select device by available driver version\n");
+            printf("  --all-devices: open every device that matches the selection, or every one that decodes, and place the stream on the least loaded\n");
+            printf("  --measure-stream-switch: time DPB teardown and recreation across resolutions, with and without the image pool\n");
+            printf("  --convert=<rgba|i420>: convert the decoded frames on the GPU before reading them back\n");
+            printf("    --color-matrix=<601|709>: YCbCr to RGB matrix for rgba (default 709)\n");
+            printf("    --full-range: the stream uses full range YCbCr\n");
+            printf("  --preview=<div>[,<div>...]: only read back NV12 renditions downscaled on the GPU by each divisor (e.g. 4,8), up to %u\n", vvb::DecoderMaxPreviews);
+            printf("    --preview-filter=<bilinear|area>: downscaling filter (default bilinear)\n");
+            printf("  --tensor=<width>x<height>: read back letterboxed, normalized NCHW RGB float tensors (e.g. 640x640)\n");
+            printf("    --tensor-fp16: float16 elements instead of float32\n");
+            printf("    --tensor-mean=<r>,<g>,<b> --tensor-std=<r>,<g>,<b>: normalization, in the [0, 1] range\n");
+            printf("  --checksum: print per-plane checksums computed on the GPU (see util::LaneHashPlane) instead of reading back the frame\n");
+            printf("  --mosaic=<tiles>: composite the frame into a grid of half size tiles on the GPU and read back the canvas, up to %u\n", vvb::DecoderMaxMosaicTiles);
+            printf("  --wall=<streams>: decode with this many decoders and composite a frame of each into one canvas, up to %u\n", vvb::DecoderMaxMosaicTiles);
+            printf("  --mock-driver[=<key>=<value>,...]: run against a software driver with no GPU, decode and compute only take time (e.g. decode_queues=2,decode_us=500)\n");
+            printf("  --bench=<frames>: decode the stream this many times without writing the output, and print the frame rate\n");
+            printf("  --streams=<n>: decode <input>, an Annex B H.264 stream, with this many decoders at once, --bench times each, and print the throughput and the cores busy\n");
+            printf("  --async: receive the frames in a coroutine resumed by the decoder instead of blocking this thread\n");
+            printf("  --max-first-frame-us=<us>: fail when the first frame takes longer to come out, from opening the decoder\n");
+            printf("  --cpu: decode with openh264 on a pool of CPU threads instead of a GPU\n");
+            printf("    --cpu-threads=<n>: threads of the pool (default one per core)\n");
+            printf("  --no-cpu-fallback: fail rather than decode on the CPU when the GPUs are busy, failing or can't decode the stream\n");
 			exit(0);
         } else if (util::StrHasPrefix(argv[arg], "--device-name=")) {
-            requested_device_name = util::StrRemovePrefix(argv[arg], "--device-name=");
+            options.device_name = util::StrRemovePrefix(argv[arg], "--device-name=");
 		} else if (util::StrHasPrefix(argv[arg], "--device-major-minor=")) {
             std::string major_minor_pair = util::StrRemovePrefix(argv[arg], "--device-major-minor=");
 
@@ -48,8 +244,8 @@ int main(int argc, char** argv)
 			ASSERT(period_offset != -1);
 			// convert major and minor to hex
 			major_minor_pair[period_offset] = '\0';
-			ASSERT(util::StrToInt(major_minor_pair.c_str(), 16, device_major));
-			ASSERT(util::StrToInt(major_minor_pair.c_str() + period_offset + 1, 16, device_minor));
+			ASSERT(util::StrToInt(major_minor_pair.c_str(), 16, options.device_major));
+			ASSERT(util::StrToInt(major_minor_pair.c_str() + period_offset + 1, 16, options.device_minor));
         } else if (util::StrHasPrefix(argv[arg], "--driver-version=")) {
             std::string whole_version = util::StrRemovePrefix(argv[arg], "--driver-version=");
 
@@ -58,440 +254,252 @@ int main(int argc, char** argv)
 			ASSERT(period_minor_offset != -1 && period_patch_offset != -1);
 			// convert major and minor to hex
 			whole_version[period_minor_offset] = '\0';
-			ASSERT(util::StrToInt(whole_version.c_str(), 10, driver_major));
+			ASSERT(util::StrToInt(whole_version.c_str(), 10, options.driver_major));
             whole_version[period_minor_offset + period_patch_offset + 1] = '\0';
-			ASSERT(util::StrToInt(whole_version.c_str() + period_minor_offset + 1, 10, driver_minor));
-            ASSERT(util::StrToInt(whole_version.c_str() + period_minor_offset + period_patch_offset + 2, 10, driver_patch));
+			ASSERT(util::StrToInt(whole_version.c_str() + period_minor_offset + 1, 10, options.driver_minor));
+            ASSERT(util::StrToInt(whole_version.c_str() + period_minor_offset + period_patch_offset + 2, 10, options.driver_patch));
+        } else if (util::StrEqual(argv[arg], "--all-devices")) {
+            options.all_devices = true;
         } else if (util::StrEqual(argv[arg], "--validate-api-calls")) {
-            enable_validation = true;
+            options.validate = true;
         } else if (util::StrEqual(argv[arg], "--detect")) {
-            detect_env = true;
+            options.detect = true;
+        } else if (util::StrEqual(argv[arg], "--measure-stream-switch")) {
+            options.measure_stream_switch = true;
+        } else if (util::StrHasPrefix(argv[arg], "--convert=")) {
+            const char* format = util::StrRemovePrefix(argv[arg], "--convert=");
+            if (util::StrEqual(format, "rgba"))
+                convert_output = vvb::DECODER_OUTPUT_RGBA8;
+            else if (util::StrEqual(format, "i420"))
+                convert_output = vvb::DECODER_OUTPUT_I420;
+            else
+                XERROR(1, "Unknown conversion: %s\n", format);
+        } else if (util::StrHasPrefix(argv[arg], "--color-matrix=")) {
+            const char* matrix = util::StrRemovePrefix(argv[arg], "--color-matrix=");
+            if (util::StrEqual(matrix, "601"))
+                options.bt601 = true;
+            else if (util::StrEqual(matrix, "709"))
+                options.bt601 = false;
+            else
+                XERROR(1, "Unknown color matrix: %s\n", matrix);
+        } else if (util::StrEqual(argv[arg], "--full-range")) {
+            options.full_range = true;
+        } else if (util::StrHasPrefix(argv[arg], "--preview=")) {
+            const char* list = util::StrRemovePrefix(argv[arg], "--preview=");
+            u32& num_previews = options.num_previews;
+            num_previews = 0;
+            while (*list) {
+                char* endptr;
+                long divisor = strtol(list, &endptr, 10);
+                if (endptr == list || divisor < 1 || num_previews == vvb::DecoderMaxPreviews || (*endptr && *endptr != ','))
+                    XERROR(1, "Invalid preview list: %s\n", argv[arg]);
+                options.preview_divisors[num_previews++] = (u32)divisor;
+                list = *endptr ? endptr + 1 : endptr;
+            }
+        } else if (util::StrHasPrefix(argv[arg], "--tensor=")) {
+            const char* size = util::StrRemovePrefix(argv[arg], "--tensor=");
+            u32& tensor_width = options.tensor_width;
+            u32& tensor_height = options.tensor_height;
+            if (sscanf(size, "%ux%u", &tensor_width, &tensor_height) != 2 || tensor_width < 2 || tensor_width % 2 || tensor_height == 0)
+                XERROR(1, "Invalid tensor size, the width must be even: %s\n", size);
+        } else if (util::StrEqual(argv[arg], "--checksum")) {
+            checksum = true;
+        } else if (util::StrHasPrefix(argv[arg], "--mosaic=")) {
+            int tiles = 0;
+            if (!util::StrToInt(util::StrRemovePrefix(argv[arg], "--mosaic="), 10, tiles) || tiles < 1 || tiles > (int)vvb::DecoderMaxMosaicTiles)
+                XERROR(1, "Invalid tile count: %s\n", argv[arg]);
+            options.mosaic_tiles = tiles;
+        } else if (util::StrHasPrefix(argv[arg], "--wall=")) {
+            if (!util::StrToInt(util::StrRemovePrefix(argv[arg], "--wall="), 10, wall_streams) || wall_streams < 1 ||
+                wall_streams > (int)vvb::DecoderMaxMosaicTiles)
+                XERROR(1, "Invalid stream count: %s\n", argv[arg]);
+        } else if (util::StrHasPrefix(argv[arg], "--streams=")) {
+            if (!util::StrToInt(util::StrRemovePrefix(argv[arg], "--streams="), 10, streams) || streams < 1)
+                XERROR(1, "Invalid stream count: %s\n", argv[arg]);
+        } else if (util::StrEqual(argv[arg], "--tensor-fp16")) {
+            options.tensor_fp16 = true;
+        } else if (util::StrHasPrefix(argv[arg], "--tensor-mean=")) {
+            float* m = options.tensor_mean;
+            if (sscanf(util::StrRemovePrefix(argv[arg], "--tensor-mean="), "%f,%f,%f", &m[0], &m[1], &m[2]) != 3)
+                XERROR(1, "Invalid tensor mean: %s\n", argv[arg]);
+        } else if (util::StrHasPrefix(argv[arg], "--tensor-std=")) {
+            float* sd = options.tensor_std;
+            if (sscanf(util::StrRemovePrefix(argv[arg], "--tensor-std="), "%f,%f,%f", &sd[0], &sd[1], &sd[2]) != 3 ||
+                sd[0] <= 0.0f || sd[1] <= 0.0f || sd[2] <= 0.0f)
+                XERROR(1, "Invalid tensor std: %s\n", argv[arg]);
+        } else if (util::StrHasPrefix(argv[arg], "--preview-filter=")) {
+            const char* filter = util::StrRemovePrefix(argv[arg], "--preview-filter=");
+            if (util::StrEqual(filter, "bilinear"))
+                options.preview_area_filter = false;
+            else if (util::StrEqual(filter, "area"))
+                options.preview_area_filter = true;
+            else
+                XERROR(1, "Unknown preview filter: %s\n", filter);
+        } else if (util::StrEqual(argv[arg], "--mock-driver")) {
+            mock_driver = "";
+        } else if (util::StrHasPrefix(argv[arg], "--mock-driver=")) {
+            mock_driver = util::StrRemovePrefix(argv[arg], "--mock-driver=");
+        } else if (util::StrEqual(argv[arg], "--async")) {
+            async = true;
+        } else if (util::StrEqual(argv[arg], "--cpu")) {
+            options.cpu_only = true;
+        } else if (util::StrHasPrefix(argv[arg], "--cpu-threads=")) {
+            int threads = 0;
+            if (!util::StrToInt(util::StrRemovePrefix(argv[arg], "--cpu-threads="), 10, threads) || threads < 1)
+                XERROR(1, "Invalid thread count: %s\n", argv[arg]);
+            options.cpu_threads = threads;
+        } else if (util::StrEqual(argv[arg], "--no-cpu-fallback")) {
+            options.cpu_fallback = false;
+        } else if (util::StrHasPrefix(argv[arg], "--bench=")) {
+            if (!util::StrToInt(util::StrRemovePrefix(argv[arg], "--bench="), 10, bench_frames) || bench_frames < 1)
+                XERROR(1, "Invalid frame count: %s\n", argv[arg]);
+        } else if (util::StrHasPrefix(argv[arg], "--max-first-frame-us=")) {
+            if (!util::StrToInt(util::StrRemovePrefix(argv[arg], "--max-first-frame-us="), 10, max_first_frame_us) ||
+                max_first_frame_us < 1)
+                XERROR(1, "Invalid time: %s\n", argv[arg]);
+        } else if (argv[arg][0] != '-' && !input) {
+            input = argv[arg];
         } else {
 			XERROR(0, "Unknown flag: %s\n", argv[arg]);
 			exit(1);
 		}
     }
-	vvb::SysVulkan::UserOptions opts;
-	opts.detect_env = detect_env;
-	opts.enable_validation = enable_validation;
-	opts.requested_device_name = requested_device_name;
-	opts.requested_device_major = device_major;
-	opts.requested_device_minor = device_minor;
-    opts.requested_driver_version_major = driver_major;
-    opts.requested_driver_version_minor = driver_minor;
-    opts.requested_driver_version_patch = driver_patch;
-
-	vvb::SysVulkan* sys_vk = new vvb::SysVulkan(opts);
-	ASSERT(sys_vk);
-    vvb::init_vulkan(*sys_vk);
-
-    auto& vk = sys_vk->_vfn;
-
-    // The following profile structs are for reference, they would need to be sniffed from
-    // the input files in reality.
-    vvb::VideoProfile av1_profile = vvb::Av1Progressive420Profile();
-    vvb::VideoProfile avc_profile = vvb::AvcProgressive420Profile();
-
-    VkVideoProfileListInfoKHR avc_session_profile_list = {};
-    avc_session_profile_list.sType = VK_STRUCTURE_TYPE_VIDEO_PROFILE_LIST_INFO_KHR;
-    avc_session_profile_list.pNext = nullptr;
-    avc_session_profile_list.profileCount = 1;
-    avc_session_profile_list.pProfiles = &avc_profile._profile_info;
-
-    //;;;;;;;;;; Cap queries
-    VkVideoCapabilitiesKHR video_caps = {};
-    video_caps.sType = VK_STRUCTURE_TYPE_VIDEO_CAPABILITIES_KHR;
-    VkVideoDecodeCapabilitiesKHR decode_caps = {};
-    decode_caps.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_CAPABILITIES_KHR;
-    VkVideoDecodeH264CapabilitiesKHR avc_caps = {};
-    avc_caps.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_CAPABILITIES_KHR;
-    decode_caps.pNext = &avc_caps;
-    video_caps.pNext = &decode_caps;
-    VK_CHECK(vk.GetPhysicalDeviceVideoCapabilitiesKHR(sys_vk->SelectedPhysicalDevice(),
-        &avc_profile._profile_info, &video_caps));
-
-    // !(video_caps.flags & VK_VIDEO_CAPABILITY_SEPARATE_REFERENCE_IMAGES_BIT_KHR) -> image arrays for dpb
-    // This test uses an image array for the DPB in any case, since it's simpler, but potentially less efficient.
-
-    printf("Buffer size alignment: %lu\n", video_caps.minBitstreamBufferSizeAlignment);
-    printf("Buffer offset alignment: %lu %lu\n", video_caps.minBitstreamBufferOffsetAlignment, util::AlignUp((VkDeviceSize)0, video_caps.minBitstreamBufferOffsetAlignment));
-
-    bool dpb_and_dst_coincide = decode_caps.flags & VK_VIDEO_DECODE_CAPABILITY_DPB_AND_OUTPUT_COINCIDE_BIT_KHR;
-    VkFormat dpb_image_format = VK_FORMAT_UNDEFINED;
-    VkFormat out_image_format = VK_FORMAT_UNDEFINED;
-    
-    auto get_supported_formats = [=](VkImageUsageFlags usage_flags){
-        u32 num_supported_formats = 0;
-        VkPhysicalDeviceVideoFormatInfoKHR video_format_info = {};
-        video_format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VIDEO_FORMAT_INFO_KHR;
-        video_format_info.pNext = &avc_session_profile_list;
-        video_format_info.imageUsage = usage_flags;
-        vk.GetPhysicalDeviceVideoFormatPropertiesKHR(sys_vk->SelectedPhysicalDevice(),
-            &video_format_info,
-            &num_supported_formats,
-            nullptr);
-        
-        std::vector<VkVideoFormatPropertiesKHR> supported_formats(num_supported_formats);
-        for (auto& sf : supported_formats)
-            sf.sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR;
-        vk.GetPhysicalDeviceVideoFormatPropertiesKHR(sys_vk->SelectedPhysicalDevice(),
-            &video_format_info,
-            &num_supported_formats,
-            supported_formats.data());
-        return supported_formats;
-    };
-    VkImageUsageFlags dpb_usage = VK_IMAGE_USAGE_VIDEO_DECODE_DPB_BIT_KHR;
-    VkImageUsageFlags dst_usage = VK_IMAGE_USAGE_VIDEO_DECODE_DST_BIT_KHR|VK_IMAGE_USAGE_TRANSFER_SRC_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-    if (dpb_and_dst_coincide)
-    {
-        dpb_usage = dst_usage | VK_IMAGE_USAGE_VIDEO_DECODE_DPB_BIT_KHR;
-        dst_usage &= ~VK_IMAGE_USAGE_VIDEO_DECODE_DST_BIT_KHR;
-    }
-    auto supported_dpb_formats = get_supported_formats(dpb_usage);
-    // Think of what to do for > 1 supported formats
-    ASSERT(supported_dpb_formats.size() == 1);
-    VkVideoFormatPropertiesKHR selected_dpb_format = supported_dpb_formats[0];
-    VkVideoFormatPropertiesKHR selected_dst_format = {};
-    selected_dst_format.sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR;
-    selected_dst_format.format = selected_dpb_format.format;
-    if (!dpb_and_dst_coincide) {
-        auto supported_output_formats = get_supported_formats(dst_usage);
-        ASSERT(supported_output_formats.size() == 1);
-        selected_dst_format = supported_output_formats[0];
-    };
-
-    printf("Coincide: %d\n", dpb_and_dst_coincide);
-    printf("dpb_usage: "); vk_print(dpb_usage); printf("\n");
-    printf("out_usage: "); vk_print(dst_usage); printf("\n");
-    
-    //;;;;;;;;;; End of cap queries
-
-    auto coding_session = vvb::CreateVideoSession(sys_vk, &avc_profile, selected_dst_format.format, selected_dpb_format.format, &video_caps,
-        1, 1);
-    vvb::AddSessionParameters(sys_vk, &coding_session);
-
-    u64 bitstream_size = util::AlignUp((VkDeviceSize)58, video_caps.minBitstreamBufferSizeAlignment);
-    auto bitstream = vvb::CreateBufferResource(sys_vk, bitstream_size,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VIDEO_DECODE_SRC_BIT_KHR,
-        VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT,
-        &avc_session_profile_list);
+    options.mock_driver = mock_driver;
+    // Only one output per run, the GPU side ones take precedence over conversions
+    if (checksum)
+        options.output = vvb::DECODER_OUTPUT_CHECKSUM;
+    else if (options.num_previews > 0)
+        options.output = vvb::DECODER_OUTPUT_PREVIEWS;
+    else if (options.mosaic_tiles > 0)
+        options.output = vvb::DECODER_OUTPUT_MOSAIC;
+    else if (options.tensor_width > 0)
+        options.output = vvb::DECODER_OUTPUT_TENSOR;
+    else
+        options.output = convert_output;
 
     u8 slice_bytes[] = {0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0x3a, 0xfe, 0xe6, 0xc0, 0xf9, 0x96, 0x55, 0x0d, 0x57, 0x7f, 0xfd, 0x69, 0x3d, 0x2b, 0xf8, 0xcd, 0x22, 0xe5, 0x25, 0xe2, 0x93, 0x0c, 0xad, 0xe0, 0xfa, 0x71, 0x00, 0xcb, 0x99, 0xd1, 0xd6, 0xb5, 0x9b, 0xed, 0x6f, 0x8b, 0x38, 0xa7, 0xdc, 0xe1, 0x90, 0x01, 0x6e, 0x00, 0x10, 0xd0, 0x9a, 0xf3, 0x63, 0x3f, 0x81, 0x00};
-    void* bitstream_mapped = nullptr;
-    VK_CHECK(vmaMapMemory(sys_vk->_allocator, bitstream._allocation, &bitstream_mapped));
-    memcpy(bitstream_mapped, slice_bytes, sizeof(slice_bytes));
-    vmaUnmapMemory(sys_vk->_allocator, bitstream._allocation);
-
-    VkBufferMemoryBarrier2 bitstream_barrier = bitstream.Barrier(vvb::TRANSITION_BUFFER_FOR_READING);
-
-    auto dpb = vvb::CreateDpbResource(sys_vk, 176, 144, 3,
-        dpb_and_dst_coincide,
-        dpb_usage, selected_dpb_format.format, selected_dpb_format.componentMapping,
-        dst_usage, selected_dst_format.format, selected_dst_format.componentMapping,
-        &avc_session_profile_list);
-
-    if (sys_vk->DecodeQueriesAreSupported())
-    {
-        VkQueryPoolCreateInfo query_pool_info = {};
-        query_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
-        query_pool_info.pNext = &avc_profile._profile_info;
-        query_pool_info.flags = 0;
-        query_pool_info.queryType = VK_QUERY_TYPE_RESULT_STATUS_ONLY_KHR;
-        query_pool_info.queryCount = 1; // this is fixed by the spec, per region decoding will change this
-        query_pool_info.pipelineStatistics = 0;
-        VK_CHECK(vk.CreateQueryPool(sys_vk->_active_dev, &query_pool_info, nullptr, &sys_vk->_query_pool));
-    }
-    VkCommandPool decode_cmd_pool = VK_NULL_HANDLE;
-    VkCommandPoolCreateInfo cmd_pool_info = {};
-    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    cmd_pool_info.pNext = nullptr;
-    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    cmd_pool_info.queueFamilyIndex = sys_vk->queue_family_decode_index;
-    VK_CHECK(vk.CreateCommandPool(sys_vk->_active_dev, &cmd_pool_info, nullptr, &decode_cmd_pool));
-    VkCommandPool tx_cmd_pool = VK_NULL_HANDLE;
-    cmd_pool_info.queueFamilyIndex = sys_vk->queue_family_tx_index;
-    VK_CHECK(vk.CreateCommandPool(sys_vk->_active_dev, &cmd_pool_info, nullptr, &tx_cmd_pool));
-
-    VkCommandBuffer decode_cmd_buf = VK_NULL_HANDLE;
-    VkCommandBuffer tx_cmd_buf = VK_NULL_HANDLE;
-    VkCommandBufferAllocateInfo cmd_buf_alloc_info = {};
-    cmd_buf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmd_buf_alloc_info.pNext = nullptr;
-    cmd_buf_alloc_info.commandPool = decode_cmd_pool;
-    cmd_buf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cmd_buf_alloc_info.commandBufferCount = 1;
-    VK_CHECK(vk.AllocateCommandBuffers(sys_vk->_active_dev, &cmd_buf_alloc_info, &decode_cmd_buf));
-    cmd_buf_alloc_info.commandPool = tx_cmd_pool;
-    VK_CHECK(vk.AllocateCommandBuffers(sys_vk->_active_dev, &cmd_buf_alloc_info, &tx_cmd_buf));
-    VkCommandBufferBeginInfo cmd_buf_begin_info = {};
-    cmd_buf_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    cmd_buf_begin_info.pNext = nullptr;
-    cmd_buf_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    cmd_buf_begin_info.pInheritanceInfo = nullptr;
-
-    vk.BeginCommandBuffer(decode_cmd_buf, &cmd_buf_begin_info);
-
-
-    // Queries
-    if (sys_vk->DecodeQueriesAreSupported())
-    {
-        vk.CmdResetQueryPool(decode_cmd_buf, sys_vk->_query_pool, 0, 1);
-    }
-
-    //auto out_image_resource = dpb_and_dst_coincide ? dpb._slot_picture_resource_infos[0] : dst_image_resource;
-
-    //;;;;;;;;;;; Video coding scope begin
-    VkVideoBeginCodingInfoKHR begin_coding_info = {};
-    begin_coding_info.sType = VK_STRUCTURE_TYPE_VIDEO_BEGIN_CODING_INFO_KHR;
-    begin_coding_info.pNext = nullptr;
-    begin_coding_info.flags = 0;
-    begin_coding_info.videoSession = coding_session._handle;
-    begin_coding_info.videoSessionParameters = coding_session._parameters;
-    VkVideoReferenceSlotInfoKHR reference_slot = {};
-    reference_slot.sType = VK_STRUCTURE_TYPE_VIDEO_REFERENCE_SLOT_INFO_KHR;
-    reference_slot.pNext = nullptr;
-    reference_slot.slotIndex = -1;
-    reference_slot.pPictureResource = &dpb._dpb_slot_picture_resource_infos[0];
-    begin_coding_info.referenceSlotCount = 1;
-    begin_coding_info.pReferenceSlots = &reference_slot;
-    vk.CmdBeginVideoCodingKHR(decode_cmd_buf, &begin_coding_info);
-
-    VkVideoCodingControlInfoKHR coding_ctrl_info = {};
-    coding_ctrl_info.sType = VK_STRUCTURE_TYPE_VIDEO_CODING_CONTROL_INFO_KHR;
-    coding_ctrl_info.pNext = nullptr;
-    coding_ctrl_info.flags = VK_VIDEO_CODING_CONTROL_RESET_BIT_KHR;
-    vk.CmdControlVideoCodingKHR(decode_cmd_buf, &coding_ctrl_info);
-
-    VkDependencyInfoKHR out_dep_info = {};
-    out_dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
-    out_dep_info.pNext = nullptr;
-    out_dep_info.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-    out_dep_info.memoryBarrierCount = 0;
-    out_dep_info.pMemoryBarriers = nullptr;
-    out_dep_info.bufferMemoryBarrierCount = 1;
-    out_dep_info.pBufferMemoryBarriers = &bitstream_barrier;
-    std::vector<VkImageMemoryBarrier2> image_barriers = dpb.SlotBarriers(vvb::TRANSITION_IMAGE_INITIALIZE, 0u);
-    out_dep_info.imageMemoryBarrierCount = image_barriers.size();
-    out_dep_info.pImageMemoryBarriers = image_barriers.data();
-    vk.CmdPipelineBarrier2KHR(decode_cmd_buf, &out_dep_info);
-
-    if (sys_vk->DecodeQueriesAreSupported())
-    {
-        vk.CmdBeginQuery(decode_cmd_buf, sys_vk->_query_pool, 0, VkQueryControlFlags());
-    }
-
-    StdVideoDecodeH264PictureInfo avc_picture_info = {};
-    avc_picture_info.flags.field_pic_flag = 0;
-    avc_picture_info.flags.is_intra = 1;
-    avc_picture_info.flags.IdrPicFlag = 0;
-    avc_picture_info.flags.bottom_field_flag = 0;
-    avc_picture_info.flags.is_reference = 1;
-    avc_picture_info.flags.complementary_field_pair = 0;
-    avc_picture_info.seq_parameter_set_id = 0;
-    avc_picture_info.pic_parameter_set_id = 0;
-    avc_picture_info.frame_num = 0;
-    avc_picture_info.idr_pic_id = 0;
-    avc_picture_info.PicOrderCnt[0] = 0;
-    avc_picture_info.PicOrderCnt[1] = 0;
-    VkVideoDecodeH264PictureInfoKHR avc_decode_info = {};
-    avc_decode_info.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_PICTURE_INFO_KHR;
-    avc_decode_info.pNext = nullptr;
-    avc_decode_info.pStdPictureInfo = &avc_picture_info;
-    avc_decode_info.sliceCount = 1;
-    u32 slice_offsets[] = {0};
-    avc_decode_info.pSliceOffsets = slice_offsets;
-
-    VkVideoDecodeInfoKHR decode_info = {};
-    decode_info.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_INFO_KHR;
-    decode_info.pNext = &avc_decode_info;
-    decode_info.flags = 0;
-    decode_info.srcBuffer = bitstream._buffer;
-    decode_info.srcBufferOffset = 0;
-    decode_info.srcBufferRange = bitstream._create_info.size;
-    decode_info.dstPictureResource = dpb.SlotDstPictureResource(0u);
-    VkVideoDecodeH264DpbSlotInfoKHR dpb_slot_info = {};
-    dpb_slot_info.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_DPB_SLOT_INFO_KHR;
-    dpb_slot_info.pNext = nullptr;
-    StdVideoDecodeH264ReferenceInfo ref_info = {};
-    ref_info.flags.top_field_flag = 0;
-    ref_info.flags.bottom_field_flag = 0;
-    ref_info.flags.used_for_long_term_reference = 0;
-    ref_info.flags.is_non_existing = 0;
-    ref_info.FrameNum = 0;
-    ref_info.PicOrderCnt[0] = 0;
-    ref_info.PicOrderCnt[1] = 0;
-    dpb_slot_info.pStdReferenceInfo = &ref_info;
-    reference_slot.pNext = &dpb_slot_info;
-    reference_slot.slotIndex = 0;
-    decode_info.pSetupReferenceSlot = nullptr; // &reference_slot;
-    decode_info.referenceSlotCount = 0;
-    decode_info.pReferenceSlots = nullptr;
-    if (dpb_and_dst_coincide && decode_info.pSetupReferenceSlot == nullptr)
-    {
-        VkDependencyInfoKHR dpb_to_dst_barrier = {};
-        dpb_to_dst_barrier.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
-        dpb_to_dst_barrier.pNext = nullptr;
-        dpb_to_dst_barrier.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-        dpb_to_dst_barrier.memoryBarrierCount = 0;
-        dpb_to_dst_barrier.pMemoryBarriers = nullptr;
-        dpb_to_dst_barrier.bufferMemoryBarrierCount = 1;
-        dpb_to_dst_barrier.pBufferMemoryBarriers = &bitstream_barrier;
-        std::vector<VkImageMemoryBarrier2> image_barriers = dpb.SlotBarriers(vvb::TRANSITION_IMAGE_DPB_TO_DST, 0u);
-        dpb_to_dst_barrier.imageMemoryBarrierCount = image_barriers.size();
-        dpb_to_dst_barrier.pImageMemoryBarriers = image_barriers.data();
-        vk.CmdPipelineBarrier2KHR(decode_cmd_buf, &dpb_to_dst_barrier);
-    }
-    vk.CmdDecodeVideoKHR(decode_cmd_buf, &decode_info);
 
-    if (sys_vk->DecodeQueriesAreSupported())
-    {
-        vk.CmdEndQuery(decode_cmd_buf, sys_vk->_query_pool, 0);
-    }
-
-    VkVideoEndCodingInfoKHR end_coding_info = {};
-    end_coding_info.sType = VK_STRUCTURE_TYPE_VIDEO_END_CODING_INFO_KHR;
-    end_coding_info.pNext = nullptr;
-    end_coding_info.flags = 0;    
-    vk.CmdEndVideoCodingKHR(decode_cmd_buf, &end_coding_info);
-    //;;;;;;;;;;; Video coding scope end
-
-    vk.EndCommandBuffer(decode_cmd_buf);
-
-    VkFenceCreateInfo fence_info = {};
-    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fence_info.pNext = nullptr;
-    fence_info.flags = 0;
-    VkFence fence;
-    vk.CreateFence(sys_vk->_active_dev, &fence_info, nullptr, &fence);
-    VkSubmitInfo submit_info = {};
-    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.pNext = nullptr;
-    submit_info.waitSemaphoreCount = 0;
-    submit_info.pWaitSemaphores = nullptr;
-    submit_info.pWaitDstStageMask = 0;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &decode_cmd_buf;
-    submit_info.signalSemaphoreCount = 0;
-    submit_info.pSignalSemaphores = nullptr;
-    VK_CHECK(vk.QueueSubmit(sys_vk->_decode_queue0, 1, &submit_info, fence));
-    VK_CHECK(vk.WaitForFences(sys_vk->_active_dev, 1, &fence, VK_TRUE, UINT64_MAX));
-
-    if (sys_vk->DecodeQueriesAreSupported())
-    {
-        VkQueryResultStatusKHR decode_status;
-        VK_CHECK(vk.GetQueryPoolResults(sys_vk->_active_dev,
-            sys_vk->_query_pool,
-            0,
-            1,
-            sizeof(decode_status),
-            &decode_status,
-            sizeof(decode_status),
-            VK_QUERY_RESULT_WITH_STATUS_BIT_KHR | VK_QUERY_RESULT_WAIT_BIT));
-        ASSERT(decode_status == VK_QUERY_RESULT_STATUS_COMPLETE_KHR);
+    if (wall_streams > 0)
+        return DecodeWall(options, wall_streams, slice_bytes, sizeof(slice_bytes));
+    if (streams > 0) {
+        // A whole stream, so that the decoders see reference pictures and parameter sets as they come in practice
+        if (!input)
+            XERROR(1, "--streams decodes an input stream, e.g. data/clip-a.h264\n");
+        util::sized_buffer bitstream = util::ReadWholeBinaryFileIntoMemory(input);
+        if (bitstream.has_error)
+            XERROR(errno, "Could not read %s\n", input);
+        AccessUnits units { bitstream.bytes, util::SplitAccessUnits(bitstream.bytes, bitstream.len) };
+        if (units.Count() == 0)
+            XERROR(1, "No access unit in %s\n", input);
+        int r = DecodeStreams(options, streams, bench_frames > 0 ? bench_frames : 1, units);
+        util::FreeSizedBuffer(&bitstream);
+        return r;
     }
 
-    vk.ResetFences(sys_vk->_active_dev, 1, &fence);
-
-    auto luma_buf = vvb::CreateBufferResource(sys_vk, 32768,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-        VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
-        &avc_session_profile_list);
-    auto chroma_buf = vvb::CreateBufferResource(sys_vk, 16384,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-        VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
-        VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT,
-        &avc_session_profile_list);
-
-    vk.BeginCommandBuffer(tx_cmd_buf, &cmd_buf_begin_info);
-        auto out_image_barrier = dpb.SlotBarriers(vvb::TRANSITION_IMAGE_TRANSFER_TO_HOST, 0u);
-
-        out_dep_info = {};
-        out_dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
-        out_dep_info.pNext = nullptr;
-        out_dep_info.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-        out_dep_info.memoryBarrierCount = 0;
-        out_dep_info.pMemoryBarriers = nullptr;
-        out_dep_info.bufferMemoryBarrierCount = 0;
-        out_dep_info.pBufferMemoryBarriers = nullptr;
-        out_dep_info.imageMemoryBarrierCount = out_image_barrier.size();
-        out_dep_info.pImageMemoryBarriers = out_image_barrier.data();
-        vk.CmdPipelineBarrier2KHR(tx_cmd_buf, &out_dep_info);
-
-        u32 luma_width_samples = 176;
-        u32 luma_buf_pitch = 192;
-        u32 luma_buf_height = 144;
-        dpb.CopySlotToBuffer(sys_vk, tx_cmd_buf, 0u, luma_width_samples, luma_buf_pitch, luma_buf_height,
-            VK_IMAGE_ASPECT_PLANE_0_BIT, luma_buf._buffer);
-        
-        u32 chroma_width_samples = luma_width_samples / 2;
-        u32 chroma_buf_pitch = luma_buf_pitch / 2;
-        u32 chroma_buf_height = luma_buf_height / 2;
-        dpb.CopySlotToBuffer(sys_vk, tx_cmd_buf, 0u, chroma_width_samples, chroma_buf_pitch, chroma_buf_height,
-            VK_IMAGE_ASPECT_PLANE_1_BIT, chroma_buf._buffer);
-    vk.EndCommandBuffer(tx_cmd_buf);
-
-    submit_info = {};
-    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.pNext = nullptr;
-    submit_info.waitSemaphoreCount = 0;
-    submit_info.pWaitSemaphores = nullptr;
-    submit_info.pWaitDstStageMask = 0;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &tx_cmd_buf;
-    submit_info.signalSemaphoreCount = 0;
-    submit_info.pSignalSemaphores = nullptr;
-    VK_CHECK(vk.QueueSubmit(sys_vk->_tx_queue0, 1, &submit_info, fence));
-    VK_CHECK(vk.WaitForFences(sys_vk->_active_dev, 1, &fence, VK_TRUE, UINT64_MAX));
-
-    FILE* out_file = fopen("/tmp/vd.yuv", "wb");
+    // Time to first frame includes opening the decoder, whose session and images are what a new stream waits for.
+    util::Timer first_frame_timer;
+    first_frame_timer.GetCurrentTime();
+    u64 first_frame_us = 0;
+    vvb::Decoder* decoder = vvb::OpenDecoder(options);
+    if (!decoder)
+        XERROR(1, "Could not initialize Vulkan\n");
+
+    // Output the frame data, in NV12 format unless a conversion was requested. Benchmarks only count frames.
+    int frame_index = 0;
+    auto output_frame = [&](vvb::DecodedFrame* frame) {
+        if (frame_index == 0)
+            first_frame_us = first_frame_timer.ElapsedMicroseconds();
+        if (bench_frames > 0) {
+            vvb::ReleaseFrame(frame);
+            frame_index++;
+            return;
+        }
+        const u8* data = vvb::FrameData(frame);
+        const vvb::FramePicture& picture = vvb::GetFramePicture(frame, 0);
+        if (options.output == vvb::DECODER_OUTPUT_CHECKSUM)
+        {
+            // Twelve bytes per frame leave the GPU. Streams decoded with --cpu give the same digests, so CPU and
+            // GPU decodes of a stream can be diffed.
+            const u32* digests = (const u32*)data;
+            printf("frame %d checksum Y:%08x U:%08x V:%08x\n", frame_index, digests[0], digests[1], digests[2]);
+        }
+        else if (options.output == vvb::DECODER_OUTPUT_PREVIEWS)
+        {
+            // Each rendition goes to its own /tmp/vd_<width>x<height>.yuv.
+            for (u32 i = 0; i < vvb::FramePictureCount(frame); i++) {
+                const vvb::FramePicture& preview = vvb::GetFramePicture(frame, i);
+                char path[64];
+                snprintf(path, sizeof(path), "/tmp/vd_%ux%u.yuv", preview.width, preview.height);
+                int preview_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (preview_fd < 0)
+                    XERROR(errno, "Could not open %s\n", path);
+                if (!WritePicture(preview_fd, data, preview))
+                    XERROR(errno, "Failed to write %s\n", path);
+                close(preview_fd);
+                printf("Wrote a %ux%u preview\n", preview.width, preview.height);
+            }
+        }
+        else
+        {
+            const char* out_path = options.output == vvb::DECODER_OUTPUT_TENSOR ? "/tmp/vd.tensor" : "/tmp/vd.yuv";
+            int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out_fd < 0)
+                XERROR(errno, "Could not open %s\n", out_path);
+            if (!WritePicture(out_fd, data, picture))
+                XERROR(errno, "Failed to write %s\n", out_path);
+            close(out_fd);
+            switch (options.output) {
+            case vvb::DECODER_OUTPUT_MOSAIC:
+                printf("Wrote a %ux%u mosaic of %u tiles\n", picture.width, picture.height, options.mosaic_tiles);
+                break;
+            case vvb::DECODER_OUTPUT_TENSOR:
+                printf("Wrote a 1x3x%ux%u %s tensor\n", picture.width, picture.height, options.tensor_fp16 ? "float16" : "float32");
+                break;
+            case vvb::DECODER_OUTPUT_RGBA8:
+            case vvb::DECODER_OUTPUT_I420:
+                printf("Wrote a %s frame\n", options.output == vvb::DECODER_OUTPUT_I420 ? "I420" : "RGBA8");
+                break;
+            default:
+                break;
+            }
+        }
+        vvb::ReleaseFrame(frame);
+        frame_index++;
+    };
 
-    void* luma_buf_data = nullptr;
-    void* chroma_buf_data = nullptr;
-    vmaMapMemory(sys_vk->_allocator, luma_buf._allocation, &luma_buf_data);
-    u8* luma_buf_bytes = (u8*)luma_buf_data;
-    u32 bytes_written = 0;
-    // Output the frame data in NV12 format
-    for (int line = 0; line < luma_buf_height; line++)
-    {
-        bytes_written += fwrite(luma_buf_bytes + line * luma_buf_pitch, 1, luma_width_samples, out_file);
+    // Frames are received while access units are still being sent, the decoder only takes so many at once.
+    int num_access_units = bench_frames > 0 ? bench_frames : 1;
+    util::Timer bench_timer;
+    bench_timer.GetCurrentTime();
+    // Outlives the coroutine, which may still be returning on the reactor thread until CloseDecoder
+    std::atomic<bool> async_done { false };
+    if (async) {
+        AccessUnits units { slice_bytes, { 0, sizeof(slice_bytes) } };
+        DecodeAsync(decoder, &units, num_access_units, &output_frame, &async_done);
+        async_done.wait(false);
+    } else {
+        for (int i = 0; i < num_access_units; i++) {
+            while (!vvb::SendAccessUnit(decoder, slice_bytes, sizeof(slice_bytes), i)) {
+                if (vvb::DecodedFrame* frame = vvb::ReceiveFrame(decoder, true))
+                    output_frame(frame);
+            }
+            while (vvb::DecodedFrame* frame = vvb::ReceiveFrame(decoder))
+                output_frame(frame);
+        }
+        while (vvb::DecodedFrame* frame = vvb::ReceiveFrame(decoder, true))
+            output_frame(frame);
     }
-    ASSERT(bytes_written == luma_width_samples * luma_buf_height);
-    vmaUnmapMemory(sys_vk->_allocator, luma_buf._allocation);
-    vmaMapMemory(sys_vk->_allocator, chroma_buf._allocation, &chroma_buf_data);
-    u8* chroma_buf_bytes = (u8*)chroma_buf_data;
-    for (int line = 0; line < chroma_buf_height; line++)
-    {
-        bytes_written += fwrite(chroma_buf_bytes + line * chroma_buf_pitch * sizeof(u16), 1, chroma_width_samples * sizeof(u16), out_file);
+    if (bench_frames > 0) {
+        u64 elapsed_us = bench_timer.ElapsedMicroseconds();
+        printf("Decoded %d of %d frames in %.1f ms, %.1f fps\n", frame_index, bench_frames, elapsed_us / 1000.0,
+            elapsed_us ? frame_index * 1000000.0 / elapsed_us : 0.0);
     }
-    ASSERT(bytes_written == luma_width_samples * luma_buf_height + 2 * (chroma_width_samples * chroma_buf_height));
-    vmaUnmapMemory(sys_vk->_allocator, chroma_buf._allocation);
-    fclose(out_file);
-
-    vk.DestroyFence(sys_vk->_active_dev, fence, nullptr);
-
-    vvb::DestroyBufferResource(sys_vk, &luma_buf);
-    vvb::DestroyBufferResource(sys_vk, &chroma_buf);
-    vvb::DestroyBufferResource(sys_vk, &bitstream);
 
-    if (sys_vk->_query_pool != VK_NULL_HANDLE)
-    {
-        vk.DestroyQueryPool(sys_vk->_active_dev, sys_vk->_query_pool, nullptr);
-    }
-    vk.DestroyCommandPool(sys_vk->_active_dev, tx_cmd_pool, nullptr);
-    vk.DestroyCommandPool(sys_vk->_active_dev, decode_cmd_pool, nullptr);
-
-    vvb::DestroyDpbResource(sys_vk, &dpb);
-
-    vvb::DestroyVideoSession(sys_vk, &coding_session);
-    if (false)
-    {
-        char *str = new char[1024*1024*1024];
-        vmaBuildStatsString(sys_vk->_allocator, &str, VK_TRUE);
-        printf("%s\n", str);
-        delete[] str;
+    vvb::CloseDecoder(decoder);
+    if (max_first_frame_us > 0) {
+        printf("First frame out after %" PRIu64 " us, at most %d us expected\n", first_frame_us, max_first_frame_us);
+        if (frame_index == 0 || first_frame_us > (u64)max_first_frame_us)
+            return 1;
     }
-	delete sys_vk;
 	return 0;
 }
@@ -15,12 +15,18 @@
 * limitations under the License.
 */
 
+#include <atomic>
+#include <bit>
 #include <cstdio>
 #include <cstdlib>
+#include <cassert>
+#include <climits>
 #include <cstdint>
 #include <cstring>
+#include <vector>
 
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <errno.h>
 
@@ -77,7 +83,7 @@ struct sized_buffer {
     u32 padding;
 };
 
-void FreeSizedBuffer(sized_buffer* B)
+inline void FreeSizedBuffer(sized_buffer* B)
 {
     if (!B || !B->bytes)
         return;
@@ -85,7 +91,7 @@ void FreeSizedBuffer(sized_buffer* B)
     B->len = 0;
 }
 
-const char* TimestampStr(bool produce = true)
+inline const char* TimestampStr(bool produce = true)
 {
     static char out[50];
     char* ptr;
@@ -103,7 +109,7 @@ const char* TimestampStr(bool produce = true)
     return out;
 }
 
-sized_buffer ReadWholeBinaryFileIntoMemory(const char* inFilename)
+inline sized_buffer ReadWholeBinaryFileIntoMemory(const char* inFilename)
 {
     sized_buffer res = {};
     res.bytes = nullptr;
@@ -143,11 +149,63 @@ sized_buffer ReadWholeBinaryFileIntoMemory(const char* inFilename)
     return res;
 }
 
+// Offsets of the access units of an Annex B stream, with the end of the stream last. A new access unit starts at an
+// access unit delimiter, SEI or parameter set after a slice, or at a slice with first_mb_in_slice 0 after one
+// (7.4.1.2.3). vvb::SendAccessUnit takes whole access units, and openh264 only decodes pictures on its own
+// threads when it gets them whole.
+inline std::vector<size_t> SplitAccessUnits(const u8* data, size_t size)
+{
+    std::vector<size_t> units;
+    bool seen_slice = false;
+    for (size_t i = 0; i + 3 < size; i++) {
+        if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+            continue;
+        size_t nal = i > 0 && data[i - 1] == 0 ? i - 1 : i;
+        u8 type = data[i + 3] & 0x1f;
+        bool slice = type == 1 || type == 5;
+        bool first_slice = slice && i + 4 < size && (data[i + 4] & 0x80);
+        bool before_slices = (type >= 6 && type <= 9) || (type >= 14 && type <= 18);
+        if (units.empty() || (seen_slice && (before_slices || first_slice))) {
+            units.push_back(nal);
+            seen_slice = false;
+        }
+        seen_slice |= slice;
+        i += 2;
+    }
+    units.push_back(size);
+    return units;
+}
+
+// writev() until every vector has been written, coping with short writes and IOV_MAX. Consumes iov.
+inline bool WriteAllVectors(int fd, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (iovcnt > 0 && written >= (ssize_t)iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (written > 0) {
+            iov->iov_base = (u8*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
 
-void* MallocZerod(size_t size)
+
+// alignment must be a power of two multiple of sizeof(void*), e.g. minImportedHostPointerAlignment for
+// memory that will be imported into Vulkan.
+inline void* MallocZerod(size_t size, size_t alignment = 64)
 {
     void* ptr = nullptr;
-    if (posix_memalign(&ptr, 64, size))
+    if (posix_memalign(&ptr, alignment, size))
         ptr = nullptr;
 
     if (ptr)
@@ -156,15 +214,15 @@ void* MallocZerod(size_t size)
     return ptr;
 }
 
-void ZeroMemory(void* _src, u32 len);
-void ZeroMemory(void* _src, u32 len)
+inline void ZeroMemory(void* _src, u32 len);
+inline void ZeroMemory(void* _src, u32 len)
 {
     u8* src = static_cast<u8*>(_src);
     for (u32 i = 0; i < len; i++)
         src[i] = 0;
 }
 
-bool StrHasPrefix(const char *str, const char* prefix)
+inline bool StrHasPrefix(const char *str, const char* prefix)
 {
     while (*prefix) {
         if (*prefix != *str)
@@ -175,7 +233,7 @@ bool StrHasPrefix(const char *str, const char* prefix)
     return true;
 }
 
-bool StrToInt(const char* str, int base, int& out)
+inline bool StrToInt(const char* str, int base, int& out)
 {
     char* endptr;
     errno = 0;
@@ -183,7 +241,7 @@ bool StrToInt(const char* str, int base, int& out)
     return !(errno != 0 || *endptr != '\0');
 }
 
-const char* StrRemovePrefix(const char* str, const char* prefix)
+inline const char* StrRemovePrefix(const char* str, const char* prefix)
 {
     while (*prefix) {
         if (*prefix != *str)
@@ -194,7 +252,7 @@ const char* StrRemovePrefix(const char* str, const char* prefix)
     return str;
 }
 
-int StrFindIndex(const char* haystack, const char* needle)
+inline int StrFindIndex(const char* haystack, const char* needle)
 {
     int needle_len = strlen(needle);
     int haystack_len = strlen(haystack);
@@ -207,7 +265,7 @@ int StrFindIndex(const char* haystack, const char* needle)
     return -1;
 }
 
-bool StrCaseInsensitiveSubstring(const char* haystack, const char* needle)
+inline bool StrCaseInsensitiveSubstring(const char* haystack, const char* needle)
 {
     int needle_len = strlen(needle);
     int haystack_len = strlen(haystack);
@@ -220,7 +278,7 @@ bool StrCaseInsensitiveSubstring(const char* haystack, const char* needle)
     return false;
 }
 
-bool StrEqual(const char* a, const char* b)
+inline bool StrEqual(const char* a, const char* b)
 {
     while (*a && *b) {
         if (*a != *b)
@@ -274,11 +332,135 @@ private:
     timespec start;
 };
 
+// Deterministic checksum of an 8 bit picture plane, also computed on the GPU by shaders/nv12_checksum.comp.
+// Every row is hashed on its own, xxHash32 style over little endian words, then the row hashes are folded in
+// order. step is the distance between samples in bytes, 2 for one component of an interleaved CbCr plane.
+constexpr u32 LaneHashP1 = 2654435761u;
+constexpr u32 LaneHashP2 = 2246822519u;
+constexpr u32 LaneHashP3 = 3266489917u;
+constexpr u32 LaneHashP4 = 668265263u;
+constexpr u32 LaneHashP5 = 374761393u;
+
+inline u32 LaneHashRotl(u32 x, u32 r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+inline u32 LaneHashAvalanche(u32 h)
+{
+    h ^= h >> 15;
+    h *= LaneHashP2;
+    h ^= h >> 13;
+    h *= LaneHashP3;
+    h ^= h >> 16;
+    return h;
+}
+
+inline u32 LaneHashRow(const u8* row, u32 width, u32 step = 1)
+{
+    u32 acc = LaneHashP5 + width;
+    for (u32 x = 0; x < width; x += 4) {
+        u32 word = 0;
+        for (u32 i = 0; i < 4 && x + i < width; i++)
+            word |= u32(row[(x + i) * step]) << (8 * i);
+        acc = LaneHashRotl(acc + word * LaneHashP2, 13) * LaneHashP1;
+    }
+    return LaneHashAvalanche(acc);
+}
+
+inline u32 LaneHashPlane(const u8* plane, u32 width, u32 height, u32 stride, u32 step = 1)
+{
+    u32 digest = LaneHashP5 + height;
+    for (u32 y = 0; y < height; y++)
+        digest = LaneHashRotl(digest + LaneHashRow(plane + size_t(y) * stride, width, step) * LaneHashP3, 17) * LaneHashP4;
+    return LaneHashAvalanche(digest);
+}
+
 template<typename T>
 constexpr T AlignUp(T x, T align)
 {
     return ((x) + ((align) - 1)) & ~((align) - 1);
 }
 
+// Bounded queue between exactly one producer thread and one consumer thread. Neither side takes a lock, Push and
+// Pop block on the indices with std::atomic wait/notify while the queue is full or empty, which is the
+// backpressure between pipeline stages. The counters are only read once both threads are done.
+template<typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(u32 capacity)
+        : _capacity(capacity), _slots(std::bit_ceil(capacity)), _mask(std::bit_ceil(capacity) - 1)
+    {
+    }
+
+    bool TryPush(const T& item)
+    {
+        u32 head = _head.load(std::memory_order_relaxed);
+        u32 size = head - _tail.load(std::memory_order_acquire);
+        if (size == _capacity)
+            return false;
+        _slots[head & _mask] = item;
+        _head.store(head + 1, std::memory_order_release);
+        _head.notify_one();
+        _pushes++;
+        _occupancy_sum += size + 1;
+        if (size + 1 > _max_occupancy)
+            _max_occupancy = size + 1;
+        return true;
+    }
+
+    void Push(const T& item)
+    {
+        while (!TryPush(item)) {
+            _full_waits++;
+            _tail.wait(_head.load(std::memory_order_relaxed) - _capacity, std::memory_order_acquire);
+        }
+    }
+
+    bool TryPop(T* item)
+    {
+        u32 tail = _tail.load(std::memory_order_relaxed);
+        if (_head.load(std::memory_order_acquire) == tail)
+            return false;
+        *item = _slots[tail & _mask];
+        _tail.store(tail + 1, std::memory_order_release);
+        _tail.notify_one();
+        return true;
+    }
+
+    void Pop(T* item)
+    {
+        while (!TryPop(item)) {
+            _empty_waits++;
+            _head.wait(_tail.load(std::memory_order_relaxed), std::memory_order_acquire);
+        }
+    }
+
+    // Producer side only
+    bool Full() const { return _head.load(std::memory_order_relaxed) - _tail.load(std::memory_order_acquire) == _capacity; }
+
+    u32 Capacity() const { return _capacity; }
+    u64 Pushes() const { return _pushes; }
+    float AverageOccupancy() const { return _pushes ? float(_occupancy_sum) / _pushes : 0.0f; }
+    u32 MaxOccupancy() const { return _max_occupancy; }
+    u32 FullWaits() const { return _full_waits; }
+    u32 EmptyWaits() const { return _empty_waits; }
+
+private:
+    const u32 _capacity;
+    std::vector<T> _slots;
+    const u32 _mask;
+    alignas(64) std::atomic<u32> _head { 0 }; // next slot written, by the producer
+    alignas(64) std::atomic<u32> _tail { 0 }; // next slot read, by the consumer
+
+    // Written by the producer
+    alignas(64) u64 _pushes { 0 };
+    u64 _occupancy_sum { 0 }; // in items, sampled after every push
+    u32 _max_occupancy { 0 };
+    u32 _full_waits { 0 };
+    // Written by the consumer
+    alignas(64) u32 _empty_waits { 0 };
+};
+
 } // namespace util
 
@@ -0,0 +1,1860 @@
+/*
+* Copyright 2023 Igalia S.L.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+// A software stand-in for a Vulkan video driver, used instead of libvulkan with --mock-driver.
+//
+// Every entry point vvp and VMA resolve through vkGetInstanceProcAddr is implemented on the host: memory is
+// anonymous mappings, copies are memcpys, and decodes and dispatches only cost time. Each queue keeps a timeline
+// of when its submitted work completes, from the latency model in Config, and fences, semaphores and queries
+// signal at those times. The host side (parsing, scheduling, submission, allocation) runs exactly as it would
+// on a GPU, so it can be profiled and scaled on machines without one. Decoded pictures are never written.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+
+namespace vvb::mock {
+
+struct Config {
+    u32 devices { 1 }; // identical physical devices
+    u32 decode_queues { 1 };
+    u32 compute_queues { 1 }; // on the graphics family
+    u32 transfer_queues { 1 }; // on a dedicated transfer family, 0 for none
+    u32 uma { 0 }; // device local memory is host visible, and decode output can be linear
+    u32 coincide { 0 }; // decode output coincides with the DPB, otherwise they are distinct images
+    u32 query_status { 1 }; // the decode family supports result status queries
+    u32 decode_errors { 0 }; // every nth completed status query reports an error, 0 for none
+    u32 max_width { 4096 };
+    u32 max_height { 2304 };
+    u32 max_dpb_slots { 17 };
+    u32 max_active_refs { 16 };
+    u32 vram_mb { 8192 };
+
+    // Device time of each operation
+    u32 decode_us { 200 }; // per picture
+    u32 decode_ns_per_mb { 100 }; // per 16x16 macroblock of the coded extent
+    u32 dispatch_us { 50 };
+    u32 copy_us { 10 }; // per copy or fill command
+    u32 copy_mbps { 12000 }; // transfer bandwidth, in MB/s
+
+    // Host time spent in the call itself
+    u32 submit_us { 5 };
+    u32 alloc_us { 20 };
+};
+
+// Parses a comma separated list of <field>=<value> into config, e.g. "decode_queues=2,decode_us=500".
+bool ParseConfig(const char* spec, Config* config)
+{
+    const struct {
+        const char* name;
+        u32* value;
+    } fields[] = {
+        { "devices", &config->devices },
+        { "decode_queues", &config->decode_queues },
+        { "compute_queues", &config->compute_queues },
+        { "transfer_queues", &config->transfer_queues },
+        { "uma", &config->uma },
+        { "coincide", &config->coincide },
+        { "query_status", &config->query_status },
+        { "decode_errors", &config->decode_errors },
+        { "max_width", &config->max_width },
+        { "max_height", &config->max_height },
+        { "max_dpb_slots", &config->max_dpb_slots },
+        { "max_active_refs", &config->max_active_refs },
+        { "vram_mb", &config->vram_mb },
+        { "decode_us", &config->decode_us },
+        { "decode_ns_per_mb", &config->decode_ns_per_mb },
+        { "dispatch_us", &config->dispatch_us },
+        { "copy_us", &config->copy_us },
+        { "copy_mbps", &config->copy_mbps },
+        { "submit_us", &config->submit_us },
+        { "alloc_us", &config->alloc_us },
+    };
+
+    std::vector<char> buf(spec, spec + strlen(spec) + 1);
+    char* save = nullptr;
+    for (char* tok = strtok_r(buf.data(), ",", &save); tok; tok = strtok_r(nullptr, ",", &save)) {
+        char* eq = strchr(tok, '=');
+        if (!eq)
+            return false;
+        *eq = '\0';
+        int value;
+        if (!util::StrToInt(eq + 1, 10, value) || value < 0)
+            return false;
+        u32 i = 0;
+        while (i < std::size(fields) && !util::StrEqual(fields[i].name, tok))
+            i++;
+        if (i == std::size(fields))
+            return false;
+        *fields[i].value = (u32)value;
+    }
+    return config->devices > 0 && config->decode_queues > 0 && config->compute_queues > 0 &&
+        config->copy_mbps > 0 && config->max_dpb_slots > 0;
+}
+
+static Config active_config;
+
+using Clock = std::chrono::steady_clock;
+using TimePoint = Clock::time_point;
+
+// Busy waits, host costs are CPU time of the calling thread, and sleeps are too coarse for a few microseconds.
+static void SpendHostTime(u32 us)
+{
+    if (us == 0)
+        return;
+    TimePoint end = Clock::now() + std::chrono::microseconds(us);
+    while (Clock::now() < end) {
+    }
+}
+
+// {{{ objects
+
+struct Instance;
+struct Device;
+
+struct PhysicalDevice {
+    Instance* _instance;
+    u32 _index;
+};
+
+struct Instance {
+    std::vector<PhysicalDevice> _physical_devices;
+};
+
+// Completion time of submitted work, shared by fences, binary semaphores and queries.
+struct Signal {
+    bool _scheduled { false };
+    TimePoint _at {};
+};
+
+struct Queue {
+    Device* _device;
+    u32 _family;
+    TimePoint _busy_until {};
+    Clock::duration _busy {};
+    u32 _submits { 0 };
+};
+
+struct Device {
+    PhysicalDevice* _physical_device;
+    std::vector<std::vector<Queue>> _queues; // per family
+    std::mutex _mutex; // guards every Signal and Queue timeline
+    std::condition_variable _submitted;
+    u32 _status_reads { 0 }; // completed status queries read, for decode_errors, guarded by _mutex
+};
+
+struct Memory {
+    u8* _ptr;
+    VkDeviceSize _size;
+    u32 _type;
+};
+
+struct Buffer {
+    VkDeviceSize _size;
+    Memory* _memory { nullptr };
+    VkDeviceSize _offset { 0 };
+};
+
+struct ImageLayout {
+    u32 _planes;
+    u32 _texel_size[2];
+    VkDeviceSize _plane_offset[2];
+    VkDeviceSize _row_pitch[2];
+    VkDeviceSize _plane_size[2];
+    VkDeviceSize _layer_pitch;
+    VkDeviceSize _size;
+};
+
+struct Image {
+    VkFormat _format;
+    ImageLayout _layout;
+    Memory* _memory { nullptr };
+    VkDeviceSize _offset { 0 };
+};
+
+struct Fence {
+    Signal _signal;
+};
+
+struct Semaphore {
+    bool _timeline;
+    u64 _initial_value;
+    std::vector<std::pair<u64, TimePoint>> _timeline_signals; // in submission order
+    Signal _binary;
+};
+
+struct QueryPool {
+    std::vector<Signal> _queries;
+};
+
+struct CommandBuffer;
+
+struct CommandPool {
+    std::vector<CommandBuffer*> _buffers;
+};
+
+struct CommandBuffer {
+    CommandPool* _pool;
+    Clock::duration _cost {};
+    std::vector<std::function<void()>> _transfers; // performed at submission, in order
+    std::vector<std::pair<QueryPool*, u32>> _reset_queries;
+    std::vector<std::pair<QueryPool*, u32>> _ended_queries;
+};
+
+struct VideoSession {
+    VkExtent2D _max_coded_extent;
+};
+
+// Pipelines, views, samplers, layouts and everything else that carries no state here.
+struct Object {
+};
+
+struct DescriptorPool {
+    std::vector<Object*> _sets;
+};
+
+template <typename T, typename H>
+T* FromHandle(H handle)
+{
+    return reinterpret_cast<T*>(handle);
+}
+
+template <typename H, typename T>
+H ToHandle(T* object)
+{
+    return reinterpret_cast<H>(object);
+}
+
+// }}}
+
+// {{{ physical device
+
+struct QueueFamily {
+    VkQueueFlags _flags;
+    u32 _count;
+};
+
+static std::vector<QueueFamily> QueueFamilies()
+{
+    std::vector<QueueFamily> r;
+    r.push_back({ VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT, active_config.compute_queues });
+    r.push_back({ VK_QUEUE_VIDEO_DECODE_BIT_KHR, active_config.decode_queues });
+    if (active_config.transfer_queues > 0)
+        r.push_back({ VK_QUEUE_TRANSFER_BIT, active_config.transfer_queues });
+    return r;
+}
+
+static const char* const device_extensions[] = {
+    VK_KHR_SAMPLER_YCBCR_CONVERSION_EXTENSION_NAME,
+    VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
+    VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME,
+    VK_KHR_VIDEO_QUEUE_EXTENSION_NAME,
+    VK_KHR_VIDEO_DECODE_QUEUE_EXTENSION_NAME,
+    VK_KHR_VIDEO_DECODE_H264_EXTENSION_NAME,
+};
+
+// Fills the two-call pattern output from a complete array.
+template <typename T>
+static VkResult CopyOut(const T* items, u32 num_items, u32* count, T* out)
+{
+    if (!out) {
+        *count = num_items;
+        return VK_SUCCESS;
+    }
+    u32 n = std::min(*count, num_items);
+    for (u32 i = 0; i < n; i++)
+        out[i] = items[i];
+    *count = n;
+    return n < num_items ? VK_INCOMPLETE : VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL EnumerateInstanceExtensionProperties(const char* layer_name, u32* count, VkExtensionProperties* props)
+{
+    if (layer_name) {
+        *count = 0;
+        return VK_ERROR_LAYER_NOT_PRESENT;
+    }
+    return CopyOut<VkExtensionProperties>(nullptr, 0, count, props);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL EnumerateInstanceLayerProperties(u32* count, VkLayerProperties* props)
+{
+    return CopyOut<VkLayerProperties>(nullptr, 0, count, props);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL EnumerateInstanceVersion(u32* version)
+{
+    *version = VK_API_VERSION_1_3;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateInstance(const VkInstanceCreateInfo* info, const VkAllocationCallbacks*, VkInstance* instance)
+{
+    if (info->enabledLayerCount > 0)
+        return VK_ERROR_LAYER_NOT_PRESENT;
+    if (info->enabledExtensionCount > 0)
+        return VK_ERROR_EXTENSION_NOT_PRESENT;
+    Instance* r = new Instance;
+    r->_physical_devices.resize(active_config.devices);
+    for (u32 i = 0; i < active_config.devices; i++)
+        r->_physical_devices[i] = { r, i };
+    *instance = ToHandle<VkInstance>(r);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyInstance(VkInstance instance, const VkAllocationCallbacks*)
+{
+    delete FromHandle<Instance>(instance);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL EnumeratePhysicalDevices(VkInstance instance, u32* count, VkPhysicalDevice* devices)
+{
+    Instance* inst = FromHandle<Instance>(instance);
+    std::vector<VkPhysicalDevice> handles;
+    for (PhysicalDevice& pd : inst->_physical_devices)
+        handles.push_back(ToHandle<VkPhysicalDevice>(&pd));
+    return CopyOut(handles.data(), (u32)handles.size(), count, devices);
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceProperties(VkPhysicalDevice physical_device, VkPhysicalDeviceProperties* props)
+{
+    PhysicalDevice* pd = FromHandle<PhysicalDevice>(physical_device);
+    *props = {};
+    props->apiVersion = VK_API_VERSION_1_3;
+    props->driverVersion = VK_MAKE_API_VERSION(0, 1, 0, 0);
+    props->vendorID = 0x10005; // VK_VENDOR_ID_MESA, no PCI vendor
+    props->deviceID = pd->_index;
+    props->deviceType = VK_PHYSICAL_DEVICE_TYPE_CPU;
+    snprintf(props->deviceName, sizeof(props->deviceName), "vvb mock video device %u", pd->_index);
+
+    VkPhysicalDeviceLimits& l = props->limits;
+    l.maxImageDimension1D = 16384;
+    l.maxImageDimension2D = 16384;
+    l.maxImageDimension3D = 2048;
+    l.maxImageDimensionCube = 16384;
+    l.maxImageArrayLayers = 2048;
+    l.maxTexelBufferElements = 1u << 27;
+    l.maxUniformBufferRange = 65536;
+    l.maxStorageBufferRange = UINT32_MAX;
+    l.maxPushConstantsSize = 256;
+    l.maxMemoryAllocationCount = 4096;
+    l.maxSamplerAllocationCount = 4000;
+    l.bufferImageGranularity = 1;
+    l.maxBoundDescriptorSets = 8;
+    l.maxPerStageDescriptorSamplers = 1u << 20;
+    l.maxPerStageDescriptorUniformBuffers = 1u << 20;
+    l.maxPerStageDescriptorStorageBuffers = 1u << 20;
+    l.maxPerStageDescriptorSampledImages = 1u << 20;
+    l.maxPerStageDescriptorStorageImages = 1u << 20;
+    l.maxPerStageResources = 1u << 20;
+    l.maxDescriptorSetSamplers = 1u << 20;
+    l.maxDescriptorSetUniformBuffers = 1u << 20;
+    l.maxDescriptorSetStorageBuffers = 1u << 20;
+    l.maxDescriptorSetSampledImages = 1u << 20;
+    l.maxDescriptorSetStorageImages = 1u << 20;
+    l.maxComputeSharedMemorySize = 65536;
+    for (u32 i = 0; i < 3; i++) {
+        l.maxComputeWorkGroupCount[i] = 65535;
+        l.maxComputeWorkGroupSize[i] = i < 2 ? 1024 : 64;
+    }
+    l.maxComputeWorkGroupInvocations = 1024;
+    l.maxSamplerAnisotropy = 16.0f;
+    l.minMemoryMapAlignment = 64;
+    l.minTexelBufferOffsetAlignment = 16;
+    l.minUniformBufferOffsetAlignment = 16;
+    l.minStorageBufferOffsetAlignment = 16;
+    l.timestampPeriod = 1.0f;
+    l.optimalBufferCopyOffsetAlignment = 1;
+    l.optimalBufferCopyRowPitchAlignment = 1;
+    l.nonCoherentAtomSize = 64;
+    l.framebufferColorSampleCounts = VK_SAMPLE_COUNT_1_BIT;
+    l.sampledImageColorSampleCounts = VK_SAMPLE_COUNT_1_BIT;
+    l.storageImageSampleCounts = VK_SAMPLE_COUNT_1_BIT;
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceProperties2(VkPhysicalDevice physical_device, VkPhysicalDeviceProperties2* props)
+{
+    PhysicalDevice* pd = FromHandle<PhysicalDevice>(physical_device);
+    GetPhysicalDeviceProperties(physical_device, &props->properties);
+    for (auto* s = reinterpret_cast<VkBaseOutStructure*>(props->pNext); s; s = s->pNext) {
+        switch (s->sType) {
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES: {
+            auto* id = reinterpret_cast<VkPhysicalDeviceIDProperties*>(s);
+            memset(id->deviceUUID, 0, VK_UUID_SIZE);
+            id->deviceUUID[0] = (u8)(pd->_index + 1);
+            // NUL terminated, it is printed as a string
+            memset(id->driverUUID, 0, VK_UUID_SIZE);
+            memcpy(id->driverUUID, "vvb-mock-driver", 15);
+            id->deviceLUIDValid = VK_FALSE;
+            id->deviceNodeMask = 0;
+            break;
+        }
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DRM_PROPERTIES_EXT: {
+            auto* drm = reinterpret_cast<VkPhysicalDeviceDrmPropertiesEXT*>(s);
+            drm->hasPrimary = VK_FALSE;
+            drm->hasRender = VK_FALSE;
+            drm->primaryMajor = drm->primaryMinor = drm->renderMajor = drm->renderMinor = 0;
+            break;
+        }
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT:
+            reinterpret_cast<VkPhysicalDeviceExternalMemoryHostPropertiesEXT*>(s)->minImportedHostPointerAlignment = 4096;
+            break;
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAINTENANCE_3_PROPERTIES: {
+            auto* m3 = reinterpret_cast<VkPhysicalDeviceMaintenance3Properties*>(s);
+            m3->maxPerSetDescriptors = 1u << 20;
+            m3->maxMemoryAllocationSize = VkDeviceSize(active_config.vram_mb) * MegaByte;
+            break;
+        }
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAINTENANCE_4_PROPERTIES:
+            reinterpret_cast<VkPhysicalDeviceMaintenance4Properties*>(s)->maxBufferSize = VkDeviceSize(active_config.vram_mb) * MegaByte;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceFeatures(VkPhysicalDevice, VkPhysicalDeviceFeatures* features)
+{
+    *features = {};
+    features->shaderInt64 = VK_TRUE;
+    features->shaderInt16 = VK_TRUE;
+    features->shaderFloat64 = VK_TRUE;
+    features->shaderImageGatherExtended = VK_TRUE;
+    features->shaderStorageImageReadWithoutFormat = VK_TRUE;
+    features->shaderStorageImageWriteWithoutFormat = VK_TRUE;
+    features->shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+    features->fragmentStoresAndAtomics = VK_TRUE;
+    features->vertexPipelineStoresAndAtomics = VK_TRUE;
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceFeatures2(VkPhysicalDevice physical_device, VkPhysicalDeviceFeatures2* features)
+{
+    GetPhysicalDeviceFeatures(physical_device, &features->features);
+    for (auto* s = reinterpret_cast<VkBaseOutStructure*>(features->pNext); s; s = s->pNext) {
+        switch (s->sType) {
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES: {
+            auto* f = reinterpret_cast<VkPhysicalDeviceVulkan11Features*>(s);
+            f->samplerYcbcrConversion = VK_TRUE;
+            f->storageBuffer16BitAccess = VK_TRUE;
+            f->storagePushConstant16 = VK_TRUE;
+            break;
+        }
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES: {
+            auto* f = reinterpret_cast<VkPhysicalDeviceVulkan12Features*>(s);
+            f->timelineSemaphore = VK_TRUE;
+            f->bufferDeviceAddress = VK_TRUE;
+            f->shaderInt8 = VK_TRUE;
+            f->shaderFloat16 = VK_TRUE;
+            f->storageBuffer8BitAccess = VK_TRUE;
+            f->uniformAndStorageBuffer8BitAccess = VK_TRUE;
+            f->storagePushConstant8 = VK_TRUE;
+            f->vulkanMemoryModel = VK_TRUE;
+            f->vulkanMemoryModelDeviceScope = VK_TRUE;
+            break;
+        }
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES: {
+            auto* f = reinterpret_cast<VkPhysicalDeviceVulkan13Features*>(s);
+            f->synchronization2 = VK_TRUE;
+            f->maintenance4 = VK_TRUE;
+            f->computeFullSubgroups = VK_TRUE;
+            f->shaderZeroInitializeWorkgroupMemory = VK_TRUE;
+            break;
+        }
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES:
+            reinterpret_cast<VkPhysicalDeviceTimelineSemaphoreFeatures*>(s)->timelineSemaphore = VK_TRUE;
+            break;
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES:
+            reinterpret_cast<VkPhysicalDeviceSynchronization2Features*>(s)->synchronization2 = VK_TRUE;
+            break;
+        case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SAMPLER_YCBCR_CONVERSION_FEATURES:
+            reinterpret_cast<VkPhysicalDeviceSamplerYcbcrConversionFeatures*>(s)->samplerYcbcrConversion = VK_TRUE;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// A discrete layout has device local VRAM plus host coherent and cached system memory, a UMA layout only
+// has device local memory, all of it host visible.
+static VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceMemoryProperties(VkPhysicalDevice, VkPhysicalDeviceMemoryProperties* props)
+{
+    *props = {};
+    constexpr VkMemoryPropertyFlags host = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    props->memoryHeaps[0] = { VkDeviceSize(active_config.vram_mb) * MegaByte, VK_MEMORY_HEAP_DEVICE_LOCAL_BIT };
+    if (active_config.uma) {
+        props->memoryHeapCount = 1;
+        props->memoryTypeCount = 2;
+        props->memoryTypes[0] = { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | host | VK_MEMORY_PROPERTY_HOST_CACHED_BIT, 0 };
+        props->memoryTypes[1] = { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | host, 0 };
+    } else {
+        props->memoryHeapCount = 2;
+        props->memoryHeaps[1] = { VkDeviceSize(16384) * MegaByte, 0 };
+        props->memoryTypeCount = 3;
+        props->memoryTypes[0] = { VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0 };
+        props->memoryTypes[1] = { host, 1 };
+        props->memoryTypes[2] = { host | VK_MEMORY_PROPERTY_HOST_CACHED_BIT, 1 };
+    }
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceMemoryProperties2(VkPhysicalDevice physical_device, VkPhysicalDeviceMemoryProperties2* props)
+{
+    GetPhysicalDeviceMemoryProperties(physical_device, &props->memoryProperties);
+}
+
+static u32 DeviceLocalMemoryTypeBits()
+{
+    VkPhysicalDeviceMemoryProperties props;
+    GetPhysicalDeviceMemoryProperties(VK_NULL_HANDLE, &props);
+    u32 bits = 0;
+    for (u32 i = 0; i < props.memoryTypeCount; i++) {
+        if (props.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+            bits |= 1u << i;
+    }
+    return bits;
+}
+
+static u32 AllMemoryTypeBits()
+{
+    return active_config.uma ? 0x3 : 0x7;
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceFormatProperties2(VkPhysicalDevice, VkFormat, VkFormatProperties2* props)
+{
+    constexpr VkFormatFeatureFlags image_features = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT | VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT |
+        VK_FORMAT_FEATURE_TRANSFER_SRC_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+    props->formatProperties.linearTilingFeatures = image_features;
+    props->formatProperties.optimalTilingFeatures = image_features;
+    props->formatProperties.bufferFeatures = 0;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL GetPhysicalDeviceImageFormatProperties2(VkPhysicalDevice,
+    const VkPhysicalDeviceImageFormatInfo2* info, VkImageFormatProperties2* props)
+{
+    // Like most hardware, linear video images are only offered where memory is shared, and never for the DPB.
+    if (info->tiling == VK_IMAGE_TILING_LINEAR &&
+        (!active_config.uma || (info->usage & VK_IMAGE_USAGE_VIDEO_DECODE_DPB_BIT_KHR)))
+        return VK_ERROR_FORMAT_NOT_SUPPORTED;
+    VkImageFormatProperties& p = props->imageFormatProperties;
+    p.maxExtent = { 16384, 16384, 1 };
+    p.maxMipLevels = 1;
+    p.maxArrayLayers = 2048;
+    p.sampleCounts = VK_SAMPLE_COUNT_1_BIT;
+    p.maxResourceSize = VkDeviceSize(active_config.vram_mb) * MegaByte;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceQueueFamilyProperties(VkPhysicalDevice, u32* count, VkQueueFamilyProperties* props)
+{
+    std::vector<VkQueueFamilyProperties> r;
+    for (const QueueFamily& family : QueueFamilies()) {
+        VkQueueFamilyProperties p = {};
+        p.queueFlags = family._flags;
+        p.queueCount = family._count;
+        p.timestampValidBits = 64;
+        p.minImageTransferGranularity = { 1, 1, 1 };
+        r.push_back(p);
+    }
+    CopyOut(r.data(), (u32)r.size(), count, props);
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetPhysicalDeviceQueueFamilyProperties2(VkPhysicalDevice physical_device, u32* count, VkQueueFamilyProperties2* props)
+{
+    std::vector<QueueFamily> families = QueueFamilies();
+    if (!props) {
+        *count = (u32)families.size();
+        return;
+    }
+    *count = std::min(*count, (u32)families.size());
+    std::vector<VkQueueFamilyProperties> plain(*count);
+    GetPhysicalDeviceQueueFamilyProperties(physical_device, count, plain.data());
+    for (u32 i = 0; i < *count; i++) {
+        props[i].queueFamilyProperties = plain[i];
+        bool decode = families[i]._flags & VK_QUEUE_VIDEO_DECODE_BIT_KHR;
+        for (auto* s = reinterpret_cast<VkBaseOutStructure*>(props[i].pNext); s; s = s->pNext) {
+            if (s->sType == VK_STRUCTURE_TYPE_QUEUE_FAMILY_VIDEO_PROPERTIES_KHR)
+                reinterpret_cast<VkQueueFamilyVideoPropertiesKHR*>(s)->videoCodecOperations = decode ? VK_VIDEO_CODEC_OPERATION_DECODE_H264_BIT_KHR : 0;
+            else if (s->sType == VK_STRUCTURE_TYPE_QUEUE_FAMILY_QUERY_RESULT_STATUS_PROPERTIES_KHR)
+                reinterpret_cast<VkQueueFamilyQueryResultStatusPropertiesKHR*>(s)->queryResultStatusSupport = decode && active_config.query_status;
+        }
+    }
+}
+
+static VkResult CheckVideoProfile(const VkVideoProfileInfoKHR* profile)
+{
+    if (profile->videoCodecOperation != VK_VIDEO_CODEC_OPERATION_DECODE_H264_BIT_KHR)
+        return VK_ERROR_VIDEO_PROFILE_CODEC_NOT_SUPPORTED_KHR;
+    if (profile->chromaSubsampling != VK_VIDEO_CHROMA_SUBSAMPLING_420_BIT_KHR ||
+        profile->lumaBitDepth != VK_VIDEO_COMPONENT_BIT_DEPTH_8_BIT_KHR ||
+        profile->chromaBitDepth != VK_VIDEO_COMPONENT_BIT_DEPTH_8_BIT_KHR)
+        return VK_ERROR_VIDEO_PROFILE_FORMAT_NOT_SUPPORTED_KHR;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL GetPhysicalDeviceVideoCapabilitiesKHR(VkPhysicalDevice,
+    const VkVideoProfileInfoKHR* profile, VkVideoCapabilitiesKHR* caps)
+{
+    VkResult res = CheckVideoProfile(profile);
+    if (res != VK_SUCCESS)
+        return res;
+    caps->flags = VK_VIDEO_CAPABILITY_SEPARATE_REFERENCE_IMAGES_BIT_KHR;
+    caps->minBitstreamBufferOffsetAlignment = 256;
+    caps->minBitstreamBufferSizeAlignment = 256;
+    caps->pictureAccessGranularity = { 16, 16 };
+    caps->minCodedExtent = { 16, 16 };
+    caps->maxCodedExtent = { active_config.max_width, active_config.max_height };
+    caps->maxDpbSlots = active_config.max_dpb_slots;
+    caps->maxActiveReferencePictures = active_config.max_active_refs;
+    strncpy(caps->stdHeaderVersion.extensionName, VK_STD_VULKAN_VIDEO_CODEC_H264_DECODE_EXTENSION_NAME, VK_MAX_EXTENSION_NAME_SIZE);
+    caps->stdHeaderVersion.specVersion = VK_STD_VULKAN_VIDEO_CODEC_H264_DECODE_SPEC_VERSION;
+    for (auto* s = reinterpret_cast<VkBaseOutStructure*>(caps->pNext); s; s = s->pNext) {
+        if (s->sType == VK_STRUCTURE_TYPE_VIDEO_DECODE_CAPABILITIES_KHR) {
+            reinterpret_cast<VkVideoDecodeCapabilitiesKHR*>(s)->flags = active_config.coincide ?
+                VK_VIDEO_DECODE_CAPABILITY_DPB_AND_OUTPUT_COINCIDE_BIT_KHR : VK_VIDEO_DECODE_CAPABILITY_DPB_AND_OUTPUT_DISTINCT_BIT_KHR;
+        } else if (s->sType == VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_CAPABILITIES_KHR) {
+            auto* avc = reinterpret_cast<VkVideoDecodeH264CapabilitiesKHR*>(s);
+            avc->maxLevelIdc = STD_VIDEO_H264_LEVEL_IDC_5_2;
+            avc->fieldOffsetGranularity = { 0, 0 };
+        }
+    }
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL GetPhysicalDeviceVideoFormatPropertiesKHR(VkPhysicalDevice,
+    const VkPhysicalDeviceVideoFormatInfoKHR* info, u32* count, VkVideoFormatPropertiesKHR* props)
+{
+    for (auto* s = reinterpret_cast<const VkBaseInStructure*>(info->pNext); s; s = s->pNext) {
+        if (s->sType != VK_STRUCTURE_TYPE_VIDEO_PROFILE_LIST_INFO_KHR)
+            continue;
+        auto* list = reinterpret_cast<const VkVideoProfileListInfoKHR*>(s);
+        for (u32 i = 0; i < list->profileCount; i++) {
+            VkResult res = CheckVideoProfile(&list->pProfiles[i]);
+            if (res != VK_SUCCESS)
+                return res;
+        }
+    }
+
+    VkVideoFormatPropertiesKHR optimal = {};
+    optimal.sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR;
+    optimal.format = VK_FORMAT_G8_B8R8_2PLANE_420_UNORM;
+    optimal.componentMapping = { VK_COMPONENT_SWIZZLE_IDENTITY, VK_COMPONENT_SWIZZLE_IDENTITY,
+        VK_COMPONENT_SWIZZLE_IDENTITY, VK_COMPONENT_SWIZZLE_IDENTITY };
+    optimal.imageCreateFlags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT;
+    optimal.imageType = VK_IMAGE_TYPE_2D;
+    optimal.imageTiling = VK_IMAGE_TILING_OPTIMAL;
+    optimal.imageUsageFlags = VK_IMAGE_USAGE_VIDEO_DECODE_DPB_BIT_KHR | VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    if (active_config.coincide || !(info->imageUsage & VK_IMAGE_USAGE_VIDEO_DECODE_DPB_BIT_KHR))
+        optimal.imageUsageFlags |= VK_IMAGE_USAGE_VIDEO_DECODE_DST_BIT_KHR;
+    VkVideoFormatPropertiesKHR formats[2] = { optimal, optimal };
+    u32 num_formats = 1;
+    // Linear output only comes without the transfer and sampled usages, the host reads it in place.
+    if (active_config.uma && !active_config.coincide && info->imageUsage == VK_IMAGE_USAGE_VIDEO_DECODE_DST_BIT_KHR) {
+        formats[1].imageTiling = VK_IMAGE_TILING_LINEAR;
+        formats[1].imageCreateFlags = 0;
+        formats[1].imageUsageFlags = VK_IMAGE_USAGE_VIDEO_DECODE_DST_BIT_KHR;
+        num_formats = 2;
+    }
+
+    if (!props) {
+        *count = num_formats;
+        return VK_SUCCESS;
+    }
+    u32 n = std::min(*count, num_formats);
+    for (u32 i = 0; i < n; i++) {
+        // Keep the caller's chain
+        formats[i].pNext = props[i].pNext;
+        props[i] = formats[i];
+    }
+    *count = n;
+    return n < num_formats ? VK_INCOMPLETE : VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL EnumerateDeviceExtensionProperties(VkPhysicalDevice, const char* layer_name, u32* count, VkExtensionProperties* props)
+{
+    if (layer_name) {
+        *count = 0;
+        return VK_ERROR_LAYER_NOT_PRESENT;
+    }
+    std::vector<VkExtensionProperties> r(std::size(device_extensions));
+    for (u32 i = 0; i < r.size(); i++) {
+        strncpy(r[i].extensionName, device_extensions[i], VK_MAX_EXTENSION_NAME_SIZE);
+        r[i].specVersion = 1;
+    }
+    return CopyOut(r.data(), (u32)r.size(), count, props);
+}
+
+// }}}
+
+// {{{ device, queues and synchronization
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateDevice(VkPhysicalDevice physical_device, const VkDeviceCreateInfo* info,
+    const VkAllocationCallbacks*, VkDevice* device)
+{
+    std::vector<QueueFamily> families = QueueFamilies();
+    for (u32 i = 0; i < info->enabledExtensionCount; i++) {
+        bool found = false;
+        for (const char* ext : device_extensions)
+            found |= util::StrEqual(ext, info->ppEnabledExtensionNames[i]);
+        if (!found)
+            return VK_ERROR_EXTENSION_NOT_PRESENT;
+    }
+
+    Device* r = new Device;
+    r->_physical_device = FromHandle<PhysicalDevice>(physical_device);
+    r->_queues.resize(families.size());
+    for (u32 i = 0; i < info->queueCreateInfoCount; i++) {
+        const VkDeviceQueueCreateInfo& q = info->pQueueCreateInfos[i];
+        if (q.queueFamilyIndex >= families.size() || q.queueCount > families[q.queueFamilyIndex]._count) {
+            delete r;
+            return VK_ERROR_INITIALIZATION_FAILED;
+        }
+        for (u32 j = 0; j < q.queueCount; j++)
+            r->_queues[q.queueFamilyIndex].push_back({ r, q.queueFamilyIndex });
+    }
+    *device = ToHandle<VkDevice>(r);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyDevice(VkDevice device, const VkAllocationCallbacks*)
+{
+    Device* dev = FromHandle<Device>(device);
+    if (!dev)
+        return;
+    // The simulated load, to compare against the wall clock of the run.
+    for (const auto& family : dev->_queues) {
+        for (u32 i = 0; i < family.size(); i++) {
+            const Queue& q = family[i];
+            if (q._submits > 0)
+                printf("Mock device %u queue %u.%u: %u submissions, %.2f ms busy\n", dev->_physical_device->_index,
+                    q._family, i, q._submits,
+                    std::chrono::duration<double, std::milli>(q._busy).count());
+        }
+    }
+    delete dev;
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetDeviceQueue(VkDevice device, u32 family, u32 index, VkQueue* queue)
+{
+    Device* dev = FromHandle<Device>(device);
+    *queue = VK_NULL_HANDLE;
+    if (family < dev->_queues.size() && index < dev->_queues[family].size())
+        *queue = ToHandle<VkQueue>(&dev->_queues[family][index]);
+}
+
+// Blocks until completion_time() reports when the awaited work is done, which needs it to be submitted first,
+// and that time is reached. completion_time is called with the device lock held.
+template <typename F>
+static VkResult WaitForCompletion(Device* dev, u64 timeout_ns, F&& completion_time)
+{
+    // Far away timeouts would overflow the clock
+    TimePoint deadline = timeout_ns >= (u64(1) << 60) ? TimePoint::max() : Clock::now() + std::chrono::nanoseconds(timeout_ns);
+    TimePoint done;
+    {
+        std::unique_lock<std::mutex> lock(dev->_mutex);
+        while (!completion_time(&done)) {
+            if (deadline == TimePoint::max())
+                dev->_submitted.wait(lock);
+            else if (dev->_submitted.wait_until(lock, deadline) == std::cv_status::timeout && !completion_time(&done))
+                return VK_TIMEOUT;
+        }
+    }
+    if (done > deadline) {
+        std::this_thread::sleep_until(deadline);
+        return VK_TIMEOUT;
+    }
+    std::this_thread::sleep_until(done);
+    return VK_SUCCESS;
+}
+
+static bool TimelineValueTime(const Semaphore* sem, u64 value, TimePoint* at)
+{
+    if (value <= sem->_initial_value) {
+        *at = TimePoint {};
+        return true;
+    }
+    for (const auto& signal : sem->_timeline_signals) {
+        if (signal.first >= value) {
+            *at = signal.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void SignalTimeline(Semaphore* sem, u64 value, TimePoint at)
+{
+    // Entries that have passed are only needed for the latest value.
+    TimePoint now = Clock::now();
+    while (sem->_timeline_signals.size() > 1 && sem->_timeline_signals[1].second <= now) {
+        sem->_initial_value = sem->_timeline_signals[0].first;
+        sem->_timeline_signals.erase(sem->_timeline_signals.begin());
+    }
+    sem->_timeline_signals.push_back({ value, at });
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL QueueSubmit(VkQueue queue, u32 count, const VkSubmitInfo* submits, VkFence fence)
+{
+    Queue* q = FromHandle<Queue>(queue);
+    Device* dev = q->_device;
+    SpendHostTime(active_config.submit_us);
+
+    std::lock_guard<std::mutex> lock(dev->_mutex);
+    for (u32 i = 0; i < count; i++) {
+        const VkSubmitInfo& submit = submits[i];
+        const VkTimelineSemaphoreSubmitInfo* timeline = nullptr;
+        for (auto* s = reinterpret_cast<const VkBaseInStructure*>(submit.pNext); s; s = s->pNext) {
+            if (s->sType == VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO)
+                timeline = reinterpret_cast<const VkTimelineSemaphoreSubmitInfo*>(s);
+        }
+
+        TimePoint start = std::max(Clock::now(), q->_busy_until);
+        for (u32 j = 0; j < submit.waitSemaphoreCount; j++) {
+            Semaphore* sem = FromHandle<Semaphore>(submit.pWaitSemaphores[j]);
+            TimePoint at = TimePoint {};
+            if (!sem->_timeline) {
+                at = sem->_binary._at;
+                sem->_binary._scheduled = false;
+            } else if (timeline && j < timeline->waitSemaphoreValueCount &&
+                !TimelineValueTime(sem, timeline->pWaitSemaphoreValues[j], &at)) {
+                // Wait before signal, which would stall the queue. Not modelled, the signal is assumed done.
+                at = TimePoint {};
+            }
+            start = std::max(start, at);
+        }
+
+        Clock::duration cost {};
+        for (u32 j = 0; j < submit.commandBufferCount; j++) {
+            CommandBuffer* cb = FromHandle<CommandBuffer>(submit.pCommandBuffers[j]);
+            for (auto& transfer : cb->_transfers)
+                transfer();
+            for (const auto& query : cb->_reset_queries)
+                query.first->_queries[query.second]._scheduled = false;
+            cost += cb->_cost;
+        }
+        TimePoint end = start + cost;
+        for (u32 j = 0; j < submit.commandBufferCount; j++) {
+            CommandBuffer* cb = FromHandle<CommandBuffer>(submit.pCommandBuffers[j]);
+            for (const auto& query : cb->_ended_queries)
+                query.first->_queries[query.second] = { true, end };
+        }
+
+        for (u32 j = 0; j < submit.signalSemaphoreCount; j++) {
+            Semaphore* sem = FromHandle<Semaphore>(submit.pSignalSemaphores[j]);
+            if (!sem->_timeline)
+                sem->_binary = { true, end };
+            else if (timeline && j < timeline->signalSemaphoreValueCount)
+                SignalTimeline(sem, timeline->pSignalSemaphoreValues[j], end);
+        }
+
+        q->_busy_until = end;
+        q->_busy += cost;
+        q->_submits++;
+    }
+    if (fence != VK_NULL_HANDLE)
+        FromHandle<Fence>(fence)->_signal = { true, std::max(Clock::now(), q->_busy_until) };
+    dev->_submitted.notify_all();
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL QueueWaitIdle(VkQueue queue)
+{
+    Queue* q = FromHandle<Queue>(queue);
+    return WaitForCompletion(q->_device, UINT64_MAX, [q](TimePoint* done) {
+        *done = q->_busy_until;
+        return true;
+    });
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL DeviceWaitIdle(VkDevice device)
+{
+    Device* dev = FromHandle<Device>(device);
+    return WaitForCompletion(dev, UINT64_MAX, [dev](TimePoint* done) {
+        *done = TimePoint {};
+        for (const auto& family : dev->_queues) {
+            for (const Queue& q : family)
+                *done = std::max(*done, q._busy_until);
+        }
+        return true;
+    });
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateFence(VkDevice, const VkFenceCreateInfo* info, const VkAllocationCallbacks*, VkFence* fence)
+{
+    Fence* r = new Fence;
+    if (info->flags & VK_FENCE_CREATE_SIGNALED_BIT)
+        r->_signal = { true, TimePoint {} };
+    *fence = ToHandle<VkFence>(r);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyFence(VkDevice, VkFence fence, const VkAllocationCallbacks*)
+{
+    delete FromHandle<Fence>(fence);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL ResetFences(VkDevice device, u32 count, const VkFence* fences)
+{
+    std::lock_guard<std::mutex> lock(FromHandle<Device>(device)->_mutex);
+    for (u32 i = 0; i < count; i++)
+        FromHandle<Fence>(fences[i])->_signal = {};
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL GetFenceStatus(VkDevice device, VkFence fence)
+{
+    std::lock_guard<std::mutex> lock(FromHandle<Device>(device)->_mutex);
+    const Signal& s = FromHandle<Fence>(fence)->_signal;
+    return s._scheduled && s._at <= Clock::now() ? VK_SUCCESS : VK_NOT_READY;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL WaitForFences(VkDevice device, u32 count, const VkFence* fences, VkBool32 wait_all, u64 timeout)
+{
+    return WaitForCompletion(FromHandle<Device>(device), timeout, [=](TimePoint* done) {
+        bool any = false, all = true;
+        TimePoint first = TimePoint::max(), last = TimePoint {};
+        for (u32 i = 0; i < count; i++) {
+            const Signal& s = FromHandle<Fence>(fences[i])->_signal;
+            all &= s._scheduled;
+            if (s._scheduled) {
+                any = true;
+                first = std::min(first, s._at);
+                last = std::max(last, s._at);
+            }
+        }
+        *done = wait_all ? last : first;
+        return wait_all ? all : any;
+    });
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateSemaphore(VkDevice, const VkSemaphoreCreateInfo* info, const VkAllocationCallbacks*, VkSemaphore* semaphore)
+{
+    Semaphore* r = new Semaphore;
+    r->_timeline = false;
+    r->_initial_value = 0;
+    for (auto* s = reinterpret_cast<const VkBaseInStructure*>(info->pNext); s; s = s->pNext) {
+        if (s->sType == VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO) {
+            auto* type = reinterpret_cast<const VkSemaphoreTypeCreateInfo*>(s);
+            r->_timeline = type->semaphoreType == VK_SEMAPHORE_TYPE_TIMELINE;
+            r->_initial_value = type->initialValue;
+        }
+    }
+    *semaphore = ToHandle<VkSemaphore>(r);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroySemaphore(VkDevice, VkSemaphore semaphore, const VkAllocationCallbacks*)
+{
+    delete FromHandle<Semaphore>(semaphore);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL WaitSemaphores(VkDevice device, const VkSemaphoreWaitInfo* info, u64 timeout)
+{
+    bool wait_any = info->flags & VK_SEMAPHORE_WAIT_ANY_BIT;
+    return WaitForCompletion(FromHandle<Device>(device), timeout, [=](TimePoint* done) {
+        bool any = false, all = true;
+        TimePoint first = TimePoint::max(), last = TimePoint {};
+        for (u32 i = 0; i < info->semaphoreCount; i++) {
+            TimePoint at;
+            if (TimelineValueTime(FromHandle<Semaphore>(info->pSemaphores[i]), info->pValues[i], &at)) {
+                any = true;
+                first = std::min(first, at);
+                last = std::max(last, at);
+            } else {
+                all = false;
+            }
+        }
+        *done = wait_any ? first : last;
+        return wait_any ? any : all;
+    });
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL GetSemaphoreCounterValue(VkDevice device, VkSemaphore semaphore, u64* value)
+{
+    std::lock_guard<std::mutex> lock(FromHandle<Device>(device)->_mutex);
+    const Semaphore* sem = FromHandle<Semaphore>(semaphore);
+    TimePoint now = Clock::now();
+    *value = sem->_initial_value;
+    for (const auto& signal : sem->_timeline_signals) {
+        if (signal.second <= now)
+            *value = std::max(*value, signal.first);
+    }
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL SignalSemaphore(VkDevice device, const VkSemaphoreSignalInfo* info)
+{
+    Device* dev = FromHandle<Device>(device);
+    std::lock_guard<std::mutex> lock(dev->_mutex);
+    SignalTimeline(FromHandle<Semaphore>(info->semaphore), info->value, Clock::now());
+    dev->_submitted.notify_all();
+    return VK_SUCCESS;
+}
+
+// }}}
+
+// {{{ memory, buffers and images
+
+static VKAPI_ATTR VkResult VKAPI_CALL AllocateMemory(VkDevice, const VkMemoryAllocateInfo* info, const VkAllocationCallbacks*, VkDeviceMemory* memory)
+{
+    SpendHostTime(active_config.alloc_us);
+    if (info->memoryTypeIndex >= (active_config.uma ? 2u : 3u))
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    // Anonymous mappings are zeroed and only backed once touched, so large DPBs cost nothing until copied.
+    void* ptr = mmap(nullptr, info->allocationSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED)
+        return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    *memory = ToHandle<VkDeviceMemory>(new Memory { static_cast<u8*>(ptr), info->allocationSize, info->memoryTypeIndex });
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL FreeMemory(VkDevice, VkDeviceMemory memory, const VkAllocationCallbacks*)
+{
+    Memory* mem = FromHandle<Memory>(memory);
+    if (!mem)
+        return;
+    munmap(mem->_ptr, mem->_size);
+    delete mem;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL MapMemory(VkDevice, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize, VkMemoryMapFlags, void** data)
+{
+    *data = FromHandle<Memory>(memory)->_ptr + offset;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL UnmapMemory(VkDevice, VkDeviceMemory)
+{
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL FlushMappedMemoryRanges(VkDevice, u32, const VkMappedMemoryRange*)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL InvalidateMappedMemoryRanges(VkDevice, u32, const VkMappedMemoryRange*)
+{
+    return VK_SUCCESS;
+}
+
+static VkMemoryRequirements BufferMemoryRequirements(VkDeviceSize size)
+{
+    return { util::AlignUp<VkDeviceSize>(size, 256), 256, AllMemoryTypeBits() };
+}
+
+static void FillMemoryRequirements2(const VkMemoryRequirements& reqs, VkMemoryRequirements2* out)
+{
+    out->memoryRequirements = reqs;
+    for (auto* s = reinterpret_cast<VkBaseOutStructure*>(out->pNext); s; s = s->pNext) {
+        if (s->sType == VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS) {
+            auto* dedicated = reinterpret_cast<VkMemoryDedicatedRequirements*>(s);
+            dedicated->prefersDedicatedAllocation = VK_FALSE;
+            dedicated->requiresDedicatedAllocation = VK_FALSE;
+        }
+    }
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateBuffer(VkDevice, const VkBufferCreateInfo* info, const VkAllocationCallbacks*, VkBuffer* buffer)
+{
+    Buffer* r = new Buffer;
+    r->_size = info->size;
+    *buffer = ToHandle<VkBuffer>(r);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyBuffer(VkDevice, VkBuffer buffer, const VkAllocationCallbacks*)
+{
+    delete FromHandle<Buffer>(buffer);
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetBufferMemoryRequirements(VkDevice, VkBuffer buffer, VkMemoryRequirements* reqs)
+{
+    *reqs = BufferMemoryRequirements(FromHandle<Buffer>(buffer)->_size);
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetBufferMemoryRequirements2(VkDevice, const VkBufferMemoryRequirementsInfo2* info, VkMemoryRequirements2* reqs)
+{
+    FillMemoryRequirements2(BufferMemoryRequirements(FromHandle<Buffer>(info->buffer)->_size), reqs);
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetDeviceBufferMemoryRequirements(VkDevice, const VkDeviceBufferMemoryRequirements* info, VkMemoryRequirements2* reqs)
+{
+    FillMemoryRequirements2(BufferMemoryRequirements(info->pCreateInfo->size), reqs);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL BindBufferMemory(VkDevice, VkBuffer buffer, VkDeviceMemory memory, VkDeviceSize offset)
+{
+    Buffer* buf = FromHandle<Buffer>(buffer);
+    buf->_memory = FromHandle<Memory>(memory);
+    buf->_offset = offset;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL BindBufferMemory2(VkDevice device, u32 count, const VkBindBufferMemoryInfo* infos)
+{
+    for (u32 i = 0; i < count; i++)
+        BindBufferMemory(device, infos[i].buffer, infos[i].memory, infos[i].memoryOffset);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkDeviceAddress VKAPI_CALL GetBufferDeviceAddress(VkDevice, const VkBufferDeviceAddressInfo* info)
+{
+    const Buffer* buf = FromHandle<Buffer>(info->buffer);
+    return buf->_memory ? reinterpret_cast<VkDeviceAddress>(buf->_memory->_ptr + buf->_offset) : 0;
+}
+
+// Planes are stored one after the other in each layer, rows padded to 256 bytes and planes to pages.
+static ImageLayout ComputeImageLayout(VkFormat format, VkExtent3D extent, u32 layers)
+{
+    ImageLayout r = {};
+    u32 chroma_x_shift = 0, chroma_y_shift = 0;
+    r._planes = 1;
+    switch (format) {
+    case VK_FORMAT_G8_B8R8_2PLANE_420_UNORM:
+    case VK_FORMAT_G8_B8R8_2PLANE_422_UNORM:
+        r._planes = 2;
+        r._texel_size[0] = 1;
+        r._texel_size[1] = 2;
+        break;
+    case VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16:
+    case VK_FORMAT_G12X4_B12X4R12X4_2PLANE_420_UNORM_3PACK16:
+    case VK_FORMAT_G16_B16R16_2PLANE_420_UNORM:
+    case VK_FORMAT_G10X6_B10X6R10X6_2PLANE_422_UNORM_3PACK16:
+    case VK_FORMAT_G12X4_B12X4R12X4_2PLANE_422_UNORM_3PACK16:
+    case VK_FORMAT_G16_B16R16_2PLANE_422_UNORM:
+        r._planes = 2;
+        r._texel_size[0] = 2;
+        r._texel_size[1] = 4;
+        break;
+    case VK_FORMAT_R8_UNORM:
+        r._texel_size[0] = 1;
+        break;
+    case VK_FORMAT_R8G8_UNORM:
+    case VK_FORMAT_R16_UNORM:
+        r._texel_size[0] = 2;
+        break;
+    default:
+        r._texel_size[0] = 4;
+        break;
+    }
+    if (r._planes == 2) {
+        chroma_x_shift = 1;
+        chroma_y_shift = (format == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM ||
+                             format == VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16 ||
+                             format == VK_FORMAT_G12X4_B12X4R12X4_2PLANE_420_UNORM_3PACK16 ||
+                             format == VK_FORMAT_G16_B16R16_2PLANE_420_UNORM)
+            ? 1
+            : 0;
+    }
+
+    VkDeviceSize offset = 0;
+    for (u32 p = 0; p < r._planes; p++) {
+        u32 width = p ? (extent.width + chroma_x_shift) >> chroma_x_shift : extent.width;
+        u32 height = p ? (extent.height + chroma_y_shift) >> chroma_y_shift : extent.height;
+        r._plane_offset[p] = offset;
+        r._row_pitch[p] = util::AlignUp<VkDeviceSize>(VkDeviceSize(width) * r._texel_size[p], 256);
+        r._plane_size[p] = r._row_pitch[p] * height;
+        offset = util::AlignUp<VkDeviceSize>(offset + r._plane_size[p], 4096);
+    }
+    r._layer_pitch = offset;
+    r._size = offset * std::max(layers, 1u);
+    return r;
+}
+
+static VkMemoryRequirements ImageMemoryRequirements(const ImageLayout& layout)
+{
+    return { layout._size, 4096, AllMemoryTypeBits() };
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateImage(VkDevice, const VkImageCreateInfo* info, const VkAllocationCallbacks*, VkImage* image)
+{
+    Image* r = new Image;
+    r->_format = info->format;
+    r->_layout = ComputeImageLayout(info->format, info->extent, info->arrayLayers);
+    *image = ToHandle<VkImage>(r);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyImage(VkDevice, VkImage image, const VkAllocationCallbacks*)
+{
+    delete FromHandle<Image>(image);
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetImageMemoryRequirements(VkDevice, VkImage image, VkMemoryRequirements* reqs)
+{
+    *reqs = ImageMemoryRequirements(FromHandle<Image>(image)->_layout);
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetImageMemoryRequirements2(VkDevice, const VkImageMemoryRequirementsInfo2* info, VkMemoryRequirements2* reqs)
+{
+    FillMemoryRequirements2(ImageMemoryRequirements(FromHandle<Image>(info->image)->_layout), reqs);
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetDeviceImageMemoryRequirements(VkDevice, const VkDeviceImageMemoryRequirements* info, VkMemoryRequirements2* reqs)
+{
+    const VkImageCreateInfo* ci = info->pCreateInfo;
+    FillMemoryRequirements2(ImageMemoryRequirements(ComputeImageLayout(ci->format, ci->extent, ci->arrayLayers)), reqs);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL BindImageMemory(VkDevice, VkImage image, VkDeviceMemory memory, VkDeviceSize offset)
+{
+    Image* img = FromHandle<Image>(image);
+    img->_memory = FromHandle<Memory>(memory);
+    img->_offset = offset;
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL BindImageMemory2(VkDevice device, u32 count, const VkBindImageMemoryInfo* infos)
+{
+    for (u32 i = 0; i < count; i++)
+        BindImageMemory(device, infos[i].image, infos[i].memory, infos[i].memoryOffset);
+    return VK_SUCCESS;
+}
+
+static u32 AspectPlane(VkImageAspectFlags aspect)
+{
+    return aspect == VK_IMAGE_ASPECT_PLANE_1_BIT ? 1 : 0;
+}
+
+static VKAPI_ATTR void VKAPI_CALL GetImageSubresourceLayout(VkDevice, VkImage image, const VkImageSubresource* subresource, VkSubresourceLayout* layout)
+{
+    const ImageLayout& l = FromHandle<Image>(image)->_layout;
+    u32 plane = AspectPlane(subresource->aspectMask);
+    layout->offset = subresource->arrayLayer * l._layer_pitch + l._plane_offset[plane];
+    layout->size = l._plane_size[plane];
+    layout->rowPitch = l._row_pitch[plane];
+    layout->arrayPitch = l._layer_pitch;
+    layout->depthPitch = l._plane_size[plane];
+}
+
+// }}}
+
+// {{{ objects without state
+
+template <typename H>
+static VkResult CreateObject(H* handle)
+{
+    *handle = ToHandle<H>(new Object);
+    return VK_SUCCESS;
+}
+
+template <typename H>
+static void DestroyObject(H handle)
+{
+    delete FromHandle<Object>(handle);
+}
+
+#define MOCK_STATELESS_OBJECT(TYPE, CREATE_INFO)                                                                            \
+    static VKAPI_ATTR VkResult VKAPI_CALL Create##TYPE(VkDevice, const CREATE_INFO*, const VkAllocationCallbacks*, Vk##TYPE* handle) \
+    {                                                                                                                       \
+        return CreateObject(handle);                                                                                        \
+    }                                                                                                                       \
+    static VKAPI_ATTR void VKAPI_CALL Destroy##TYPE(VkDevice, Vk##TYPE handle, const VkAllocationCallbacks*)                \
+    {                                                                                                                       \
+        DestroyObject(handle);                                                                                              \
+    }
+
+MOCK_STATELESS_OBJECT(ImageView, VkImageViewCreateInfo)
+MOCK_STATELESS_OBJECT(Sampler, VkSamplerCreateInfo)
+MOCK_STATELESS_OBJECT(SamplerYcbcrConversion, VkSamplerYcbcrConversionCreateInfo)
+MOCK_STATELESS_OBJECT(ShaderModule, VkShaderModuleCreateInfo)
+MOCK_STATELESS_OBJECT(PipelineLayout, VkPipelineLayoutCreateInfo)
+MOCK_STATELESS_OBJECT(DescriptorSetLayout, VkDescriptorSetLayoutCreateInfo)
+MOCK_STATELESS_OBJECT(DescriptorUpdateTemplate, VkDescriptorUpdateTemplateCreateInfo)
+MOCK_STATELESS_OBJECT(VideoSessionParametersKHR, VkVideoSessionParametersCreateInfoKHR)
+
+#undef MOCK_STATELESS_OBJECT
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateDebugUtilsMessengerEXT(VkInstance, const VkDebugUtilsMessengerCreateInfoEXT*,
+    const VkAllocationCallbacks*, VkDebugUtilsMessengerEXT* messenger)
+{
+    return CreateObject(messenger);
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyDebugUtilsMessengerEXT(VkInstance, VkDebugUtilsMessengerEXT messenger, const VkAllocationCallbacks*)
+{
+    DestroyObject(messenger);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateComputePipelines(VkDevice, VkPipelineCache, u32 count,
+    const VkComputePipelineCreateInfo*, const VkAllocationCallbacks*, VkPipeline* pipelines)
+{
+    for (u32 i = 0; i < count; i++)
+        CreateObject(&pipelines[i]);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyPipeline(VkDevice, VkPipeline pipeline, const VkAllocationCallbacks*)
+{
+    DestroyObject(pipeline);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateDescriptorPool(VkDevice, const VkDescriptorPoolCreateInfo*, const VkAllocationCallbacks*, VkDescriptorPool* pool)
+{
+    *pool = ToHandle<VkDescriptorPool>(new DescriptorPool);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyDescriptorPool(VkDevice, VkDescriptorPool pool, const VkAllocationCallbacks*)
+{
+    DescriptorPool* p = FromHandle<DescriptorPool>(pool);
+    if (!p)
+        return;
+    for (Object* set : p->_sets)
+        delete set;
+    delete p;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL AllocateDescriptorSets(VkDevice, const VkDescriptorSetAllocateInfo* info, VkDescriptorSet* sets)
+{
+    DescriptorPool* p = FromHandle<DescriptorPool>(info->descriptorPool);
+    for (u32 i = 0; i < info->descriptorSetCount; i++) {
+        p->_sets.push_back(new Object);
+        sets[i] = ToHandle<VkDescriptorSet>(p->_sets.back());
+    }
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL UpdateDescriptorSets(VkDevice, u32, const VkWriteDescriptorSet*, u32, const VkCopyDescriptorSet*)
+{
+}
+
+static VKAPI_ATTR void VKAPI_CALL UpdateDescriptorSetWithTemplate(VkDevice, VkDescriptorSet, VkDescriptorUpdateTemplate, const void*)
+{
+}
+
+// }}}
+
+// {{{ command buffers
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateCommandPool(VkDevice, const VkCommandPoolCreateInfo*, const VkAllocationCallbacks*, VkCommandPool* pool)
+{
+    *pool = ToHandle<VkCommandPool>(new CommandPool);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyCommandPool(VkDevice, VkCommandPool pool, const VkAllocationCallbacks*)
+{
+    CommandPool* p = FromHandle<CommandPool>(pool);
+    if (!p)
+        return;
+    for (CommandBuffer* cb : p->_buffers)
+        delete cb;
+    delete p;
+}
+
+static void ResetCommands(CommandBuffer* cb)
+{
+    cb->_cost = {};
+    cb->_transfers.clear();
+    cb->_reset_queries.clear();
+    cb->_ended_queries.clear();
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL ResetCommandPool(VkDevice, VkCommandPool pool, VkCommandPoolResetFlags)
+{
+    for (CommandBuffer* cb : FromHandle<CommandPool>(pool)->_buffers)
+        ResetCommands(cb);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL AllocateCommandBuffers(VkDevice, const VkCommandBufferAllocateInfo* info, VkCommandBuffer* buffers)
+{
+    CommandPool* p = FromHandle<CommandPool>(info->commandPool);
+    for (u32 i = 0; i < info->commandBufferCount; i++) {
+        CommandBuffer* cb = new CommandBuffer;
+        cb->_pool = p;
+        p->_buffers.push_back(cb);
+        buffers[i] = ToHandle<VkCommandBuffer>(cb);
+    }
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL FreeCommandBuffers(VkDevice, VkCommandPool pool, u32 count, const VkCommandBuffer* buffers)
+{
+    CommandPool* p = FromHandle<CommandPool>(pool);
+    for (u32 i = 0; i < count; i++) {
+        CommandBuffer* cb = FromHandle<CommandBuffer>(buffers[i]);
+        if (!cb)
+            continue;
+        p->_buffers.erase(std::remove(p->_buffers.begin(), p->_buffers.end(), cb), p->_buffers.end());
+        delete cb;
+    }
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL BeginCommandBuffer(VkCommandBuffer cmd_buf, const VkCommandBufferBeginInfo*)
+{
+    ResetCommands(FromHandle<CommandBuffer>(cmd_buf));
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL EndCommandBuffer(VkCommandBuffer)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL ResetCommandBuffer(VkCommandBuffer cmd_buf, VkCommandBufferResetFlags)
+{
+    ResetCommands(FromHandle<CommandBuffer>(cmd_buf));
+    return VK_SUCCESS;
+}
+
+static Clock::duration CopyCost(VkDeviceSize bytes)
+{
+    return std::chrono::microseconds(active_config.copy_us) + std::chrono::nanoseconds(bytes * 1000 / active_config.copy_mbps);
+}
+
+static void CopyImageRegion(const Image* image, const Buffer* buffer, const VkBufferImageCopy& region, bool to_buffer)
+{
+    ASSERT(image->_memory && buffer->_memory);
+    const ImageLayout& l = image->_layout;
+    u32 plane = AspectPlane(region.imageSubresource.aspectMask);
+    VkDeviceSize texel = l._texel_size[plane];
+    VkDeviceSize row_bytes = region.imageExtent.width * texel;
+    VkDeviceSize buffer_pitch = region.bufferRowLength ? region.bufferRowLength * texel : row_bytes;
+    VkDeviceSize buffer_layer_pitch = buffer_pitch * (region.bufferImageHeight ? region.bufferImageHeight : region.imageExtent.height);
+    for (u32 layer = 0; layer < region.imageSubresource.layerCount; layer++) {
+        u8* img = image->_memory->_ptr + image->_offset + (region.imageSubresource.baseArrayLayer + layer) * l._layer_pitch +
+            l._plane_offset[plane] + region.imageOffset.y * l._row_pitch[plane] + region.imageOffset.x * texel;
+        u8* buf = buffer->_memory->_ptr + buffer->_offset + region.bufferOffset + layer * buffer_layer_pitch;
+        for (u32 y = 0; y < region.imageExtent.height; y++) {
+            if (to_buffer)
+                memcpy(buf + y * buffer_pitch, img + y * l._row_pitch[plane], row_bytes);
+            else
+                memcpy(img + y * l._row_pitch[plane], buf + y * buffer_pitch, row_bytes);
+        }
+    }
+}
+
+static void RecordImageCopy(CommandBuffer* cb, Image* image, Buffer* buffer, u32 count, const VkBufferImageCopy* regions, bool to_buffer)
+{
+    std::vector<VkBufferImageCopy> copies(regions, regions + count);
+    VkDeviceSize bytes = 0;
+    for (const auto& region : copies)
+        bytes += VkDeviceSize(region.imageExtent.width) * region.imageExtent.height * region.imageSubresource.layerCount *
+            image->_layout._texel_size[AspectPlane(region.imageSubresource.aspectMask)];
+    cb->_cost += CopyCost(bytes);
+    cb->_transfers.push_back([=]() {
+        for (const auto& region : copies)
+            CopyImageRegion(image, buffer, region, to_buffer);
+    });
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdCopyImageToBuffer(VkCommandBuffer cmd_buf, VkImage image, VkImageLayout, VkBuffer buffer,
+    u32 count, const VkBufferImageCopy* regions)
+{
+    RecordImageCopy(FromHandle<CommandBuffer>(cmd_buf), FromHandle<Image>(image), FromHandle<Buffer>(buffer), count, regions, true);
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdCopyBufferToImage(VkCommandBuffer cmd_buf, VkBuffer buffer, VkImage image, VkImageLayout,
+    u32 count, const VkBufferImageCopy* regions)
+{
+    RecordImageCopy(FromHandle<CommandBuffer>(cmd_buf), FromHandle<Image>(image), FromHandle<Buffer>(buffer), count, regions, false);
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdCopyBuffer(VkCommandBuffer cmd_buf, VkBuffer src, VkBuffer dst, u32 count, const VkBufferCopy* regions)
+{
+    CommandBuffer* cb = FromHandle<CommandBuffer>(cmd_buf);
+    const Buffer* s = FromHandle<Buffer>(src);
+    const Buffer* d = FromHandle<Buffer>(dst);
+    std::vector<VkBufferCopy> copies(regions, regions + count);
+    VkDeviceSize bytes = 0;
+    for (const auto& region : copies)
+        bytes += region.size;
+    cb->_cost += CopyCost(bytes);
+    cb->_transfers.push_back([=]() {
+        for (const auto& region : copies)
+            memmove(d->_memory->_ptr + d->_offset + region.dstOffset, s->_memory->_ptr + s->_offset + region.srcOffset, region.size);
+    });
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdFillBuffer(VkCommandBuffer cmd_buf, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, u32 data)
+{
+    CommandBuffer* cb = FromHandle<CommandBuffer>(cmd_buf);
+    const Buffer* b = FromHandle<Buffer>(buffer);
+    if (size == VK_WHOLE_SIZE)
+        size = (b->_size - offset) & ~VkDeviceSize(3);
+    cb->_cost += CopyCost(size);
+    cb->_transfers.push_back([=]() {
+        u32* dst = reinterpret_cast<u32*>(b->_memory->_ptr + b->_offset + offset);
+        for (VkDeviceSize i = 0; i < size / 4; i++)
+            dst[i] = data;
+    });
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdDispatch(VkCommandBuffer cmd_buf, u32, u32, u32)
+{
+    FromHandle<CommandBuffer>(cmd_buf)->_cost += std::chrono::microseconds(active_config.dispatch_us);
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdBindPipeline(VkCommandBuffer, VkPipelineBindPoint, VkPipeline)
+{
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdBindDescriptorSets(VkCommandBuffer, VkPipelineBindPoint, VkPipelineLayout, u32, u32,
+    const VkDescriptorSet*, u32, const u32*)
+{
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdPushConstants(VkCommandBuffer, VkPipelineLayout, VkShaderStageFlags, u32, u32, const void*)
+{
+}
+
+// Work runs in submission order on each queue, so barriers order nothing further.
+static VKAPI_ATTR void VKAPI_CALL CmdPipelineBarrier(VkCommandBuffer, VkPipelineStageFlags, VkPipelineStageFlags, VkDependencyFlags,
+    u32, const VkMemoryBarrier*, u32, const VkBufferMemoryBarrier*, u32, const VkImageMemoryBarrier*)
+{
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdPipelineBarrier2(VkCommandBuffer, const VkDependencyInfo*)
+{
+}
+
+// }}}
+
+// {{{ queries
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateQueryPool(VkDevice, const VkQueryPoolCreateInfo* info, const VkAllocationCallbacks*, VkQueryPool* pool)
+{
+    QueryPool* r = new QueryPool;
+    r->_queries.resize(info->queryCount);
+    *pool = ToHandle<VkQueryPool>(r);
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyQueryPool(VkDevice, VkQueryPool pool, const VkAllocationCallbacks*)
+{
+    delete FromHandle<QueryPool>(pool);
+}
+
+static VKAPI_ATTR void VKAPI_CALL ResetQueryPool(VkDevice device, VkQueryPool pool, u32 first, u32 count)
+{
+    std::lock_guard<std::mutex> lock(FromHandle<Device>(device)->_mutex);
+    QueryPool* p = FromHandle<QueryPool>(pool);
+    for (u32 i = first; i < first + count; i++)
+        p->_queries[i] = {};
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdResetQueryPool(VkCommandBuffer cmd_buf, VkQueryPool pool, u32 first, u32 count)
+{
+    CommandBuffer* cb = FromHandle<CommandBuffer>(cmd_buf);
+    for (u32 i = first; i < first + count; i++)
+        cb->_reset_queries.push_back({ FromHandle<QueryPool>(pool), i });
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdBeginQuery(VkCommandBuffer, VkQueryPool, u32, VkQueryControlFlags)
+{
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdEndQuery(VkCommandBuffer cmd_buf, VkQueryPool pool, u32 query)
+{
+    FromHandle<CommandBuffer>(cmd_buf)->_ended_queries.push_back({ FromHandle<QueryPool>(pool), query });
+}
+
+// Result status queries report VK_QUERY_RESULT_STATUS_COMPLETE_KHR once the decode has completed, or
+// VK_QUERY_RESULT_STATUS_ERROR_KHR for every decode_errors-th of them.
+static VKAPI_ATTR VkResult VKAPI_CALL GetQueryPoolResults(VkDevice device, VkQueryPool pool, u32 first, u32 count,
+    size_t, void* data, VkDeviceSize stride, VkQueryResultFlags flags)
+{
+    Device* dev = FromHandle<Device>(device);
+    QueryPool* p = FromHandle<QueryPool>(pool);
+    VkResult result = VK_SUCCESS;
+    for (u32 i = 0; i < count; i++) {
+        const Signal* query = &p->_queries[first + i];
+        bool available;
+        if (flags & VK_QUERY_RESULT_WAIT_BIT) {
+            available = WaitForCompletion(dev, UINT64_MAX, [query](TimePoint* done) {
+                *done = query->_at;
+                return query->_scheduled;
+            }) == VK_SUCCESS;
+        } else {
+            std::lock_guard<std::mutex> lock(dev->_mutex);
+            available = query->_scheduled && query->_at <= Clock::now();
+        }
+
+        u8* out = static_cast<u8*>(data) + i * stride;
+        i64 status = available ? VK_QUERY_RESULT_STATUS_COMPLETE_KHR : VK_QUERY_RESULT_STATUS_NOT_READY_KHR;
+        if (available && active_config.decode_errors) {
+            std::lock_guard<std::mutex> lock(dev->_mutex);
+            if (++dev->_status_reads % active_config.decode_errors == 0)
+                status = VK_QUERY_RESULT_STATUS_ERROR_KHR;
+        }
+        if (!available)
+            result = VK_NOT_READY;
+        if (!available && !(flags & (VK_QUERY_RESULT_WITH_STATUS_BIT_KHR | VK_QUERY_RESULT_PARTIAL_BIT)))
+            continue;
+        if (flags & VK_QUERY_RESULT_64_BIT)
+            *reinterpret_cast<i64*>(out) = status;
+        else
+            *reinterpret_cast<i32*>(out) = (i32)status;
+    }
+    return result;
+}
+
+// }}}
+
+// {{{ video
+
+static VKAPI_ATTR VkResult VKAPI_CALL CreateVideoSessionKHR(VkDevice, const VkVideoSessionCreateInfoKHR* info,
+    const VkAllocationCallbacks*, VkVideoSessionKHR* session)
+{
+    VkResult res = CheckVideoProfile(info->pVideoProfile);
+    if (res != VK_SUCCESS)
+        return res;
+    if (info->maxCodedExtent.width > active_config.max_width || info->maxCodedExtent.height > active_config.max_height ||
+        info->maxDpbSlots > active_config.max_dpb_slots || info->maxActiveReferencePictures > active_config.max_active_refs)
+        return VK_ERROR_INITIALIZATION_FAILED;
+    *session = ToHandle<VkVideoSessionKHR>(new VideoSession { info->maxCodedExtent });
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL DestroyVideoSessionKHR(VkDevice, VkVideoSessionKHR session, const VkAllocationCallbacks*)
+{
+    delete FromHandle<VideoSession>(session);
+}
+
+// Context memory in the size range hardware decoders ask for, the bigger binding scaling with the picture size.
+static VKAPI_ATTR VkResult VKAPI_CALL GetVideoSessionMemoryRequirementsKHR(VkDevice, VkVideoSessionKHR session,
+    u32* count, VkVideoSessionMemoryRequirementsKHR* reqs)
+{
+    const VideoSession* s = FromHandle<VideoSession>(session);
+    VkDeviceSize mbs = VkDeviceSize((s->_max_coded_extent.width + 15) / 16) * ((s->_max_coded_extent.height + 15) / 16);
+    const VkDeviceSize sizes[2] = { util::AlignUp<VkDeviceSize>(mbs * 256, 65536), 65536 };
+    if (!reqs) {
+        *count = 2;
+        return VK_SUCCESS;
+    }
+    u32 n = std::min(*count, 2u);
+    for (u32 i = 0; i < n; i++) {
+        reqs[i].memoryBindIndex = i;
+        reqs[i].memoryRequirements = { sizes[i], 4096, DeviceLocalMemoryTypeBits() };
+    }
+    *count = n;
+    return n < 2 ? VK_INCOMPLETE : VK_SUCCESS;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL BindVideoSessionMemoryKHR(VkDevice, VkVideoSessionKHR, u32, const VkBindVideoSessionMemoryInfoKHR*)
+{
+    return VK_SUCCESS;
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdBeginVideoCodingKHR(VkCommandBuffer, const VkVideoBeginCodingInfoKHR*)
+{
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdControlVideoCodingKHR(VkCommandBuffer, const VkVideoCodingControlInfoKHR*)
+{
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdEndVideoCodingKHR(VkCommandBuffer, const VkVideoEndCodingInfoKHR*)
+{
+}
+
+static VKAPI_ATTR void VKAPI_CALL CmdDecodeVideoKHR(VkCommandBuffer cmd_buf, const VkVideoDecodeInfoKHR* info)
+{
+    const VkExtent2D& extent = info->dstPictureResource.codedExtent;
+    u64 mbs = u64((extent.width + 15) / 16) * ((extent.height + 15) / 16);
+    FromHandle<CommandBuffer>(cmd_buf)->_cost += std::chrono::microseconds(active_config.decode_us) +
+        std::chrono::nanoseconds(mbs * active_config.decode_ns_per_mb);
+}
+
+// }}}
+
+// {{{ entry points
+
+template <typename PFN>
+static PFN_vkVoidFunction EntryPoint(PFN fn)
+{
+    return reinterpret_cast<PFN_vkVoidFunction>(fn);
+}
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL GetInstanceProcAddr(VkInstance, const char* name);
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL GetDeviceProcAddr(VkDevice, const char* name);
+
+// The signature of each function is checked against its PFN_vk type.
+#define MOCK_ENTRY(NAME) { "vk" #NAME, EntryPoint<PFN_vk##NAME>(NAME) },
+#define MOCK_ALIAS(ALIAS, NAME) { "vk" #ALIAS, EntryPoint<PFN_vk##ALIAS>(NAME) },
+
+static const struct {
+    const char* name;
+    PFN_vkVoidFunction fn;
+} entry_points[] = {
+    MOCK_ENTRY(GetInstanceProcAddr)
+    MOCK_ENTRY(GetDeviceProcAddr)
+    MOCK_ENTRY(EnumerateInstanceExtensionProperties)
+    MOCK_ENTRY(EnumerateInstanceLayerProperties)
+    MOCK_ENTRY(EnumerateInstanceVersion)
+    MOCK_ENTRY(CreateInstance)
+    MOCK_ENTRY(DestroyInstance)
+    MOCK_ENTRY(CreateDebugUtilsMessengerEXT)
+    MOCK_ENTRY(DestroyDebugUtilsMessengerEXT)
+    MOCK_ENTRY(EnumeratePhysicalDevices)
+    MOCK_ENTRY(GetPhysicalDeviceProperties)
+    MOCK_ENTRY(GetPhysicalDeviceProperties2)
+    MOCK_ALIAS(GetPhysicalDeviceProperties2KHR, GetPhysicalDeviceProperties2)
+    MOCK_ENTRY(GetPhysicalDeviceFeatures)
+    MOCK_ENTRY(GetPhysicalDeviceFeatures2)
+    MOCK_ENTRY(GetPhysicalDeviceMemoryProperties)
+    MOCK_ENTRY(GetPhysicalDeviceMemoryProperties2)
+    MOCK_ALIAS(GetPhysicalDeviceMemoryProperties2KHR, GetPhysicalDeviceMemoryProperties2)
+    MOCK_ENTRY(GetPhysicalDeviceFormatProperties2)
+    MOCK_ENTRY(GetPhysicalDeviceImageFormatProperties2)
+    MOCK_ENTRY(GetPhysicalDeviceQueueFamilyProperties)
+    MOCK_ENTRY(GetPhysicalDeviceQueueFamilyProperties2)
+    MOCK_ENTRY(GetPhysicalDeviceVideoCapabilitiesKHR)
+    MOCK_ENTRY(GetPhysicalDeviceVideoFormatPropertiesKHR)
+    MOCK_ENTRY(EnumerateDeviceExtensionProperties)
+    MOCK_ENTRY(CreateDevice)
+    MOCK_ENTRY(DestroyDevice)
+    MOCK_ENTRY(DeviceWaitIdle)
+    MOCK_ENTRY(GetDeviceQueue)
+    MOCK_ENTRY(QueueSubmit)
+    MOCK_ENTRY(QueueWaitIdle)
+    MOCK_ENTRY(CreateFence)
+    MOCK_ENTRY(DestroyFence)
+    MOCK_ENTRY(ResetFences)
+    MOCK_ENTRY(GetFenceStatus)
+    MOCK_ENTRY(WaitForFences)
+    MOCK_ENTRY(CreateSemaphore)
+    MOCK_ENTRY(DestroySemaphore)
+    MOCK_ENTRY(WaitSemaphores)
+    MOCK_ALIAS(WaitSemaphoresKHR, WaitSemaphores)
+    MOCK_ENTRY(GetSemaphoreCounterValue)
+    MOCK_ENTRY(SignalSemaphore)
+    MOCK_ENTRY(AllocateMemory)
+    MOCK_ENTRY(FreeMemory)
+    MOCK_ENTRY(MapMemory)
+    MOCK_ENTRY(UnmapMemory)
+    MOCK_ENTRY(FlushMappedMemoryRanges)
+    MOCK_ENTRY(InvalidateMappedMemoryRanges)
+    MOCK_ENTRY(CreateBuffer)
+    MOCK_ENTRY(DestroyBuffer)
+    MOCK_ENTRY(GetBufferMemoryRequirements)
+    MOCK_ENTRY(GetBufferMemoryRequirements2)
+    MOCK_ALIAS(GetBufferMemoryRequirements2KHR, GetBufferMemoryRequirements2)
+    MOCK_ENTRY(GetDeviceBufferMemoryRequirements)
+    MOCK_ENTRY(BindBufferMemory)
+    MOCK_ENTRY(BindBufferMemory2)
+    MOCK_ALIAS(BindBufferMemory2KHR, BindBufferMemory2)
+    MOCK_ENTRY(GetBufferDeviceAddress)
+    MOCK_ENTRY(CreateImage)
+    MOCK_ENTRY(DestroyImage)
+    MOCK_ENTRY(GetImageMemoryRequirements)
+    MOCK_ENTRY(GetImageMemoryRequirements2)
+    MOCK_ALIAS(GetImageMemoryRequirements2KHR, GetImageMemoryRequirements2)
+    MOCK_ENTRY(GetDeviceImageMemoryRequirements)
+    MOCK_ENTRY(BindImageMemory)
+    MOCK_ENTRY(BindImageMemory2)
+    MOCK_ALIAS(BindImageMemory2KHR, BindImageMemory2)
+    MOCK_ENTRY(GetImageSubresourceLayout)
+    MOCK_ENTRY(CreateImageView)
+    MOCK_ENTRY(DestroyImageView)
+    MOCK_ENTRY(CreateSampler)
+    MOCK_ENTRY(DestroySampler)
+    MOCK_ENTRY(CreateSamplerYcbcrConversion)
+    MOCK_ENTRY(DestroySamplerYcbcrConversion)
+    MOCK_ENTRY(CreateShaderModule)
+    MOCK_ENTRY(DestroyShaderModule)
+    MOCK_ENTRY(CreatePipelineLayout)
+    MOCK_ENTRY(DestroyPipelineLayout)
+    MOCK_ENTRY(CreateComputePipelines)
+    MOCK_ENTRY(DestroyPipeline)
+    MOCK_ENTRY(CreateDescriptorSetLayout)
+    MOCK_ENTRY(DestroyDescriptorSetLayout)
+    MOCK_ENTRY(CreateDescriptorPool)
+    MOCK_ENTRY(DestroyDescriptorPool)
+    MOCK_ENTRY(AllocateDescriptorSets)
+    MOCK_ENTRY(UpdateDescriptorSets)
+    MOCK_ENTRY(CreateDescriptorUpdateTemplate)
+    MOCK_ENTRY(DestroyDescriptorUpdateTemplate)
+    MOCK_ENTRY(UpdateDescriptorSetWithTemplate)
+    MOCK_ENTRY(CreateCommandPool)
+    MOCK_ENTRY(DestroyCommandPool)
+    MOCK_ENTRY(ResetCommandPool)
+    MOCK_ENTRY(AllocateCommandBuffers)
+    MOCK_ENTRY(FreeCommandBuffers)
+    MOCK_ENTRY(BeginCommandBuffer)
+    MOCK_ENTRY(EndCommandBuffer)
+    MOCK_ENTRY(ResetCommandBuffer)
+    MOCK_ENTRY(CmdCopyImageToBuffer)
+    MOCK_ENTRY(CmdCopyBufferToImage)
+    MOCK_ENTRY(CmdCopyBuffer)
+    MOCK_ENTRY(CmdFillBuffer)
+    MOCK_ENTRY(CmdDispatch)
+    MOCK_ENTRY(CmdBindPipeline)
+    MOCK_ENTRY(CmdBindDescriptorSets)
+    MOCK_ENTRY(CmdPushConstants)
+    MOCK_ENTRY(CmdPipelineBarrier)
+    MOCK_ENTRY(CmdPipelineBarrier2)
+    MOCK_ALIAS(CmdPipelineBarrier2KHR, CmdPipelineBarrier2)
+    MOCK_ENTRY(CreateQueryPool)
+    MOCK_ENTRY(DestroyQueryPool)
+    MOCK_ENTRY(ResetQueryPool)
+    MOCK_ENTRY(CmdResetQueryPool)
+    MOCK_ENTRY(CmdBeginQuery)
+    MOCK_ENTRY(CmdEndQuery)
+    MOCK_ENTRY(GetQueryPoolResults)
+    MOCK_ENTRY(CreateVideoSessionKHR)
+    MOCK_ENTRY(DestroyVideoSessionKHR)
+    MOCK_ENTRY(GetVideoSessionMemoryRequirementsKHR)
+    MOCK_ENTRY(BindVideoSessionMemoryKHR)
+    MOCK_ENTRY(CreateVideoSessionParametersKHR)
+    MOCK_ENTRY(DestroyVideoSessionParametersKHR)
+    MOCK_ENTRY(CmdBeginVideoCodingKHR)
+    MOCK_ENTRY(CmdControlVideoCodingKHR)
+    MOCK_ENTRY(CmdEndVideoCodingKHR)
+    MOCK_ENTRY(CmdDecodeVideoKHR)
+};
+
+#undef MOCK_ALIAS
+#undef MOCK_ENTRY
+
+// Instance and device level functions share one table, every name resolves regardless of the handle.
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL GetInstanceProcAddr(VkInstance, const char* name)
+{
+    for (const auto& entry : entry_points) {
+        if (!strcmp(entry.name, name))
+            return entry.fn;
+    }
+    return nullptr;
+}
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL GetDeviceProcAddr(VkDevice, const char* name)
+{
+    return GetInstanceProcAddr(VK_NULL_HANDLE, name);
+}
+
+// Makes config the active model and returns the driver's vkGetInstanceProcAddr, which replaces the loader's.
+PFN_vkGetInstanceProcAddr Install(const Config& config)
+{
+    active_config = config;
+    printf("Mock driver: %u decode, %u compute and %u transfer queues, %s memory, decode %u us + %u ns/MB\n",
+        config.decode_queues, config.compute_queues, config.transfer_queues, config.uma ? "UMA" : "discrete",
+        config.decode_us, config.decode_ns_per_mb);
+    return GetInstanceProcAddr;
+}
+
+// }}}
+
+} // namespace vvb::mock
@@ -1,10 +1,18 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <bit>
 #include <cassert>
 #include <cinttypes>
+#include <condition_variable>
+#include <coroutine>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
 #define LINUX 1
@@ -13,6 +21,10 @@
 
 #ifdef LINUX
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #include "vk_mem_alloc.h"
@@ -178,6 +190,8 @@ enum FFVulkanExtensions {
     FF_VK_EXT_VIDEO_ENCODE_H264 = 1ULL << 17, /* VK_EXT_video_encode_h264 */
     FF_VK_EXT_VIDEO_ENCODE_H265 = 1ULL << 18, /* VK_EXT_video_encode_h265 */
     FF_VK_EXT_VIDEO_DECODE_AV1 = 1ULL << 19, /* VK_MESA_video_decode_av1 */
+    FF_VK_EXT_HOST_IMAGE_COPY = 1ULL << 20, /* VK_EXT_host_image_copy */
+    FF_VK_EXT_MEMORY_BUDGET = 1ULL << 21, /* VK_EXT_memory_budget */
 
     FF_VK_EXT_NO_FLAG = 1ULL << 31,
 };
@@ -241,6 +255,8 @@ enum FFVulkanExtensions {
     MACRO(1, 1, FF_VK_EXT_EXTERNAL_FD_SEM, GetSemaphoreFdKHR)                         \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, CreateSemaphore)                                   \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, WaitSemaphores)                                    \
+    MACRO(1, 1, FF_VK_EXT_NO_FLAG, SignalSemaphore)                                   \
+    MACRO(1, 1, FF_VK_EXT_NO_FLAG, GetSemaphoreCounterValue)                          \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, DestroySemaphore)                                  \
                                                                                       \
     /* Memory */                                                                      \
@@ -261,6 +277,7 @@ enum FFVulkanExtensions {
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, CmdPipelineBarrier)                                \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, CmdCopyBufferToImage)                              \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, CmdCopyImageToBuffer)                              \
+    MACRO(1, 1, FF_VK_EXT_NO_FLAG, CmdCopyBuffer)                                     \
                                                                                       \
     /* Buffer */                                                                      \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, GetBufferMemoryRequirements2)                      \
@@ -285,6 +302,7 @@ enum FFVulkanExtensions {
     /* DescriptorSet */                                                               \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, CreateDescriptorSetLayout)                         \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, AllocateDescriptorSets)                            \
+    MACRO(1, 1, FF_VK_EXT_NO_FLAG, UpdateDescriptorSets)                              \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, CreateDescriptorPool)                              \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, DestroyDescriptorPool)                             \
     MACRO(1, 1, FF_VK_EXT_NO_FLAG, DestroyDescriptorSetLayout)                        \
@@ -352,6 +370,11 @@ enum FFVulkanExtensions {
     MACRO(1, 1, FF_VK_EXT_EXTERNAL_WIN32_SEM, GetSemaphoreWin32HandleKHR) \
     MACRO(1, 1, FF_VK_EXT_EXTERNAL_WIN32_MEMORY, GetMemoryWin32HandleKHR)
 
+/* Macro containing the VK_EXT_host_image_copy functions, only present in recent headers */
+#define FN_LIST_HOST_IMAGE_COPY(MACRO)                                    \
+    MACRO(1, 1, FF_VK_EXT_HOST_IMAGE_COPY, CopyImageToMemoryEXT)          \
+    MACRO(1, 1, FF_VK_EXT_HOST_IMAGE_COPY, TransitionImageLayoutEXT)
+
 /* Macro to turn a function name into a definition */
 #define PFN_DEF(req_inst, req_dev, ext_flag, name) \
     PFN_vk##name name;
@@ -362,6 +385,9 @@ typedef struct VulkanFunctions {
 #ifdef _WIN32
     FN_LIST_WIN32(PFN_DEF)
 #endif
+#ifdef VK_EXT_host_image_copy
+    FN_LIST_HOST_IMAGE_COPY(PFN_DEF)
+#endif
 } VulkanFunctions;
 
 /* Macro to turn a function name into a loader struct */
@@ -386,18 +412,230 @@ struct VulkanPhysicalDevicePriv {
     VkPhysicalDeviceVulkan13Features features_1_3;
     VkPhysicalDeviceDescriptorBufferFeaturesEXT desc_buf_features;
     VkPhysicalDeviceShaderAtomicFloatFeaturesEXT atomic_float_features;
+#ifdef VK_EXT_host_image_copy
+    VkPhysicalDeviceHostImageCopyFeaturesEXT host_image_copy_features;
+    VkPhysicalDeviceHostImageCopyPropertiesEXT host_image_copy_props;
+    VkImageLayout host_image_copy_src_layouts[32];
+#endif
     VkPhysicalDeviceFeatures2 features;
 };
 
+// Results of physical device queries that only change with the driver, persisted between runs so that a launch
+// can skip them. One file per device under $XDG_CACHE_HOME/vvb, a header with the key followed by records.
+// Records hold raw Vulkan structs, so the header version is part of the key.
+class CapabilityCache {
+public:
+    enum RecordTag : u32 {
+        RECORD_FEATURES = 1,
+        RECORD_DEVICE_EXTENSIONS,
+        RECORD_QUEUE_FAMILIES,
+        RECORD_VIDEO_CAPABILITIES,
+        RECORD_VIDEO_FORMATS,
+    };
+
+    struct Key {
+        u8 driver_uuid[VK_UUID_SIZE];
+        u32 vendor_id;
+        u32 device_id;
+        u32 driver_version;
+        u32 header_version;
+    };
+
+    bool Enabled() const { return !_path.empty(); }
+
+    // Loads the cache of the device with the given key, unless refresh is set, in which case it is only rewritten.
+    void Open(const Key& key, bool refresh)
+    {
+        _key = key;
+        _records.clear();
+        _dirty = false;
+
+        const char* base = getenv("XDG_CACHE_HOME");
+        std::string dir = base && *base ? std::string(base) : std::string(getenv("HOME") ? getenv("HOME") : "/tmp") + "/.cache";
+        dir += "/vvb";
+        char name[2 * VK_UUID_SIZE + 32];
+        char* p = name;
+        for (u32 i = 0; i < VK_UUID_SIZE; i++)
+            p += sprintf(p, "%02x", key.driver_uuid[i]);
+        sprintf(p, "-%04x-%08x.caps", key.vendor_id, key.device_id);
+        _dir = dir;
+        _path = dir + "/" + name;
+
+        if (refresh)
+            return;
+
+        int fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        struct stat st;
+        void* map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(FileHeader))
+            map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            return;
+
+        const u8* bytes = static_cast<const u8*>(map);
+        const u8* end = bytes + st.st_size;
+        FileHeader header;
+        memcpy(&header, bytes, sizeof(header));
+        if (header.magic == Magic && header.version == Version && !memcmp(&header.key, &key, sizeof(key))) {
+            const u8* cursor = bytes + sizeof(header);
+            while (cursor + sizeof(RecordHeader) <= end) {
+                RecordHeader rh;
+                memcpy(&rh, cursor, sizeof(rh));
+                cursor += sizeof(rh);
+                if (rh.size > u64(end - cursor)) {
+                    // Truncated, drop what was read and query again
+                    _records.clear();
+                    break;
+                }
+                _records.push_back({ rh.tag, rh.arg, std::vector<u8>(cursor, cursor + rh.size) });
+                cursor += rh.size;
+            }
+        }
+        munmap(map, st.st_size);
+    }
+
+    bool Find(RecordTag tag, u64 arg, std::vector<u8>* data) const
+    {
+        for (const Record& r : _records) {
+            if (r.tag == tag && r.arg == arg) {
+                *data = r.data;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename T>
+    bool FindArray(RecordTag tag, u64 arg, std::vector<T>* items) const
+    {
+        std::vector<u8> data;
+        if (!Find(tag, arg, &data) || data.size() % sizeof(T))
+            return false;
+        items->resize(data.size() / sizeof(T));
+        memcpy(items->data(), data.data(), data.size());
+        return true;
+    }
+
+    template <typename T>
+    bool FindValue(RecordTag tag, u64 arg, T* value) const
+    {
+        std::vector<u8> data;
+        if (!Find(tag, arg, &data) || data.size() != sizeof(T))
+            return false;
+        memcpy(value, data.data(), sizeof(T));
+        return true;
+    }
+
+    void Store(RecordTag tag, u64 arg, const void* data, size_t size)
+    {
+        if (!Enabled())
+            return;
+        const u8* bytes = static_cast<const u8*>(data);
+        for (Record& r : _records) {
+            if (r.tag == tag && r.arg == arg) {
+                r.data.assign(bytes, bytes + size);
+                _dirty = true;
+                return;
+            }
+        }
+        _records.push_back({ tag, arg, std::vector<u8>(bytes, bytes + size) });
+        _dirty = true;
+    }
+
+    // Writes the cache if anything was added, through a rename so that concurrent launches never see a partial file.
+    void Save()
+    {
+        if (!_dirty)
+            return;
+        _dirty = false;
+
+        for (size_t i = 1; i <= _dir.size(); i++) {
+            if (i == _dir.size() || _dir[i] == '/')
+                mkdir(_dir.substr(0, i).c_str(), 0755);
+        }
+
+        std::vector<u8> out(sizeof(FileHeader));
+        FileHeader header = { Magic, Version, _key };
+        memcpy(out.data(), &header, sizeof(header));
+        for (const Record& r : _records) {
+            RecordHeader rh = { r.tag, 0, r.arg, r.data.size() };
+            const u8* p = reinterpret_cast<const u8*>(&rh);
+            out.insert(out.end(), p, p + sizeof(rh));
+            out.insert(out.end(), r.data.begin(), r.data.end());
+        }
+
+        std::string tmp = _path + "." + std::to_string(getpid());
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Could not write the capability cache %s: %s\n", tmp.c_str(), strerror(errno));
+            return;
+        }
+        bool ok = write(fd, out.data(), out.size()) == (ssize_t)out.size();
+        close(fd);
+        if (!ok || rename(tmp.c_str(), _path.c_str()) != 0) {
+            fprintf(stderr, "Could not write the capability cache %s\n", _path.c_str());
+            unlink(tmp.c_str());
+        }
+    }
+
+    const std::string& Path() const { return _path; }
+
+private:
+    static constexpr u32 Magic = 0x43425656; // "VVBC"
+    static constexpr u32 Version = 1;
+
+    struct FileHeader {
+        u32 magic;
+        u32 version;
+        Key key;
+    };
+
+    struct RecordHeader {
+        u32 tag;
+        u32 reserved;
+        u64 arg;
+        u64 size;
+    };
+
+    struct Record {
+        u32 tag;
+        u64 arg;
+        std::vector<u8> data;
+    };
+
+    Key _key {};
+    std::string _dir;
+    std::string _path;
+    std::vector<Record> _records;
+    bool _dirty { false };
+};
+
+struct SemaphoreReactor;
+struct VideoSessionPool;
+struct ImagePool;
+
 class SysVulkan {
 public:
     VmaAllocator _allocator;
 
     PFN_vkGetInstanceProcAddr _get_proc_addr { nullptr };
-    VulkanFunctions _vfn;
+    VulkanFunctions _vfn {};
     
     void* _libvulkan { nullptr }; // Library and loader functions
-    unsigned int extensions;
+    bool _owns_instance { true }; // false for the other devices of a DeviceGroup, see init_vulkan_device
+    unsigned int extensions { 0 };
+
+    // Time spent in each step of init_vulkan
+    struct StartupTimes {
+        u64 loader_us;
+        u64 instance_us;
+        u64 probe_us; // physical device selection and queries
+        u64 device_us; // device creation and device level functions
+        u64 allocator_us;
+    } _startup {};
 
     std::vector<VkLayerProperties> _available_instance_layers;
     VkInstance _instance { VK_NULL_HANDLE };
@@ -412,6 +650,7 @@ public:
     size_t _selected_physical_dev_idx { 0 };
     VulkanPhysicalDevicePriv _selected_physical_device_priv;
     std::vector<VkExtensionProperties> _selected_device_all_available_extensions;
+    CapabilityCache _caps_cache; // of the selected device
     VkPhysicalDevice SelectedPhysicalDevice() const
     {
         ASSERT(_physical_devices.size() > 0);
@@ -421,8 +660,10 @@ public:
     /* Settings */
     int dev_is_nvidia;
     int use_linear_images;
+    int use_host_image_copy;
+    int use_sampler_array_indexing;
     /* Debug callback */
-    VkDebugUtilsMessengerEXT _dev_debug_ctx;
+    VkDebugUtilsMessengerEXT _dev_debug_ctx { VK_NULL_HANDLE };
     // -- end of physical device settings
 
     /* Queues */
@@ -474,6 +715,7 @@ public:
 
     VkQueue _decode_queue0{VK_NULL_HANDLE};
     VkQueue _tx_queue0{VK_NULL_HANDLE};
+    VkQueue _comp_queue0{VK_NULL_HANDLE}; // only if the device has a compute queue family
 
     bool EncodeQueriesAreSupported() const
     {
@@ -485,12 +727,32 @@ public:
         return _qf_query_support[queue_family_decode_index].queryResultStatusSupport;
     }
 
-    VkQueryPool _query_pool { VK_NULL_HANDLE };
+    // VkQueue access is externally synchronized, every stream placed on the device submits to its queues.
+    std::mutex _queue_mutex;
+
+    // Resumes the coroutines of every stream placed on the device, see AcquireSemaphoreReactor.
+    SemaphoreReactor* _reactor { nullptr };
+    u32 _reactor_users { 0 };
+    std::mutex _reactor_mutex;
+
+    // Warm sessions for the streams placed on the device, see AcquireVideoSessionPool.
+    VideoSessionPool* _session_pool { nullptr };
+    u32 _session_pool_users { 0 };
+    std::mutex _session_pool_mutex;
+
+    // DPB and output images, recycled across the streams of the device, see AcquireImagePool.
+    ImagePool* _image_pool { nullptr };
+    u32 _image_pool_users { 0 };
+    std::mutex _image_pool_mutex;
+
+    // Video session memory is suballocated from one custom pool per memory type, created on first use.
+    VmaPool _session_memory_pools[VK_MAX_MEMORY_TYPES] {};
+    std::mutex _session_memory_pools_mutex;
     
     std::vector<const char*> _active_dev_enabled_exts;
 
     struct UserOptions {
-        bool detect_env { false };
+        bool detect_env { false }; // print devices, extensions and queue families while starting up
         bool enable_validation { true };
         const char* requested_device_name { nullptr };
         int requested_device_major { -1 };
@@ -498,6 +760,10 @@ public:
         int requested_driver_version_major { -1 };
         int requested_driver_version_minor { -1 };
         int requested_driver_version_patch { -1 };
+        bool any_decode_device { false }; // without any of the above, any device that decodes matches
+        int physical_device_index { -1 }; // overrides the above when set
+        bool compute_only { false }; // accept a device without decode queues, e.g. to test the shaders on lavapipe
+        const mock::Config* mock_driver { nullptr }; // run against the mock driver instead of libvulkan
     } _options;
 
     SysVulkan(const UserOptions& options)
@@ -509,14 +775,20 @@ public:
     ~SysVulkan()
     {
         auto& vk = _vfn;
+        for (VmaPool pool : _session_memory_pools) {
+            if (pool != VK_NULL_HANDLE)
+                vmaDestroyPool(_allocator, pool);
+        }
         vmaDestroyAllocator(_allocator);
 
-        if (_dev_debug_ctx)
-            vk.DestroyDebugUtilsMessengerEXT(_instance, _dev_debug_ctx, nullptr);
-
         if (_active_dev != VK_NULL_HANDLE)
             vk.DestroyDevice(_active_dev, nullptr);
 
+        // The devices sharing the instance are destroyed first, see DestroyDeviceGroup
+        if (!_owns_instance)
+            return;
+        if (_dev_debug_ctx)
+            vk.DestroyDebugUtilsMessengerEXT(_instance, _dev_debug_ctx, nullptr);
         if (_instance != VK_NULL_HANDLE)
             vk.DestroyInstance(_instance, nullptr);
         if (_libvulkan)
@@ -548,6 +820,7 @@ static const VulkanOptExtension optional_device_exts[] = {
     },
     { VK_EXT_PHYSICAL_DEVICE_DRM_EXTENSION_NAME, FF_VK_EXT_DEVICE_DRM },
     { VK_EXT_SHADER_ATOMIC_FLOAT_EXTENSION_NAME, FF_VK_EXT_ATOMIC_FLOAT },
+    { VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, FF_VK_EXT_MEMORY_BUDGET }, // free memory for stream placement
 
     /* Imports/exports */
     { VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME, FF_VK_EXT_EXTERNAL_FD_MEMORY },
@@ -573,24 +846,22 @@ static const VulkanOptExtension optional_device_exts[] = {
 #endif
     { VK_KHR_VIDEO_DECODE_H265_EXTENSION_NAME, FF_VK_EXT_VIDEO_DECODE_H265 },
     { "VK_MESA_video_decode_av1", FF_VK_EXT_VIDEO_DECODE_AV1 },
+
+    /* Host transfers */
+#ifdef VK_EXT_host_image_copy
+    { VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME, FF_VK_EXT_HOST_IMAGE_COPY },
+#endif
 };
 
+// Picks the optional extensions out of _selected_device_all_available_extensions, which must be queried first.
 static void check_device_extensions(SysVulkan& sys_vk, std::vector<const char*>& enabled_extensions)
 {
-    auto& vk = sys_vk._vfn;
+    const bool verbose = sys_vk._options.detect_env;
 
     enabled_extensions.clear();
 
-    u64 start = util::RDTSC();
-    util::Timer t;
-    ASSERT(sys_vk._selected_device_all_available_extensions.empty());
-
-    t.GetCurrentTime();
-    get_vector(sys_vk._selected_device_all_available_extensions, vk.EnumerateDeviceExtensionProperties, sys_vk.SelectedPhysicalDevice(), nullptr);
-    u64 end = util::RDTSC();
-    u64 ms = t.ElapsedMilliseconds();
-    fprintf(stderr, "EnumerateDeviceExtensionProperties took %" PRIu64 " ms (%" PRIu64 " cycles)\n", ms, end - start);
-    fprintf(stderr, "device extensions:\n");
+    if (verbose)
+        fprintf(stderr, "device extensions:\n");
     int optional_exts_num;
     optional_exts_num = ARRAY_ELEMS(optional_device_exts);
 
@@ -604,10 +875,8 @@ static void check_device_extensions(SysVulkan& sys_vk, std::vector<const char*>&
                 break;
             }
         }
-        if (found)
-            printf("[ENABLED] %s\n", prop.extensionName);
-        else
-            printf("[       ] %s\n", prop.extensionName);
+        if (verbose)
+            printf("[%s] %s\n", found ? "ENABLED" : "       ", prop.extensionName);
     }
 }
 
@@ -617,9 +886,9 @@ static void check_instance_extensions(SysVulkan& sys_vk, std::vector<const char*
 
     enabled_extensions.clear();
 
-    std::vector<VkExtensionProperties> properties;
-    get_vector(properties, vk.EnumerateInstanceExtensionProperties, default_layer);
     if (sys_vk._options.enable_validation) {
+        std::vector<VkExtensionProperties> properties;
+        get_vector(properties, vk.EnumerateInstanceExtensionProperties, default_layer);
         fprintf(stderr, "extensions provided by layer %s:\n", default_layer);
         for (const auto& prop : properties) {
             if (!strcmp(prop.extensionName, VK_EXT_DEBUG_UTILS_EXTENSION_NAME)) {
@@ -630,6 +899,9 @@ static void check_instance_extensions(SysVulkan& sys_vk, std::vector<const char*
         }
     }
 
+    // No implementation extension is needed, they are only listed
+    if (!sys_vk._options.detect_env)
+        return;
     std::vector<VkExtensionProperties> default_extension_properties;
     get_vector(default_extension_properties, vk.EnumerateInstanceExtensionProperties, nullptr);
     fprintf(stderr, "implementation available instance extensions:\n");
@@ -645,16 +917,21 @@ static void check_validation_layers(SysVulkan& sys_vk, std::vector<const char*>&
 
     auto& layers = sys_vk._available_instance_layers;
     layers.clear();
+    enabled_layers.clear();
+
+    if (!sys_vk._options.enable_validation && !sys_vk._options.detect_env)
+        return;
     get_vector(layers, vk.EnumerateInstanceLayerProperties);
 
-    enabled_layers.clear();
+    if (sys_vk._options.detect_env) {
+        for (const auto& layerProperties : layers)
+            fprintf(stderr, "Instance layer: %s\n", layerProperties.layerName);
+    }
 
     if (sys_vk._options.enable_validation) {
         bool found_default = false;
 
         for (const auto& layerProperties : layers) {
-            fprintf(stderr, "Instance layer: %s\n", layerProperties.layerName);
-
             if (!strcmp(default_layer, layerProperties.layerName)) {
                 found_default = 1;
                 break;
@@ -759,49 +1036,14 @@ class DPB {
 class FrameContext {
 };
 
-// Decoded (raw) video data.
-class Frame {
-public:
-    // Resources backing this frame.
-    VkImage img; // Images to which memory is bound
-    VkDeviceMemory mem; // Memory backing frame resources
-    ptrdiff_t offset { 0 }; // Optional offset into the mem for img.
-
-    // The coded dimensions in pixels.
-    int width, height;
-
-    VkFormat format;
-
-    i64 pts; // Time when frame should be shown to the user.
-
-    // Picture number in bitstream order
-    int coded_picture_number;
-
-    // Picture number in display order
-    int display_picture_number;
-
-    // The content is interlaced
-    int interlaced_frame;
-    int top_field_first;
-
-    // Updated per barrier
-    VkAccessFlagBits access;
-    VkImageLayout layout;
-
-    // Timeline semaphore for img. Signal before and after (with increment) at every submission
-    VkSemaphore sem;
-    u64 sem_value;
-
-    // Queue family for the img
-    u32 queue_family { VK_QUEUE_FAMILY_IGNORED };
-};
-
 enum Codec { H264 };
 
 struct video_device_preferences {
     std::vector<Codec> required_codecs;
 };
 
+// Loads the functions of one level: global ones, then instance ones once has_inst, then device ones once has_dev.
+// Device functions of extensions missing from extensions_mask are left null.
 void load_vk_functions(SysVulkan& sys_vk, const uint64_t extensions_mask = FF_VK_EXT_NO_FLAG, bool has_inst = false, bool has_dev = false)
 {
     static const struct FunctionLoadInfo {
@@ -814,6 +1056,9 @@ void load_vk_functions(SysVulkan& sys_vk, const uint64_t extensions_mask = FF_VK
         FN_LIST(PFN_LOAD_INFO)
 #ifdef _WIN32
             FN_LIST_WIN32(PFN_LOAD_INFO)
+#endif
+#ifdef VK_EXT_host_image_copy
+            FN_LIST_HOST_IMAGE_COPY(PFN_LOAD_INFO)
 #endif
     };
 
@@ -821,12 +1066,20 @@ void load_vk_functions(SysVulkan& sys_vk, const uint64_t extensions_mask = FF_VK
         const struct FunctionLoadInfo* load = &vk_load_info[i];
         PFN_vkVoidFunction fn = nullptr;
 
-        if (load->req_dev && !has_dev)
+        if (load->req_dev != has_dev || (!load->req_dev && load->req_inst != has_inst))
             continue;
-        if (load->req_inst && !has_inst)
+        // Cleared rather than skipped, the table may have been copied from another device
+        if (load->req_dev && load->ext_flag != FF_VK_EXT_NO_FLAG && !(extensions_mask & load->ext_flag)) {
+            *(PFN_vkVoidFunction*)((uint8_t*)&sys_vk._vfn + load->struct_offset) = nullptr;
             continue;
+        }
+
+        // Names that already carry a vendor suffix have no aliases to try
+        const char* base = load->names[0];
+        size_t base_len = strlen(base);
+        bool suffixed = base_len > 3 && (!strcmp(base + base_len - 3, "KHR") || !strcmp(base + base_len - 3, "EXT"));
 
-        for (u32 j = 0; j < ARRAY_ELEMS(load->names); j++) {
+        for (u32 j = 0; j < (suffixed ? 1 : ARRAY_ELEMS(load->names)); j++) {
             const char* name = load->names[j];
 
             if (load->req_dev)
@@ -840,19 +1093,69 @@ void load_vk_functions(SysVulkan& sys_vk, const uint64_t extensions_mask = FF_VK
                 break;
         }
 
-        if (false && ((extensions_mask & ~FF_VK_EXT_NO_FLAG) & load->ext_flag)) {
-            abort();
-        }
-
         *(PFN_vkVoidFunction*)((uint8_t*)&sys_vk._vfn + load->struct_offset) = fn;
     }
 }
 
-static void choose_and_load_device(SysVulkan& sys_vk)
+// Copies a cached struct over one that is part of a pNext chain, keeping the chain.
+template <typename T>
+static void RestoreChained(T* dst, const T& src)
+{
+    void* next = dst->pNext;
+    *dst = src;
+    dst->pNext = next;
+}
+
+// The RECORD_FEATURES record
+struct CachedFeatures {
+    VkPhysicalDeviceFeatures2 features;
+    VkPhysicalDeviceVulkan11Features features_1_1;
+    VkPhysicalDeviceVulkan12Features features_1_2;
+    VkPhysicalDeviceVulkan13Features features_1_3;
+    VkPhysicalDeviceDescriptorBufferFeaturesEXT desc_buf_features;
+    VkPhysicalDeviceShaderAtomicFloatFeaturesEXT atomic_float_features;
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features;
+#ifdef VK_EXT_host_image_copy
+    VkPhysicalDeviceHostImageCopyFeaturesEXT host_image_copy_features;
+#endif
+};
+
+// An element of the RECORD_QUEUE_FAMILIES record
+struct CachedQueueFamily {
+    VkQueueFamilyProperties props;
+    VkVideoCodecOperationFlagsKHR video_codec_operations;
+    VkBool32 query_result_status_support;
+};
+
+static void print_physical_devices(const SysVulkan& sys_vk)
+{
+    auto& prop = sys_vk._physical_device_props;
+    auto& idp = sys_vk._physical_device_id_props;
+    auto& drm_prop = sys_vk._physical_device_drm_props;
+
+    for (u32 i = 0; i < sys_vk._physical_devices.size(); i++) {
+        printf("    %d: %s (driverUUID=%s version=%u.%u.%u.%u) (%s) (deviceID=0x%x) (primary major/minor 0x%lx/0x%lx render major/minor 0x%lx/0x%lx\n",
+            i,
+            prop[i].properties.deviceName,
+            idp[i].driverUUID,
+            VK_API_VERSION_MAJOR(prop[i].properties.driverVersion),
+            VK_API_VERSION_MINOR(prop[i].properties.driverVersion),
+            VK_API_VERSION_PATCH(prop[i].properties.driverVersion),
+            VK_API_VERSION_VARIANT(prop[i].properties.driverVersion),
+            vk_dev_type(prop[i].properties.deviceType),
+            prop[i].properties.deviceID,
+            drm_prop[i].primaryMajor,
+            drm_prop[i].primaryMinor,
+            drm_prop[i].renderMajor,
+            drm_prop[i].renderMinor);
+    }
+}
+
+// Lists every physical device with its properties, concurrently since drivers may wake up the hardware to answer.
+static void probe_physical_devices(SysVulkan& sys_vk)
 {
     auto& vk = sys_vk._vfn;
 
-    // Find a device on the machine
     auto& prop = sys_vk._physical_device_props;
     auto& idp = sys_vk._physical_device_id_props;
     auto& drm_prop = sys_vk._physical_device_drm_props;
@@ -862,73 +1165,99 @@ static void choose_and_load_device(SysVulkan& sys_vk)
         XERROR(1, "No physical device found!");
 
     const auto num_devices = sys_vk._physical_devices.size();
-    if (num_devices > 1)
-        printf("%ld physical devices discovered\n", num_devices);
-    else
-        printf("single physical device discovered\n");
+    if (sys_vk._options.detect_env)
+        printf("%ld physical device(s) discovered\n", num_devices);
     prop.resize(num_devices);
     idp.resize(num_devices);
     drm_prop.resize(num_devices);
 
-    for (u32 i = 0; i < num_devices; i++) {
+    auto probe = [&](u32 i) {
         drm_prop[i].sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DRM_PROPERTIES_EXT;
         idp[i].pNext = &drm_prop[i];
         idp[i].sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
         prop[i].sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
         prop[i].pNext = &idp[i];
         vk.GetPhysicalDeviceProperties2(sys_vk._physical_devices[i], &prop[i]);
-        printf("    %d: %s (driverUUID=%s version=%u.%u.%u.%u) (%s) (deviceID=0x%x) (primary major/minor 0x%lx/0x%lx render major/minor 0x%lx/0x%lx\n",
-            i,
-            prop[i].properties.deviceName,
-            idp[i].driverUUID,
-            VK_API_VERSION_MAJOR(prop[i].properties.driverVersion),
-            VK_API_VERSION_MINOR(prop[i].properties.driverVersion),
-            VK_API_VERSION_PATCH(prop[i].properties.driverVersion),
-            VK_API_VERSION_VARIANT(prop[i].properties.driverVersion),
-            vk_dev_type(prop[i].properties.deviceType),
-            prop[i].properties.deviceID,
-            drm_prop[i].primaryMajor,
-            drm_prop[i].primaryMinor,
-            drm_prop[i].renderMajor,
-            drm_prop[i].renderMinor);
+    };
+    if (num_devices > 1) {
+        std::vector<std::thread> probes;
+        for (u32 i = 0; i < num_devices; i++)
+            probes.emplace_back(probe, i);
+        for (auto& thread : probes)
+            thread.join();
+    } else {
+        probe(0);
     }
 
-    i32 choice = -1;
+    if (sys_vk._options.detect_env)
+        print_physical_devices(sys_vk);
+}
 
-    for (u32 i = 0; i < num_devices; i++) {
-        auto& opts = sys_vk._options;       
-        if (opts.requested_driver_version_major != -1 && opts.requested_driver_version_minor != -1 && opts.requested_driver_version_patch != -1) {
-            if (VK_API_VERSION_MAJOR(prop[i].properties.driverVersion) == opts.requested_driver_version_major &&
-                VK_API_VERSION_MINOR(prop[i].properties.driverVersion) == opts.requested_driver_version_minor &&
-                VK_API_VERSION_PATCH(prop[i].properties.driverVersion) == opts.requested_driver_version_patch) {
-                choice = i;
-                printf("Device %s picked based on driver version selection\n", prop[i].properties.deviceName);
-                break;
-            }
-            if (drm_prop[i].primaryMajor == opts.requested_device_major && drm_prop[i].primaryMinor == opts.requested_device_minor) {
-                choice = i;
-                printf("Device %s picked based on major/minor number selection\n", prop[i].properties.deviceName);
-                break;
-            }
-        }
-        if (opts.requested_device_major != -1 || opts.requested_device_minor != -1) {
-            if (drm_prop[i].primaryMajor == opts.requested_device_major && drm_prop[i].primaryMinor == opts.requested_device_minor) {
-                choice = i;
-                printf("Device %s picked based on major/minor number selection\n", prop[i].properties.deviceName);
-                break;
-            }
-        }
+// Devices without a decode queue family are never picked for decoding
+static bool HasDecodeQueueFamily(const SysVulkan& sys_vk, VkPhysicalDevice physical_device)
+{
+    auto families = get_vector_noerror<VkQueueFamilyProperties>(sys_vk._vfn.GetPhysicalDeviceQueueFamilyProperties, physical_device);
+    for (const auto& family : families) {
+        if (family.queueFlags & VK_QUEUE_VIDEO_DECODE_BIT_KHR)
+            return true;
+    }
+    return false;
+}
+
+// Which of the requested properties physical device i matches, or nullptr.
+static const char* requested_device_match(const SysVulkan& sys_vk, u32 i)
+{
+    auto& opts = sys_vk._options;
+    auto& props = sys_vk._physical_device_props[i].properties;
+    auto& drm_prop = sys_vk._physical_device_drm_props[i];
+
+    if (opts.requested_driver_version_major != -1 && opts.requested_driver_version_minor != -1 && opts.requested_driver_version_patch != -1) {
+        if (VK_API_VERSION_MAJOR(props.driverVersion) == opts.requested_driver_version_major &&
+            VK_API_VERSION_MINOR(props.driverVersion) == opts.requested_driver_version_minor &&
+            VK_API_VERSION_PATCH(props.driverVersion) == opts.requested_driver_version_patch)
+            return "driver version";
+    }
+    if (opts.requested_device_major != -1 || opts.requested_device_minor != -1) {
+        if (drm_prop.primaryMajor == opts.requested_device_major && drm_prop.primaryMinor == opts.requested_device_minor)
+            return "major/minor number";
+    }
+    if (opts.requested_device_name && util::StrCaseInsensitiveSubstring(props.deviceName, opts.requested_device_name))
+        return "device name";
+    if (opts.any_decode_device && !opts.requested_device_name && opts.requested_device_major == -1 &&
+        opts.requested_device_minor == -1 && opts.requested_driver_version_major == -1 &&
+        HasDecodeQueueFamily(sys_vk, sys_vk._physical_devices[i]))
+        return "decode support";
+    return nullptr;
+}
+
+static void choose_and_load_device(SysVulkan& sys_vk)
+{
+    auto& vk = sys_vk._vfn;
+
+    auto& prop = sys_vk._physical_device_props;
+    auto& idp = sys_vk._physical_device_id_props;
+    auto& drm_prop = sys_vk._physical_device_drm_props;
+
+    const bool verbose = sys_vk._options.detect_env;
+    const auto num_devices = sys_vk._physical_devices.size();
 
-        const char* this_device_name = prop[i].properties.deviceName;
-        if (opts.requested_device_name && util::StrCaseInsensitiveSubstring(this_device_name, opts.requested_device_name)) {
+    i32 choice = -1;
+    if (sys_vk._options.physical_device_index != -1) {
+        // Picked by a DeviceGroup
+        ASSERT((size_t)sys_vk._options.physical_device_index < num_devices);
+        choice = sys_vk._options.physical_device_index;
+    }
+    for (u32 i = 0; choice == -1 && i < num_devices; i++) {
+        if (const char* reason = requested_device_match(sys_vk, i)) {
             choice = i;
-            printf("Device %s picked based on device name selection (%s)\n", prop[i].properties.deviceName, opts.requested_device_name);
-            break;
+            printf("Device %s picked based on %s selection\n", prop[i].properties.deviceName, reason);
         }
     }
 
     if (choice == -1)
     {
+        if (!verbose)
+            print_physical_devices(sys_vk);
         printf("ERROR: No physical device selected\n");
         printf("Consult the above list of available devices, and then select one using either:\n");
         printf("    --device-name=<name> (e.g. --device-name=amd) (insensitive substring search) OR\n");
@@ -943,6 +1272,29 @@ static void choose_and_load_device(SysVulkan& sys_vk)
 
     sys_vk.dev_is_nvidia = drm_prop[choice].primaryMajor == 0xe2;
 
+    // What the driver reports for the device is cached, --detect queries it again. Mock devices change with
+    // their configuration, they are never cached.
+    auto& cache = sys_vk._caps_cache;
+    if (!sys_vk._options.mock_driver) {
+        CapabilityCache::Key key = {};
+        memcpy(key.driver_uuid, idp[choice].driverUUID, VK_UUID_SIZE);
+        key.vendor_id = prop[choice].properties.vendorID;
+        key.device_id = prop[choice].properties.deviceID;
+        key.driver_version = prop[choice].properties.driverVersion;
+        key.header_version = VK_HEADER_VERSION;
+        cache.Open(key, sys_vk._options.detect_env);
+    }
+
+    // The extensions are only needed once the queues are set up, list them meanwhile.
+    ASSERT(sys_vk._selected_device_all_available_extensions.empty());
+    std::thread extension_query;
+    if (!cache.FindArray(CapabilityCache::RECORD_DEVICE_EXTENSIONS, 0, &sys_vk._selected_device_all_available_extensions)) {
+        extension_query = std::thread([&sys_vk, &vk]() {
+            get_vector(sys_vk._selected_device_all_available_extensions, vk.EnumerateDeviceExtensionProperties,
+                sys_vk.SelectedPhysicalDevice(), nullptr);
+        });
+    }
+
     // Device selected, now query its features for decoding.
     VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features = {};
     timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
@@ -950,6 +1302,12 @@ static void choose_and_load_device(SysVulkan& sys_vk)
     VkPhysicalDeviceShaderAtomicFloatFeaturesEXT atomic_float_features = {};
     atomic_float_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_ATOMIC_FLOAT_FEATURES_EXT;
     atomic_float_features.pNext = &timeline_features;
+#ifdef VK_EXT_host_image_copy
+    VkPhysicalDeviceHostImageCopyFeaturesEXT host_image_copy_features = {};
+    host_image_copy_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_IMAGE_COPY_FEATURES_EXT;
+    host_image_copy_features.pNext = atomic_float_features.pNext;
+    atomic_float_features.pNext = &host_image_copy_features;
+#endif
 
     VkPhysicalDeviceDescriptorBufferFeaturesEXT desc_buf_features = {};
     desc_buf_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_FEATURES_EXT;
@@ -969,12 +1327,32 @@ static void choose_and_load_device(SysVulkan& sys_vk)
     dev_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
     dev_features.pNext = &dev_features_1_1;
 
-    util::Timer t;
-    u64 us;
-    t.GetCurrentTime();
-    vk.GetPhysicalDeviceFeatures2(sys_vk.SelectedPhysicalDevice(), &dev_features);
-    us = t.ElapsedMicroseconds();
-    printf("GetPhysicalDeviceFeatures2 took %" PRIu64 " us\n", us);
+    CachedFeatures cached_features;
+    if (cache.FindValue(CapabilityCache::RECORD_FEATURES, 0, &cached_features)) {
+        RestoreChained(&dev_features, cached_features.features);
+        RestoreChained(&dev_features_1_1, cached_features.features_1_1);
+        RestoreChained(&dev_features_1_2, cached_features.features_1_2);
+        RestoreChained(&dev_features_1_3, cached_features.features_1_3);
+        RestoreChained(&desc_buf_features, cached_features.desc_buf_features);
+        RestoreChained(&atomic_float_features, cached_features.atomic_float_features);
+        RestoreChained(&timeline_features, cached_features.timeline_features);
+#ifdef VK_EXT_host_image_copy
+        RestoreChained(&host_image_copy_features, cached_features.host_image_copy_features);
+#endif
+    } else {
+        vk.GetPhysicalDeviceFeatures2(sys_vk.SelectedPhysicalDevice(), &dev_features);
+        cached_features.features = dev_features;
+        cached_features.features_1_1 = dev_features_1_1;
+        cached_features.features_1_2 = dev_features_1_2;
+        cached_features.features_1_3 = dev_features_1_3;
+        cached_features.desc_buf_features = desc_buf_features;
+        cached_features.atomic_float_features = atomic_float_features;
+        cached_features.timeline_features = timeline_features;
+#ifdef VK_EXT_host_image_copy
+        cached_features.host_image_copy_features = host_image_copy_features;
+#endif
+        cache.Store(CapabilityCache::RECORD_FEATURES, 0, &cached_features, sizeof(cached_features));
+    }
 
     VkDeviceCreateInfo dev_info = {};
     dev_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -1003,7 +1381,9 @@ static void choose_and_load_device(SysVulkan& sys_vk)
     COPY_FEATURE(priv.features, shaderInt64)
     COPY_FEATURE(priv.features, shaderInt16)
     COPY_FEATURE(priv.features, shaderFloat64)
+    COPY_FEATURE(priv.features, shaderSampledImageArrayDynamicIndexing)
 #undef COPY_FEATURE
+    sys_vk.use_sampler_array_indexing = dev_features.features.shaderSampledImageArrayDynamicIndexing;
 
     priv.features_1_1.samplerYcbcrConversion = dev_features_1_1.samplerYcbcrConversion;
     priv.features_1_1.storagePushConstant16 = dev_features_1_1.storagePushConstant16;
@@ -1033,8 +1413,11 @@ static void choose_and_load_device(SysVulkan& sys_vk)
     dev_info.pNext = &priv.features;
 
     /// Now setup the queue families on the chosen physical device
-    u32 qf_properties_count;
-    vk.GetPhysicalDeviceQueueFamilyProperties2(sys_vk.SelectedPhysicalDevice(), &qf_properties_count, nullptr);
+    std::vector<CachedQueueFamily> cached_families;
+    bool cached_qf = cache.FindArray(CapabilityCache::RECORD_QUEUE_FAMILIES, 0, &cached_families);
+    u32 qf_properties_count = cached_families.size();
+    if (!cached_qf)
+        vk.GetPhysicalDeviceQueueFamilyProperties2(sys_vk.SelectedPhysicalDevice(), &qf_properties_count, nullptr);
     assert(qf_properties_count);
     sys_vk._qf_properties.resize(qf_properties_count);
     sys_vk._qf_video_properties.resize(qf_properties_count);
@@ -1047,7 +1430,22 @@ static void choose_and_load_device(SysVulkan& sys_vk)
         sys_vk._qf_video_properties[i].pNext = &sys_vk._qf_query_support[i];
         sys_vk._qf_properties[i].pNext = &sys_vk._qf_video_properties[i];
     }
-    vk.GetPhysicalDeviceQueueFamilyProperties2(sys_vk.SelectedPhysicalDevice(), &qf_properties_count, sys_vk._qf_properties.data());
+    if (cached_qf) {
+        for (u32 i = 0; i < qf_properties_count; i++) {
+            sys_vk._qf_properties[i].queueFamilyProperties = cached_families[i].props;
+            sys_vk._qf_video_properties[i].videoCodecOperations = cached_families[i].video_codec_operations;
+            sys_vk._qf_query_support[i].queryResultStatusSupport = cached_families[i].query_result_status_support;
+        }
+    } else {
+        vk.GetPhysicalDeviceQueueFamilyProperties2(sys_vk.SelectedPhysicalDevice(), &qf_properties_count, sys_vk._qf_properties.data());
+        cached_families.resize(qf_properties_count);
+        for (u32 i = 0; i < qf_properties_count; i++) {
+            cached_families[i].props = sys_vk._qf_properties[i].queueFamilyProperties;
+            cached_families[i].video_codec_operations = sys_vk._qf_video_properties[i].videoCodecOperations;
+            cached_families[i].query_result_status_support = sys_vk._qf_query_support[i].queryResultStatusSupport;
+        }
+        cache.Store(CapabilityCache::RECORD_QUEUE_FAMILIES, 0, cached_families.data(), cached_families.size() * sizeof(CachedQueueFamily));
+    }
 
     sys_vk._qf_mutexs.resize(qf_properties_count);
     for (u32 i = 0; i < qf_properties_count; i++) {
@@ -1058,8 +1456,15 @@ static void choose_and_load_device(SysVulkan& sys_vk)
         }
     }
 
-    printf("Queue families:\n");
+    if (verbose)
+        printf("Queue families:\n");
     for (u32 i = 0; i < sys_vk._qf_properties.size(); i++) {
+        /* We use this field to keep a score of how many times we've used that
+         * queue family in order to make better choices. */
+        sys_vk._qf_properties[i].queueFamilyProperties.timestampValidBits = 0;
+        if (!verbose)
+            continue;
+
         auto flags = sys_vk._qf_properties[i].queueFamilyProperties.queueFlags;
         printf("    %i:%s%s%s%s%s%s%s (queues: %i)", i,
             ((flags) & VK_QUEUE_GRAPHICS_BIT) ? " graphics" : "",
@@ -1082,10 +1487,6 @@ static void choose_and_load_device(SysVulkan& sys_vk)
         if (sys_vk._qf_video_properties[i].videoCodecOperations & VK_VIDEO_CODEC_OPERATION_ENCODE_H265_BIT_EXT)
             printf(" (encode H265)");
         printf("\n");
-
-        /* We use this field to keep a score of how many times we've used that
-         * queue family in order to make better choices. */
-        sys_vk._qf_properties[i].queueFamilyProperties.timestampValidBits = 0;
     }
 
     auto pick_queue_family = [&sys_vk](VkQueueFlagBits flags) {
@@ -1195,7 +1596,7 @@ static void choose_and_load_device(SysVulkan& sys_vk)
     SETUP_QUEUE(enc_index)
     SETUP_QUEUE(dec_index)
 
-    ASSERT(sys_vk.queue_family_decode_index > -1);
+    ASSERT(sys_vk.queue_family_decode_index > -1 || sys_vk._options.compute_only);
 
 #undef SETUP_QUEUE
 
@@ -1204,13 +1605,35 @@ static void choose_and_load_device(SysVulkan& sys_vk)
     // Now check the device has the supported extensions for video
 
     std::vector<const char*> enabled_device_extensions;
+    if (extension_query.joinable()) {
+        extension_query.join();
+        const auto& exts = sys_vk._selected_device_all_available_extensions;
+        cache.Store(CapabilityCache::RECORD_DEVICE_EXTENSIONS, 0, exts.data(), exts.size() * sizeof(VkExtensionProperties));
+    }
     check_device_extensions(sys_vk, enabled_device_extensions);
 
     dev_info.ppEnabledExtensionNames = enabled_device_extensions.data();
     dev_info.enabledExtensionCount = enabled_device_extensions.size();
 
+    sys_vk.use_host_image_copy = 0;
+#ifdef VK_EXT_host_image_copy
+    // The feature struct may only be chained once the extension is known to be enabled.
+    for (const char* ext : enabled_device_extensions) {
+        if (!strcmp(ext, VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME) && host_image_copy_features.hostImageCopy) {
+            priv.host_image_copy_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_IMAGE_COPY_FEATURES_EXT;
+            priv.host_image_copy_features.pNext = nullptr;
+            priv.host_image_copy_features.hostImageCopy = VK_TRUE;
+            priv.atomic_float_features.pNext = &priv.host_image_copy_features;
+            sys_vk.use_host_image_copy = 1;
+        }
+    }
+#endif
+
+    util::Timer t;
+    t.GetCurrentTime();
     VkResult res = vk.CreateDevice(sys_vk.SelectedPhysicalDevice(), &dev_info, nullptr,
         &sys_vk._active_dev);
+    sys_vk._startup.device_us = t.ElapsedMicroseconds();
     for (u32 i = 0; i < dev_info.queueCreateInfoCount; i++)
         free((void*)dev_info.pQueueCreateInfos[i].pQueuePriorities);
     free((void*)dev_info.pQueueCreateInfos);
@@ -1261,10 +1684,23 @@ static VkBool32 VKAPI_CALL vk_dbg_callback(VkDebugUtilsMessageSeverityFlagBitsEX
     return 0;
 }
 
-bool init_vulkan(SysVulkan& sys_vk)
+// Integrated GPUs and SoCs expose their device local memory to the host, every device local type is host visible.
+static bool IsUnifiedMemory(const VkPhysicalDeviceMemoryProperties& memory_props)
 {
-    auto& vk = sys_vk._vfn;
+    bool has_device_local = false;
+    for (u32 i = 0; i < memory_props.memoryTypeCount; i++) {
+        VkMemoryPropertyFlags flags = memory_props.memoryTypes[i].propertyFlags;
+        if (!(flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+            continue;
+        if (!(flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
+            return false;
+        has_device_local = true;
+    }
+    return has_device_local;
+}
 
+static bool open_libvulkan(SysVulkan& sys_vk)
+{
     // Find the Vulkan loader
     static const std::array<const char*, 2> libnames = {
         "libvulkan.so.1",
@@ -1300,44 +1736,30 @@ bool init_vulkan(SysVulkan& sys_vk)
 #else
 #error "Unsupported platform"
 #endif
+    return sys_vk._get_proc_addr != nullptr;
+}
+
+// Selects a physical device among those probed, then creates the device, its queues and its allocator.
+static void load_device(SysVulkan& sys_vk)
+{
+    auto& vk = sys_vk._vfn;
 
+    const bool verbose = sys_vk._options.detect_env;
+    auto& startup = sys_vk._startup;
     util::Timer t;
-    u64 ms;
 
-    t.GetCurrentTime();
-    load_vk_functions(sys_vk);
-    ms = t.ElapsedMicroseconds();
-    printf("DEBUG: core load_vk_functions took %" PRIu64 " us\n", ms);
-    
-    t.GetCurrentTime();
-    load_instance(sys_vk);
-    ms = t.ElapsedMilliseconds();
-    printf("DEBUG: load_instance took %" PRIu64 " ms\n", ms);
+    choose_and_load_device(sys_vk);
 
+    // Fill in everything else needed now that an instance and a physical device are available.
     t.GetCurrentTime();
-    load_vk_functions(sys_vk, FF_VK_EXT_NO_FLAG, true, false);
-    ms = t.ElapsedMicroseconds();
-    printf("DEBUG: full load_vk_functions took %" PRIu64 " us\n", ms);
+    load_vk_functions(sys_vk, sys_vk.extensions, true, true);
 
-    if (sys_vk._options.enable_validation) {
-        VkDebugUtilsMessengerCreateInfoEXT dbg = {};
-        dbg.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
-        dbg.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
-        dbg.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
-        dbg.pfnUserCallback = vk_dbg_callback;
-        dbg.pUserData = nullptr;
-
-        vk.CreateDebugUtilsMessengerEXT(sys_vk._instance, &dbg, nullptr, &sys_vk._dev_debug_ctx);
-    }
-
-    choose_and_load_device(sys_vk);
-
-    // Fill in everything else needed now that an instance and a physical device are available.
-    load_vk_functions(sys_vk, sys_vk.extensions, true, true);
-
-    vk.GetDeviceQueue(sys_vk._active_dev, sys_vk.queue_family_decode_index, 0, &sys_vk._decode_queue0);
+    if (sys_vk.queue_family_decode_index > -1)
+        vk.GetDeviceQueue(sys_vk._active_dev, sys_vk.queue_family_decode_index, 0, &sys_vk._decode_queue0);
     vk.GetDeviceQueue(sys_vk._active_dev, sys_vk.queue_family_tx_index, 0, &sys_vk._tx_queue0);
-    ASSERT(sys_vk._decode_queue0 != VK_NULL_HANDLE && sys_vk._tx_queue0 != VK_NULL_HANDLE);
+    ASSERT((sys_vk._decode_queue0 != VK_NULL_HANDLE || sys_vk._options.compute_only) && sys_vk._tx_queue0 != VK_NULL_HANDLE);
+    if (sys_vk.queue_family_comp_index > -1)
+        vk.GetDeviceQueue(sys_vk._active_dev, sys_vk.queue_family_comp_index, 0, &sys_vk._comp_queue0);
 
     auto& device_priv = sys_vk._selected_physical_device_priv;
 
@@ -1345,22 +1767,48 @@ bool init_vulkan(SysVulkan& sys_vk)
     device_priv.props.pNext = &device_priv.external_memory_host_props;
     device_priv.external_memory_host_props.sType = (VkStructureType)VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
     device_priv.external_memory_host_props.pNext = nullptr;
+#ifdef VK_EXT_host_image_copy
+    if (sys_vk.use_host_image_copy) {
+        device_priv.host_image_copy_props = {};
+        device_priv.host_image_copy_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_IMAGE_COPY_PROPERTIES_EXT;
+        device_priv.host_image_copy_props.copySrcLayoutCount = ARRAY_ELEMS(device_priv.host_image_copy_src_layouts);
+        device_priv.host_image_copy_props.pCopySrcLayouts = device_priv.host_image_copy_src_layouts;
+        device_priv.external_memory_host_props.pNext = &device_priv.host_image_copy_props;
+    }
+#endif
 
     vk.GetPhysicalDeviceProperties2(sys_vk.SelectedPhysicalDevice(), &device_priv.props);
-    printf("Using device: %s\n",
-        device_priv.props.properties.deviceName);
-    printf("Physical device alignments:\n");
-    printf("    optimalBufferCopyRowPitchAlignment: %" PRIu64 "\n",
-        device_priv.props.properties.limits.optimalBufferCopyRowPitchAlignment);
-    printf("    minMemoryMapAlignment:              %ld\n",
-        device_priv.props.properties.limits.minMemoryMapAlignment);
-    printf("    nonCoherentAtomSize:                %" PRIu64 "\n",
-        device_priv.props.properties.limits.nonCoherentAtomSize);
-    if (sys_vk.extensions & FF_VK_EXT_EXTERNAL_HOST_MEMORY)
-        printf("    minImportedHostPointerAlignment:    %" PRIu64 "\n",
-            device_priv.external_memory_host_props.minImportedHostPointerAlignment);
+    vk.GetPhysicalDeviceMemoryProperties(sys_vk.SelectedPhysicalDevice(), &device_priv.memory_props);
+    // On UMA devices decode output can go straight to mapped linear images, see CreateDpbResource.
+    sys_vk.use_linear_images = IsUnifiedMemory(device_priv.memory_props);
+    printf("Using device: %s (%s)\n",
+        device_priv.props.properties.deviceName, sys_vk.use_linear_images ? "UMA" : "discrete memory");
+#ifdef VK_EXT_host_image_copy
+    // Decoded pictures are copied from the general layout, which the implementation has to list as a source.
+    if (sys_vk.use_host_image_copy) {
+        bool copies_from_general = false;
+        for (u32 i = 0; i < device_priv.host_image_copy_props.copySrcLayoutCount; i++)
+            copies_from_general |= device_priv.host_image_copy_src_layouts[i] == VK_IMAGE_LAYOUT_GENERAL;
+        sys_vk.use_host_image_copy = copies_from_general;
+    }
+#endif
+    if (verbose) {
+        printf("Physical device alignments:\n");
+        printf("    optimalBufferCopyRowPitchAlignment: %" PRIu64 "\n",
+            device_priv.props.properties.limits.optimalBufferCopyRowPitchAlignment);
+        printf("    minMemoryMapAlignment:              %ld\n",
+            device_priv.props.properties.limits.minMemoryMapAlignment);
+        printf("    nonCoherentAtomSize:                %" PRIu64 "\n",
+            device_priv.props.properties.limits.nonCoherentAtomSize);
+        if (sys_vk.extensions & FF_VK_EXT_EXTERNAL_HOST_MEMORY)
+            printf("    minImportedHostPointerAlignment:    %" PRIu64 "\n",
+                device_priv.external_memory_host_props.minImportedHostPointerAlignment);
+        printf("Host image copy: %d\n", sys_vk.use_host_image_copy);
+    }
+    startup.device_us += t.ElapsedMicroseconds();
 
     // Create the GPU memory allocator
+    t.GetCurrentTime();
     VmaVulkanFunctions vulkanFunctions = {};
     vulkanFunctions.vkGetInstanceProcAddr = sys_vk._get_proc_addr;
     vulkanFunctions.vkGetDeviceProcAddr = vk.GetDeviceProcAddr;
@@ -1371,11 +1819,177 @@ bool init_vulkan(SysVulkan& sys_vk)
     allocatorCreateInfo.device = sys_vk._active_dev;
     allocatorCreateInfo.instance = sys_vk._instance;
     allocatorCreateInfo.pVulkanFunctions = &vulkanFunctions;
+    if (sys_vk.extensions & FF_VK_EXT_MEMORY_BUDGET)
+        allocatorCreateInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
  
     VK_CHECK(vmaCreateAllocator(&allocatorCreateInfo, &sys_vk._allocator));
+    startup.allocator_us = t.ElapsedMicroseconds();
+
+    sys_vk._caps_cache.Save();
+}
+
+bool init_vulkan(SysVulkan& sys_vk)
+{
+    auto& vk = sys_vk._vfn;
+
+    auto& startup = sys_vk._startup;
+    util::Timer total, t;
+    total.GetCurrentTime();
+
+    t.GetCurrentTime();
+    if (sys_vk._options.mock_driver)
+        sys_vk._get_proc_addr = mock::Install(*sys_vk._options.mock_driver);
+    else if (!open_libvulkan(sys_vk))
+        return false;
+    load_vk_functions(sys_vk);
+    startup.loader_us = t.ElapsedMicroseconds();
+
+    t.GetCurrentTime();
+    load_instance(sys_vk);
+    load_vk_functions(sys_vk, FF_VK_EXT_NO_FLAG, true, false);
+
+    if (sys_vk._options.enable_validation) {
+        VkDebugUtilsMessengerCreateInfoEXT dbg = {};
+        dbg.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+        dbg.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+        dbg.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+        dbg.pfnUserCallback = vk_dbg_callback;
+        dbg.pUserData = nullptr;
+
+        vk.CreateDebugUtilsMessengerEXT(sys_vk._instance, &dbg, nullptr, &sys_vk._dev_debug_ctx);
+    }
+    startup.instance_us = t.ElapsedMicroseconds();
+
+    t.GetCurrentTime();
+    probe_physical_devices(sys_vk);
+    load_device(sys_vk);
+    startup.probe_us = t.ElapsedMicroseconds() - startup.device_us - startup.allocator_us;
+
+    printf("Startup took %.2f ms: loader %.2f, instance %.2f, device probing %.2f, device %.2f, allocator %.2f\n",
+        total.ElapsedMicroseconds() / 1000.0, startup.loader_us / 1000.0, startup.instance_us / 1000.0,
+        startup.probe_us / 1000.0, startup.device_us / 1000.0, startup.allocator_us / 1000.0);
+    return true;
+}
+
+// Opens another physical device on the instance of instance_owner, which has to outlive sys_vk. The device
+// gets its own dispatch table, allocator and queues.
+bool init_vulkan_device(SysVulkan& sys_vk, const SysVulkan& instance_owner, u32 physical_dev_idx)
+{
+    sys_vk._owns_instance = false;
+    sys_vk._get_proc_addr = instance_owner._get_proc_addr;
+    sys_vk._vfn = instance_owner._vfn; // the device level entry points are replaced in load_device
+    sys_vk._instance = instance_owner._instance;
+    sys_vk._physical_devices = instance_owner._physical_devices;
+    sys_vk._physical_device_props = instance_owner._physical_device_props;
+    sys_vk._physical_device_id_props = instance_owner._physical_device_id_props;
+    sys_vk._physical_device_drm_props = instance_owner._physical_device_drm_props;
+    sys_vk._options.physical_device_index = physical_dev_idx;
+
+    util::Timer t;
+    t.GetCurrentTime();
+    load_device(sys_vk);
+    printf("Device %u took %.2f ms: device %.2f, allocator %.2f\n", physical_dev_idx,
+        t.ElapsedMicroseconds() / 1000.0, sys_vk._startup.device_us / 1000.0, sys_vk._startup.allocator_us / 1000.0);
+    return true;
+}
+
+// Every device a process decodes on. The first one owns the loader and the instance, the others share them,
+// each with its own VkDevice, dispatch table, allocator and queues. All of a stream's resources come from the
+// device it was placed on.
+struct DeviceGroup
+{
+    std::vector<SysVulkan*> _devices;
+    std::vector<u32> _streams; // active streams per device
+    std::mutex _mutex;
+};
+
+// Opens the device selected by options like init_vulkan, then every other device that matches the selection,
+// or every device that can decode when nothing was requested.
+bool InitDeviceGroup(DeviceGroup* group, SysVulkan::UserOptions options)
+{
+    ASSERT(group->_devices.empty());
+    options.any_decode_device = true;
+    auto* first = new SysVulkan(options);
+    if (!init_vulkan(*first)) {
+        delete first;
+        return false;
+    }
+    group->_devices.push_back(first);
+
+    for (u32 i = 0; i < first->_physical_devices.size(); i++) {
+        if (i == first->_selected_physical_dev_idx)
+            continue;
+        if (!requested_device_match(*first, i) || !HasDecodeQueueFamily(*first, first->_physical_devices[i]))
+            continue;
+        auto* other = new SysVulkan(options);
+        init_vulkan_device(*other, *first, i);
+        group->_devices.push_back(other);
+    }
+    group->_streams.assign(group->_devices.size(), 0);
+    printf("Decoding on %zu device(s)\n", group->_devices.size());
     return true;
 }
 
+// Device local memory the allocator of sys_vk can still take, from VK_EXT_memory_budget when it is enabled and
+// estimated from the heap sizes otherwise.
+static VkDeviceSize FreeDeviceLocalMemory(SysVulkan* sys_vk)
+{
+    const auto& memory_props = sys_vk->_selected_physical_device_priv.memory_props;
+    VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+    vmaGetHeapBudgets(sys_vk->_allocator, budgets);
+
+    VkDeviceSize free = 0;
+    for (u32 i = 0; i < memory_props.memoryHeapCount; i++) {
+        if ((memory_props.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && budgets[i].budget > budgets[i].usage)
+            free += budgets[i].budget - budgets[i].usage;
+    }
+    return free;
+}
+
+// Picks the device for a new stream, the one with the fewest active streams and then the most free device local
+// memory. Every placed stream is given back with ReleaseStream.
+SysVulkan* PlaceStream(DeviceGroup* group)
+{
+    std::lock_guard<std::mutex> lock(group->_mutex);
+    ASSERT(!group->_devices.empty());
+    u32 best = 0;
+    VkDeviceSize best_free = FreeDeviceLocalMemory(group->_devices[0]);
+    for (u32 i = 1; i < group->_devices.size(); i++) {
+        if (group->_streams[i] > group->_streams[best])
+            continue;
+        VkDeviceSize free = FreeDeviceLocalMemory(group->_devices[i]);
+        if (group->_streams[i] < group->_streams[best] || free > best_free) {
+            best = i;
+            best_free = free;
+        }
+    }
+    group->_streams[best]++;
+    return group->_devices[best];
+}
+
+void ReleaseStream(DeviceGroup* group, SysVulkan* sys_vk)
+{
+    std::lock_guard<std::mutex> lock(group->_mutex);
+    for (u32 i = 0; i < group->_devices.size(); i++) {
+        if (group->_devices[i] == sys_vk) {
+            ASSERT(group->_streams[i] > 0);
+            group->_streams[i]--;
+            return;
+        }
+    }
+    ASSERT(false);
+}
+
+void DestroyDeviceGroup(DeviceGroup* group)
+{
+    // The first device owns the instance, it goes last
+    for (size_t i = group->_devices.size(); i-- > 0;)
+        delete group->_devices[i];
+    group->_devices.clear();
+    group->_streams.clear();
+}
+
+
 struct VideoProfile
 {
     VkVideoDecodeUsageInfoKHR _decode_usage_info;
@@ -1400,10 +2014,10 @@ bool VideoProfilesDiffer(const VideoProfile& a, const VideoProfile& b)
     switch(a._profile_info.videoCodecOperation)
     {
         case VK_VIDEO_CODEC_OPERATION_DECODE_AV1_BIT_MESA:
-            return a._decode_codec_profile.av1.stdProfileIdc == b._decode_codec_profile.av1.stdProfileIdc;
+            return a._decode_codec_profile.av1.stdProfileIdc != b._decode_codec_profile.av1.stdProfileIdc;
         case VK_VIDEO_CODEC_OPERATION_DECODE_H264_BIT_KHR:
-            return a._decode_codec_profile.avc.stdProfileIdc == b._decode_codec_profile.avc.stdProfileIdc && \
-                a._decode_codec_profile.avc.pictureLayout == b._decode_codec_profile.avc.pictureLayout;
+            return a._decode_codec_profile.avc.stdProfileIdc != b._decode_codec_profile.avc.stdProfileIdc || \
+                a._decode_codec_profile.avc.pictureLayout != b._decode_codec_profile.avc.pictureLayout;
         default: ASSERT(false);
     }
     return false;
@@ -1444,14 +2058,138 @@ VideoProfile Av1Progressive420Profile()
     return av1_profile;
 }
 
+// Identifies a video profile in the capability cache, fails for profiles with structs it does not know.
+static bool VideoProfileCacheKey(const VkVideoProfileInfoKHR& profile, u32* key)
+{
+    u32 fields[7] = { profile.videoCodecOperation, profile.chromaSubsampling, profile.lumaBitDepth, profile.chromaBitDepth };
+    for (auto* s = reinterpret_cast<const VkBaseInStructure*>(profile.pNext); s; s = s->pNext) {
+        switch (s->sType) {
+        case VK_STRUCTURE_TYPE_VIDEO_DECODE_USAGE_INFO_KHR:
+            fields[4] = reinterpret_cast<const VkVideoDecodeUsageInfoKHR*>(s)->videoUsageHints;
+            break;
+        case VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_PROFILE_INFO_KHR:
+            fields[5] = reinterpret_cast<const VkVideoDecodeH264ProfileInfoKHR*>(s)->stdProfileIdc;
+            fields[6] = reinterpret_cast<const VkVideoDecodeH264ProfileInfoKHR*>(s)->pictureLayout;
+            break;
+        case VK_STRUCTURE_TYPE_VIDEO_DECODE_AV1_PROFILE_INFO_MESA:
+            fields[5] = reinterpret_cast<const VkVideoDecodeAV1ProfileInfoMESA*>(s)->stdProfileIdc;
+            break;
+        default:
+            return false;
+        }
+    }
+    *key = util::LaneHashRow(reinterpret_cast<const u8*>(fields), sizeof(fields));
+    return true;
+}
+
+// vkGetPhysicalDeviceVideoCapabilitiesKHR through the capability cache. Only the decode and H.264 decode
+// capabilities can be chained to caps for it to be cached.
+VkResult GetVideoCapabilities(SysVulkan* sys_vk, const VkVideoProfileInfoKHR* profile, VkVideoCapabilitiesKHR* caps)
+{
+    struct CachedVideoCapabilities {
+        VkVideoCapabilitiesKHR video;
+        VkVideoDecodeCapabilitiesKHR decode;
+        VkVideoDecodeH264CapabilitiesKHR avc;
+    };
+    auto& vk = sys_vk->_vfn;
+    auto& cache = sys_vk->_caps_cache;
+
+    VkVideoDecodeCapabilitiesKHR* decode = nullptr;
+    VkVideoDecodeH264CapabilitiesKHR* avc = nullptr;
+    u32 profile_key = 0;
+    bool cacheable = cache.Enabled() && VideoProfileCacheKey(*profile, &profile_key);
+    for (auto* s = reinterpret_cast<VkBaseOutStructure*>(caps->pNext); s; s = s->pNext) {
+        if (s->sType == VK_STRUCTURE_TYPE_VIDEO_DECODE_CAPABILITIES_KHR)
+            decode = reinterpret_cast<VkVideoDecodeCapabilitiesKHR*>(s);
+        else if (s->sType == VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_CAPABILITIES_KHR)
+            avc = reinterpret_cast<VkVideoDecodeH264CapabilitiesKHR*>(s);
+        else
+            cacheable = false;
+    }
+    // The chained structs are part of the key, an entry without them cannot answer a query with them.
+    u64 arg = (u64(profile_key) << 32) | (decode ? 1 : 0) | (avc ? 2 : 0);
+
+    CachedVideoCapabilities cached = {};
+    if (cacheable && cache.FindValue(CapabilityCache::RECORD_VIDEO_CAPABILITIES, arg, &cached)) {
+        RestoreChained(caps, cached.video);
+        if (decode)
+            RestoreChained(decode, cached.decode);
+        if (avc)
+            RestoreChained(avc, cached.avc);
+        return VK_SUCCESS;
+    }
+
+    VkResult res = vk.GetPhysicalDeviceVideoCapabilitiesKHR(sys_vk->SelectedPhysicalDevice(), profile, caps);
+    if (res == VK_SUCCESS && cacheable) {
+        cached.video = *caps;
+        if (decode)
+            cached.decode = *decode;
+        if (avc)
+            cached.avc = *avc;
+        cache.Store(CapabilityCache::RECORD_VIDEO_CAPABILITIES, arg, &cached, sizeof(cached));
+    }
+    return res;
+}
+
+// vkGetPhysicalDeviceVideoFormatPropertiesKHR for the profiles and image usage, through the capability cache.
+std::vector<VkVideoFormatPropertiesKHR> GetVideoFormats(SysVulkan* sys_vk, const VkVideoProfileListInfoKHR* profiles,
+    VkImageUsageFlags usage)
+{
+    auto& vk = sys_vk->_vfn;
+    auto& cache = sys_vk->_caps_cache;
+
+    std::vector<u32> profile_keys(profiles->profileCount);
+    bool cacheable = cache.Enabled();
+    for (u32 i = 0; cacheable && i < profiles->profileCount; i++)
+        cacheable = VideoProfileCacheKey(profiles->pProfiles[i], &profile_keys[i]);
+    u64 arg = 0;
+    if (cacheable)
+        arg = (u64(util::LaneHashRow(reinterpret_cast<const u8*>(profile_keys.data()), profile_keys.size() * sizeof(u32))) << 32) | usage;
+
+    std::vector<VkVideoFormatPropertiesKHR> supported_formats;
+    if (cacheable && cache.FindArray(CapabilityCache::RECORD_VIDEO_FORMATS, arg, &supported_formats)) {
+        for (auto& sf : supported_formats)
+            sf.pNext = nullptr;
+        return supported_formats;
+    }
+
+    u32 num_supported_formats = 0;
+    VkPhysicalDeviceVideoFormatInfoKHR video_format_info = {};
+    video_format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VIDEO_FORMAT_INFO_KHR;
+    video_format_info.pNext = profiles;
+    video_format_info.imageUsage = usage;
+    vk.GetPhysicalDeviceVideoFormatPropertiesKHR(sys_vk->SelectedPhysicalDevice(),
+        &video_format_info,
+        &num_supported_formats,
+        nullptr);
+
+    supported_formats.resize(num_supported_formats);
+    for (auto& sf : supported_formats)
+        sf.sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR;
+    vk.GetPhysicalDeviceVideoFormatPropertiesKHR(sys_vk->SelectedPhysicalDevice(),
+        &video_format_info,
+        &num_supported_formats,
+        supported_formats.data());
+    supported_formats.resize(num_supported_formats);
+    if (cacheable)
+        cache.Store(CapabilityCache::RECORD_VIDEO_FORMATS, arg, supported_formats.data(),
+            supported_formats.size() * sizeof(VkVideoFormatPropertiesKHR));
+    return supported_formats;
+}
+
 enum TransitionType
 {
     TRANSITION_IMAGE_INITIALIZE,
     TRANSITION_IMAGE_TRANSFER_TO_HOST,
     TRANSITION_IMAGE_DPB_TO_DST,
+    TRANSITION_IMAGE_DST_TO_HOST,
+    TRANSITION_IMAGE_DECODE_TO_COMPUTE,
+    TRANSITION_IMAGE_TRANSFER_TO_COMPUTE,
     TRANSITION_BUFFER_FOR_READING,
 };
 
+constexpr u32 NoOutputLayer = ~0u;
+
 struct Dpb
 {
     VkImageCreateInfo _dpb_image_info;
@@ -1461,14 +2199,53 @@ struct Dpb
     VkImageView _dpb_slot_views[16]; // check min / max caps
     VkVideoPictureResourceInfoKHR _dpb_slot_picture_resource_infos[16];
 
+    // Only allocated for non-coincident implementations (AMD only currently). The output pool is sized from
+    // the reorder depth rather than the DPB size, see BindOutputLayer for how slots map onto it.
     VkImageCreateInfo _dst_image_info;
     VmaAllocationCreateInfo _dst_alloc_create_info;
-    VmaAllocation _dst_allocation;
-    VkImage _dst_images; // One used for non-coincident cases (AMD only currently)
+    VmaAllocation _dst_allocation { VK_NULL_HANDLE };
+    VkImage _dst_images { VK_NULL_HANDLE };
     VkImageView _dst_slot_views[16]; // check min / max caps
     VkVideoPictureResourceInfoKHR _dst_slot_picture_resource_infos[16];
 
     bool _coincident_image_resources = true;
+    // Output images are linear and persistently mapped, frames are read in place rather than copied out.
+    bool _dst_linear = false;
+    // Output images were created with VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT, frames are copied out on the host.
+    bool _host_copy = false;
+
+    // Set when the images were acquired from an ImagePool, and must be released back to it.
+    ImagePool* _image_pool { nullptr };
+
+    // The output layer the last decode into each slot wrote, NoOutputLayer when none.
+    u32 _slot_output_layers[16];
+
+    // Called when a decode into slot_idx is recorded. The caller owns layer until it is bound again: layers come
+    // from a free list (FramePool) that only takes them back once their frame is released, so a layer that is
+    // held or being read back is never decoded into. A layer is bound to one slot at a time.
+    void BindOutputLayer(u32 slot_idx, u32 layer)
+    {
+        ASSERT(!_coincident_image_resources && layer < _dst_image_info.arrayLayers);
+        for (u32& bound : _slot_output_layers) {
+            if (bound == layer)
+                bound = NoOutputLayer;
+        }
+        _slot_output_layers[slot_idx] = layer;
+    }
+
+    u32 OutputLayer(u32 slot_idx) const
+    {
+        ASSERT(!_coincident_image_resources && _slot_output_layers[slot_idx] != NoOutputLayer);
+        return _slot_output_layers[slot_idx];
+    }
+
+    // The layout a decode leaves its output picture in, the old layout of the transitions that follow it.
+    VkImageLayout DecodedOutputLayout() const
+    {
+        if (_dst_linear || _host_copy)
+            return VK_IMAGE_LAYOUT_GENERAL;
+        return _coincident_image_resources ? VK_IMAGE_LAYOUT_VIDEO_DECODE_DPB_KHR : VK_IMAGE_LAYOUT_VIDEO_DECODE_DST_KHR;
+    }
 
     std::vector<VkImageMemoryBarrier2> SlotBarriers(TransitionType trans_type, u32 slot_idx)
     {
@@ -1494,12 +2271,14 @@ struct Dpb
                 dpb_barrier.dstAccessMask = VK_ACCESS_2_VIDEO_DECODE_WRITE_BIT_KHR;
                 dpb_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
                 dpb_barrier.newLayout = VK_IMAGE_LAYOUT_VIDEO_DECODE_DPB_KHR;
-                dst_barrier = dpb_barrier;
-                dst_barrier.image = _dst_images;
-                dst_barrier.newLayout = VK_IMAGE_LAYOUT_VIDEO_DECODE_DST_KHR;
                 r.push_back(dpb_barrier);
-                if (!_coincident_image_resources)
+                if (!_coincident_image_resources) {
+                    dst_barrier = dpb_barrier;
+                    dst_barrier.image = _dst_images;
+                    dst_barrier.subresourceRange.baseArrayLayer = OutputLayer(slot_idx);
+                    dst_barrier.newLayout = VK_IMAGE_LAYOUT_VIDEO_DECODE_DST_KHR;
                     r.push_back(dst_barrier);
+                }
                 return r;
             case TRANSITION_IMAGE_DPB_TO_DST:
                 dpb_barrier.srcStageMask = VK_PIPELINE_STAGE_2_VIDEO_DECODE_BIT_KHR;
@@ -1518,31 +2297,85 @@ struct Dpb
                 dpb_barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT_KHR;
                 dpb_barrier.oldLayout = VK_IMAGE_LAYOUT_VIDEO_DECODE_DPB_KHR;
                 dpb_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-                dst_barrier = dpb_barrier;
-                dst_barrier.image = _dst_images;
-                dst_barrier.oldLayout = VK_IMAGE_LAYOUT_VIDEO_DECODE_DST_KHR;
-                if (!_coincident_image_resources)
+                if (!_coincident_image_resources) {
+                    dst_barrier = dpb_barrier;
+                    dst_barrier.image = _dst_images;
+                    dst_barrier.subresourceRange.baseArrayLayer = OutputLayer(slot_idx);
+                    dst_barrier.oldLayout = VK_IMAGE_LAYOUT_VIDEO_DECODE_DST_KHR;
                     r.push_back(dst_barrier);
-                else
+                } else {
                     r.push_back(dpb_barrier);
+                }
                 return r;
                 break;
+            case TRANSITION_IMAGE_DST_TO_HOST:
+                // Host reads of linear images, and host image copies, are done from the general layout.
+                ASSERT(_dst_linear || _host_copy);
+                dpb_barrier.srcStageMask = VK_PIPELINE_STAGE_2_VIDEO_DECODE_BIT_KHR;
+                dpb_barrier.srcAccessMask = VK_ACCESS_2_VIDEO_DECODE_WRITE_BIT_KHR;
+                dpb_barrier.dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT;
+                dpb_barrier.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
+                dpb_barrier.oldLayout = VK_IMAGE_LAYOUT_VIDEO_DECODE_DPB_KHR;
+                dpb_barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+                if (!_coincident_image_resources) {
+                    dst_barrier = dpb_barrier;
+                    dst_barrier.image = _dst_images;
+                    dst_barrier.subresourceRange.baseArrayLayer = OutputLayer(slot_idx);
+                    dst_barrier.oldLayout = VK_IMAGE_LAYOUT_VIDEO_DECODE_DST_KHR;
+                    r.push_back(dst_barrier);
+                } else {
+                    r.push_back(dpb_barrier);
+                }
+                return r;
+            case TRANSITION_IMAGE_DECODE_TO_COMPUTE:
+                // Recorded on the compute queue after the decode has been waited for, so only the layout changes.
+                dpb_barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE_KHR;
+                dpb_barrier.srcAccessMask = VK_ACCESS_2_NONE_KHR;
+                dpb_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+                dpb_barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+                dpb_barrier.oldLayout = VK_IMAGE_LAYOUT_VIDEO_DECODE_DPB_KHR;
+                dpb_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                if (!_coincident_image_resources) {
+                    dst_barrier = dpb_barrier;
+                    dst_barrier.image = _dst_images;
+                    dst_barrier.subresourceRange.baseArrayLayer = OutputLayer(slot_idx);
+                    dst_barrier.oldLayout = VK_IMAGE_LAYOUT_VIDEO_DECODE_DST_KHR;
+                    r.push_back(dst_barrier);
+                } else {
+                    r.push_back(dpb_barrier);
+                }
+                return r;
+            case TRANSITION_IMAGE_TRANSFER_TO_COMPUTE:
+                // After the readback of a picture that may be composited later, on another queue once its frame
+                // is received, so it stays sampleable without another barrier.
+                dpb_barrier.srcStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR;
+                dpb_barrier.srcAccessMask = VK_ACCESS_2_NONE_KHR;
+                dpb_barrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE_KHR;
+                dpb_barrier.dstAccessMask = VK_ACCESS_2_NONE_KHR;
+                dpb_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+                dpb_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                if (!_coincident_image_resources) {
+                    dpb_barrier.image = _dst_images;
+                    dpb_barrier.subresourceRange.baseArrayLayer = OutputLayer(slot_idx);
+                }
+                r.push_back(dpb_barrier);
+                return r;
         }
 
         return r;
     }
 
     void CopySlotToBuffer(vvb::SysVulkan* sys_vk, VkCommandBuffer cmd_buf, u32 slot_idx, u32 width_samples,
-        u32 buf_pitch, u32 buf_height, VkImageAspectFlags aspect_mask, VkBuffer buffer)
+        u32 buf_pitch, u32 buf_height, VkImageAspectFlags aspect_mask, VkBuffer buffer, VkDeviceSize buffer_offset = 0)
     {
         auto& vk = sys_vk->_vfn;
         VkBufferImageCopy copy_region = {};
-        copy_region.bufferOffset = 0;
+        copy_region.bufferOffset = buffer_offset;
         copy_region.bufferRowLength = buf_pitch;
         copy_region.bufferImageHeight = buf_height;
         copy_region.imageSubresource.aspectMask = aspect_mask;
         copy_region.imageSubresource.mipLevel = 0;
-        copy_region.imageSubresource.baseArrayLayer = slot_idx;
+        copy_region.imageSubresource.baseArrayLayer = _coincident_image_resources ? slot_idx : OutputLayer(slot_idx);
         copy_region.imageSubresource.layerCount = 1;
         copy_region.imageOffset = { 0, 0, 0 };
         copy_region.imageExtent = { width_samples, buf_height, 1 };
@@ -1559,24 +2392,315 @@ struct Dpb
         }
         else
         {
-            return _dst_slot_picture_resource_infos[slot_idx];
+            return _dst_slot_picture_resource_infos[OutputLayer(slot_idx)];
+        }
+    }
+};
+
+// A video image with one view per array layer, which is how pictures are bound to DPB slots and decode outputs.
+struct VideoImage
+{
+    VkImage _image { VK_NULL_HANDLE };
+    VmaAllocation _allocation { VK_NULL_HANDLE };
+    VkDeviceSize _allocation_size { 0 };
+    u32 _num_layers { 0 };
+    VkImageView _layer_views[16];
+};
+
+VideoImage CreateVideoImage(vvb::SysVulkan* sys_vk, const VkImageCreateInfo* image_info,
+    const VmaAllocationCreateInfo* alloc_create_info, VkComponentMapping view_component_map)
+{
+    auto& vk = sys_vk->_vfn;
+    VideoImage r = {};
+    ASSERT(image_info->arrayLayers <= ARRAY_ELEMS(r._layer_views));
+
+    VmaAllocationInfo allocation_info = {};
+    VK_CHECK(vmaCreateImage(sys_vk->_allocator,
+        image_info,
+        alloc_create_info,
+        &r._image,
+        &r._allocation,
+        &allocation_info));
+    r._allocation_size = allocation_info.size;
+    r._num_layers = image_info->arrayLayers;
+
+    for (u32 layer = 0; layer < r._num_layers; layer++)
+    {
+        VkImageViewUsageCreateInfo view_usage_info = {};
+        view_usage_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO;
+        view_usage_info.usage = image_info->usage;
+        // Shader access goes through per-plane views, see FrameConverter.
+        if (image_info->flags & VK_IMAGE_CREATE_EXTENDED_USAGE_BIT)
+            view_usage_info.usage &= ~(VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
+        VkImageViewCreateInfo image_view_info = {};
+        image_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        image_view_info.pNext = &view_usage_info;
+        image_view_info.flags = 0;
+        image_view_info.image = r._image;
+        image_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D; // todo: 2d arrays are also supported but not tested
+        image_view_info.format = image_info->format;
+        image_view_info.components = view_component_map;
+        image_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        image_view_info.subresourceRange.baseMipLevel = 0;
+        image_view_info.subresourceRange.levelCount = 1;
+        image_view_info.subresourceRange.baseArrayLayer = layer;
+        image_view_info.subresourceRange.layerCount = 1;
+        VK_CHECK(vk.CreateImageView(sys_vk->_active_dev, &image_view_info, nullptr, &r._layer_views[layer]));
+    }
+    return r;
+}
+void DestroyVideoImage(vvb::SysVulkan* sys_vk, VideoImage* r)
+{
+    auto& vk = sys_vk->_vfn;
+    for (u32 layer = 0; layer < r->_num_layers; layer++)
+        vk.DestroyImageView(sys_vk->_active_dev, r->_layer_views[layer], nullptr);
+    vmaDestroyImage(sys_vk->_allocator, r->_image, r->_allocation);
+    *r = {};
+}
+
+// Images created with a video profile list can only be used with compatible profiles, so the list is part of
+// the pool key. FNV-1a over the fields that affect compatibility.
+u64 HashVideoProfileList(const VkVideoProfileListInfoKHR* profile_list)
+{
+    u64 h = 0xcbf29ce484222325ULL;
+    auto mix = [&h](u64 v) {
+        h ^= v;
+        h *= 0x100000001b3ULL;
+    };
+    if (!profile_list)
+        return h;
+    for (u32 i = 0; i < profile_list->profileCount; i++) {
+        const VkVideoProfileInfoKHR& profile = profile_list->pProfiles[i];
+        mix(profile.videoCodecOperation);
+        mix(profile.chromaSubsampling);
+        mix(profile.lumaBitDepth);
+        mix(profile.chromaBitDepth);
+        for (auto* ext = (const VkBaseInStructure*)profile.pNext; ext; ext = ext->pNext) {
+            switch (ext->sType) {
+            case VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_PROFILE_INFO_KHR:
+                mix(((const VkVideoDecodeH264ProfileInfoKHR*)ext)->stdProfileIdc);
+                mix(((const VkVideoDecodeH264ProfileInfoKHR*)ext)->pictureLayout);
+                break;
+            case VK_STRUCTURE_TYPE_VIDEO_DECODE_AV1_PROFILE_INFO_MESA:
+                mix(((const VkVideoDecodeAV1ProfileInfoMESA*)ext)->stdProfileIdc);
+                break;
+            case VK_STRUCTURE_TYPE_VIDEO_DECODE_USAGE_INFO_KHR:
+                mix(((const VkVideoDecodeUsageInfoKHR*)ext)->videoUsageHints);
+                break;
+            default:
+                break;
+            }
         }
     }
+    return h;
+}
+
+struct ImagePoolKey
+{
+    VkFormat _format;
+    VkImageCreateFlags _flags; // mutable format images have plane views, others may not allow them
+    VkImageUsageFlags _usage;
+    VkImageTiling _tiling;
+    VkComponentMapping _components;
+    u64 _profile_list_hash;
+
+    bool operator==(const ImagePoolKey& other) const
+    {
+        return _format == other._format && _flags == other._flags && _usage == other._usage &&
+            _tiling == other._tiling && _profile_list_hash == other._profile_list_hash &&
+            memcmp(&_components, &other._components, sizeof(_components)) == 0;
+    }
+};
+
+// Recycles DPB and output images, along with their per-layer views, across sessions and the streams of a device.
+// Stream starts and resolution switches then only pay for a vmaCreateImage when no compatible image is free.
+// Images are created at an "extent class" (the coded extent rounded up), the picture resources bound to them
+// use the real coded extent, so one pooled image serves every resolution within its class.
+struct ImagePool
+{
+    struct Entry
+    {
+        ImagePoolKey _key;
+        VkExtent2D _extent_class;
+        VideoImage _image;
+        bool _in_use { false };
+        u64 _release_tick { 0 };
+    };
+    std::vector<Entry> _entries;
+    std::mutex _mutex; // streams acquire and release from their submit stage
+
+    VkExtent2D _max_extent;
+    u32 _max_free_entries { 8 };
+    u64 _tick { 0 };
+
+    u32 _hits { 0 };
+    u32 _misses { 0 };
+
+    static constexpr u32 ExtentClassAlignment = 128;
+
+    VkExtent2D ExtentClass(VkExtent2D extent) const
+    {
+        VkExtent2D r;
+        r.width = std::min(util::AlignUp(extent.width, ExtentClassAlignment), _max_extent.width);
+        r.height = std::min(util::AlignUp(extent.height, ExtentClassAlignment), _max_extent.height);
+        return r;
+    }
 };
 
-Dpb CreateDpbResource(vvb::SysVulkan* sys_vk, u32 width, u32 height, u32 num_slots,
+void InitImagePool(ImagePool* pool, VkExtent2D max_extent, u32 max_free_entries = 8)
+{
+    pool->_max_extent = max_extent;
+    pool->_max_free_entries = max_free_entries;
+}
+
+// Returns a free image compatible with image_info, or creates one. The extent in image_info is replaced by its
+// extent class. A larger class is only reused when its area is within 1.5x of the request, to stop small
+// streams from pinning 4K allocations.
+VideoImage AcquirePooledImage(vvb::SysVulkan* sys_vk, ImagePool* pool, VkImageCreateInfo* image_info,
+    const VmaAllocationCreateInfo* alloc_create_info, VkComponentMapping view_component_map,
+    const VkVideoProfileListInfoKHR* profile_list)
+{
+    ImagePoolKey key = {};
+    key._format = image_info->format;
+    key._flags = image_info->flags;
+    key._usage = image_info->usage;
+    key._tiling = image_info->tiling;
+    key._components = view_component_map;
+    key._profile_list_hash = HashVideoProfileList(profile_list);
+
+    std::unique_lock<std::mutex> lock(pool->_mutex);
+    VkExtent2D want = pool->ExtentClass(VkExtent2D { image_info->extent.width, image_info->extent.height });
+    u64 want_area = u64(want.width) * want.height;
+
+    int best = -1;
+    u64 best_cost = UINT64_MAX;
+    for (u32 i = 0; i < pool->_entries.size(); i++) {
+        const auto& e = pool->_entries[i];
+        if (e._in_use || !(e._key == key) || e._image._num_layers < image_info->arrayLayers)
+            continue;
+        if (e._extent_class.width < want.width || e._extent_class.height < want.height)
+            continue;
+        u64 area = u64(e._extent_class.width) * e._extent_class.height;
+        if (area * 2 > want_area * 3)
+            continue;
+        u64 cost = area * e._image._num_layers;
+        if (cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+
+    if (best != -1) {
+        auto& e = pool->_entries[best];
+        e._in_use = true;
+        image_info->extent = VkExtent3D { e._extent_class.width, e._extent_class.height, 1 };
+        image_info->arrayLayers = e._image._num_layers;
+        pool->_hits++;
+        return e._image;
+    }
+
+    image_info->extent = VkExtent3D { want.width, want.height, 1 };
+    ImagePool::Entry e = {};
+    e._key = key;
+    e._extent_class = want;
+    e._in_use = true;
+    pool->_misses++;
+    // Image creation is slow, the other streams of the device keep acquiring and releasing meanwhile.
+    lock.unlock();
+    e._image = CreateVideoImage(sys_vk, image_info, alloc_create_info, view_component_map);
+    lock.lock();
+    pool->_entries.push_back(e);
+    return e._image;
+}
+
+// Returns the image to the pool. Beyond _max_free_entries free images, the least recently released are
+// destroyed.
+void ReleasePooledImage(vvb::SysVulkan* sys_vk, ImagePool* pool, VkImage image)
+{
+    std::lock_guard<std::mutex> lock(pool->_mutex);
+    u32 num_free = 0;
+    bool found = false;
+    for (auto& e : pool->_entries) {
+        if (e._image._image == image) {
+            ASSERT(e._in_use);
+            e._in_use = false;
+            e._release_tick = ++pool->_tick;
+            found = true;
+        }
+        if (!e._in_use)
+            num_free++;
+    }
+    ASSERT(found);
+
+    while (num_free > pool->_max_free_entries) {
+        auto oldest = pool->_entries.end();
+        for (auto it = pool->_entries.begin(); it != pool->_entries.end(); ++it) {
+            if (!it->_in_use && (oldest == pool->_entries.end() || it->_release_tick < oldest->_release_tick))
+                oldest = it;
+        }
+        DestroyVideoImage(sys_vk, &oldest->_image);
+        pool->_entries.erase(oldest);
+        num_free--;
+    }
+}
+
+void DestroyImagePool(vvb::SysVulkan* sys_vk, ImagePool* pool)
+{
+    printf("Image pool: %u hits, %u misses, %zu images held\n", pool->_hits, pool->_misses, pool->_entries.size());
+    for (auto& e : pool->_entries) {
+        ASSERT(!e._in_use);
+        DestroyVideoImage(sys_vk, &e._image);
+    }
+    pool->_entries.clear();
+}
+
+// The first stream on a device sets the largest extent class from its capabilities, the pool lives until the
+// last stream is closed.
+ImagePool* AcquireImagePool(SysVulkan* sys_vk, VkExtent2D max_extent)
+{
+    std::lock_guard<std::mutex> lock(sys_vk->_image_pool_mutex);
+    if (sys_vk->_image_pool_users++ == 0) {
+        sys_vk->_image_pool = new ImagePool;
+        InitImagePool(sys_vk->_image_pool, max_extent);
+    }
+    return sys_vk->_image_pool;
+}
+
+void ReleaseImagePool(SysVulkan* sys_vk)
+{
+    std::lock_guard<std::mutex> lock(sys_vk->_image_pool_mutex);
+    ASSERT(sys_vk->_image_pool_users > 0);
+    if (--sys_vk->_image_pool_users > 0)
+        return;
+    DestroyImagePool(sys_vk, sys_vk->_image_pool);
+    delete sys_vk->_image_pool;
+    sys_vk->_image_pool = nullptr;
+}
+
+// num_output_slots is only used for non-coincident implementations, and should be derived from the reorder
+// depth of the stream (max_num_reorder_frames + 1), since an output picture is only held until it is displayed.
+// When image_pool is given, images are taken from and returned to it rather than created and destroyed.
+// linear_output requests linear, host mapped output images (UMA devices), it falls back to optimal tiling when
+// the implementation cannot create them with enough layers.
+Dpb CreateDpbResource(vvb::SysVulkan* sys_vk, u32 width, u32 height, u32 num_slots, u32 num_output_slots,
     bool coincident_image_resources,
     VkImageUsageFlags dpb_usage, VkFormat dpb_format, VkComponentMapping dpb_view_component_map,
     VkImageUsageFlags dst_usage, VkFormat dst_format, VkComponentMapping dst_view_component_map,
-    VkVideoProfileListInfoKHR* profile_list = nullptr)
+    VkVideoProfileListInfoKHR* profile_list = nullptr, ImagePool* image_pool = nullptr, bool linear_output = false)
 {
     auto& vk = sys_vk->_vfn;
     Dpb r = {};
     printf("Dpb is %lu bytes\n", sizeof(r));
     static_assert(sizeof(r) < 4000, "Dpb is too big");
     ASSERT(num_slots < 16);
+    ASSERT(num_output_slots > 0 && num_output_slots <= num_slots);
 
     r._coincident_image_resources = coincident_image_resources;
+    r._image_pool = image_pool;
+    std::fill_n(r._slot_output_layers, ARRAY_ELEMS(r._slot_output_layers), NoOutputLayer);
+#ifdef VK_EXT_host_image_copy
+    r._host_copy = (coincident_image_resources ? dpb_usage : dst_usage) & VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT;
+#endif
 
     r._dpb_image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     r._dpb_image_info.pNext = profile_list;
@@ -1591,67 +2715,95 @@ Dpb CreateDpbResource(vvb::SysVulkan* sys_vk, u32 width, u32 height, u32 num_slo
     r._dpb_image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
     r._dpb_image_info.usage = dpb_usage;
     r._dpb_image_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
-    u32 queue_family_indices[2] = {(u32)sys_vk->queue_family_decode_index, (u32)sys_vk->queue_family_tx_index};
-    r._dpb_image_info.queueFamilyIndexCount = 2;
+    // Decoded pictures are read by the transfer queue, and by the compute queue for conversions.
+    u32 queue_family_indices[3] = {(u32)sys_vk->queue_family_decode_index};
+    u32 num_queue_families = 1;
+    for (int qf : { sys_vk->queue_family_tx_index, sys_vk->queue_family_comp_index }) {
+        if (qf > -1 && std::find(queue_family_indices, queue_family_indices + num_queue_families, (u32)qf) == queue_family_indices + num_queue_families)
+            queue_family_indices[num_queue_families++] = qf;
+    }
+    if (num_queue_families == 1)
+        r._dpb_image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    r._dpb_image_info.queueFamilyIndexCount = num_queue_families;
     r._dpb_image_info.pQueueFamilyIndices = queue_family_indices;
     r._dpb_alloc_create_info.flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT;
     r._dpb_alloc_create_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-    VK_CHECK(vmaCreateImage(sys_vk->_allocator,
-        &r._dpb_image_info,
-        &r._dpb_alloc_create_info,
-        &r._dpb_images,
-        &r._dpb_allocation,
-        nullptr));
-    
-    // Now reuse the above to create the dst images. This are required for non-coincident implementations like AMD
-    // A little heavy handed to always allocate them, but makes life simpler.
+
+    // Set up the dst images from the above. These are only required for non-coincident implementations
+    // like AMD, and only need to hold pictures until they are output, so the reorder depth bounds their number.
     r._dst_image_info = r._dpb_image_info;
     r._dst_image_info.format = dst_format;
     r._dst_image_info.usage = dst_usage;
-    VK_CHECK(vmaCreateImage(sys_vk->_allocator,
-        &r._dst_image_info,
-        &r._dst_alloc_create_info,
-        &r._dst_images,
-        &r._dst_allocation,
-        nullptr));
+    r._dst_image_info.arrayLayers = coincident_image_resources ? 0 : num_output_slots;
+    r._dst_alloc_create_info = r._dpb_alloc_create_info;
+    // Sampled output images are read through plane views (R8 / R8G8), which needs a mutable format, and the
+    // sampled usage may only be supported by the plane formats.
+    VkImageCreateInfo& out_image_info = coincident_image_resources ? r._dpb_image_info : r._dst_image_info;
+    if (out_image_info.usage & VK_IMAGE_USAGE_SAMPLED_BIT)
+        out_image_info.flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT;
+    if (linear_output) {
+        ASSERT(!coincident_image_resources);
+        VkPhysicalDeviceImageFormatInfo2 format_info = {};
+        format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+        format_info.pNext = profile_list;
+        format_info.format = dst_format;
+        format_info.type = VK_IMAGE_TYPE_2D;
+        format_info.tiling = VK_IMAGE_TILING_LINEAR;
+        format_info.usage = dst_usage;
+        VkImageFormatProperties2 format_props = {};
+        format_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+        VkResult res = vk.GetPhysicalDeviceImageFormatProperties2(sys_vk->SelectedPhysicalDevice(), &format_info, &format_props);
+        if (res == VK_SUCCESS && format_props.imageFormatProperties.maxArrayLayers >= num_output_slots &&
+            format_props.imageFormatProperties.maxExtent.width >= width &&
+            format_props.imageFormatProperties.maxExtent.height >= height) {
+            r._dst_linear = true;
+            r._dst_image_info.tiling = VK_IMAGE_TILING_LINEAR;
+            r._dst_alloc_create_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+            r._dst_alloc_create_info.flags |= VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+            r._dst_alloc_create_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+        } else {
+            // The picture is then copied out on the transfer queue, like on discrete GPUs.
+            printf("Linear output images are not supported at %ux%u (%s), using optimal tiling\n", width, height,
+                vk_ret2str(res));
+            r._dst_image_info.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        }
+    }
+
+    auto acquire = [&](VkImageCreateInfo* image_info, const VmaAllocationCreateInfo* alloc_create_info, VkComponentMapping components) {
+        if (image_pool)
+            return AcquirePooledImage(sys_vk, image_pool, image_info, alloc_create_info, components, profile_list);
+        return CreateVideoImage(sys_vk, image_info, alloc_create_info, components);
+    };
+
+    VideoImage dpb_image = acquire(&r._dpb_image_info, &r._dpb_alloc_create_info, dpb_view_component_map);
+    r._dpb_images = dpb_image._image;
+    r._dpb_allocation = dpb_image._allocation;
+    memcpy(r._dpb_slot_views, dpb_image._layer_views, sizeof(r._dpb_slot_views));
+
+    if (!coincident_image_resources) {
+        VideoImage dst_image = acquire(&r._dst_image_info, &r._dst_alloc_create_info, dst_view_component_map);
+        r._dst_images = dst_image._image;
+        r._dst_allocation = dst_image._allocation;
+        memcpy(r._dst_slot_views, dst_image._layer_views, sizeof(r._dst_slot_views));
+        // Against one output layer per DPB slot, estimated from the DPB allocation since the output images share
+        // its format class and extent. A pooled image may have more layers than asked for, which costs memory.
+        i64 bytes_per_layer = i64(dpb_image._allocation_size / dpb_image._num_layers);
+        i64 saved_bytes = bytes_per_layer * (i64(r._dpb_image_info.arrayLayers) - i64(r._dst_image_info.arrayLayers));
+        printf("Output images: %u layers sized from reorder depth, %s %.2f MB of device memory\n",
+            r._dst_image_info.arrayLayers, saved_bytes >= 0 ? "saved" : "spent", ToMegaByte(std::abs(saved_bytes)));
+    } else {
+        printf("Output images: coincident with DPB\n");
+    }
 
     for (u32 slot_idx = 0; slot_idx < num_slots; slot_idx++)
     {
-        VkImageViewUsageCreateInfo dpb_view_usage_info = {};
-        dpb_view_usage_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO;
-        dpb_view_usage_info.usage = dpb_usage;
-        VkImageViewUsageCreateInfo dst_view_usage_info = {};
-        dst_view_usage_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO;
-        dst_view_usage_info.usage = dst_usage;
-        VkImageViewCreateInfo image_view_info = {};
-        image_view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        image_view_info.pNext = &dpb_view_usage_info;
-        image_view_info.flags = 0;
-        image_view_info.image = r._dpb_images;
-        image_view_info.viewType = VK_IMAGE_VIEW_TYPE_2D; // todo: 2d arrays are also supported but not tested
-        image_view_info.format = dpb_format;
-        image_view_info.components = dpb_view_component_map;
-        image_view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        image_view_info.subresourceRange.baseMipLevel = 0;
-        image_view_info.subresourceRange.levelCount = 1;
-        image_view_info.subresourceRange.baseArrayLayer = slot_idx;
-        image_view_info.subresourceRange.layerCount = 1;
-        VK_CHECK(vk.CreateImageView(sys_vk->_active_dev, &image_view_info, nullptr, &r._dpb_slot_views[slot_idx]));
-        if (!coincident_image_resources)
-        {
-            image_view_info.pNext = &dst_view_usage_info;
-            image_view_info.image = r._dst_images;
-            image_view_info.format = dst_format;
-            image_view_info.components = dst_view_component_map;
-            VK_CHECK(vk.CreateImageView(sys_vk->_active_dev, &image_view_info, nullptr, &r._dst_slot_views[slot_idx]));
-        }
         r._dpb_slot_picture_resource_infos[slot_idx].sType = VK_STRUCTURE_TYPE_VIDEO_PICTURE_RESOURCE_INFO_KHR;
         r._dpb_slot_picture_resource_infos[slot_idx].pNext = nullptr;
         r._dpb_slot_picture_resource_infos[slot_idx].codedOffset = VkOffset2D{0, 0};
         r._dpb_slot_picture_resource_infos[slot_idx].codedExtent = VkExtent2D{width, height};
         r._dpb_slot_picture_resource_infos[slot_idx].baseArrayLayer = 0;
         r._dpb_slot_picture_resource_infos[slot_idx].imageViewBinding = r._dpb_slot_views[slot_idx];
-        if (!coincident_image_resources)
+        if (!coincident_image_resources && slot_idx < num_output_slots)
         {
             r._dst_slot_picture_resource_infos[slot_idx].sType = VK_STRUCTURE_TYPE_VIDEO_PICTURE_RESOURCE_INFO_KHR;
             r._dst_slot_picture_resource_infos[slot_idx].pNext = nullptr;
@@ -1665,14 +2817,27 @@ Dpb CreateDpbResource(vvb::SysVulkan* sys_vk, u32 width, u32 height, u32 num_slo
 }
 void DestroyDpbResource(vvb::SysVulkan* sys_vk, Dpb* r)
 {
-    auto& vk = sys_vk->_vfn;
-    for (u32 slot_idx = 0; slot_idx < r->_dpb_image_info.arrayLayers; slot_idx++)
-    {
-        vk.DestroyImageView(sys_vk->_active_dev, r->_dpb_slot_views[slot_idx], nullptr);
-        vk.DestroyImageView(sys_vk->_active_dev, r->_dst_slot_views[slot_idx], nullptr);
+    if (r->_image_pool) {
+        ReleasePooledImage(sys_vk, r->_image_pool, r->_dpb_images);
+        if (r->_dst_images != VK_NULL_HANDLE)
+            ReleasePooledImage(sys_vk, r->_image_pool, r->_dst_images);
+        return;
+    }
+
+    VideoImage dpb_image = {};
+    dpb_image._image = r->_dpb_images;
+    dpb_image._allocation = r->_dpb_allocation;
+    dpb_image._num_layers = r->_dpb_image_info.arrayLayers;
+    memcpy(dpb_image._layer_views, r->_dpb_slot_views, sizeof(dpb_image._layer_views));
+    DestroyVideoImage(sys_vk, &dpb_image);
+    if (r->_dst_images != VK_NULL_HANDLE) {
+        VideoImage dst_image = {};
+        dst_image._image = r->_dst_images;
+        dst_image._allocation = r->_dst_allocation;
+        dst_image._num_layers = r->_dst_image_info.arrayLayers;
+        memcpy(dst_image._layer_views, r->_dst_slot_views, sizeof(dst_image._layer_views));
+        DestroyVideoImage(sys_vk, &dst_image);
     }
-    vmaDestroyImage(sys_vk->_allocator, r->_dpb_images, r->_dpb_allocation);
-    vmaDestroyImage(sys_vk->_allocator, r->_dst_images, r->_dst_allocation);
 }
 
 struct BufferResource
@@ -1681,6 +2846,8 @@ struct BufferResource
     VmaAllocation _allocation;
     VkBufferCreateInfo _create_info;
     VmaAllocationCreateInfo _alloc_info;
+    // Only set for buffers created with VMA_ALLOCATION_CREATE_MAPPED_BIT, which stay mapped for their lifetime.
+    void* _mapped { nullptr };
 
     VkBufferMemoryBarrier2 Barrier(TransitionType trans_type)
     {
@@ -1722,36 +2889,607 @@ BufferResource CreateBufferResource(vvb::SysVulkan* sys_vk, VkDeviceSize size,
     // Note! This is rather subtle. Since I don't intend to read the bitstream back to the CPU, it seems
     // I can use uncached combined memory for extra performance.
     r._alloc_info.flags = alloc_flags;
+    VmaAllocationInfo allocation_info = {};
     vmaCreateBuffer(sys_vk->_allocator,
         &r._create_info,
         &r._alloc_info,
         &r._buffer,
         &r._allocation,
-        nullptr);
+        &allocation_info);
+    r._mapped = allocation_info.pMappedData;
     return r;
 }
 void DestroyBufferResource(vvb::SysVulkan* sys_vk, BufferResource* r)
 {
     vmaDestroyBuffer(sys_vk->_allocator, r->_buffer, r->_allocation);
 }
+// Without resizable BAR a discrete GPU only exposes a 256 MB window of its memory to the host, so VMA places
+// host written bitstream buffers in system memory and the decoder reads slice data across PCIe.
+bool BitstreamNeedsStaging(SysVulkan* sys_vk)
+{
+    const auto& memory_props = sys_vk->_selected_physical_device_priv.memory_props;
+    if (IsUnifiedMemory(memory_props))
+        return false;
+    const VkMemoryPropertyFlags wanted = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    for (u32 i = 0; i < memory_props.memoryTypeCount; i++) {
+        const auto& type = memory_props.memoryTypes[i];
+        if ((type.propertyFlags & wanted) == wanted && memory_props.memoryHeaps[type.heapIndex].size > (256ull << 20))
+            return false;
+    }
+    return true;
+}
+
+VkSemaphore CreateTimelineSemaphore(SysVulkan* sys_vk)
+{
+    VkSemaphoreTypeCreateInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timeline_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    timeline_info.initialValue = 0;
+    VkSemaphoreCreateInfo semaphore_info = {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &timeline_info;
+    VkSemaphore r = VK_NULL_HANDLE;
+    VK_CHECK(sys_vk->_vfn.CreateSemaphore(sys_vk->_active_dev, &semaphore_info, nullptr, &r));
+    return r;
+}
+
+// Access units are packed into a bitstream ring the decoder reads from. When staging is needed, they are
+// written to a host ring instead and copied in batches to the device local ring on the transfer queue, which
+// signals _uploaded for the decode submissions to wait on. Otherwise the device ring is written directly.
+// Every access unit holds its region until the decode reading it has signalled its retire value on
+// _retire_timeline, a region is only written over after that. An access unit larger than the ring grows it.
+struct BitstreamUploadRing
+{
+    static constexpr u32 NumUploadCmdBufs = 4;
+
+    // [_offset, _end) of the ring, released once _retire_value is reached
+    struct Region
+    {
+        VkDeviceSize _offset;
+        VkDeviceSize _end;
+        u64 _retire_value;
+    };
+
+    bool _staged { false };
+    VkDeviceSize _size { 0 };
+    VkDeviceSize _head { 0 };
+    VkDeviceSize _offset_alignment { 1 };
+    VkDeviceSize _size_alignment { 1 };
+    VkVideoProfileListInfoKHR* _profile_list { nullptr };
+
+    BufferResource _device {};
+    BufferResource _staging {};
+    u8* _write_ptr { nullptr };
+
+    // Oldest first, in ring order
+    std::deque<Region> _regions;
+    VkSemaphore _retire_timeline { VK_NULL_HANDLE };
+    u32 _reuse_waits { 0 };
+    u32 _grows { 0 };
+
+    // Staged mode only
+    std::vector<VkBufferCopy> _pending;
+    VkSemaphore _uploaded { VK_NULL_HANDLE };
+    u64 _upload_value { 0 };
+    VkCommandPool _cmd_pool { VK_NULL_HANDLE };
+    VkCommandBuffer _cmd_bufs[NumUploadCmdBufs] {};
+    u64 _cmd_buf_values[NumUploadCmdBufs] {};
+    u32 _next_cmd_buf { 0 };
+    u64 _bytes_uploaded { 0 };
+    u32 _batches { 0 };
+};
+
+// The device ring, and the staging ring it is uploaded from, of ring->_size bytes.
+static void CreateBitstreamRingBuffers(SysVulkan* sys_vk, BitstreamUploadRing* ring)
+{
+    if (!ring->_staged) {
+        ring->_device = CreateBufferResource(sys_vk, ring->_size, VK_BUFFER_USAGE_VIDEO_DECODE_SRC_BIT_KHR,
+            VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+            VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT, ring->_profile_list);
+        ring->_write_ptr = (u8*)ring->_device._mapped;
+        return;
+    }
+
+    // The device ring is shared between the transfer and decode queues rather than transferred between them.
+    ring->_device = {};
+    ring->_device._create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    ring->_device._create_info.pNext = ring->_profile_list;
+    ring->_device._create_info.size = ring->_size;
+    ring->_device._create_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VIDEO_DECODE_SRC_BIT_KHR;
+    u32 queue_family_indices[2] = {(u32)sys_vk->queue_family_decode_index, (u32)sys_vk->queue_family_tx_index};
+    if (queue_family_indices[0] != queue_family_indices[1]) {
+        ring->_device._create_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        ring->_device._create_info.queueFamilyIndexCount = 2;
+        ring->_device._create_info.pQueueFamilyIndices = queue_family_indices;
+    } else {
+        ring->_device._create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    }
+    ring->_device._alloc_info.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    VK_CHECK(vmaCreateBuffer(sys_vk->_allocator, &ring->_device._create_info, &ring->_device._alloc_info,
+        &ring->_device._buffer, &ring->_device._allocation, nullptr));
+    ring->_device._create_info.pQueueFamilyIndices = nullptr;
+
+    ring->_staging = CreateBufferResource(sys_vk, ring->_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    ring->_write_ptr = (u8*)ring->_staging._mapped;
+}
+
+// retire_timeline is the semaphore the decodes reading the ring signal, see PushAccessUnit.
+BitstreamUploadRing CreateBitstreamUploadRing(SysVulkan* sys_vk, VkDeviceSize size, const VkVideoCapabilitiesKHR* video_caps,
+    VkVideoProfileListInfoKHR* profile_list, VkSemaphore retire_timeline)
+{
+    auto& vk = sys_vk->_vfn;
+    BitstreamUploadRing r = {};
+    r._staged = BitstreamNeedsStaging(sys_vk);
+    r._offset_alignment = std::max<VkDeviceSize>(video_caps->minBitstreamBufferOffsetAlignment, 1);
+    r._size_alignment = std::max<VkDeviceSize>(video_caps->minBitstreamBufferSizeAlignment, 1);
+    r._size = util::AlignUp(size, r._size_alignment);
+    r._profile_list = profile_list;
+    r._retire_timeline = retire_timeline;
+    CreateBitstreamRingBuffers(sys_vk, &r);
+
+    if (!r._staged) {
+        printf("Bitstream ring: %.2f MB, written directly\n", ToMegaByte(r._size));
+        return r;
+    }
+
+    r._uploaded = CreateTimelineSemaphore(sys_vk);
+
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    cmd_pool_info.queueFamilyIndex = sys_vk->queue_family_tx_index;
+    VK_CHECK(vk.CreateCommandPool(sys_vk->_active_dev, &cmd_pool_info, nullptr, &r._cmd_pool));
+    VkCommandBufferAllocateInfo cmd_buf_alloc_info = {};
+    cmd_buf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buf_alloc_info.commandPool = r._cmd_pool;
+    cmd_buf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buf_alloc_info.commandBufferCount = BitstreamUploadRing::NumUploadCmdBufs;
+    VK_CHECK(vk.AllocateCommandBuffers(sys_vk->_active_dev, &cmd_buf_alloc_info, r._cmd_bufs));
+
+    printf("Bitstream ring: %.2f MB, staged through the transfer queue\n", ToMegaByte(r._size));
+    return r;
+}
+
+// Releases the oldest regions of the ring while they overlap [begin, end), waiting for their decodes. Regions
+// are allocated in ring order, so the ones in the way are always at the front.
+static void RetireBitstreamRegions(SysVulkan* sys_vk, BitstreamUploadRing* ring, VkDeviceSize begin, VkDeviceSize end)
+{
+    auto& vk = sys_vk->_vfn;
+    while (!ring->_regions.empty()) {
+        const BitstreamUploadRing::Region& region = ring->_regions.front();
+        if (region._end <= begin || region._offset >= end)
+            break;
+        u64 value = 0;
+        VK_CHECK(vk.GetSemaphoreCounterValue(sys_vk->_active_dev, ring->_retire_timeline, &value));
+        if (value < region._retire_value) {
+            VkSemaphoreWaitInfo wait_info = {};
+            wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+            wait_info.semaphoreCount = 1;
+            wait_info.pSemaphores = &ring->_retire_timeline;
+            wait_info.pValues = &region._retire_value;
+            VK_CHECK(vk.WaitSemaphores(sys_vk->_active_dev, &wait_info, UINT64_MAX));
+            ring->_reuse_waits++;
+        }
+        ring->_regions.pop_front();
+    }
+}
+
+// Replaces the buffers of the ring with ones of at least min_size bytes, once every decode reading the current
+// ones has retired. Uploads are submitted as soon as they are pushed, so none is pending.
+static void GrowBitstreamRing(SysVulkan* sys_vk, BitstreamUploadRing* ring, VkDeviceSize min_size)
+{
+    ASSERT(ring->_pending.empty());
+    RetireBitstreamRegions(sys_vk, ring, 0, ring->_size);
+    ASSERT(ring->_regions.empty());
+    VkDeviceSize size = util::AlignUp(std::max(ring->_size * 2, min_size), ring->_size_alignment);
+    printf("Bitstream ring: growing from %.2f MB to %.2f MB for an access unit of %.2f MB\n",
+        ToMegaByte(ring->_size), ToMegaByte(size), ToMegaByte(min_size));
+    DestroyBufferResource(sys_vk, &ring->_device);
+    if (ring->_staged)
+        DestroyBufferResource(sys_vk, &ring->_staging);
+    ring->_size = size;
+    ring->_head = 0;
+    ring->_grows++;
+    CreateBitstreamRingBuffers(sys_vk, ring);
+}
+
+// Packs one access unit into the ring, returning the offset the decoder should read it from. The decode reading
+// it must signal retire_value on the retire timeline of the ring, the region is written over after that.
+// *range is set to the size rounded up to minBitstreamBufferSizeAlignment, for srcBufferRange.
+VkDeviceSize PushAccessUnit(SysVulkan* sys_vk, BitstreamUploadRing* ring, const void* data, VkDeviceSize size,
+    u64 retire_value, VkDeviceSize* range)
+{
+    VkDeviceSize aligned_size = util::AlignUp(size, ring->_size_alignment);
+    if (aligned_size > ring->_size)
+        GrowBitstreamRing(sys_vk, ring, aligned_size);
+    VkDeviceSize offset = util::AlignUp(ring->_head, ring->_offset_alignment);
+    if (offset + aligned_size > ring->_size) {
+        // The end of the ring is skipped, the access units still there are in the way of the next lap.
+        RetireBitstreamRegions(sys_vk, ring, ring->_head, ring->_size);
+        offset = 0;
+    }
+    RetireBitstreamRegions(sys_vk, ring, offset, offset + aligned_size);
+
+    memcpy(ring->_write_ptr + offset, data, size);
+    memset(ring->_write_ptr + offset + size, 0, aligned_size - size);
+    ring->_head = offset + aligned_size;
+    ring->_regions.push_back(BitstreamUploadRing::Region { offset, offset + aligned_size, retire_value });
+
+    if (ring->_staged) {
+        // Adjacent access units are merged into a single copy region.
+        if (!ring->_pending.empty() && ring->_pending.back().srcOffset + ring->_pending.back().size == offset)
+            ring->_pending.back().size += aligned_size;
+        else
+            ring->_pending.push_back(VkBufferCopy { offset, offset, aligned_size });
+    }
+    *range = aligned_size;
+    return offset;
+}
+
+// Copies every access unit pushed since the last call to the device ring in one transfer submission.
+// Returns the value of _uploaded the decode submissions reading them must wait for, 0 when the ring is
+// written directly, in which case the writes are only flushed.
+u64 SubmitBitstreamUploads(SysVulkan* sys_vk, BitstreamUploadRing* ring)
+{
+    auto& vk = sys_vk->_vfn;
+    if (!ring->_staged) {
+        VK_CHECK(vmaFlushAllocation(sys_vk->_allocator, ring->_device._allocation, 0, VK_WHOLE_SIZE));
+        return 0;
+    }
+    if (ring->_pending.empty())
+        return ring->_upload_value;
+
+    VK_CHECK(vmaFlushAllocation(sys_vk->_allocator, ring->_staging._allocation, 0, VK_WHOLE_SIZE));
+
+    u32 idx = ring->_next_cmd_buf;
+    ring->_next_cmd_buf = (idx + 1) % BitstreamUploadRing::NumUploadCmdBufs;
+    if (ring->_cmd_buf_values[idx] != 0) {
+        VkSemaphoreWaitInfo wait_info = {};
+        wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        wait_info.semaphoreCount = 1;
+        wait_info.pSemaphores = &ring->_uploaded;
+        wait_info.pValues = &ring->_cmd_buf_values[idx];
+        VK_CHECK(vk.WaitSemaphores(sys_vk->_active_dev, &wait_info, UINT64_MAX));
+    }
+
+    VkCommandBuffer cmd_buf = ring->_cmd_bufs[idx];
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    VK_CHECK(vk.BeginCommandBuffer(cmd_buf, &begin_info));
+    vk.CmdCopyBuffer(cmd_buf, ring->_staging._buffer, ring->_device._buffer, (u32)ring->_pending.size(), ring->_pending.data());
+    VK_CHECK(vk.EndCommandBuffer(cmd_buf));
+
+    u64 signal_value = ++ring->_upload_value;
+    VkTimelineSemaphoreSubmitInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &signal_value;
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &cmd_buf;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &ring->_uploaded;
+    VK_CHECK(vk.QueueSubmit(sys_vk->_tx_queue0, 1, &submit_info, VK_NULL_HANDLE));
+    ring->_cmd_buf_values[idx] = signal_value;
+
+    for (const auto& region : ring->_pending)
+        ring->_bytes_uploaded += region.size;
+    ring->_batches++;
+    ring->_pending.clear();
+    return signal_value;
+}
+
+// Barrier making the access units visible to the decoder. In staged mode the semaphore wait already orders the
+// transfer, the barrier only covers the read.
+VkBufferMemoryBarrier2 BitstreamRingBarrier(const BitstreamUploadRing* ring)
+{
+    VkBufferMemoryBarrier2 r = {};
+    r.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+    r.srcStageMask = ring->_staged ? VK_PIPELINE_STAGE_2_NONE_KHR : VK_PIPELINE_STAGE_2_HOST_BIT;
+    r.srcAccessMask = ring->_staged ? VK_ACCESS_2_NONE_KHR : VK_ACCESS_2_HOST_WRITE_BIT;
+    r.dstStageMask = VK_PIPELINE_STAGE_2_VIDEO_DECODE_BIT_KHR;
+    r.dstAccessMask = VK_ACCESS_2_VIDEO_DECODE_READ_BIT_KHR;
+    r.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    r.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    r.buffer = ring->_device._buffer;
+    r.offset = 0;
+    r.size = VK_WHOLE_SIZE;
+    return r;
+}
+
+void DestroyBitstreamUploadRing(SysVulkan* sys_vk, BitstreamUploadRing* ring)
+{
+    auto& vk = sys_vk->_vfn;
+    printf("Bitstream ring: %u waits for a region to retire, grown %u times\n", ring->_reuse_waits, ring->_grows);
+    if (ring->_staged) {
+        printf("Bitstream uploads: %.2f MB in %u batches\n", ToMegaByte(ring->_bytes_uploaded), ring->_batches);
+        VkSemaphoreWaitInfo wait_info = {};
+        wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        wait_info.semaphoreCount = 1;
+        wait_info.pSemaphores = &ring->_uploaded;
+        wait_info.pValues = &ring->_upload_value;
+        VK_CHECK(vk.WaitSemaphores(sys_vk->_active_dev, &wait_info, UINT64_MAX));
+        vk.DestroyCommandPool(sys_vk->_active_dev, ring->_cmd_pool, nullptr);
+        vk.DestroySemaphore(sys_vk->_active_dev, ring->_uploaded, nullptr);
+        DestroyBufferResource(sys_vk, &ring->_staging);
+    }
+    DestroyBufferResource(sys_vk, &ring->_device);
+    *ring = {};
+}
+
+// One thread per device resuming the coroutines that wait on its timeline semaphores. It waits for any of the
+// awaited values at once with vkWaitSemaphores, so no thread is blocked per stream. A timeline semaphore of its
+// own, signalled from the host, wakes it up for new waits and for coroutines posted from other threads.
+// Coroutines run on the thread when resumed and must not block it.
+struct SemaphoreReactor
+{
+    struct Wait
+    {
+        VkSemaphore _semaphore;
+        u64 _value;
+        std::coroutine_handle<> _handle;
+    };
+
+    SysVulkan* _sys_vk { nullptr };
+    std::thread _thread;
+    std::mutex _mutex;
+    std::vector<Wait> _waits; // in the order they were awaited
+    std::vector<std::coroutine_handle<>> _posted;
+    VkSemaphore _wakeup { VK_NULL_HANDLE };
+    u64 _wakeup_value { 0 };
+    bool _stopping { false };
+
+    // Stats
+    u64 _num_waits { 0 };
+    u64 _num_resumed { 0 };
+    u64 _num_blocking_waits { 0 };
+    u32 _max_waits { 0 };
+};
+
+// The return type of coroutines nobody awaits. They start right away and free themselves once they return.
+struct DetachedCoroutine
+{
+    struct promise_type
+    {
+        DetachedCoroutine get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { abort(); }
+    };
+};
+
+static bool SemaphoreReached(SysVulkan* sys_vk, VkSemaphore semaphore, u64 value)
+{
+    u64 current = 0;
+    VK_CHECK(sys_vk->_vfn.GetSemaphoreCounterValue(sys_vk->_active_dev, semaphore, &current));
+    return current >= value;
+}
+
+// Called with the mutex held. The reactor thread looks at its lists again before blocking, it is not signalled.
+static void WakeReactor(SemaphoreReactor* r)
+{
+    if (std::this_thread::get_id() == r->_thread.get_id())
+        return;
+    VkSemaphoreSignalInfo signal_info = {};
+    signal_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO;
+    signal_info.semaphore = r->_wakeup;
+    signal_info.value = ++r->_wakeup_value;
+    VK_CHECK(r->_sys_vk->_vfn.SignalSemaphore(r->_sys_vk->_active_dev, &signal_info));
+}
+
+static void RunReactor(SemaphoreReactor* r)
+{
+    auto& vk = r->_sys_vk->_vfn;
+    std::vector<std::coroutine_handle<>> resume;
+    std::vector<VkSemaphore> semaphores;
+    std::vector<u64> values;
+    for (;;)
+    {
+        std::unique_lock<std::mutex> lock(r->_mutex);
+        resume.swap(r->_posted);
+        // Completed waits are resumed in the order they were awaited
+        size_t kept = 0;
+        for (size_t i = 0; i < r->_waits.size(); i++) {
+            const SemaphoreReactor::Wait wait = r->_waits[i];
+            if (SemaphoreReached(r->_sys_vk, wait._semaphore, wait._value))
+                resume.push_back(wait._handle);
+            else
+                r->_waits[kept++] = wait;
+        }
+        r->_waits.resize(kept);
+
+        if (resume.empty()) {
+            if (r->_stopping && r->_waits.empty())
+                break;
+            semaphores.clear();
+            values.clear();
+            for (const auto& wait : r->_waits) {
+                semaphores.push_back(wait._semaphore);
+                values.push_back(wait._value);
+            }
+            semaphores.push_back(r->_wakeup);
+            values.push_back(r->_wakeup_value + 1);
+            lock.unlock();
+
+            VkSemaphoreWaitInfo wait_info = {};
+            wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+            wait_info.flags = VK_SEMAPHORE_WAIT_ANY_BIT;
+            wait_info.semaphoreCount = (u32)semaphores.size();
+            wait_info.pSemaphores = semaphores.data();
+            wait_info.pValues = values.data();
+            VK_CHECK(vk.WaitSemaphores(r->_sys_vk->_active_dev, &wait_info, UINT64_MAX));
+            r->_num_blocking_waits++;
+            continue;
+        }
+        lock.unlock();
+
+        r->_num_resumed += resume.size();
+        for (std::coroutine_handle<> handle : resume)
+            handle.resume();
+        resume.clear();
+    }
+}
+
+void InitSemaphoreReactor(SysVulkan* sys_vk, SemaphoreReactor* r)
+{
+    r->_sys_vk = sys_vk;
+    r->_wakeup = CreateTimelineSemaphore(sys_vk);
+    r->_thread = std::thread(RunReactor, r);
+}
+
+// Resumes handle on the reactor thread once semaphore reaches value.
+void AwaitSemaphore(SemaphoreReactor* r, VkSemaphore semaphore, u64 value, std::coroutine_handle<> handle)
+{
+    std::lock_guard<std::mutex> lock(r->_mutex);
+    r->_waits.push_back({ semaphore, value, handle });
+    r->_num_waits++;
+    r->_max_waits = std::max(r->_max_waits, (u32)r->_waits.size());
+    WakeReactor(r);
+}
+
+// Resumes handle on the reactor thread, for coroutines waiting on the host rather than on the device.
+void PostToReactor(SemaphoreReactor* r, std::coroutine_handle<> handle)
+{
+    std::lock_guard<std::mutex> lock(r->_mutex);
+    r->_posted.push_back(handle);
+    WakeReactor(r);
+}
+
+// co_await SemaphoreSignal { reactor, semaphore, value } suspends until the timeline semaphore reaches value.
+struct SemaphoreSignal
+{
+    SemaphoreReactor* _reactor;
+    VkSemaphore _semaphore;
+    u64 _value;
+
+    bool await_ready() { return SemaphoreReached(_reactor->_sys_vk, _semaphore, _value); }
+    void await_suspend(std::coroutine_handle<> handle) { AwaitSemaphore(_reactor, _semaphore, _value, handle); }
+    void await_resume() {}
+};
+
+// Returns once every wait has completed and its coroutine has been resumed.
+void DestroySemaphoreReactor(SemaphoreReactor* r)
+{
+    {
+        std::lock_guard<std::mutex> lock(r->_mutex);
+        r->_stopping = true;
+        WakeReactor(r);
+    }
+    r->_thread.join();
+    ASSERT(r->_waits.empty() && r->_posted.empty());
+    printf("Semaphore reactor: %" PRIu64 " waits, up to %u at once, %" PRIu64 " resumes after %" PRIu64 " blocking waits\n",
+        r->_num_waits, r->_max_waits, r->_num_resumed, r->_num_blocking_waits);
+    r->_sys_vk->_vfn.DestroySemaphore(r->_sys_vk->_active_dev, r->_wakeup, nullptr);
+    r->_wakeup = VK_NULL_HANDLE;
+}
+
+// The reactor of the device, started for its first user. Every user awaits its own timeline semaphores on it
+// and gives it back with ReleaseSemaphoreReactor.
+SemaphoreReactor* AcquireSemaphoreReactor(SysVulkan* sys_vk)
+{
+    std::lock_guard<std::mutex> lock(sys_vk->_reactor_mutex);
+    if (sys_vk->_reactor_users++ == 0) {
+        sys_vk->_reactor = new SemaphoreReactor;
+        InitSemaphoreReactor(sys_vk, sys_vk->_reactor);
+    }
+    return sys_vk->_reactor;
+}
+
+// Stops the reactor with its last user, whose waits must have completed.
+void ReleaseSemaphoreReactor(SysVulkan* sys_vk)
+{
+    std::lock_guard<std::mutex> lock(sys_vk->_reactor_mutex);
+    ASSERT(sys_vk->_reactor_users > 0);
+    if (--sys_vk->_reactor_users > 0)
+        return;
+    DestroySemaphoreReactor(sys_vk->_reactor);
+    delete sys_vk->_reactor;
+    sys_vk->_reactor = nullptr;
+}
+
 struct VideoSession
 {
     VkVideoSessionKHR _handle;
     VkVideoSessionParametersKHR _parameters{VK_NULL_HANDLE};
     std::vector<VmaAllocation> _memory_allocations;
-    std::vector<VmaAllocationInfo> _memory_allocation_infos;
     std::vector<VkVideoSessionMemoryRequirementsKHR> _memory_requirements;
 
     VkVideoSessionCreateInfoKHR _create_info;
-    VkExtensionProperties _avc_ext_version{
-        VK_STD_VULKAN_VIDEO_CODEC_H264_DECODE_EXTENSION_NAME,
-        VK_STD_VULKAN_VIDEO_CODEC_H264_DECODE_SPEC_VERSION
-    };
-     const VkExtensionProperties _av1_ext_version = {
-        VK_STD_VULKAN_VIDEO_CODEC_AV1_DECODE_EXTENSION_NAME,
-        VK_MAKE_VERSION(0, 0, 1),
-    };
+    // Copy of the profile the session was created with, only the fields are valid, not the pNext chain.
+    VideoProfile _profile;
+    // Set whenever the session is new or has been repurposed for a new stream, the next coding scope must
+    // begin with VK_VIDEO_CODING_CONTROL_RESET_BIT_KHR.
+    bool _reset_pending { true };
+    u32 _num_reuses { 0 };
+};
+
+// What pStdHeaderVersion of the create info points to. Outside of VideoSession, which is moved around by value.
+static const VkExtensionProperties avc_std_header_version = {
+    VK_STD_VULKAN_VIDEO_CODEC_H264_DECODE_EXTENSION_NAME,
+    VK_STD_VULKAN_VIDEO_CODEC_H264_DECODE_SPEC_VERSION
 };
+// Session memory requirements are typically many small allocations per session. With hundreds of sessions,
+// giving each its own VkDeviceMemory risks hitting maxMemoryAllocationCount, so they are suballocated from
+// per memory type pools instead, and recycled when sessions are destroyed.
+constexpr VkDeviceSize SessionMemoryPoolBlockSize = 64 * MegaByte;
+
+VmaAllocationCreateInfo SessionMemoryAllocCreateInfo(u32 memory_type_bits)
+{
+    VmaAllocationCreateInfo r = {};
+    r.usage = VMA_MEMORY_USAGE_UNKNOWN;
+    r.preferredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    r.memoryTypeBits = memory_type_bits;
+    return r;
+}
+
+VmaPool GetSessionMemoryPool(SysVulkan* sys_vk, u32 memory_type_bits)
+{
+    VmaAllocationCreateInfo alloc_create_info = SessionMemoryAllocCreateInfo(memory_type_bits);
+    u32 memory_type_index = 0;
+    VK_CHECK(vmaFindMemoryTypeIndex(sys_vk->_allocator, memory_type_bits, &alloc_create_info, &memory_type_index));
+
+    std::lock_guard<std::mutex> lock(sys_vk->_session_memory_pools_mutex);
+    VmaPool& pool = sys_vk->_session_memory_pools[memory_type_index];
+    if (pool == VK_NULL_HANDLE) {
+        VmaPoolCreateInfo pool_create_info = {};
+        pool_create_info.memoryTypeIndex = memory_type_index;
+        pool_create_info.blockSize = SessionMemoryPoolBlockSize;
+        VK_CHECK(vmaCreatePool(sys_vk->_allocator, &pool_create_info, &pool));
+        char name[64];
+        snprintf(name, sizeof(name), "video session memory (type %u)", memory_type_index);
+        vmaSetPoolName(sys_vk->_allocator, pool, name);
+    }
+    return pool;
+}
+
+// Occupancy is the fraction of the pool's device memory holding live bindings. Fragmentation is
+// 1 - (largest free range / total free bytes), 0 when all free space is contiguous.
+void PrintSessionMemoryPoolStats(SysVulkan* sys_vk)
+{
+    std::lock_guard<std::mutex> lock(sys_vk->_session_memory_pools_mutex);
+    for (u32 type_idx = 0; type_idx < VK_MAX_MEMORY_TYPES; type_idx++) {
+        VmaPool pool = sys_vk->_session_memory_pools[type_idx];
+        if (pool == VK_NULL_HANDLE)
+            continue;
+        VmaDetailedStatistics stats = {};
+        vmaCalculatePoolStatistics(sys_vk->_allocator, pool, &stats);
+        VkDeviceSize block_bytes = stats.statistics.blockBytes;
+        VkDeviceSize allocation_bytes = stats.statistics.allocationBytes;
+        VkDeviceSize free_bytes = block_bytes - allocation_bytes;
+        float occupancy = block_bytes ? float(allocation_bytes) / float(block_bytes) : 0.0f;
+        float fragmentation = free_bytes ? 1.0f - float(stats.unusedRangeSizeMax) / float(free_bytes) : 0.0f;
+        printf("Session memory pool (type %u): %u blocks, %u allocations, %.2f/%.2f MB used (%.0f%% occupancy, %.0f%% fragmentation)\n",
+            type_idx, stats.statistics.blockCount, stats.statistics.allocationCount,
+            ToMegaByte(allocation_bytes), ToMegaByte(block_bytes), occupancy * 100.0f, fragmentation * 100.0f);
+    }
+}
+
 VideoSession CreateVideoSession(SysVulkan* sys_vk, const vvb::VideoProfile* avc_profile, VkFormat selected_output_picture_format,
     VkFormat selected_reference_picture_format, const VkVideoCapabilitiesKHR* video_caps, u32 max_dpb_slots, u32 max_reference_slots)
 {
@@ -1767,7 +3505,9 @@ VideoSession CreateVideoSession(SysVulkan* sys_vk, const vvb::VideoProfile* avc_
     session._create_info.referencePictureFormat = selected_reference_picture_format;
     session._create_info.maxDpbSlots = max_dpb_slots; // std::min(video_caps.maxDpbSlots, AVC_MAX_DPB_REF_SLOTS + 1u); // From the H.264 spec, + 1 for the setup slot.
     session._create_info.maxActiveReferencePictures = max_reference_slots; // std::min(video_caps.maxActiveReferencePictures, (u32)AVC_MAX_DPB_REF_SLOTS);
-    session._create_info.pStdHeaderVersion = &session._avc_ext_version;
+    session._create_info.pStdHeaderVersion = &avc_std_header_version;
+    session._profile = *avc_profile;
+    session._reset_pending = true;
 
     auto& vk = sys_vk->_vfn;
 
@@ -1776,7 +3516,6 @@ VideoSession CreateVideoSession(SysVulkan* sys_vk, const vvb::VideoProfile* avc_
         nullptr,
         &session._handle));
 
-    session._memory_requirements;
     u32 num_reqs = 0;
     VK_CHECK(vk.GetVideoSessionMemoryRequirementsKHR(sys_vk->_active_dev, session._handle, &num_reqs, nullptr));
     session._memory_requirements.resize(num_reqs);
@@ -1786,19 +3525,18 @@ VideoSession CreateVideoSession(SysVulkan* sys_vk, const vvb::VideoProfile* avc_
     
     session._memory_allocations.resize(session._memory_requirements.size());
     std::vector<VmaAllocationInfo> session_memory_allocation_infos(session._memory_requirements.size());
-    VmaAllocationCreateInfo session_memory_alloc_create_info = {};
+    VkDeviceSize total_session_memory = 0;
     for (u32 i = 0; i < session._memory_requirements.size(); i++) {
         auto& mem_req = session._memory_requirements[i];
         auto& allocation = session._memory_allocations[i];
         auto& allocation_info = session_memory_allocation_infos[i];
-        session_memory_alloc_create_info.memoryTypeBits = mem_req.memoryRequirements.memoryTypeBits;
+        VmaAllocationCreateInfo session_memory_alloc_create_info = SessionMemoryAllocCreateInfo(mem_req.memoryRequirements.memoryTypeBits);
+        // Requirements too large to share a block are left to the default (dedicated) path.
+        if (mem_req.memoryRequirements.size <= SessionMemoryPoolBlockSize / 2)
+            session_memory_alloc_create_info.pool = GetSessionMemoryPool(sys_vk, mem_req.memoryRequirements.memoryTypeBits);
         VK_CHECK(vmaAllocateMemory(sys_vk->_allocator, &mem_req.memoryRequirements, &session_memory_alloc_create_info,
                 &allocation, &allocation_info));
-
-        if (allocation_info.size > 1024*1024)
-            printf("Allocated %lu MB of session memory for index %d\n", allocation_info.size / 1024 / 1024, i);
-        else
-            printf("Allocated %lu KB of session memory for index %d\n", allocation_info.size / 1024, i);
+        total_session_memory += allocation_info.size;
 
         VkBindVideoSessionMemoryInfoKHR bind_session_memory_info = {};
         bind_session_memory_info.sType = VK_STRUCTURE_TYPE_BIND_VIDEO_SESSION_MEMORY_INFO_KHR;
@@ -1810,6 +3548,7 @@ VideoSession CreateVideoSession(SysVulkan* sys_vk, const vvb::VideoProfile* avc_
 
         VK_CHECK(vk.BindVideoSessionMemoryKHR(sys_vk->_active_dev, session._handle, 1, &bind_session_memory_info));
     }
+    printf("Bound %.2f MB of session memory in %u bindings\n", ToMegaByte(total_session_memory), num_reqs);
     return session;
 }
 void DestroyVideoSession(SysVulkan* sys_vk, VideoSession* session)
@@ -1822,104 +3561,307 @@ void DestroyVideoSession(SysVulkan* sys_vk, VideoSession* session)
         vk.DestroyVideoSessionParametersKHR(sys_vk->_active_dev, session->_parameters, nullptr);
 }
 
+void AddSessionParameters(SysVulkan* sys_vk, vvb::VideoSession* session);
+
+// Whether a stream with the given requirements can be decoded with an existing session. maxCodedExtent is set
+// to the device maximum at creation, so in practice any resolution switch within the same profile and formats fits.
+bool VideoSessionFits(const VideoSession& session, const vvb::VideoProfile* profile, VkFormat output_picture_format,
+    VkFormat reference_picture_format, VkExtent2D coded_extent, u32 max_dpb_slots, u32 max_reference_slots)
+{
+    const auto& info = session._create_info;
+    return !VideoProfilesDiffer(session._profile, *profile) &&
+        info.pictureFormat == output_picture_format &&
+        info.referencePictureFormat == reference_picture_format &&
+        coded_extent.width <= info.maxCodedExtent.width &&
+        coded_extent.height <= info.maxCodedExtent.height &&
+        max_dpb_slots <= info.maxDpbSlots &&
+        max_reference_slots <= info.maxActiveReferencePictures;
+}
+
+// Called when a new SPS arrives. If the stream fits the existing session, the session and its bound memory are
+// kept, only the parameters object is replaced and a reset is scheduled for the next coding scope. Otherwise the
+// session is torn down and created again. Decodes recorded against the session signal up to last_submitted_value
+// on timeline, which is waited for before anything is destroyed. Returns true if the session was reused.
+bool ReconfigureVideoSession(SysVulkan* sys_vk, VideoSession* session, const vvb::VideoProfile* profile,
+    VkFormat output_picture_format, VkFormat reference_picture_format, VkExtent2D coded_extent,
+    const VkVideoCapabilitiesKHR* video_caps, u32 max_dpb_slots, u32 max_reference_slots,
+    VkSemaphore timeline, u64 last_submitted_value)
+{
+    auto& vk = sys_vk->_vfn;
+    if (last_submitted_value != 0) {
+        VkSemaphoreWaitInfo wait_info = {};
+        wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        wait_info.semaphoreCount = 1;
+        wait_info.pSemaphores = &timeline;
+        wait_info.pValues = &last_submitted_value;
+        VK_CHECK(vk.WaitSemaphores(sys_vk->_active_dev, &wait_info, UINT64_MAX));
+    }
+    if (VideoSessionFits(*session, profile, output_picture_format, reference_picture_format, coded_extent,
+            max_dpb_slots, max_reference_slots)) {
+        if (session->_parameters != VK_NULL_HANDLE) {
+            vk.DestroyVideoSessionParametersKHR(sys_vk->_active_dev, session->_parameters, nullptr);
+            session->_parameters = VK_NULL_HANDLE;
+        }
+        AddSessionParameters(sys_vk, session);
+        session->_reset_pending = true;
+        session->_num_reuses++;
+        return true;
+    }
+
+    DestroyVideoSession(sys_vk, session);
+    *session = CreateVideoSession(sys_vk, profile, output_picture_format, reference_picture_format, video_caps,
+        max_dpb_slots, max_reference_slots);
+    AddSessionParameters(sys_vk, session);
+    return false;
+}
+
+// The parameter sets of the test stream, until SPS and PPS are parsed. The GPU session gets them through
+// AddSessionParameters, the CPU decoder as Annex B NAL units. Not copyable, the SPS points into it.
+struct AvcParameterSets
+{
+    StdVideoH264SequenceParameterSet _sps;
+    StdVideoH264SequenceParameterSetVui _vui;
+    StdVideoH264HrdParameters _hrd;
+    int32_t _offset_for_ref_frame[1];
+    StdVideoH264PictureParameterSet _pps;
+};
+
+// MaxDpbMbs of Table A-1, by StdVideoH264LevelIdc.
+static const u32 avc_max_dpb_mbs[] = {
+    396, 900, 2376, 2376, 2376, 4752, 8100, 8100, 18000, 20480, 32768, 32768, 34816, 110400, 184320, 184320,
+    696320, 696320, 696320,
+};
+
+// Pictures the stream may decode ahead of the one output next: max_num_reorder_frames of the VUI, or when the
+// SPS has no bitstream restriction, its inferred value (E.2.1): 0 for baseline, which has no B slices, otherwise
+// MaxDpbFrames of the level and picture size (A.3.1).
+u32 AvcReorderDepth(const StdVideoH264SequenceParameterSet& sps)
+{
+    const StdVideoH264SequenceParameterSetVui* vui = sps.pSequenceParameterSetVui;
+    if (sps.flags.vui_parameters_present_flag && vui && vui->flags.bitstream_restriction_flag)
+        return std::min<u32>(vui->max_num_reorder_frames, std::max<u32>(vui->max_dec_frame_buffering, 1));
+    if (sps.profile_idc == STD_VIDEO_H264_PROFILE_IDC_BASELINE)
+        return 0;
+    u32 level = std::min<u32>(sps.level_idc, ARRAY_ELEMS(avc_max_dpb_mbs) - 1);
+    u32 frame_mbs = (sps.pic_width_in_mbs_minus1 + 1) * (2 - sps.flags.frame_mbs_only_flag) *
+        (sps.pic_height_in_map_units_minus1 + 1);
+    return std::min(avc_max_dpb_mbs[level] / frame_mbs, 16u);
+}
+
+// Reads the payload of a NAL unit, skipping emulation prevention bytes. Reads past the end return zeros and
+// set _overrun.
+struct RbspReader
+{
+    const u8* _data;
+    size_t _size;
+    size_t _pos { 0 };
+    u32 _bit { 0 }; // of _data[_pos], from the most significant
+    u32 _zeros { 0 }; // consecutive zero bytes before _pos
+    bool _overrun { false };
+
+    u32 Bits(u32 n)
+    {
+        u32 value = 0;
+        for (u32 i = 0; i < n; i++) {
+            if (_bit == 0 && _zeros >= 2 && _pos < _size && _data[_pos] == 3) {
+                _pos++;
+                _zeros = 0;
+            }
+            if (_pos >= _size) {
+                _overrun = true;
+                value <<= 1;
+                continue;
+            }
+            value = (value << 1) | ((_data[_pos] >> (7 - _bit)) & 1);
+            if (++_bit == 8) {
+                _zeros = _data[_pos] == 0 ? _zeros + 1 : 0;
+                _bit = 0;
+                _pos++;
+            }
+        }
+        return value;
+    }
+
+    bool Flag() { return Bits(1) != 0; }
+
+    u32 UE()
+    {
+        u32 len = 0;
+        while (!Flag() && !_overrun && len < 32)
+            len++;
+        if (len == 32)
+            _overrun = true;
+        return _overrun ? 0 : (1u << len) - 1 + Bits(len);
+    }
+
+    i32 SE()
+    {
+        u32 code = UE();
+        return code & 1 ? i32((code + 1) / 2) : -i32(code / 2);
+    }
+};
+
+// The coded size of an SPS NAL unit (header included), in whole macroblocks: what the DPB is made for. Cropping
+// is not applied. Returns false when the SPS is truncated.
+bool ReadAvcCodedExtent(const u8* nal, size_t size, VkExtent2D* extent)
+{
+    if (size < 4)
+        return false;
+    RbspReader r { nal + 1, size - 1 };
+    u32 profile_idc = r.Bits(8);
+    r.Bits(16); // constraint flags and level_idc
+    r.UE(); // seq_parameter_set_id
+    if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 || profile_idc == 244 || profile_idc == 44 ||
+        profile_idc == 83 || profile_idc == 86 || profile_idc == 118 || profile_idc == 128 || profile_idc == 138 ||
+        profile_idc == 139 || profile_idc == 134 || profile_idc == 135) {
+        u32 chroma_format_idc = r.UE();
+        if (chroma_format_idc == 3)
+            r.Flag(); // separate_colour_plane_flag
+        r.UE(); // bit_depth_luma_minus8
+        r.UE(); // bit_depth_chroma_minus8
+        r.Flag(); // qpprime_y_zero_transform_bypass_flag
+        if (r.Flag()) { // seq_scaling_matrix_present_flag
+            for (u32 i = 0; i < (chroma_format_idc != 3 ? 8u : 12u); i++) {
+                if (!r.Flag())
+                    continue;
+                u32 list_size = i < 6 ? 16 : 64;
+                i32 last_scale = 8;
+                i32 next_scale = 8;
+                for (u32 j = 0; j < list_size && next_scale != 0 && !r._overrun; j++) {
+                    next_scale = (last_scale + r.SE() + 256) % 256;
+                    last_scale = next_scale == 0 ? last_scale : next_scale;
+                }
+            }
+        }
+    }
+    r.UE(); // log2_max_frame_num_minus4
+    u32 pic_order_cnt_type = r.UE();
+    if (pic_order_cnt_type == 0) {
+        r.UE(); // log2_max_pic_order_cnt_lsb_minus4
+    } else if (pic_order_cnt_type == 1) {
+        r.Flag(); // delta_pic_order_always_zero_flag
+        r.SE(); // offset_for_non_ref_pic
+        r.SE(); // offset_for_top_to_bottom_field
+        u32 num_ref_frames_in_pic_order_cnt_cycle = r.UE();
+        for (u32 i = 0; i < num_ref_frames_in_pic_order_cnt_cycle && !r._overrun; i++)
+            r.SE();
+    }
+    r.UE(); // max_num_ref_frames
+    r.Flag(); // gaps_in_frame_num_value_allowed_flag
+    u32 pic_width_in_mbs = r.UE() + 1;
+    u32 pic_height_in_map_units = r.UE() + 1;
+    u32 frame_mbs_only_flag = r.Flag();
+    if (r._overrun || pic_width_in_mbs > 1024 || pic_height_in_map_units > 1024)
+        return false;
+    extent->width = pic_width_in_mbs * 16;
+    extent->height = (2 - frame_mbs_only_flag) * pic_height_in_map_units * 16;
+    return true;
+}
+
+void InitAvcParameterSets(AvcParameterSets* ps)
+{
+    ps->_sps = {};
+    ps->_sps.flags.direct_8x8_inference_flag = 1;
+    ps->_sps.flags.mb_adaptive_frame_field_flag = 0;
+    ps->_sps.flags.frame_mbs_only_flag = 1;
+    ps->_sps.flags.delta_pic_order_always_zero_flag = 0;
+    ps->_sps.flags.separate_colour_plane_flag = 0;
+    ps->_sps.flags.gaps_in_frame_num_value_allowed_flag = 0;
+    ps->_sps.flags.qpprime_y_zero_transform_bypass_flag = 0;
+    ps->_sps.flags.frame_cropping_flag = 0;
+    ps->_sps.flags.seq_scaling_matrix_present_flag = 0;
+    ps->_sps.flags.vui_parameters_present_flag = 1;
+    ps->_sps.profile_idc = STD_VIDEO_H264_PROFILE_IDC_HIGH;
+    ps->_sps.level_idc = STD_VIDEO_H264_LEVEL_IDC_1_1;
+    ps->_sps.chroma_format_idc = STD_VIDEO_H264_CHROMA_FORMAT_IDC_420;
+    ps->_sps.seq_parameter_set_id = 0;
+    ps->_sps.bit_depth_luma_minus8 = 0;
+    ps->_sps.bit_depth_chroma_minus8 = 0;
+    ps->_sps.log2_max_frame_num_minus4 = 0;
+    ps->_sps.pic_order_cnt_type = STD_VIDEO_H264_POC_TYPE_2;
+    ps->_sps.offset_for_non_ref_pic = 0;
+    ps->_sps.offset_for_top_to_bottom_field = 0;
+    ps->_sps.log2_max_pic_order_cnt_lsb_minus4 = 0;
+    ps->_sps.num_ref_frames_in_pic_order_cnt_cycle = 0;
+    ps->_sps.max_num_ref_frames = 3;
+    ps->_sps.pic_width_in_mbs_minus1 = 10;
+    ps->_sps.pic_height_in_map_units_minus1 = 8;
+    ps->_sps.frame_crop_left_offset = 0;
+    ps->_sps.frame_crop_right_offset = 0;
+    ps->_sps.frame_crop_top_offset = 0;
+    ps->_sps.frame_crop_bottom_offset = 0;
+    ps->_offset_for_ref_frame[0] = 0;
+    ps->_sps.pOffsetForRefFrame = ps->_offset_for_ref_frame;
+    ps->_sps.pScalingLists = nullptr;
+    ps->_vui = {};
+    ps->_vui.flags.aspect_ratio_info_present_flag = 0;
+    ps->_vui.flags.overscan_info_present_flag = 0;
+    ps->_vui.flags.overscan_appropriate_flag = 0;
+    ps->_vui.flags.video_signal_type_present_flag = 0;
+    ps->_vui.flags.video_full_range_flag = 0;
+    ps->_vui.flags.color_description_present_flag = 0;
+    ps->_vui.flags.timing_info_present_flag = 1;
+    ps->_vui.flags.fixed_frame_rate_flag = 0;
+    ps->_vui.flags.bitstream_restriction_flag = 1;
+    ps->_vui.flags.nal_hrd_parameters_present_flag = 0;
+    ps->_vui.flags.vcl_hrd_parameters_present_flag = 0;
+    ps->_vui.aspect_ratio_idc = STD_VIDEO_H264_ASPECT_RATIO_IDC_UNSPECIFIED;
+    ps->_vui.sar_width = 1;
+    ps->_vui.sar_height = 1;
+    ps->_vui.video_format = 0;
+    ps->_vui.colour_primaries = 0;
+    ps->_vui.transfer_characteristics = 0;
+    ps->_vui.num_units_in_tick = 1;
+    ps->_vui.time_scale = 60;
+    ps->_vui.max_num_reorder_frames = 0;
+    ps->_vui.max_dec_frame_buffering = 3;
+    ps->_vui.chroma_sample_loc_type_top_field = 0;
+    ps->_vui.chroma_sample_loc_type_bottom_field = 0;
+    ps->_hrd = {};
+    ps->_hrd.cpb_cnt_minus1 = 0;
+    ps->_hrd.bit_rate_scale = 0;
+    ps->_hrd.cpb_size_scale = 0;
+    ps->_hrd.initial_cpb_removal_delay_length_minus1 = 23;
+    ps->_hrd.cpb_removal_delay_length_minus1 = 0;
+    ps->_hrd.dpb_output_delay_length_minus1 = 0;
+    ps->_hrd.time_offset_length = 0;
+    ps->_vui.pHrdParameters = &ps->_hrd;
+    ps->_sps.pSequenceParameterSetVui = &ps->_vui;
+
+    ps->_pps = {};
+    ps->_pps.flags.transform_8x8_mode_flag = 1;
+    ps->_pps.flags.redundant_pic_cnt_present_flag = 0;
+    ps->_pps.flags.constrained_intra_pred_flag = 0;
+    ps->_pps.flags.deblocking_filter_control_present_flag = 1;
+    ps->_pps.flags.weighted_pred_flag = 1;
+    ps->_pps.flags.bottom_field_pic_order_in_frame_present_flag = 0;
+    ps->_pps.flags.entropy_coding_mode_flag = 1;
+    ps->_pps.flags.pic_scaling_matrix_present_flag = 0;
+    ps->_pps.seq_parameter_set_id = 0;
+    ps->_pps.pic_parameter_set_id = 0;
+    ps->_pps.num_ref_idx_l0_default_active_minus1 = 2;
+    ps->_pps.num_ref_idx_l1_default_active_minus1 = 0;
+    ps->_pps.weighted_bipred_idc = STD_VIDEO_H264_WEIGHTED_BIPRED_IDC_DEFAULT;
+    ps->_pps.pic_init_qp_minus26 = -16;
+    ps->_pps.pic_init_qs_minus26 = 0;
+    ps->_pps.chroma_qp_index_offset = -2;
+    ps->_pps.second_chroma_qp_index_offset = -2;
+    ps->_pps.pScalingLists = nullptr;
+}
+
 void AddSessionParameters(SysVulkan* sys_vk, vvb::VideoSession* session)
 {
     auto& vk = sys_vk->_vfn;
-    StdVideoH264SequenceParameterSet avc_std_sps = {};
-    avc_std_sps.flags.direct_8x8_inference_flag = 1;
-    avc_std_sps.flags.mb_adaptive_frame_field_flag = 0;
-    avc_std_sps.flags.frame_mbs_only_flag = 1;
-    avc_std_sps.flags.delta_pic_order_always_zero_flag = 0;
-    avc_std_sps.flags.separate_colour_plane_flag = 0;
-    avc_std_sps.flags.gaps_in_frame_num_value_allowed_flag = 0;
-    avc_std_sps.flags.qpprime_y_zero_transform_bypass_flag = 0;
-    avc_std_sps.flags.frame_cropping_flag = 0;
-    avc_std_sps.flags.seq_scaling_matrix_present_flag = 0;
-    avc_std_sps.flags.vui_parameters_present_flag = 1;
-    avc_std_sps.profile_idc = STD_VIDEO_H264_PROFILE_IDC_HIGH;
-    avc_std_sps.level_idc = STD_VIDEO_H264_LEVEL_IDC_1_1;
-    avc_std_sps.chroma_format_idc = STD_VIDEO_H264_CHROMA_FORMAT_IDC_420;
-    avc_std_sps.seq_parameter_set_id = 0;
-    avc_std_sps.bit_depth_luma_minus8 = 0;
-    avc_std_sps.bit_depth_chroma_minus8 = 0;
-    avc_std_sps.log2_max_frame_num_minus4 = 0;
-    avc_std_sps.pic_order_cnt_type = STD_VIDEO_H264_POC_TYPE_2;
-    avc_std_sps.offset_for_non_ref_pic = 0;
-    avc_std_sps.offset_for_top_to_bottom_field = 0;
-    avc_std_sps.log2_max_pic_order_cnt_lsb_minus4 = 0;
-    avc_std_sps.num_ref_frames_in_pic_order_cnt_cycle = 0;
-    avc_std_sps.max_num_ref_frames = 3;
-    avc_std_sps.pic_width_in_mbs_minus1 = 10;
-    avc_std_sps.pic_height_in_map_units_minus1 = 8;
-    avc_std_sps.frame_crop_left_offset = 0;
-    avc_std_sps.frame_crop_right_offset = 0;
-    avc_std_sps.frame_crop_top_offset = 0;
-    avc_std_sps.frame_crop_bottom_offset = 0;
-    int32_t offset_for_ref_frame[] = {0};
-    avc_std_sps.pOffsetForRefFrame = offset_for_ref_frame;
-    avc_std_sps.pScalingLists = nullptr;
-    StdVideoH264SequenceParameterSetVui avc_std_sps_vui = {};
-    avc_std_sps_vui.flags.aspect_ratio_info_present_flag = 0;
-    avc_std_sps_vui.flags.overscan_info_present_flag = 0;
-    avc_std_sps_vui.flags.overscan_appropriate_flag = 0;
-    avc_std_sps_vui.flags.video_signal_type_present_flag = 0;
-    avc_std_sps_vui.flags.video_full_range_flag = 0;
-    avc_std_sps_vui.flags.color_description_present_flag = 0;
-    avc_std_sps_vui.flags.timing_info_present_flag = 1;
-    avc_std_sps_vui.flags.fixed_frame_rate_flag = 0;
-    avc_std_sps_vui.flags.bitstream_restriction_flag = 1;
-    avc_std_sps_vui.flags.nal_hrd_parameters_present_flag = 0;
-    avc_std_sps_vui.flags.vcl_hrd_parameters_present_flag = 0;
-    avc_std_sps_vui.aspect_ratio_idc = STD_VIDEO_H264_ASPECT_RATIO_IDC_UNSPECIFIED;
-    avc_std_sps_vui.sar_width = 1;
-    avc_std_sps_vui.sar_height = 1;
-    avc_std_sps_vui.video_format = 0;
-    avc_std_sps_vui.colour_primaries = 0;
-    avc_std_sps_vui.transfer_characteristics = 0;
-    avc_std_sps_vui.num_units_in_tick = 1;
-    avc_std_sps_vui.time_scale = 60;
-    avc_std_sps_vui.max_num_reorder_frames = 0;
-    avc_std_sps_vui.max_dec_frame_buffering = 3;
-    avc_std_sps_vui.chroma_sample_loc_type_top_field = 0;
-    avc_std_sps_vui.chroma_sample_loc_type_bottom_field = 0;
-    StdVideoH264HrdParameters avc_std_sps_vui_hrd = {};
-    avc_std_sps_vui_hrd.cpb_cnt_minus1 = 0;
-    avc_std_sps_vui_hrd.bit_rate_scale = 0;
-    avc_std_sps_vui_hrd.cpb_size_scale = 0;
-    avc_std_sps_vui_hrd.initial_cpb_removal_delay_length_minus1 = 23;
-    avc_std_sps_vui_hrd.cpb_removal_delay_length_minus1 = 0;
-    avc_std_sps_vui_hrd.dpb_output_delay_length_minus1 = 0;
-    avc_std_sps_vui_hrd.time_offset_length = 0;
-    avc_std_sps_vui.pHrdParameters = &avc_std_sps_vui_hrd;
-    avc_std_sps.pSequenceParameterSetVui = &avc_std_sps_vui;
-    
-    StdVideoH264PictureParameterSet avc_std_pps = {};
-    avc_std_pps.flags.transform_8x8_mode_flag = 1;
-    avc_std_pps.flags.redundant_pic_cnt_present_flag = 0;
-    avc_std_pps.flags.constrained_intra_pred_flag = 0;
-    avc_std_pps.flags.deblocking_filter_control_present_flag = 1;
-    avc_std_pps.flags.weighted_pred_flag = 1;
-    avc_std_pps.flags.bottom_field_pic_order_in_frame_present_flag = 0;
-    avc_std_pps.flags.entropy_coding_mode_flag = 1;
-    avc_std_pps.flags.pic_scaling_matrix_present_flag = 0;
-    avc_std_pps.seq_parameter_set_id = 0;
-    avc_std_pps.pic_parameter_set_id = 0;
-    avc_std_pps.num_ref_idx_l0_default_active_minus1 = 2;
-    avc_std_pps.num_ref_idx_l1_default_active_minus1 = 0;
-    avc_std_pps.weighted_bipred_idc = STD_VIDEO_H264_WEIGHTED_BIPRED_IDC_DEFAULT;
-    avc_std_pps.pic_init_qp_minus26 = -16;
-    avc_std_pps.pic_init_qs_minus26 = 0;
-    avc_std_pps.chroma_qp_index_offset = -2;
-    avc_std_pps.second_chroma_qp_index_offset = -2;
-    avc_std_pps.pScalingLists = nullptr;
+    AvcParameterSets ps;
+    InitAvcParameterSets(&ps);
 
     VkVideoDecodeH264SessionParametersAddInfoKHR avc_params_add_info = {};
     avc_params_add_info.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_SESSION_PARAMETERS_ADD_INFO_KHR;
     avc_params_add_info.pNext = nullptr;
     avc_params_add_info.stdSPSCount = 1;
-    avc_params_add_info.pStdSPSs = &avc_std_sps;
+    avc_params_add_info.pStdSPSs = &ps._sps;
     avc_params_add_info.stdPPSCount = 1;
-    avc_params_add_info.pStdPPSs = &avc_std_pps;
+    avc_params_add_info.pStdPPSs = &ps._pps;
 
     VkVideoDecodeH264SessionParametersCreateInfoKHR avc_params = {};
     avc_params.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_SESSION_PARAMETERS_CREATE_INFO_KHR;
@@ -1938,4 +3880,1947 @@ void AddSessionParameters(SysVulkan* sys_vk, vvb::VideoSession* session)
     VK_CHECK(vk.CreateVideoSessionParametersKHR(sys_vk->_active_dev, &session_params_create_info,
         nullptr, &session->_parameters));
 }
+
+// Pre-created sessions, with their memory already bound, for the profiles and formats we expect to see. A new
+// stream takes a warm session instead of paying for CreateVideoSessionKHR, the memory requirement queries and
+// one allocation and bind per requirement. A background thread tops each configuration back up to its target,
+// and the sessions of closed streams go back to it. One pool per device, shared by the streams placed on it.
+struct VideoSessionPool
+{
+    struct Config
+    {
+        VideoProfile _profile;
+        VkFormat _output_picture_format;
+        VkFormat _reference_picture_format;
+        u32 _max_dpb_slots;
+        u32 _max_reference_slots;
+        u32 _num_warm;
+        std::vector<VideoSession> _ready;
+    };
+    // Sessions keep a pointer to their config's profile, so configs must not move.
+    std::vector<std::unique_ptr<Config>> _configs;
+    VkVideoCapabilitiesKHR _video_caps;
+
+    std::mutex _mutex;
+    std::condition_variable _refill_cv;
+    std::thread _refill_thread;
+    bool _quit { false };
+
+    u32 _hits { 0 };
+    u32 _misses { 0 };
+};
+
+// Configurations must all be added before StartVideoSessionPool.
+void AddVideoSessionPoolConfig(VideoSessionPool* pool, const vvb::VideoProfile* profile,
+    VkFormat output_picture_format, VkFormat reference_picture_format,
+    u32 max_dpb_slots, u32 max_reference_slots, u32 num_warm)
+{
+    ASSERT(!pool->_refill_thread.joinable());
+    auto config = std::make_unique<VideoSessionPool::Config>();
+    config->_profile = *profile;
+    config->_profile._profile_info.pNext = &config->_profile._decode_codec_profile;
+    config->_output_picture_format = output_picture_format;
+    config->_reference_picture_format = reference_picture_format;
+    config->_max_dpb_slots = max_dpb_slots;
+    config->_max_reference_slots = max_reference_slots;
+    config->_num_warm = num_warm;
+    pool->_configs.push_back(std::move(config));
+}
+
+static void RefillVideoSessionPool(SysVulkan* sys_vk, VideoSessionPool* pool)
+{
+    std::unique_lock<std::mutex> lock(pool->_mutex);
+    while (!pool->_quit) {
+        VideoSessionPool::Config* needy = nullptr;
+        for (auto& config : pool->_configs) {
+            if (config->_ready.size() < config->_num_warm) {
+                needy = config.get();
+                break;
+            }
+        }
+        if (!needy) {
+            pool->_refill_cv.wait(lock);
+            continue;
+        }
+
+        // Session creation is slow, do not hold up acquirers while it happens.
+        lock.unlock();
+        VideoSession session = CreateVideoSession(sys_vk, &needy->_profile, needy->_output_picture_format,
+            needy->_reference_picture_format, &pool->_video_caps, needy->_max_dpb_slots, needy->_max_reference_slots);
+        lock.lock();
+        needy->_ready.push_back(std::move(session));
+    }
+}
+
+// Without a warm target, the pool only keeps the sessions streams give back.
+void StartVideoSessionPool(SysVulkan* sys_vk, VideoSessionPool* pool, const VkVideoCapabilitiesKHR* video_caps)
+{
+    pool->_video_caps = *video_caps;
+    pool->_video_caps.pNext = nullptr;
+    pool->_quit = false;
+    for (auto& config : pool->_configs) {
+        if (config->_num_warm > 0) {
+            pool->_refill_thread = std::thread(RefillVideoSessionPool, sys_vk, pool);
+            break;
+        }
+    }
+}
+
+// Returns a warm session matching the request if one is ready, otherwise creates one on the calling thread.
+// Parameters are stream specific and still have to be added by the caller.
+VideoSession AcquireVideoSession(SysVulkan* sys_vk, VideoSessionPool* pool, const vvb::VideoProfile* profile,
+    VkFormat output_picture_format, VkFormat reference_picture_format, const VkVideoCapabilitiesKHR* video_caps,
+    u32 max_dpb_slots, u32 max_reference_slots)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool->_mutex);
+        for (auto& config : pool->_configs) {
+            if (config->_ready.empty())
+                continue;
+            VideoSession& candidate = config->_ready.back();
+            if (!VideoSessionFits(candidate, profile, output_picture_format, reference_picture_format,
+                    video_caps->maxCodedExtent, max_dpb_slots, max_reference_slots))
+                continue;
+            VideoSession session = std::move(candidate);
+            config->_ready.pop_back();
+            session._reset_pending = true;
+            pool->_hits++;
+            pool->_refill_cv.notify_one();
+            return session;
+        }
+        pool->_misses++;
+    }
+    return CreateVideoSession(sys_vk, profile, output_picture_format, reference_picture_format, video_caps,
+        max_dpb_slots, max_reference_slots);
+}
+
+// Takes back the session of a closed stream, idle, as a warm one for the next stream when a configuration it fits
+// is short of its target. Otherwise it is destroyed.
+void ReleaseVideoSession(SysVulkan* sys_vk, VideoSessionPool* pool, VideoSession* session)
+{
+    auto& vk = sys_vk->_vfn;
+    if (session->_parameters != VK_NULL_HANDLE) {
+        vk.DestroyVideoSessionParametersKHR(sys_vk->_active_dev, session->_parameters, nullptr);
+        session->_parameters = VK_NULL_HANDLE;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool->_mutex);
+        for (auto& config : pool->_configs) {
+            if (config->_ready.size() >= std::max(config->_num_warm, 1u) ||
+                !VideoSessionFits(*session, &config->_profile, config->_output_picture_format,
+                    config->_reference_picture_format, pool->_video_caps.maxCodedExtent, config->_max_dpb_slots,
+                    config->_max_reference_slots))
+                continue;
+            config->_ready.push_back(std::move(*session));
+            *session = {};
+            return;
+        }
+    }
+    DestroyVideoSession(sys_vk, session);
+}
+
+void StopVideoSessionPool(SysVulkan* sys_vk, VideoSessionPool* pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool->_mutex);
+        pool->_quit = true;
+    }
+    pool->_refill_cv.notify_one();
+    if (pool->_refill_thread.joinable())
+        pool->_refill_thread.join();
+
+    printf("Session pool: %u hits, %u misses\n", pool->_hits, pool->_misses);
+    for (auto& config : pool->_configs) {
+        for (auto& session : config->_ready)
+            DestroyVideoSession(sys_vk, &session);
+        config->_ready.clear();
+    }
+}
+
+// The first stream on a device configures the pool for its profile and formats and starts warming num_warm
+// sessions for the streams that follow, without waiting for them. Streams with another configuration miss and
+// create their session themselves.
+VideoSessionPool* AcquireVideoSessionPool(SysVulkan* sys_vk, const vvb::VideoProfile* profile,
+    VkFormat output_picture_format, VkFormat reference_picture_format, const VkVideoCapabilitiesKHR* video_caps,
+    u32 max_dpb_slots, u32 max_reference_slots, u32 num_warm)
+{
+    std::lock_guard<std::mutex> lock(sys_vk->_session_pool_mutex);
+    if (sys_vk->_session_pool_users++ == 0) {
+        sys_vk->_session_pool = new VideoSessionPool;
+        AddVideoSessionPoolConfig(sys_vk->_session_pool, profile, output_picture_format, reference_picture_format,
+            max_dpb_slots, max_reference_slots, num_warm);
+        StartVideoSessionPool(sys_vk, sys_vk->_session_pool, video_caps);
+    }
+    return sys_vk->_session_pool;
+}
+
+void ReleaseVideoSessionPool(SysVulkan* sys_vk)
+{
+    std::lock_guard<std::mutex> lock(sys_vk->_session_pool_mutex);
+    ASSERT(sys_vk->_session_pool_users > 0);
+    if (--sys_vk->_session_pool_users > 0)
+        return;
+    StopVideoSessionPool(sys_vk, sys_vk->_session_pool);
+    delete sys_vk->_session_pool;
+    sys_vk->_session_pool = nullptr;
+}
+
+// Where the two planes of an NV12 picture land in a readback buffer. Both planes share one buffer, the chroma
+// plane following the luma plane. When tight, rows have no padding and the buffer holds exactly the bytes of an
+// NV12 frame, so it can be written out with a single write. Otherwise rows are padded to
+// optimalBufferCopyRowPitchAlignment, which some implementations copy faster.
+struct NV12ReadbackLayout
+{
+    u32 _width; // coded size in luma samples
+    u32 _height;
+    u32 _luma_row_length; // bufferRowLength for plane 0, in R8 texels
+    u32 _chroma_row_length; // bufferRowLength for plane 1, in R8G8 texels
+    VkDeviceSize _luma_offset;
+    VkDeviceSize _chroma_offset;
+    VkDeviceSize _size;
+    bool _tight;
+
+    u32 LumaPitch() const { return _luma_row_length; }
+    u32 ChromaPitch() const { return _chroma_row_length * sizeof(u16); }
+    u32 FrameBytes() const { return _width * _height + _width * (_height / 2); }
+};
+
+// The row pitch alignment is only a performance hint, a tight layout is always valid.
+NV12ReadbackLayout ComputeNV12ReadbackLayout(SysVulkan* sys_vk, u32 width, u32 height, bool prefer_tight = true)
+{
+    const auto& limits = sys_vk->_selected_physical_device_priv.props.properties.limits;
+    auto round_up = [](VkDeviceSize x, VkDeviceSize align) {
+        return align > 1 ? (x + align - 1) / align * align : x;
+    };
+    ASSERT(width % 2 == 0 && height % 2 == 0);
+
+    NV12ReadbackLayout r = {};
+    r._width = width;
+    r._height = height;
+    u32 pitch = prefer_tight ? width : (u32)round_up(width, std::max<VkDeviceSize>(limits.optimalBufferCopyRowPitchAlignment, 2));
+    r._tight = pitch == width;
+    r._luma_row_length = pitch;
+    r._chroma_row_length = pitch / 2;
+    r._luma_offset = 0;
+    // Plane 1 texels are 2 bytes, the offset only needs aligning further when padding is allowed anyway.
+    r._chroma_offset = r._tight ? VkDeviceSize(pitch) * height
+                                : round_up(VkDeviceSize(pitch) * height, std::max<VkDeviceSize>(limits.optimalBufferCopyOffsetAlignment, 2));
+    r._size = r._chroma_offset + VkDeviceSize(pitch) * (height / 2);
+    if (r._tight)
+        ASSERT(r._size == r.FrameBytes());
+    return r;
+}
+
+// Returns the mapping of a linear output image, with layout describing where the planes of slot_idx are in it.
+// The decode must have completed and been followed by TRANSITION_IMAGE_DST_TO_HOST. No transfer is involved.
+const void* MapLinearOutputSlot(SysVulkan* sys_vk, Dpb* dpb, u32 slot_idx, u32 width, u32 height, NV12ReadbackLayout* layout)
+{
+    auto& vk = sys_vk->_vfn;
+    ASSERT(dpb->_dst_linear);
+
+    VkSubresourceLayout planes[2] = {};
+    VkImageAspectFlagBits aspects[2] = { VK_IMAGE_ASPECT_PLANE_0_BIT, VK_IMAGE_ASPECT_PLANE_1_BIT };
+    for (u32 i = 0; i < 2; i++) {
+        VkImageSubresource subresource = {};
+        subresource.aspectMask = aspects[i];
+        subresource.mipLevel = 0;
+        subresource.arrayLayer = dpb->OutputLayer(slot_idx);
+        vk.GetImageSubresourceLayout(sys_vk->_active_dev, dpb->_dst_images, &subresource, &planes[i]);
+    }
+
+    *layout = {};
+    layout->_width = width;
+    layout->_height = height;
+    layout->_luma_row_length = (u32)planes[0].rowPitch;
+    layout->_chroma_row_length = (u32)planes[1].rowPitch / 2;
+    layout->_luma_offset = planes[0].offset;
+    layout->_chroma_offset = planes[1].offset;
+    layout->_size = planes[1].offset + planes[1].size;
+    layout->_tight = planes[0].rowPitch == width && planes[1].rowPitch == width &&
+        planes[1].offset == planes[0].offset + VkDeviceSize(width) * height;
+
+    VmaAllocationInfo allocation_info = {};
+    vmaGetAllocationInfo(sys_vk->_allocator, dpb->_dst_allocation, &allocation_info);
+    VK_CHECK(vmaInvalidateAllocation(sys_vk->_allocator, dpb->_dst_allocation, 0, VK_WHOLE_SIZE));
+    return allocation_info.pMappedData;
+}
+
+// Whether output images of this format can be created with linear tiling for the given profile, at any size up
+// to one output layer per DPB slot. CreateDpbResource checks the actual size again.
+bool LinearOutputSupported(SysVulkan* sys_vk, VkFormat format, VkImageUsageFlags usage,
+    const VkVideoProfileListInfoKHR* profile_list)
+{
+    auto& vk = sys_vk->_vfn;
+    VkPhysicalDeviceImageFormatInfo2 format_info = {};
+    format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+    format_info.pNext = profile_list;
+    format_info.format = format;
+    format_info.type = VK_IMAGE_TYPE_2D;
+    format_info.tiling = VK_IMAGE_TILING_LINEAR;
+    format_info.usage = usage;
+    VkImageFormatProperties2 format_props = {};
+    format_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+    VkResult res = vk.GetPhysicalDeviceImageFormatProperties2(sys_vk->SelectedPhysicalDevice(), &format_info, &format_props);
+    if (res != VK_SUCCESS) {
+        printf("Linear output images are not supported for this profile (%s)\n", vk_ret2str(res));
+        return false;
+    }
+    return format_props.imageFormatProperties.maxArrayLayers >= 1;
+}
+
+// Whether output images of this format can carry VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT for the given profile.
+bool HostImageCopySupported(SysVulkan* sys_vk, VkFormat format, VkImageUsageFlags usage,
+    const VkVideoProfileListInfoKHR* profile_list)
+{
+#ifdef VK_EXT_host_image_copy
+    auto& vk = sys_vk->_vfn;
+    if (!sys_vk->use_host_image_copy)
+        return false;
+
+    VkPhysicalDeviceImageFormatInfo2 format_info = {};
+    format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+    format_info.pNext = profile_list;
+    format_info.format = format;
+    format_info.type = VK_IMAGE_TYPE_2D;
+    format_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    format_info.usage = usage | VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT;
+    VkImageFormatProperties2 format_props = {};
+    format_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+    return vk.GetPhysicalDeviceImageFormatProperties2(sys_vk->SelectedPhysicalDevice(), &format_info, &format_props) == VK_SUCCESS;
+#else
+    return false;
+#endif
+}
+
+// Copies both planes of slot_idx into dst on the calling thread with vkCopyImageToMemoryEXT, no buffer and no
+// transfer queue. The decode must have completed and been followed by TRANSITION_IMAGE_DST_TO_HOST.
+void CopySlotToHostMemory(SysVulkan* sys_vk, Dpb* dpb, u32 slot_idx, const NV12ReadbackLayout& layout, void* dst)
+{
+#ifdef VK_EXT_host_image_copy
+    auto& vk = sys_vk->_vfn;
+    ASSERT(dpb->_host_copy);
+
+    u32 layer = dpb->_coincident_image_resources ? slot_idx : dpb->OutputLayer(slot_idx);
+    VkImageToMemoryCopyEXT regions[2] = {};
+    for (u32 plane = 0; plane < 2; plane++) {
+        VkImageToMemoryCopyEXT& region = regions[plane];
+        region.sType = VK_STRUCTURE_TYPE_IMAGE_TO_MEMORY_COPY_EXT;
+        region.pHostPointer = (u8*)dst + (plane == 0 ? layout._luma_offset : layout._chroma_offset);
+        region.memoryRowLength = plane == 0 ? layout._luma_row_length : layout._chroma_row_length;
+        region.memoryImageHeight = plane == 0 ? layout._height : layout._height / 2;
+        region.imageSubresource.aspectMask = plane == 0 ? VK_IMAGE_ASPECT_PLANE_0_BIT : VK_IMAGE_ASPECT_PLANE_1_BIT;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = layer;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = { 0, 0, 0 };
+        region.imageExtent = { plane == 0 ? layout._width : layout._width / 2, region.memoryImageHeight, 1 };
+    }
+
+    VkCopyImageToMemoryInfoEXT copy_info = {};
+    copy_info.sType = VK_STRUCTURE_TYPE_COPY_IMAGE_TO_MEMORY_INFO_EXT;
+    copy_info.flags = 0;
+    copy_info.srcImage = dpb->_coincident_image_resources ? dpb->_dpb_images : dpb->_dst_images;
+    copy_info.srcImageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    copy_info.regionCount = ARRAY_ELEMS(regions);
+    copy_info.pRegions = regions;
+    VK_CHECK(vk.CopyImageToMemoryEXT(sys_vk->_active_dev, &copy_info));
+#else
+    ASSERT(false);
+#endif
+}
+
+// Persistently mapped host buffers for readback, recycled between frames instead of being re-created.
+struct ReadbackBufferPool
+{
+    std::vector<BufferResource> _free;
+    u32 _created { 0 };
+    u32 _reused { 0 };
+};
+
+BufferResource AcquireReadbackBuffer(SysVulkan* sys_vk, ReadbackBufferPool* pool, VkDeviceSize size)
+{
+    for (auto it = pool->_free.begin(); it != pool->_free.end(); ++it) {
+        if (it->_create_info.size >= size) {
+            BufferResource r = *it;
+            pool->_free.erase(it);
+            pool->_reused++;
+            return r;
+        }
+    }
+    pool->_created++;
+    BufferResource r = CreateBufferResource(sys_vk, size,
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    ASSERT(r._mapped);
+    return r;
+}
+
+void ReleaseReadbackBuffer(ReadbackBufferPool* pool, const BufferResource& buffer)
+{
+    pool->_free.push_back(buffer);
+}
+
+void DestroyReadbackBufferPool(SysVulkan* sys_vk, ReadbackBufferPool* pool)
+{
+    printf("Readback pool: %u buffers created, %u reused\n", pool->_created, pool->_reused);
+    for (auto& buffer : pool->_free)
+        DestroyBufferResource(sys_vk, &buffer);
+    pool->_free.clear();
+}
+
+// Records the copies of both planes of a decoded slot into buffer, according to layout. The slot must already
+// be in VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL.
+void RecordNV12Readback(SysVulkan* sys_vk, VkCommandBuffer cmd_buf, Dpb* dpb, u32 slot_idx,
+    const NV12ReadbackLayout& layout, VkBuffer buffer)
+{
+    dpb->CopySlotToBuffer(sys_vk, cmd_buf, slot_idx, layout._width, layout._luma_row_length, layout._height,
+        VK_IMAGE_ASPECT_PLANE_0_BIT, buffer, layout._luma_offset);
+    dpb->CopySlotToBuffer(sys_vk, cmd_buf, slot_idx, layout._width / 2, layout._chroma_row_length, layout._height / 2,
+        VK_IMAGE_ASPECT_PLANE_1_BIT, buffer, layout._chroma_offset);
+}
+
+// Readback straight into application owned host memory. When VK_EXT_external_memory_host is enabled and the
+// allocation is suitably aligned, it is imported as a VkBuffer and the transfer writes into it directly, no
+// staging copy and no memcpy out of a VMA mapping. Otherwise a staging buffer from the readback pool is used
+// and copied out in FinishHostReadback. Targets are meant to live as long as the host memory, e.g. one per
+// frame cache entry, so the import is only paid once.
+struct HostReadbackTarget
+{
+    void* _host_ptr { nullptr };
+    VkDeviceSize _size { 0 };
+
+    // Imported path
+    VkBuffer _imported_buffer { VK_NULL_HANDLE };
+    VkDeviceMemory _imported_memory { VK_NULL_HANDLE };
+
+    // Fallback path
+    BufferResource _staging {};
+    bool _uses_staging { false };
+
+    VkBuffer Buffer() const { return _uses_staging ? _staging._buffer : _imported_buffer; }
+};
+
+static bool ImportHostPointer(SysVulkan* sys_vk, HostReadbackTarget* r)
+{
+    auto& vk = sys_vk->_vfn;
+    if (!(sys_vk->extensions & FF_VK_EXT_EXTERNAL_HOST_MEMORY))
+        return false;
+
+    const auto& device_priv = sys_vk->_selected_physical_device_priv;
+    VkDeviceSize alignment = device_priv.external_memory_host_props.minImportedHostPointerAlignment;
+    if (alignment == 0 || (uintptr_t)r->_host_ptr % alignment != 0 || r->_size % alignment != 0)
+        return false;
+
+    VkMemoryHostPointerPropertiesEXT host_ptr_props = {};
+    host_ptr_props.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+    if (vk.GetMemoryHostPointerPropertiesEXT(sys_vk->_active_dev, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+            r->_host_ptr, &host_ptr_props) != VK_SUCCESS)
+        return false;
+
+    VkExternalMemoryBufferCreateInfo external_buffer_info = {};
+    external_buffer_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+    external_buffer_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    VkBufferCreateInfo buffer_info = {};
+    buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buffer_info.pNext = &external_buffer_info;
+    buffer_info.size = r->_size;
+    buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    if (vk.CreateBuffer(sys_vk->_active_dev, &buffer_info, nullptr, &r->_imported_buffer) != VK_SUCCESS)
+        return false;
+
+    VkBufferMemoryRequirementsInfo2 mem_req_info = {};
+    mem_req_info.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2;
+    mem_req_info.buffer = r->_imported_buffer;
+    VkMemoryRequirements2 mem_req = {};
+    mem_req.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+    vk.GetBufferMemoryRequirements2(sys_vk->_active_dev, &mem_req_info, &mem_req);
+
+    // The memory is never mapped through Vulkan, the host reads it through _host_ptr, so insist on coherency.
+    u32 type_bits = host_ptr_props.memoryTypeBits & mem_req.memoryRequirements.memoryTypeBits;
+    int memory_type_index = -1;
+    for (u32 i = 0; i < device_priv.memory_props.memoryTypeCount; i++) {
+        if ((type_bits & (1u << i)) &&
+            (device_priv.memory_props.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+            memory_type_index = i;
+            break;
+        }
+    }
+
+    VkImportMemoryHostPointerInfoEXT import_info = {};
+    import_info.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+    import_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    import_info.pHostPointer = r->_host_ptr;
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.pNext = &import_info;
+    alloc_info.allocationSize = r->_size;
+    alloc_info.memoryTypeIndex = memory_type_index;
+    if (memory_type_index == -1 ||
+        vk.AllocateMemory(sys_vk->_active_dev, &alloc_info, nullptr, &r->_imported_memory) != VK_SUCCESS ||
+        vk.BindBufferMemory(sys_vk->_active_dev, r->_imported_buffer, r->_imported_memory, 0) != VK_SUCCESS) {
+        if (r->_imported_memory != VK_NULL_HANDLE)
+            vk.FreeMemory(sys_vk->_active_dev, r->_imported_memory, nullptr);
+        vk.DestroyBuffer(sys_vk->_active_dev, r->_imported_buffer, nullptr);
+        r->_imported_memory = VK_NULL_HANDLE;
+        r->_imported_buffer = VK_NULL_HANDLE;
+        return false;
+    }
+    return true;
+}
+
+HostReadbackTarget CreateHostReadbackTarget(SysVulkan* sys_vk, ReadbackBufferPool* staging_pool, void* host_ptr, VkDeviceSize size)
+{
+    HostReadbackTarget r = {};
+    r._host_ptr = host_ptr;
+    r._size = size;
+    if (!ImportHostPointer(sys_vk, &r)) {
+        r._uses_staging = true;
+        r._staging = AcquireReadbackBuffer(sys_vk, staging_pool, size);
+    }
+    return r;
+}
+
+// Call once the transfer writing to the target has completed.
+void FinishHostReadback(SysVulkan* sys_vk, HostReadbackTarget* target)
+{
+    if (!target->_uses_staging)
+        return;
+    VK_CHECK(vmaInvalidateAllocation(sys_vk->_allocator, target->_staging._allocation, 0, VK_WHOLE_SIZE));
+    memcpy(target->_host_ptr, target->_staging._mapped, target->_size);
+}
+
+void DestroyHostReadbackTarget(SysVulkan* sys_vk, ReadbackBufferPool* staging_pool, HostReadbackTarget* target)
+{
+    auto& vk = sys_vk->_vfn;
+    if (target->_uses_staging) {
+        ReleaseReadbackBuffer(staging_pool, target->_staging);
+    } else {
+        vk.DestroyBuffer(sys_vk->_active_dev, target->_imported_buffer, nullptr);
+        vk.FreeMemory(sys_vk->_active_dev, target->_imported_memory, nullptr);
+    }
+    *target = {};
+}
+
+struct FramePool;
+
+// Decoded (raw) video data, in an output slot of a Dpb handed out by a FramePool. Frames are refcounted and the
+// slot is only decoded into again once the last reference is dropped, so holders use it without a copy.
+class Frame {
+public:
+    // Resources backing this frame.
+    VkImage img; // Images to which memory is bound
+    VkDeviceMemory mem; // Memory backing frame resources
+    ptrdiff_t offset { 0 }; // Optional offset into the mem for img.
+    u32 layer { 0 }; // Array layer of img with the picture
+
+    // The coded dimensions in pixels.
+    int width, height;
+
+    VkFormat format;
+
+    i64 pts; // Time when frame should be shown to the user.
+
+    // Picture number in bitstream order
+    int coded_picture_number;
+
+    // Picture number in display order
+    int display_picture_number;
+
+    // The content is interlaced
+    int interlaced_frame;
+    int top_field_first;
+
+    // The layout of the picture after the last barrier recorded on it, by its decode, its readback or a compute
+    // stage. Completion is tracked by the timeline semaphores of the decoder rather than per frame.
+    VkImageLayout layout;
+
+    // Queue family for the img
+    u32 queue_family { VK_QUEUE_FAMILY_IGNORED };
+
+    // Host view of the picture: the mapped linear output image, or a copy in host memory owned by the pool.
+    void* host { nullptr };
+    NV12ReadbackLayout host_layout {};
+    HostReadbackTarget readback {}; // what the transfer queue copies the picture to, for host copies
+
+    FramePool* pool { nullptr };
+    u32 slot { 0 }; // output slot of the pool's Dpb
+    std::atomic<u32> refs { 0 };
+};
+
+// One frame per output slot of a Dpb, so memory is bounded by the number of slots and nothing is allocated per
+// decoded picture. AcquireFrame waits for a release while every frame is referenced.
+struct FramePool
+{
+    Dpb* _dpb { nullptr };
+    std::vector<std::unique_ptr<Frame>> _frames;
+    std::vector<u32> _free;
+    std::mutex _mutex;
+    std::condition_variable _released;
+    u32 _acquired { 0 };
+    u32 _waited { 0 }; // acquisitions that had to wait for a release
+};
+
+// With host_copies, every frame not read in place from a linear output image gets host memory for an NV12 copy
+// of its picture, imported into Vulkan when possible or else staged through staging_pool.
+void InitFramePool(SysVulkan* sys_vk, FramePool* pool, Dpb* dpb, u32 num_frames, u32 width, u32 height,
+    bool host_copies, ReadbackBufferPool* staging_pool)
+{
+    const VkImageCreateInfo& image_info = dpb->_coincident_image_resources ? dpb->_dpb_image_info : dpb->_dst_image_info;
+    VmaAllocation allocation = dpb->_coincident_image_resources ? dpb->_dpb_allocation : dpb->_dst_allocation;
+    ASSERT(num_frames > 0 && num_frames <= image_info.arrayLayers);
+    VmaAllocationInfo allocation_info = {};
+    vmaGetAllocationInfo(sys_vk->_allocator, allocation, &allocation_info);
+
+    pool->_dpb = dpb;
+    for (u32 i = 0; i < num_frames; i++) {
+        auto frame = std::make_unique<Frame>();
+        frame->img = dpb->_coincident_image_resources ? dpb->_dpb_images : dpb->_dst_images;
+        frame->mem = allocation_info.deviceMemory;
+        frame->offset = allocation_info.offset;
+        // Frame i decodes into DPB slot i and, when the output is distinct, writes output layer i, which the
+        // frame owns until its last reference is released.
+        frame->layer = i;
+        frame->width = width;
+        frame->height = height;
+        frame->format = image_info.format;
+        frame->pts = 0;
+        frame->coded_picture_number = 0;
+        frame->display_picture_number = 0;
+        frame->interlaced_frame = 0;
+        frame->top_field_first = 0;
+        frame->layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        frame->pool = pool;
+        frame->slot = i;
+        if (host_copies && !dpb->_dst_linear) {
+            frame->host_layout = ComputeNV12ReadbackLayout(sys_vk, width, height);
+            size_t alignment = std::max<size_t>(64,
+                sys_vk->_selected_physical_device_priv.external_memory_host_props.minImportedHostPointerAlignment);
+            size_t size = util::AlignUp<size_t>(frame->host_layout._size, alignment);
+            frame->host = util::MallocZerod(size, alignment);
+            if (!frame->host)
+                XERROR(1, "Could not allocate host frame\n");
+            if (!dpb->_host_copy)
+                frame->readback = CreateHostReadbackTarget(sys_vk, staging_pool, frame->host, size);
+        }
+        pool->_frames.push_back(std::move(frame));
+        pool->_free.push_back(num_frames - 1 - i); // slot 0 first
+    }
+    const Frame& first = *pool->_frames[0];
+    if (first.host && !dpb->_host_copy)
+        printf("Readback %s\n", first.readback._uses_staging ? "through staging buffer" : "into imported host memory");
+}
+
+// Returns a free frame with one reference.
+Frame* AcquireFrame(FramePool* pool)
+{
+    std::unique_lock<std::mutex> lock(pool->_mutex);
+    if (pool->_free.empty()) {
+        pool->_waited++;
+        pool->_released.wait(lock, [pool] { return !pool->_free.empty(); });
+    }
+    Frame* frame = pool->_frames[pool->_free.back()].get();
+    pool->_free.pop_back();
+    pool->_acquired++;
+    ASSERT(frame->refs.load(std::memory_order_relaxed) == 0);
+    frame->refs.store(1, std::memory_order_relaxed);
+    return frame;
+}
+
+// Waits until every frame has been released, before the Dpb they are in is replaced.
+void WaitFramePoolIdle(FramePool* pool)
+{
+    std::unique_lock<std::mutex> lock(pool->_mutex);
+    pool->_released.wait(lock, [pool] { return pool->_free.size() == pool->_frames.size(); });
+}
+
+Frame* RefFrame(Frame* frame)
+{
+    frame->refs.fetch_add(1, std::memory_order_relaxed);
+    return frame;
+}
+
+// The last reference gives the slot back to the decoder.
+void UnrefFrame(Frame* frame)
+{
+    if (frame->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    FramePool* pool = frame->pool;
+    {
+        std::lock_guard<std::mutex> lock(pool->_mutex);
+        pool->_free.push_back(frame->slot);
+    }
+    pool->_released.notify_one();
+}
+
+// Every frame must have been released.
+void DestroyFramePool(SysVulkan* sys_vk, FramePool* pool, ReadbackBufferPool* staging_pool)
+{
+    ASSERT(pool->_free.size() == pool->_frames.size());
+    printf("Frame pool: %zu frames, %u acquired, %u waited for a release\n", pool->_frames.size(),
+        pool->_acquired, pool->_waited);
+    for (auto& frame : pool->_frames) {
+        if (frame->readback._host_ptr)
+            DestroyHostReadbackTarget(sys_vk, staging_pool, &frame->readback);
+        if (!pool->_dpb->_dst_linear)
+            free(frame->host);
+    }
+    pool->_frames.clear();
+    pool->_free.clear();
+}
+
+// GPU conversion of decoded NV12 output to packed RGBA8 or planar I420, see shaders/nv12_convert.comp.
+// Conversions are batched: one dispatch covers a run of consecutive output layers.
+static const u32 nv12_convert_spv[] = {
+#include "shaders/nv12_convert.comp.inc"
+};
+
+enum ConvertFormat
+{
+    CONVERT_RGBA8,
+    CONVERT_I420,
+};
+
+enum ColorMatrix
+{
+    COLOR_MATRIX_BT601,
+    COLOR_MATRIX_BT709,
+};
+
+struct ConvertedFrameLayout
+{
+    ConvertFormat _format;
+    u32 _width;
+    u32 _height;
+    VkDeviceSize _luma_pitch; // bytes, the only plane for RGBA8
+    VkDeviceSize _chroma_pitch;
+    VkDeviceSize _u_offset;
+    VkDeviceSize _v_offset;
+    VkDeviceSize _frame_size;
+};
+
+// Frames are tightly packed, except for the rows of I420 planes: the shader writes whole words of 8x2 luma
+// blocks, so rows are padded to a multiple of 8 luma samples. Odd sizes round the chroma planes up.
+ConvertedFrameLayout ComputeConvertedFrameLayout(ConvertFormat format, u32 width, u32 height)
+{
+    ConvertedFrameLayout r = {};
+    r._format = format;
+    r._width = width;
+    r._height = height;
+    if (format == CONVERT_RGBA8) {
+        r._luma_pitch = VkDeviceSize(width) * 4;
+        r._frame_size = r._luma_pitch * height;
+    } else {
+        VkDeviceSize chroma_height = (height + 1) / 2;
+        r._luma_pitch = util::AlignUp(width, 8u);
+        r._chroma_pitch = r._luma_pitch / 2;
+        r._u_offset = r._luma_pitch * height;
+        r._v_offset = r._u_offset + r._chroma_pitch * chroma_height;
+        r._frame_size = r._v_offset + r._chroma_pitch * chroma_height;
+    }
+    return r;
+}
+
+struct ConvertPushConstants
+{
+    float _row_r[4];
+    float _row_g[4];
+    float _row_b[4];
+    u32 _width;
+    u32 _height;
+    u32 _base_layer;
+    u32 _frame_stride_words;
+    u32 _luma_pitch_words;
+    u32 _chroma_pitch_words;
+    u32 _u_offset_words;
+    u32 _v_offset_words;
+};
+
+// Rows of the matrix taking normalized (y, cb, cr, 1) samples to RGB, with the range expansion folded in.
+static void ComputeConversionMatrix(ColorMatrix matrix, bool full_range, float* out_row_r, float* out_row_g, float* out_row_b)
+{
+    float kr = matrix == COLOR_MATRIX_BT709 ? 0.2126f : 0.299f;
+    float kb = matrix == COLOR_MATRIX_BT709 ? 0.0722f : 0.114f;
+    float kg = 1.0f - kr - kb;
+    float y_scale = full_range ? 1.0f : 255.0f / 219.0f;
+    float y_offset = full_range ? 0.0f : -16.0f / 219.0f;
+    float c_scale = full_range ? 1.0f : 255.0f / 224.0f;
+    float c_offset = full_range ? -128.0f / 255.0f : -128.0f / 224.0f;
+
+    float r_cr = 2.0f * (1.0f - kr);
+    float b_cb = 2.0f * (1.0f - kb);
+    float g_cb = -2.0f * kb * (1.0f - kb) / kg;
+    float g_cr = -2.0f * kr * (1.0f - kr) / kg;
+
+    const float row_r[4] = { y_scale, 0.0f, r_cr * c_scale, y_offset + r_cr * c_offset };
+    const float row_g[4] = { y_scale, g_cb * c_scale, g_cr * c_scale, y_offset + (g_cb + g_cr) * c_offset };
+    const float row_b[4] = { y_scale, b_cb * c_scale, 0.0f, y_offset + b_cb * c_offset };
+    memcpy(out_row_r, row_r, sizeof(row_r));
+    memcpy(out_row_g, row_g, sizeof(row_g));
+    memcpy(out_row_b, row_b, sizeof(row_b));
+}
+
+// Plane formats of the multi-planar formats the decoder outputs.
+static bool PlaneViewFormats(VkFormat format, VkFormat* luma, VkFormat* chroma)
+{
+    switch (format) {
+    case VK_FORMAT_G8_B8R8_2PLANE_420_UNORM:
+        *luma = VK_FORMAT_R8_UNORM;
+        *chroma = VK_FORMAT_R8G8_UNORM;
+        return true;
+    case VK_FORMAT_G10X6_B10X6R10X6_2PLANE_420_UNORM_3PACK16:
+        *luma = VK_FORMAT_R10X6_UNORM_PACK16;
+        *chroma = VK_FORMAT_R10X6G10X6_UNORM_2PACK16;
+        return true;
+    case VK_FORMAT_G16_B16R16_2PLANE_420_UNORM:
+        *luma = VK_FORMAT_R16_UNORM;
+        *chroma = VK_FORMAT_R16G16_UNORM;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Whether decoded output of this format can be sampled by the converter, usage is the output image usage
+// without VK_IMAGE_USAGE_SAMPLED_BIT.
+bool FrameConversionSupported(SysVulkan* sys_vk, VkFormat format, VkImageUsageFlags usage,
+    const VkVideoProfileListInfoKHR* profile_list)
+{
+    auto& vk = sys_vk->_vfn;
+    VkFormat luma, chroma;
+    if (sys_vk->_comp_queue0 == VK_NULL_HANDLE || !PlaneViewFormats(format, &luma, &chroma))
+        return false;
+
+    VkPhysicalDeviceImageFormatInfo2 format_info = {};
+    format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+    format_info.pNext = profile_list;
+    format_info.format = format;
+    format_info.type = VK_IMAGE_TYPE_2D;
+    format_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    format_info.usage = usage | VK_IMAGE_USAGE_SAMPLED_BIT;
+    format_info.flags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT;
+    VkImageFormatProperties2 format_props = {};
+    format_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+    return vk.GetPhysicalDeviceImageFormatProperties2(sys_vk->SelectedPhysicalDevice(), &format_info, &format_props) == VK_SUCCESS;
+}
+
+// Sampled R8 / R8G8 (or 16 bit) views over every layer of a Dpb's output image array.
+struct PlaneViews
+{
+    VkImage _source { VK_NULL_HANDLE };
+    VkImageView _luma_view { VK_NULL_HANDLE };
+    VkImageView _chroma_view { VK_NULL_HANDLE };
+};
+
+// (Re)creates the views when the output image array of the Dpb changed, e.g. after a resolution switch.
+static void UpdatePlaneViews(SysVulkan* sys_vk, PlaneViews* views, const Dpb* dpb)
+{
+    auto& vk = sys_vk->_vfn;
+    const VkImageCreateInfo& image_info = dpb->_coincident_image_resources ? dpb->_dpb_image_info : dpb->_dst_image_info;
+    VkImage image = dpb->_coincident_image_resources ? dpb->_dpb_images : dpb->_dst_images;
+    if (views->_source == image)
+        return;
+    ASSERT(image_info.usage & VK_IMAGE_USAGE_SAMPLED_BIT);
+
+    vk.DestroyImageView(sys_vk->_active_dev, views->_luma_view, nullptr);
+    vk.DestroyImageView(sys_vk->_active_dev, views->_chroma_view, nullptr);
+
+    VkFormat plane_formats[2];
+    bool known_format = PlaneViewFormats(image_info.format, &plane_formats[0], &plane_formats[1]);
+    ASSERT(known_format);
+    (void)known_format;
+    VkImageView* plane_views[2] = { &views->_luma_view, &views->_chroma_view };
+    VkImageAspectFlagBits aspects[2] = { VK_IMAGE_ASPECT_PLANE_0_BIT, VK_IMAGE_ASPECT_PLANE_1_BIT };
+    for (u32 i = 0; i < 2; i++) {
+        VkImageViewUsageCreateInfo view_usage_info = {};
+        view_usage_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_USAGE_CREATE_INFO;
+        view_usage_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT;
+        VkImageViewCreateInfo view_info = {};
+        view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        view_info.pNext = &view_usage_info;
+        view_info.image = image;
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+        view_info.format = plane_formats[i];
+        view_info.subresourceRange.aspectMask = aspects[i];
+        view_info.subresourceRange.baseMipLevel = 0;
+        view_info.subresourceRange.levelCount = 1;
+        view_info.subresourceRange.baseArrayLayer = 0;
+        view_info.subresourceRange.layerCount = image_info.arrayLayers;
+        VK_CHECK(vk.CreateImageView(sys_vk->_active_dev, &view_info, nullptr, plane_views[i]));
+    }
+    views->_source = image;
+}
+
+static void DestroyPlaneViews(SysVulkan* sys_vk, PlaneViews* views)
+{
+    auto& vk = sys_vk->_vfn;
+    vk.DestroyImageView(sys_vk->_active_dev, views->_luma_view, nullptr);
+    vk.DestroyImageView(sys_vk->_active_dev, views->_chroma_view, nullptr);
+    *views = {};
+}
+
+// Descriptor set layout shared by the NV12 compute shaders: the two planes through an immutable sampler, then
+// the destination storage buffer.
+static VkDescriptorSetLayout CreatePlaneSamplingSetLayout(SysVulkan* sys_vk, const VkSampler* sampler)
+{
+    auto& vk = sys_vk->_vfn;
+    VkDescriptorSetLayoutBinding bindings[3] = {};
+    for (u32 i = 0; i < 2; i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        bindings[i].pImmutableSamplers = sampler;
+    }
+    bindings[2].binding = 2;
+    bindings[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[2].descriptorCount = 1;
+    bindings[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    VkDescriptorSetLayoutCreateInfo set_layout_info = {};
+    set_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    set_layout_info.bindingCount = ARRAY_ELEMS(bindings);
+    set_layout_info.pBindings = bindings;
+    VkDescriptorSetLayout r = VK_NULL_HANDLE;
+    VK_CHECK(vk.CreateDescriptorSetLayout(sys_vk->_active_dev, &set_layout_info, nullptr, &r));
+    return r;
+}
+
+static void WritePlaneSamplingSet(SysVulkan* sys_vk, VkDescriptorSet set, const PlaneViews& views,
+    VkBuffer dst, VkDeviceSize dst_offset, VkDeviceSize dst_range)
+{
+    auto& vk = sys_vk->_vfn;
+    VkDescriptorImageInfo image_infos[2] = {};
+    image_infos[0].imageView = views._luma_view;
+    image_infos[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    image_infos[1].imageView = views._chroma_view;
+    image_infos[1].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    VkDescriptorBufferInfo buffer_info = { dst, dst_offset, dst_range };
+    VkWriteDescriptorSet writes[3] = {};
+    for (u32 i = 0; i < 3; i++) {
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].dstSet = set;
+        writes[i].dstBinding = i;
+        writes[i].descriptorCount = 1;
+        writes[i].descriptorType = i < 2 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        if (i < 2)
+            writes[i].pImageInfo = &image_infos[i];
+        else
+            writes[i].pBufferInfo = &buffer_info;
+    }
+    vk.UpdateDescriptorSets(sys_vk->_active_dev, ARRAY_ELEMS(writes), writes, 0, nullptr);
+}
+
+// Makes the shader writes to dst visible to the host once the submission has completed.
+static void RecordComputeToHostBarrier(SysVulkan* sys_vk, VkCommandBuffer cmd_buf, VkBuffer dst,
+    VkDeviceSize offset, VkDeviceSize size)
+{
+    auto& vk = sys_vk->_vfn;
+    VkBufferMemoryBarrier2 buffer_barrier = {};
+    buffer_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+    buffer_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    buffer_barrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    buffer_barrier.dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT;
+    buffer_barrier.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
+    buffer_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    buffer_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    buffer_barrier.buffer = dst;
+    buffer_barrier.offset = offset;
+    buffer_barrier.size = size;
+    VkDependencyInfoKHR dep_info = {};
+    dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+    dep_info.bufferMemoryBarrierCount = 1;
+    dep_info.pBufferMemoryBarriers = &buffer_barrier;
+    vk.CmdPipelineBarrier2KHR(cmd_buf, &dep_info);
+}
+
+// Moves the output layers of num_frames slots, starting at first_slot, to the shader read layout.
+static void RecordDecodeToComputeBarriers(SysVulkan* sys_vk, VkCommandBuffer cmd_buf, Dpb* dpb, u32 first_slot, u32 num_frames)
+{
+    auto& vk = sys_vk->_vfn;
+    std::vector<VkImageMemoryBarrier2> image_barriers;
+    for (u32 i = 0; i < num_frames; i++) {
+        auto slot_barriers = dpb->SlotBarriers(TRANSITION_IMAGE_DECODE_TO_COMPUTE, first_slot + i);
+        image_barriers.insert(image_barriers.end(), slot_barriers.begin(), slot_barriers.end());
+    }
+    VkDependencyInfoKHR dep_info = {};
+    dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+    dep_info.imageMemoryBarrierCount = image_barriers.size();
+    dep_info.pImageMemoryBarriers = image_barriers.data();
+    vk.CmdPipelineBarrier2KHR(cmd_buf, &dep_info);
+}
+
+static VkDescriptorPool CreateSingleSetDescriptorPool(SysVulkan* sys_vk, VkDescriptorSetLayout set_layout, VkDescriptorSet* set)
+{
+    auto& vk = sys_vk->_vfn;
+    VkDescriptorPoolSize pool_sizes[2] = {
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 },
+    };
+    VkDescriptorPoolCreateInfo descriptor_pool_info = {};
+    descriptor_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptor_pool_info.maxSets = 1;
+    descriptor_pool_info.poolSizeCount = ARRAY_ELEMS(pool_sizes);
+    descriptor_pool_info.pPoolSizes = pool_sizes;
+    VkDescriptorPool r = VK_NULL_HANDLE;
+    VK_CHECK(vk.CreateDescriptorPool(sys_vk->_active_dev, &descriptor_pool_info, nullptr, &r));
+    VkDescriptorSetAllocateInfo set_alloc_info = {};
+    set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_alloc_info.descriptorPool = r;
+    set_alloc_info.descriptorSetCount = 1;
+    set_alloc_info.pSetLayouts = &set_layout;
+    VK_CHECK(vk.AllocateDescriptorSets(sys_vk->_active_dev, &set_alloc_info, set));
+    return r;
+}
+
+static VkPipelineLayout CreateComputePipelineLayout(SysVulkan* sys_vk, VkDescriptorSetLayout set_layout, u32 push_constants_size)
+{
+    auto& vk = sys_vk->_vfn;
+    VkPushConstantRange push_range = {};
+    push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_range.offset = 0;
+    push_range.size = push_constants_size;
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &set_layout;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_range;
+    VkPipelineLayout r = VK_NULL_HANDLE;
+    VK_CHECK(vk.CreatePipelineLayout(sys_vk->_active_dev, &pipeline_layout_info, nullptr, &r));
+    return r;
+}
+
+static VkSampler CreatePlaneSampler(SysVulkan* sys_vk, VkFilter filter)
+{
+    auto& vk = sys_vk->_vfn;
+    VkSamplerCreateInfo sampler_info = {};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = filter;
+    sampler_info.minFilter = filter;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    VkSampler r = VK_NULL_HANDLE;
+    VK_CHECK(vk.CreateSampler(sys_vk->_active_dev, &sampler_info, nullptr, &r));
+    return r;
+}
+
+struct FrameConverter
+{
+    VkSampler _sampler { VK_NULL_HANDLE };
+    VkDescriptorSetLayout _set_layout { VK_NULL_HANDLE };
+    VkPipelineLayout _pipeline_layout { VK_NULL_HANDLE };
+    VkPipeline _pipelines[2] {}; // indexed by ConvertFormat
+    VkDescriptorPool _descriptor_pool { VK_NULL_HANDLE };
+    VkDescriptorSet _set { VK_NULL_HANDLE };
+    PlaneViews _views;
+
+    ColorMatrix _matrix { COLOR_MATRIX_BT709 };
+    bool _full_range { false };
+};
+
+FrameConverter CreateFrameConverter(SysVulkan* sys_vk, ColorMatrix matrix, bool full_range)
+{
+    auto& vk = sys_vk->_vfn;
+    FrameConverter r = {};
+    r._matrix = matrix;
+    r._full_range = full_range;
+
+    r._sampler = CreatePlaneSampler(sys_vk, VK_FILTER_NEAREST);
+    r._set_layout = CreatePlaneSamplingSetLayout(sys_vk, &r._sampler);
+    r._pipeline_layout = CreateComputePipelineLayout(sys_vk, r._set_layout, sizeof(ConvertPushConstants));
+
+    VkShaderModuleCreateInfo module_info = {};
+    module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    module_info.codeSize = sizeof(nv12_convert_spv);
+    module_info.pCode = nv12_convert_spv;
+    VkShaderModule module = VK_NULL_HANDLE;
+    VK_CHECK(vk.CreateShaderModule(sys_vk->_active_dev, &module_info, nullptr, &module));
+
+    // One pipeline per output format, selected by the OUTPUT_I420 specialization constant.
+    u32 output_i420[2] = { 0, 1 };
+    VkSpecializationMapEntry spec_entry = { 0, 0, sizeof(u32) };
+    VkSpecializationInfo spec_infos[2] = {};
+    VkComputePipelineCreateInfo pipeline_infos[2] = {};
+    for (u32 i = 0; i < 2; i++) {
+        spec_infos[i].mapEntryCount = 1;
+        spec_infos[i].pMapEntries = &spec_entry;
+        spec_infos[i].dataSize = sizeof(u32);
+        spec_infos[i].pData = &output_i420[i];
+        pipeline_infos[i].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipeline_infos[i].stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipeline_infos[i].stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipeline_infos[i].stage.module = module;
+        pipeline_infos[i].stage.pName = "main";
+        pipeline_infos[i].stage.pSpecializationInfo = &spec_infos[i];
+        pipeline_infos[i].layout = r._pipeline_layout;
+    }
+    VK_CHECK(vk.CreateComputePipelines(sys_vk->_active_dev, VK_NULL_HANDLE, 2, pipeline_infos, nullptr, r._pipelines));
+    vk.DestroyShaderModule(sys_vk->_active_dev, module, nullptr);
+
+    r._descriptor_pool = CreateSingleSetDescriptorPool(sys_vk, r._set_layout, &r._set);
+    return r;
+}
+
+// Records the conversion of num_frames pictures, starting at first_slot, into dst at dst_offset, frames
+// following each other at layout._frame_size. The slots must map to consecutive output layers. The decodes
+// must have been waited for (fence or semaphore) before cmd_buf, which belongs to the compute queue, runs.
+// Only one conversion may be in flight per converter, the destination binding is rewritten on every call.
+void RecordFrameConversion(SysVulkan* sys_vk, FrameConverter* conv, VkCommandBuffer cmd_buf, Dpb* dpb,
+    u32 first_slot, u32 num_frames, const ConvertedFrameLayout& layout, VkBuffer dst, VkDeviceSize dst_offset)
+{
+    auto& vk = sys_vk->_vfn;
+    UpdatePlaneViews(sys_vk, &conv->_views, dpb);
+    u32 base_layer = dpb->_coincident_image_resources ? first_slot : dpb->OutputLayer(first_slot);
+    ASSERT(dpb->_coincident_image_resources || dpb->OutputLayer(first_slot + num_frames - 1) == base_layer + num_frames - 1);
+    WritePlaneSamplingSet(sys_vk, conv->_set, conv->_views, dst, dst_offset, layout._frame_size * num_frames);
+    RecordDecodeToComputeBarriers(sys_vk, cmd_buf, dpb, first_slot, num_frames);
+
+    ConvertPushConstants pc = {};
+    ComputeConversionMatrix(conv->_matrix, conv->_full_range, pc._row_r, pc._row_g, pc._row_b);
+    pc._width = layout._width;
+    pc._height = layout._height;
+    pc._base_layer = base_layer;
+    pc._frame_stride_words = layout._frame_size / 4;
+    pc._luma_pitch_words = layout._luma_pitch / 4;
+    pc._chroma_pitch_words = layout._chroma_pitch / 4;
+    pc._u_offset_words = layout._u_offset / 4;
+    pc._v_offset_words = layout._v_offset / 4;
+
+    vk.CmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, conv->_pipelines[layout._format]);
+    vk.CmdBindDescriptorSets(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, conv->_pipeline_layout, 0, 1, &conv->_set, 0, nullptr);
+    vk.CmdPushConstants(cmd_buf, conv->_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+    // RGBA8 is one invocation per pixel, I420 one per 8x2 block, partial ones included, in 8x8 workgroups.
+    u32 block_w = layout._format == CONVERT_I420 ? 8 : 1;
+    u32 block_h = layout._format == CONVERT_I420 ? 2 : 1;
+    u32 groups_x = util::AlignUp(util::AlignUp(layout._width, block_w) / block_w, 8u) / 8;
+    u32 groups_y = util::AlignUp(util::AlignUp(layout._height, block_h) / block_h, 8u) / 8;
+    vk.CmdDispatch(cmd_buf, groups_x, groups_y, num_frames);
+    RecordComputeToHostBarrier(sys_vk, cmd_buf, dst, dst_offset, layout._frame_size * num_frames);
+}
+
+void DestroyFrameConverter(SysVulkan* sys_vk, FrameConverter* conv)
+{
+    auto& vk = sys_vk->_vfn;
+    DestroyPlaneViews(sys_vk, &conv->_views);
+    vk.DestroyDescriptorPool(sys_vk->_active_dev, conv->_descriptor_pool, nullptr);
+    for (VkPipeline pipeline : conv->_pipelines)
+        vk.DestroyPipeline(sys_vk->_active_dev, pipeline, nullptr);
+    vk.DestroyPipelineLayout(sys_vk->_active_dev, conv->_pipeline_layout, nullptr);
+    vk.DestroyDescriptorSetLayout(sys_vk->_active_dev, conv->_set_layout, nullptr);
+    vk.DestroySampler(sys_vk->_active_dev, conv->_sampler, nullptr);
+    *conv = {};
+}
+
+// GPU downscaling of one decoded picture into a few smaller NV12 renditions (thumbnails, previews), see
+// shaders/nv12_downscale.comp. All renditions of a picture come out of a single dispatch.
+static const u32 nv12_downscale_spv[] = {
+#include "shaders/nv12_downscale.comp.inc"
+};
+
+constexpr u32 MaxRenditions = 4;
+
+enum DownscaleFilter
+{
+    DOWNSCALE_FILTER_BILINEAR,
+    DOWNSCALE_FILTER_AREA,
+};
+
+struct Rendition
+{
+    u32 _width;
+    u32 _height;
+    VkDeviceSize _luma_offset;
+    VkDeviceSize _chroma_offset;
+    VkDeviceSize _size;
+};
+
+struct RenditionSet
+{
+    u32 _count;
+    Rendition _renditions[MaxRenditions];
+    VkDeviceSize _total_size;
+};
+
+// One rendition per divisor of the source size, packed back to back as tight NV12. The shader writes 4x2 luma
+// blocks, so widths are rounded down to a multiple of 4 and heights to a multiple of 2.
+RenditionSet ComputeRenditionSet(u32 src_width, u32 src_height, const u32* divisors, u32 count)
+{
+    ASSERT(count <= MaxRenditions);
+    RenditionSet r = {};
+    r._count = count;
+    VkDeviceSize offset = 0;
+    for (u32 i = 0; i < count; i++) {
+        ASSERT(divisors[i] > 0);
+        Rendition& rendition = r._renditions[i];
+        rendition._width = std::max(src_width / divisors[i] & ~3u, 4u);
+        rendition._height = std::max(src_height / divisors[i] & ~1u, 2u);
+        rendition._luma_offset = offset;
+        rendition._chroma_offset = offset + VkDeviceSize(rendition._width) * rendition._height;
+        rendition._size = VkDeviceSize(rendition._width) * rendition._height * 3 / 2;
+        offset += rendition._size;
+    }
+    r._total_size = offset;
+    return r;
+}
+
+struct DownscalePushConstants
+{
+    struct {
+        u32 _width;
+        u32 _height;
+        u32 _luma_offset_words;
+        u32 _chroma_offset_words;
+    } _renditions[MaxRenditions];
+    u32 _src_width;
+    u32 _src_height;
+    u32 _layer;
+    u32 _filter;
+};
+
+struct FrameDownscaler
+{
+    VkSampler _sampler { VK_NULL_HANDLE };
+    VkDescriptorSetLayout _set_layout { VK_NULL_HANDLE };
+    VkPipelineLayout _pipeline_layout { VK_NULL_HANDLE };
+    VkPipeline _pipeline { VK_NULL_HANDLE };
+    VkDescriptorPool _descriptor_pool { VK_NULL_HANDLE };
+    VkDescriptorSet _set { VK_NULL_HANDLE };
+    PlaneViews _views;
+
+    bool _linear_filter { false }; // whether the plane formats support linear filtering
+};
+
+static bool PlaneFormatsSupportLinearFilter(SysVulkan* sys_vk, VkFormat format)
+{
+    auto& vk = sys_vk->_vfn;
+    VkFormat plane_formats[2];
+    if (!PlaneViewFormats(format, &plane_formats[0], &plane_formats[1]))
+        return false;
+    for (VkFormat plane_format : plane_formats) {
+        VkFormatProperties2 format_props = {};
+        format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+        vk.GetPhysicalDeviceFormatProperties2(sys_vk->SelectedPhysicalDevice(), plane_format, &format_props);
+        if (!(format_props.formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT))
+            return false;
+    }
+    return true;
+}
+
+// format is the decoded output format, it decides whether bilinear filtering is available.
+FrameDownscaler CreateFrameDownscaler(SysVulkan* sys_vk, VkFormat format)
+{
+    auto& vk = sys_vk->_vfn;
+    FrameDownscaler r = {};
+    r._linear_filter = PlaneFormatsSupportLinearFilter(sys_vk, format);
+
+    // The area filter uses texelFetch, which ignores the sampler.
+    r._sampler = CreatePlaneSampler(sys_vk, r._linear_filter ? VK_FILTER_LINEAR : VK_FILTER_NEAREST);
+    r._set_layout = CreatePlaneSamplingSetLayout(sys_vk, &r._sampler);
+    r._pipeline_layout = CreateComputePipelineLayout(sys_vk, r._set_layout, sizeof(DownscalePushConstants));
+
+    VkShaderModuleCreateInfo module_info = {};
+    module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    module_info.codeSize = sizeof(nv12_downscale_spv);
+    module_info.pCode = nv12_downscale_spv;
+    VkShaderModule module = VK_NULL_HANDLE;
+    VK_CHECK(vk.CreateShaderModule(sys_vk->_active_dev, &module_info, nullptr, &module));
+
+    VkComputePipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = r._pipeline_layout;
+    VK_CHECK(vk.CreateComputePipelines(sys_vk->_active_dev, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &r._pipeline));
+    vk.DestroyShaderModule(sys_vk->_active_dev, module, nullptr);
+
+    r._descriptor_pool = CreateSingleSetDescriptorPool(sys_vk, r._set_layout, &r._set);
+    return r;
+}
+
+// Records the downscale of the picture in slot_idx (width x height) into every rendition of set, written to
+// dst from offset 0. Same rules as RecordFrameConversion: the decode must have been waited for, and only one
+// downscale may be in flight per downscaler. Bilinear falls back to the area filter when the hardware can't
+// filter the plane formats. Renditions are always 8 bit NV12.
+void RecordDownscale(SysVulkan* sys_vk, FrameDownscaler* ds, VkCommandBuffer cmd_buf, Dpb* dpb, u32 slot_idx,
+    u32 width, u32 height, const RenditionSet& set, DownscaleFilter filter, VkBuffer dst)
+{
+    auto& vk = sys_vk->_vfn;
+    ASSERT(set._count > 0 && set._count <= MaxRenditions);
+    UpdatePlaneViews(sys_vk, &ds->_views, dpb);
+    WritePlaneSamplingSet(sys_vk, ds->_set, ds->_views, dst, 0, set._total_size);
+    RecordDecodeToComputeBarriers(sys_vk, cmd_buf, dpb, slot_idx, 1);
+
+    DownscalePushConstants pc = {};
+    u32 max_width = 0, max_height = 0;
+    for (u32 i = 0; i < set._count; i++) {
+        const Rendition& rendition = set._renditions[i];
+        pc._renditions[i]._width = rendition._width;
+        pc._renditions[i]._height = rendition._height;
+        pc._renditions[i]._luma_offset_words = rendition._luma_offset / 4;
+        pc._renditions[i]._chroma_offset_words = rendition._chroma_offset / 4;
+        max_width = std::max(max_width, rendition._width);
+        max_height = std::max(max_height, rendition._height);
+    }
+    pc._src_width = width;
+    pc._src_height = height;
+    pc._layer = dpb->_coincident_image_resources ? slot_idx : dpb->OutputLayer(slot_idx);
+    pc._filter = filter == DOWNSCALE_FILTER_BILINEAR && ds->_linear_filter ? DOWNSCALE_FILTER_BILINEAR : DOWNSCALE_FILTER_AREA;
+
+    vk.CmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, ds->_pipeline);
+    vk.CmdBindDescriptorSets(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, ds->_pipeline_layout, 0, 1, &ds->_set, 0, nullptr);
+    vk.CmdPushConstants(cmd_buf, ds->_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+    // One invocation per 4x2 block of the largest rendition, in 8x8 workgroups, smaller renditions exit early.
+    u32 groups_x = util::AlignUp(max_width / 4, 8u) / 8;
+    u32 groups_y = util::AlignUp(max_height / 2, 8u) / 8;
+    vk.CmdDispatch(cmd_buf, groups_x, groups_y, set._count);
+    RecordComputeToHostBarrier(sys_vk, cmd_buf, dst, 0, set._total_size);
+}
+
+void DestroyFrameDownscaler(SysVulkan* sys_vk, FrameDownscaler* ds)
+{
+    auto& vk = sys_vk->_vfn;
+    DestroyPlaneViews(sys_vk, &ds->_views);
+    vk.DestroyDescriptorPool(sys_vk->_active_dev, ds->_descriptor_pool, nullptr);
+    vk.DestroyPipeline(sys_vk->_active_dev, ds->_pipeline, nullptr);
+    vk.DestroyPipelineLayout(sys_vk->_active_dev, ds->_pipeline_layout, nullptr);
+    vk.DestroyDescriptorSetLayout(sys_vk->_active_dev, ds->_set_layout, nullptr);
+    vk.DestroySampler(sys_vk->_active_dev, ds->_sampler, nullptr);
+    *ds = {};
+}
+
+// Fused preprocessing for inference, see shaders/nv12_tensor.comp: decoded pictures become letterboxed,
+// normalized NCHW RGB tensors without leaving the GPU. Batches of consecutive output layers take one dispatch.
+static const u32 nv12_tensor_spv[] = {
+#include "shaders/nv12_tensor.comp.inc"
+};
+
+struct TensorLayout
+{
+    u32 _width;
+    u32 _height;
+    bool _fp16;
+    // The source picture scaled to fit, aspect ratio preserved, centered.
+    u32 _content_x;
+    u32 _content_y;
+    u32 _content_width;
+    u32 _content_height;
+    VkDeviceSize _frame_size; // bytes, 3 planes of _width x _height elements
+};
+
+TensorLayout ComputeTensorLayout(u32 src_width, u32 src_height, u32 width, u32 height, bool fp16)
+{
+    ASSERT(width % 2 == 0 && src_width > 0 && src_height > 0);
+    TensorLayout r = {};
+    r._width = width;
+    r._height = height;
+    r._fp16 = fp16;
+    if (u64(width) * src_height <= u64(height) * src_width) {
+        r._content_width = width;
+        r._content_height = std::max<u32>(u64(src_height) * width / src_width, 1);
+    } else {
+        r._content_width = std::max<u32>(u64(src_width) * height / src_height, 1);
+        r._content_height = height;
+    }
+    r._content_x = (width - r._content_width) / 2;
+    r._content_y = (height - r._content_height) / 2;
+    r._frame_size = VkDeviceSize(width) * height * 3 * (fp16 ? 2 : 4);
+    return r;
+}
+
+// Per-channel statistics in the [0, 1] RGB domain, as most detectors specify them, e.g. the ImageNet
+// mean { 0.485, 0.456, 0.406 } and std { 0.229, 0.224, 0.225 }. The defaults only rescale to [0, 1].
+struct TensorNormalization
+{
+    float _mean[3] { 0.0f, 0.0f, 0.0f };
+    float _std[3] { 1.0f, 1.0f, 1.0f };
+    float _pad[3] { 114.0f / 255.0f, 114.0f / 255.0f, 114.0f / 255.0f }; // letterbox colour, before normalization
+};
+
+struct TensorPushConstants
+{
+    float _row_r[4];
+    float _row_g[4];
+    float _row_b[4];
+    float _scale[4];
+    float _bias[4];
+    float _pad[4];
+    u32 _width;
+    u32 _height;
+    u32 _content_x;
+    u32 _content_y;
+    u32 _content_width;
+    u32 _content_height;
+    u32 _base_layer;
+    u32 _frame_stride_words;
+};
+static_assert(sizeof(TensorPushConstants) <= 128, "exceeds the guaranteed maxPushConstantsSize");
+
+struct FrameTensorizer
+{
+    VkSampler _sampler { VK_NULL_HANDLE };
+    VkDescriptorSetLayout _set_layout { VK_NULL_HANDLE };
+    VkPipelineLayout _pipeline_layout { VK_NULL_HANDLE };
+    VkPipeline _pipelines[2] {}; // float32, float16
+    VkDescriptorPool _descriptor_pool { VK_NULL_HANDLE };
+    VkDescriptorSet _set { VK_NULL_HANDLE };
+    PlaneViews _views;
+
+    ColorMatrix _matrix { COLOR_MATRIX_BT709 };
+    bool _full_range { false };
+    TensorNormalization _norm;
+};
+
+// format is the decoded output format, pictures are resized bilinearly when its planes can be filtered,
+// nearest otherwise.
+FrameTensorizer CreateFrameTensorizer(SysVulkan* sys_vk, VkFormat format, ColorMatrix matrix, bool full_range,
+    const TensorNormalization& norm)
+{
+    auto& vk = sys_vk->_vfn;
+    FrameTensorizer r = {};
+    r._matrix = matrix;
+    r._full_range = full_range;
+    r._norm = norm;
+
+    r._sampler = CreatePlaneSampler(sys_vk, PlaneFormatsSupportLinearFilter(sys_vk, format) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST);
+    r._set_layout = CreatePlaneSamplingSetLayout(sys_vk, &r._sampler);
+    r._pipeline_layout = CreateComputePipelineLayout(sys_vk, r._set_layout, sizeof(TensorPushConstants));
+
+    VkShaderModuleCreateInfo module_info = {};
+    module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    module_info.codeSize = sizeof(nv12_tensor_spv);
+    module_info.pCode = nv12_tensor_spv;
+    VkShaderModule module = VK_NULL_HANDLE;
+    VK_CHECK(vk.CreateShaderModule(sys_vk->_active_dev, &module_info, nullptr, &module));
+
+    // One pipeline per element type, selected by the OUTPUT_F16 specialization constant.
+    u32 output_f16[2] = { 0, 1 };
+    VkSpecializationMapEntry spec_entry = { 0, 0, sizeof(u32) };
+    VkSpecializationInfo spec_infos[2] = {};
+    VkComputePipelineCreateInfo pipeline_infos[2] = {};
+    for (u32 i = 0; i < 2; i++) {
+        spec_infos[i].mapEntryCount = 1;
+        spec_infos[i].pMapEntries = &spec_entry;
+        spec_infos[i].dataSize = sizeof(u32);
+        spec_infos[i].pData = &output_f16[i];
+        pipeline_infos[i].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipeline_infos[i].stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipeline_infos[i].stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipeline_infos[i].stage.module = module;
+        pipeline_infos[i].stage.pName = "main";
+        pipeline_infos[i].stage.pSpecializationInfo = &spec_infos[i];
+        pipeline_infos[i].layout = r._pipeline_layout;
+    }
+    VK_CHECK(vk.CreateComputePipelines(sys_vk->_active_dev, VK_NULL_HANDLE, 2, pipeline_infos, nullptr, r._pipelines));
+    vk.DestroyShaderModule(sys_vk->_active_dev, module, nullptr);
+
+    r._descriptor_pool = CreateSingleSetDescriptorPool(sys_vk, r._set_layout, &r._set);
+    return r;
+}
+
+// Records the preprocessing of num_frames pictures (src_width x src_height), starting at first_slot, into a
+// batch of tensors at dst_offset, the layout of RecordFrameConversion with layout._frame_size as the stride.
+// Same synchronization rules too.
+void RecordFrameTensors(SysVulkan* sys_vk, FrameTensorizer* tz, VkCommandBuffer cmd_buf, Dpb* dpb, u32 first_slot,
+    u32 num_frames, const TensorLayout& layout, VkBuffer dst, VkDeviceSize dst_offset)
+{
+    auto& vk = sys_vk->_vfn;
+    UpdatePlaneViews(sys_vk, &tz->_views, dpb);
+    u32 base_layer = dpb->_coincident_image_resources ? first_slot : dpb->OutputLayer(first_slot);
+    ASSERT(dpb->_coincident_image_resources || dpb->OutputLayer(first_slot + num_frames - 1) == base_layer + num_frames - 1);
+    WritePlaneSamplingSet(sys_vk, tz->_set, tz->_views, dst, dst_offset, layout._frame_size * num_frames);
+    RecordDecodeToComputeBarriers(sys_vk, cmd_buf, dpb, first_slot, num_frames);
+
+    TensorPushConstants pc = {};
+    ComputeConversionMatrix(tz->_matrix, tz->_full_range, pc._row_r, pc._row_g, pc._row_b);
+    for (u32 c = 0; c < 3; c++) {
+        pc._scale[c] = 1.0f / tz->_norm._std[c];
+        pc._bias[c] = -tz->_norm._mean[c] / tz->_norm._std[c];
+        pc._pad[c] = (tz->_norm._pad[c] - tz->_norm._mean[c]) / tz->_norm._std[c];
+    }
+    pc._width = layout._width;
+    pc._height = layout._height;
+    pc._content_x = layout._content_x;
+    pc._content_y = layout._content_y;
+    pc._content_width = layout._content_width;
+    pc._content_height = layout._content_height;
+    pc._base_layer = base_layer;
+    pc._frame_stride_words = layout._frame_size / 4;
+
+    vk.CmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, tz->_pipelines[layout._fp16 ? 1 : 0]);
+    vk.CmdBindDescriptorSets(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, tz->_pipeline_layout, 0, 1, &tz->_set, 0, nullptr);
+    vk.CmdPushConstants(cmd_buf, tz->_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+    // One invocation per pair of pixels, in 8x8 workgroups.
+    u32 groups_x = util::AlignUp(layout._width / 2, 8u) / 8;
+    u32 groups_y = util::AlignUp(layout._height, 8u) / 8;
+    vk.CmdDispatch(cmd_buf, groups_x, groups_y, num_frames);
+    RecordComputeToHostBarrier(sys_vk, cmd_buf, dst, dst_offset, layout._frame_size * num_frames);
+}
+
+void DestroyFrameTensorizer(SysVulkan* sys_vk, FrameTensorizer* tz)
+{
+    auto& vk = sys_vk->_vfn;
+    DestroyPlaneViews(sys_vk, &tz->_views);
+    vk.DestroyDescriptorPool(sys_vk->_active_dev, tz->_descriptor_pool, nullptr);
+    for (VkPipeline pipeline : tz->_pipelines)
+        vk.DestroyPipeline(sys_vk->_active_dev, pipeline, nullptr);
+    vk.DestroyPipelineLayout(sys_vk->_active_dev, tz->_pipeline_layout, nullptr);
+    vk.DestroyDescriptorSetLayout(sys_vk->_active_dev, tz->_set_layout, nullptr);
+    vk.DestroySampler(sys_vk->_active_dev, tz->_sampler, nullptr);
+    *tz = {};
+}
+
+// Video wall compositing, see shaders/nv12_mosaic.comp: the current picture of up to MaxMosaicTiles decoders
+// is scaled into its tile of one NV12 canvas in a single dispatch, and only the canvas is read back.
+static const u32 nv12_mosaic_spv[] = {
+#include "shaders/nv12_mosaic.comp.inc"
+};
+
+constexpr u32 MaxMosaicTiles = 64;
+
+struct MosaicLayout
+{
+    u32 _columns;
+    u32 _rows;
+    u32 _tile_width;
+    u32 _tile_height;
+    u32 _width; // canvas
+    u32 _height;
+    VkDeviceSize _chroma_offset;
+    VkDeviceSize _size; // tight NV12
+};
+
+// As square a grid as fits num_tiles. Tiles are rounded down to a multiple of 4x2, the shader's block size.
+MosaicLayout ComputeMosaicLayout(u32 num_tiles, u32 tile_width, u32 tile_height)
+{
+    ASSERT(num_tiles > 0 && num_tiles <= MaxMosaicTiles);
+    MosaicLayout r = {};
+    r._columns = 1;
+    while (r._columns * r._columns < num_tiles)
+        r._columns++;
+    r._rows = (num_tiles + r._columns - 1) / r._columns;
+    r._tile_width = std::max(tile_width & ~3u, 4u);
+    r._tile_height = std::max(tile_height & ~1u, 2u);
+    r._width = r._columns * r._tile_width;
+    r._height = r._rows * r._tile_height;
+    r._chroma_offset = VkDeviceSize(r._width) * r._height;
+    r._size = r._chroma_offset + VkDeviceSize(r._width) * (r._height / 2);
+    return r;
+}
+
+// The picture in _slot of _dpb, or a black tile when _dpb is null. _layout is the one of its Frame: pictures
+// already read back for mosaics are sampled in it, pictures straight from their decode are transitioned first.
+struct MosaicSource
+{
+    Dpb* _dpb;
+    u32 _slot;
+    VkImageLayout _layout;
+};
+
+struct MosaicPushConstants
+{
+    u32 _tile_width;
+    u32 _tile_height;
+    u32 _columns;
+    u32 _pitch_words;
+    u32 _chroma_offset_words;
+};
+
+struct MosaicCompositor
+{
+    VkSampler _sampler { VK_NULL_HANDLE };
+    VkDescriptorSetLayout _set_layout { VK_NULL_HANDLE };
+    VkPipelineLayout _pipeline_layout { VK_NULL_HANDLE };
+    VkPipeline _pipeline { VK_NULL_HANDLE };
+    VkDescriptorPool _descriptor_pool { VK_NULL_HANDLE };
+    VkDescriptorSet _set { VK_NULL_HANDLE };
+    u32 _max_tiles { 0 }; // sources per composite, the elements of the sampler arrays, see MosaicTileLimit
+    PlaneViews _views[MaxMosaicTiles];
+    BufferResource _tiles {}; // u32[4] per tile, written by the host on every composite
+};
+
+// The shader indexes an array of samplers with the tile index.
+bool MosaicSupported(SysVulkan* sys_vk)
+{
+    return sys_vk->_comp_queue0 != VK_NULL_HANDLE && sys_vk->use_sampler_array_indexing;
+}
+
+// The tiles a compositor can sample at once. Each tile takes a combined image sampler per plane, which counts
+// against both the sampler and the sampled image limits, per stage and per set, and the storage buffers take
+// two more resources. Devices only have to allow 16 of each per stage, 8 tiles.
+u32 MosaicTileLimit(SysVulkan* sys_vk)
+{
+    const VkPhysicalDeviceLimits& limits = sys_vk->_selected_physical_device_priv.props.properties.limits;
+    u32 descriptors = std::min({ limits.maxPerStageDescriptorSamplers, limits.maxPerStageDescriptorSampledImages,
+        limits.maxDescriptorSetSamplers, limits.maxDescriptorSetSampledImages, limits.maxPerStageResources - 2 });
+    return std::min(MaxMosaicTiles, descriptors / 2);
+}
+
+// format is the output format of the decoders, which must all share it. The sampler arrays have max_tiles
+// elements, at most MosaicTileLimit.
+MosaicCompositor CreateMosaicCompositor(SysVulkan* sys_vk, VkFormat format, u32 max_tiles)
+{
+    auto& vk = sys_vk->_vfn;
+    ASSERT(MosaicSupported(sys_vk) && max_tiles > 0 && max_tiles <= MosaicTileLimit(sys_vk));
+    MosaicCompositor r = {};
+    r._max_tiles = max_tiles;
+    r._sampler = CreatePlaneSampler(sys_vk, PlaneFormatsSupportLinearFilter(sys_vk, format) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST);
+
+    VkSampler samplers[MaxMosaicTiles];
+    for (VkSampler& sampler : samplers)
+        sampler = r._sampler;
+    VkDescriptorSetLayoutBinding bindings[4] = {};
+    for (u32 i = 0; i < 2; i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        bindings[i].descriptorCount = max_tiles;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        bindings[i].pImmutableSamplers = samplers;
+    }
+    for (u32 i = 2; i < 4; i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    VkDescriptorSetLayoutCreateInfo set_layout_info = {};
+    set_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    set_layout_info.bindingCount = ARRAY_ELEMS(bindings);
+    set_layout_info.pBindings = bindings;
+    VK_CHECK(vk.CreateDescriptorSetLayout(sys_vk->_active_dev, &set_layout_info, nullptr, &r._set_layout));
+    r._pipeline_layout = CreateComputePipelineLayout(sys_vk, r._set_layout, sizeof(MosaicPushConstants));
+
+    VkShaderModuleCreateInfo module_info = {};
+    module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    module_info.codeSize = sizeof(nv12_mosaic_spv);
+    module_info.pCode = nv12_mosaic_spv;
+    VkShaderModule module = VK_NULL_HANDLE;
+    VK_CHECK(vk.CreateShaderModule(sys_vk->_active_dev, &module_info, nullptr, &module));
+    // The MAX_TILES specialization constant sizes the sampler arrays like the bindings.
+    VkSpecializationMapEntry spec_entry = { 0, 0, sizeof(u32) };
+    VkSpecializationInfo spec_info = {};
+    spec_info.mapEntryCount = 1;
+    spec_info.pMapEntries = &spec_entry;
+    spec_info.dataSize = sizeof(u32);
+    spec_info.pData = &max_tiles;
+    VkComputePipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.stage.pSpecializationInfo = &spec_info;
+    pipeline_info.layout = r._pipeline_layout;
+    VK_CHECK(vk.CreateComputePipelines(sys_vk->_active_dev, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &r._pipeline));
+    vk.DestroyShaderModule(sys_vk->_active_dev, module, nullptr);
+
+    VkDescriptorPoolSize pool_sizes[2] = {
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 * max_tiles },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 },
+    };
+    VkDescriptorPoolCreateInfo descriptor_pool_info = {};
+    descriptor_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptor_pool_info.maxSets = 1;
+    descriptor_pool_info.poolSizeCount = ARRAY_ELEMS(pool_sizes);
+    descriptor_pool_info.pPoolSizes = pool_sizes;
+    VK_CHECK(vk.CreateDescriptorPool(sys_vk->_active_dev, &descriptor_pool_info, nullptr, &r._descriptor_pool));
+    VkDescriptorSetAllocateInfo set_alloc_info = {};
+    set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_alloc_info.descriptorPool = r._descriptor_pool;
+    set_alloc_info.descriptorSetCount = 1;
+    set_alloc_info.pSetLayouts = &r._set_layout;
+    VK_CHECK(vk.AllocateDescriptorSets(sys_vk->_active_dev, &set_alloc_info, &r._set));
+
+    r._tiles = CreateBufferResource(sys_vk, sizeof(u32) * 4 * MaxMosaicTiles,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    ASSERT(r._tiles._mapped);
+    return r;
+}
+
+// Records the composite of num_sources pictures, in grid order, into dst (layout._size bytes from offset 0).
+// num_sources may be less than the grid, the remaining cells are black. Every source's decode, and readback,
+// must have been waited for, and only one composite may be in flight per compositor: the tile table is host
+// memory. Sources that were not sampleable yet are left in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+void RecordMosaic(SysVulkan* sys_vk, MosaicCompositor* mc, VkCommandBuffer cmd_buf, const MosaicSource* sources,
+    u32 num_sources, const MosaicLayout& layout, VkBuffer dst)
+{
+    auto& vk = sys_vk->_vfn;
+    u32 num_tiles = layout._columns * layout._rows;
+    // Cells past the sources are black and never index the sampler arrays
+    ASSERT(num_sources <= num_tiles && num_sources <= mc->_max_tiles && num_tiles <= MaxMosaicTiles);
+
+    // Every array element has to be valid, unused ones repeat the first source.
+    u32 (*tiles)[4] = (u32 (*)[4])mc->_tiles._mapped;
+    VkDescriptorImageInfo image_infos[2][MaxMosaicTiles] = {};
+    auto sampleable = [](VkImageLayout l) {
+        return l == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL || l == VK_IMAGE_LAYOUT_GENERAL;
+    };
+    std::vector<VkImageMemoryBarrier2> image_barriers;
+    std::vector<std::pair<const Dpb*, u32>> transitioned; // a picture shown in several tiles is transitioned once
+    int first_source = -1;
+    for (u32 i = 0; i < num_tiles; i++) {
+        const MosaicSource* source = i < num_sources && sources[i]._dpb ? &sources[i] : nullptr;
+        tiles[i][0] = 0;
+        tiles[i][1] = source != nullptr;
+        if (!source)
+            continue;
+        Dpb* dpb = source->_dpb;
+        UpdatePlaneViews(sys_vk, &mc->_views[i], dpb);
+        tiles[i][0] = dpb->_coincident_image_resources ? source->_slot : dpb->OutputLayer(source->_slot);
+        VkImageLayout sampled_layout = sampleable(source->_layout) ? source->_layout : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        image_infos[0][i] = { VK_NULL_HANDLE, mc->_views[i]._luma_view, sampled_layout };
+        image_infos[1][i] = { VK_NULL_HANDLE, mc->_views[i]._chroma_view, sampled_layout };
+        if (first_source == -1)
+            first_source = i;
+        if (sampleable(source->_layout))
+            continue;
+        ASSERT(source->_layout == dpb->DecodedOutputLayout());
+        std::pair<const Dpb*, u32> picture = { dpb, source->_slot };
+        if (std::find(transitioned.begin(), transitioned.end(), picture) != transitioned.end())
+            continue;
+        transitioned.push_back(picture);
+        auto slot_barriers = dpb->SlotBarriers(TRANSITION_IMAGE_DECODE_TO_COMPUTE, source->_slot);
+        image_barriers.insert(image_barriers.end(), slot_barriers.begin(), slot_barriers.end());
+    }
+    ASSERT(first_source != -1);
+    for (u32 i = 0; i < mc->_max_tiles; i++) {
+        if (image_infos[0][i].imageView == VK_NULL_HANDLE) {
+            image_infos[0][i] = image_infos[0][first_source];
+            image_infos[1][i] = image_infos[1][first_source];
+        }
+    }
+    VK_CHECK(vmaFlushAllocation(sys_vk->_allocator, mc->_tiles._allocation, 0, VK_WHOLE_SIZE));
+
+    VkDescriptorBufferInfo buffer_infos[2] = {
+        { dst, 0, layout._size },
+        { mc->_tiles._buffer, 0, VK_WHOLE_SIZE },
+    };
+    VkWriteDescriptorSet writes[4] = {};
+    for (u32 i = 0; i < 4; i++) {
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].dstSet = mc->_set;
+        writes[i].dstBinding = i;
+        writes[i].descriptorCount = i < 2 ? mc->_max_tiles : 1;
+        writes[i].descriptorType = i < 2 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        if (i < 2)
+            writes[i].pImageInfo = image_infos[i];
+        else
+            writes[i].pBufferInfo = &buffer_infos[i - 2];
+    }
+    vk.UpdateDescriptorSets(sys_vk->_active_dev, ARRAY_ELEMS(writes), writes, 0, nullptr);
+
+    if (!image_barriers.empty()) {
+        VkDependencyInfoKHR dep_info = {};
+        dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+        dep_info.imageMemoryBarrierCount = image_barriers.size();
+        dep_info.pImageMemoryBarriers = image_barriers.data();
+        vk.CmdPipelineBarrier2KHR(cmd_buf, &dep_info);
+    }
+
+    MosaicPushConstants pc = {};
+    pc._tile_width = layout._tile_width;
+    pc._tile_height = layout._tile_height;
+    pc._columns = layout._columns;
+    pc._pitch_words = layout._width / 4;
+    pc._chroma_offset_words = layout._chroma_offset / 4;
+    vk.CmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, mc->_pipeline);
+    vk.CmdBindDescriptorSets(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, mc->_pipeline_layout, 0, 1, &mc->_set, 0, nullptr);
+    vk.CmdPushConstants(cmd_buf, mc->_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+    u32 groups_x = util::AlignUp(layout._tile_width / 4, 8u) / 8;
+    u32 groups_y = util::AlignUp(layout._tile_height / 2, 8u) / 8;
+    vk.CmdDispatch(cmd_buf, groups_x, groups_y, num_tiles);
+    RecordComputeToHostBarrier(sys_vk, cmd_buf, dst, 0, layout._size);
+}
+
+void DestroyMosaicCompositor(SysVulkan* sys_vk, MosaicCompositor* mc)
+{
+    auto& vk = sys_vk->_vfn;
+    for (PlaneViews& views : mc->_views)
+        DestroyPlaneViews(sys_vk, &views);
+    DestroyBufferResource(sys_vk, &mc->_tiles);
+    vk.DestroyDescriptorPool(sys_vk->_active_dev, mc->_descriptor_pool, nullptr);
+    vk.DestroyPipeline(sys_vk->_active_dev, mc->_pipeline, nullptr);
+    vk.DestroyPipelineLayout(sys_vk->_active_dev, mc->_pipeline_layout, nullptr);
+    vk.DestroyDescriptorSetLayout(sys_vk->_active_dev, mc->_set_layout, nullptr);
+    vk.DestroySampler(sys_vk->_active_dev, mc->_sampler, nullptr);
+    *mc = {};
+}
+
+// Per-plane checksums of decoded pictures computed on the GPU, see shaders/nv12_checksum.comp. Only three
+// words per frame are read back, util::LaneHashPlane gives the same digests for CPU decoded output.
+static const u32 nv12_checksum_spv[] = {
+#include "shaders/nv12_checksum.comp.inc"
+};
+
+struct ChecksumPushConstants
+{
+    u32 _width;
+    u32 _height;
+    u32 _base_layer;
+    u32 _num_frames;
+    u32 _pass;
+};
+
+struct FrameHasher
+{
+    VkSampler _sampler { VK_NULL_HANDLE };
+    VkDescriptorSetLayout _set_layout { VK_NULL_HANDLE };
+    VkPipelineLayout _pipeline_layout { VK_NULL_HANDLE };
+    VkPipeline _pipeline { VK_NULL_HANDLE };
+    VkDescriptorPool _descriptor_pool { VK_NULL_HANDLE };
+    VkDescriptorSet _set { VK_NULL_HANDLE };
+    PlaneViews _views;
+    BufferResource _rows {}; // row hashes between the two passes, grown on demand
+};
+
+// Digests are of the 8 bit samples, deeper formats would need a different reference.
+bool FrameChecksumSupported(SysVulkan* sys_vk, VkFormat format, VkImageUsageFlags usage,
+    const VkVideoProfileListInfoKHR* profile_list)
+{
+    return format == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM && FrameConversionSupported(sys_vk, format, usage, profile_list);
+}
+
+FrameHasher CreateFrameHasher(SysVulkan* sys_vk)
+{
+    auto& vk = sys_vk->_vfn;
+    FrameHasher r = {};
+    // Samples are fetched, the sampler is only there to make combined image samplers.
+    r._sampler = CreatePlaneSampler(sys_vk, VK_FILTER_NEAREST);
+
+    VkDescriptorSetLayoutBinding bindings[4] = {};
+    for (u32 i = 0; i < 4; i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = i < 2 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        bindings[i].pImmutableSamplers = i < 2 ? &r._sampler : nullptr;
+    }
+    VkDescriptorSetLayoutCreateInfo set_layout_info = {};
+    set_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    set_layout_info.bindingCount = ARRAY_ELEMS(bindings);
+    set_layout_info.pBindings = bindings;
+    VK_CHECK(vk.CreateDescriptorSetLayout(sys_vk->_active_dev, &set_layout_info, nullptr, &r._set_layout));
+    r._pipeline_layout = CreateComputePipelineLayout(sys_vk, r._set_layout, sizeof(ChecksumPushConstants));
+
+    VkShaderModuleCreateInfo module_info = {};
+    module_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    module_info.codeSize = sizeof(nv12_checksum_spv);
+    module_info.pCode = nv12_checksum_spv;
+    VkShaderModule module = VK_NULL_HANDLE;
+    VK_CHECK(vk.CreateShaderModule(sys_vk->_active_dev, &module_info, nullptr, &module));
+    VkComputePipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = r._pipeline_layout;
+    VK_CHECK(vk.CreateComputePipelines(sys_vk->_active_dev, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &r._pipeline));
+    vk.DestroyShaderModule(sys_vk->_active_dev, module, nullptr);
+
+    VkDescriptorPoolSize pool_sizes[2] = {
+        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 },
+    };
+    VkDescriptorPoolCreateInfo descriptor_pool_info = {};
+    descriptor_pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptor_pool_info.maxSets = 1;
+    descriptor_pool_info.poolSizeCount = ARRAY_ELEMS(pool_sizes);
+    descriptor_pool_info.pPoolSizes = pool_sizes;
+    VK_CHECK(vk.CreateDescriptorPool(sys_vk->_active_dev, &descriptor_pool_info, nullptr, &r._descriptor_pool));
+    VkDescriptorSetAllocateInfo set_alloc_info = {};
+    set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    set_alloc_info.descriptorPool = r._descriptor_pool;
+    set_alloc_info.descriptorSetCount = 1;
+    set_alloc_info.pSetLayouts = &r._set_layout;
+    VK_CHECK(vk.AllocateDescriptorSets(sys_vk->_active_dev, &set_alloc_info, &r._set));
+    return r;
+}
+
+// Records the checksums of num_frames pictures (width x height), starting at first_slot, as Y, Cb, Cr u32
+// digests per frame into dst at dst_offset, 12 bytes per frame. Same rules as RecordFrameConversion.
+void RecordFrameChecksums(SysVulkan* sys_vk, FrameHasher* hasher, VkCommandBuffer cmd_buf, Dpb* dpb, u32 first_slot,
+    u32 num_frames, u32 width, u32 height, VkBuffer dst, VkDeviceSize dst_offset)
+{
+    auto& vk = sys_vk->_vfn;
+    ASSERT(width % 2 == 0 && height % 2 == 0);
+    VkDeviceSize rows_size = VkDeviceSize(height) * 2 * num_frames * sizeof(u32);
+    if (hasher->_rows._buffer == VK_NULL_HANDLE || hasher->_rows._create_info.size < rows_size) {
+        if (hasher->_rows._buffer != VK_NULL_HANDLE)
+            DestroyBufferResource(sys_vk, &hasher->_rows);
+        hasher->_rows = CreateBufferResource(sys_vk, rows_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE);
+    }
+    VkDeviceSize digests_size = VkDeviceSize(num_frames) * 3 * sizeof(u32);
+
+    UpdatePlaneViews(sys_vk, &hasher->_views, dpb);
+    u32 base_layer = dpb->_coincident_image_resources ? first_slot : dpb->OutputLayer(first_slot);
+    ASSERT(dpb->_coincident_image_resources || dpb->OutputLayer(first_slot + num_frames - 1) == base_layer + num_frames - 1);
+    WritePlaneSamplingSet(sys_vk, hasher->_set, hasher->_views, dst, dst_offset, digests_size);
+    VkDescriptorBufferInfo rows_info = { hasher->_rows._buffer, 0, rows_size };
+    VkWriteDescriptorSet rows_write = {};
+    rows_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    rows_write.dstSet = hasher->_set;
+    rows_write.dstBinding = 3;
+    rows_write.descriptorCount = 1;
+    rows_write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    rows_write.pBufferInfo = &rows_info;
+    vk.UpdateDescriptorSets(sys_vk->_active_dev, 1, &rows_write, 0, nullptr);
+    RecordDecodeToComputeBarriers(sys_vk, cmd_buf, dpb, first_slot, num_frames);
+
+    ChecksumPushConstants pc = {};
+    pc._width = width;
+    pc._height = height;
+    pc._base_layer = base_layer;
+    pc._num_frames = num_frames;
+    vk.CmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, hasher->_pipeline);
+    vk.CmdBindDescriptorSets(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, hasher->_pipeline_layout, 0, 1, &hasher->_set, 0, nullptr);
+
+    // Pass 0: one lane per row, planes along y, frames along z.
+    pc._pass = 0;
+    vk.CmdPushConstants(cmd_buf, hasher->_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+    vk.CmdDispatch(cmd_buf, util::AlignUp(height, 64u) / 64, 3, num_frames);
+
+    VkBufferMemoryBarrier2 rows_barrier = {};
+    rows_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2;
+    rows_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    rows_barrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    rows_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    rows_barrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+    rows_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    rows_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    rows_barrier.buffer = hasher->_rows._buffer;
+    rows_barrier.offset = 0;
+    rows_barrier.size = rows_size;
+    VkDependencyInfoKHR dep_info = {};
+    dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+    dep_info.bufferMemoryBarrierCount = 1;
+    dep_info.pBufferMemoryBarriers = &rows_barrier;
+    vk.CmdPipelineBarrier2KHR(cmd_buf, &dep_info);
+
+    // Pass 1: one invocation per plane digest.
+    pc._pass = 1;
+    vk.CmdPushConstants(cmd_buf, hasher->_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+    vk.CmdDispatch(cmd_buf, util::AlignUp(3 * num_frames, 64u) / 64, 1, 1);
+    RecordComputeToHostBarrier(sys_vk, cmd_buf, dst, dst_offset, digests_size);
+}
+
+void DestroyFrameHasher(SysVulkan* sys_vk, FrameHasher* hasher)
+{
+    auto& vk = sys_vk->_vfn;
+    DestroyPlaneViews(sys_vk, &hasher->_views);
+    if (hasher->_rows._buffer != VK_NULL_HANDLE)
+        DestroyBufferResource(sys_vk, &hasher->_rows);
+    vk.DestroyDescriptorPool(sys_vk->_active_dev, hasher->_descriptor_pool, nullptr);
+    vk.DestroyPipeline(sys_vk->_active_dev, hasher->_pipeline, nullptr);
+    vk.DestroyPipelineLayout(sys_vk->_active_dev, hasher->_pipeline_layout, nullptr);
+    vk.DestroyDescriptorSetLayout(sys_vk->_active_dev, hasher->_set_layout, nullptr);
+    vk.DestroySampler(sys_vk->_active_dev, hasher->_sampler, nullptr);
+    *hasher = {};
+}
 } // namespace vvb
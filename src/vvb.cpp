@@ -0,0 +1,1964 @@
+/*
+* Copyright 2023 Igalia S.L.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+// The vvb library, see vvb.hpp. The bootstrap, the mock driver and the CPU decode pool are compiled into this
+// translation unit.
+#include "util.hpp"
+#include "vk.hpp"
+
+#include <atomic>
+#include <coroutine>
+#include <numeric>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "vk_mock_driver.cpp"
+#include "vulkan_video_bootstrap.cpp"
+#include "cpu_decode_pool.cpp"
+#include "vvb.hpp"
+
+namespace vvb {
+
+static_assert(DecoderMaxPreviews == MaxRenditions && DecoderMaxMosaicTiles == MaxMosaicTiles);
+
+struct DecodedFrame
+{
+    Decoder* _decoder;
+    Mosaic* _mosaic { nullptr }; // instead of _decoder for the canvases of ComposeMosaic
+    std::atomic<u32> _refs { 1 };
+    i64 _pts { 0 };
+    const u8* _data { nullptr };
+    u32 _num_pictures { 0 };
+    FramePicture _pictures[DecoderMaxPreviews] {};
+
+    // Backing memory, a readback buffer of the decoder, a reference on a pooled frame, or an allocation of its
+    // own when decoded on the CPU
+    BufferResource _buffer {};
+    Frame* _frame { nullptr };
+    u8* _host { nullptr };
+};
+
+constexpr u32 MaxDecodesInFlight = 4;
+constexpr u32 MaxSlicesPerPicture = 32;
+constexpr u32 PipelineQueueDepth = 16;
+
+// Decodes submitted and not retired yet by the GPU streams of the process, the live depth of the decode queues
+// that places new streams on the CPU past DecoderOptions::gpu_queue_limit.
+static std::atomic<u32> gpu_decodes_in_flight { 0 };
+
+// A copy of an access unit as sent, with its bytes right after it. The parse stage demuxes it in place.
+struct AccessUnit
+{
+    size_t _size;
+    i64 _pts;
+    u32 _num_slices;
+    u32 _slice_offsets[MaxSlicesPerPicture];
+    bool _new_sps; // the stream switched to another SPS at or before this access unit
+    VkExtent2D _coded_extent; // of the SPS in effect, see ReadAvcCodedExtent
+
+    u8* Data() { return (u8*)(this + 1); }
+    const u8* Data() const { return (const u8*)(this + 1); }
+};
+
+// A decode between the submit and retire stages, with its own command buffer and status query.
+struct DecodeSubmission
+{
+    VkCommandBuffer _cmd_buf { VK_NULL_HANDLE };
+    u64 _value { 0 }; // of Decoder::_decode_done once it completes
+    u32 _query { 0 };
+    Frame* _frame { nullptr };
+    i64 _pts { 0 };
+};
+
+struct PipelineStage
+{
+    const char* _name;
+    std::thread _thread; // the retire stage runs on the reactor instead
+    util::Timer _lifetime;
+    u64 _lifetime_ns { 0 };
+    u64 _busy_ns { 0 }; // not waiting on a queue, a frame or the GPU
+    u64 _items { 0 };
+};
+
+struct Decoder
+{
+    DecoderOptions _options;
+    mock::Config _mock_config;
+
+    SysVulkan* _sys_vk { nullptr }; // shared with the other streams placed on it with all_devices
+
+    VideoProfile _profile;
+    VkVideoProfileListInfoKHR _profile_list {};
+    VkVideoCapabilitiesKHR _video_caps {};
+    VkVideoDecodeCapabilitiesKHR _decode_caps {};
+    VkVideoDecodeH264CapabilitiesKHR _avc_caps {};
+
+    bool _dpb_and_dst_coincide { false };
+    bool _linear_output { false };
+    bool _mosaic_source { false }; // received NV12 frames stay sampleable, for ComposeMosaic
+    VkImageUsageFlags _dpb_usage { 0 };
+    VkImageUsageFlags _dst_usage { 0 };
+    VkVideoFormatPropertiesKHR _dpb_format {};
+    VkVideoFormatPropertiesKHR _dst_format {};
+
+    // The coded size the DPB is made for: the one of the SPS in AddSessionParameters, until the stream's SPS
+    // is parsed. Changed by the submit stage, see ResizePictures.
+    u32 _width { 176 };
+    u32 _height { 144 };
+    // max_num_reorder_frames from the SPS VUI (see AvcReorderDepth), bounds the number of output pictures.
+    u32 _reorder_depth { 0 };
+    std::vector<u8> _sps; // the last SPS NAL unit of the stream, owned by the parse stage
+    u32 _sps_changes { 0 };
+    u32 _sps_session_reuses { 0 };
+
+    VideoSessionPool* _session_pool { nullptr }; // the device's, see AcquireVideoSessionPool
+    VideoSession _session {};
+    BitstreamUploadRing _bitstream_ring {};
+    ImagePool* _image_pool { nullptr }; // the device's, see AcquireImagePool
+    Dpb _dpb {};
+    FramePool _frame_pool;
+
+    VkQueryPool _query_pool { VK_NULL_HANDLE }; // one result status query per decode in flight
+    VkCommandPool _decode_cmd_pool { VK_NULL_HANDLE };
+    VkCommandPool _tx_cmd_pool { VK_NULL_HANDLE };
+    VkCommandPool _comp_cmd_pool { VK_NULL_HANDLE };
+    VkCommandBuffer _tx_cmd_buf { VK_NULL_HANDLE };
+    VkCommandBuffer _comp_cmd_buf { VK_NULL_HANDLE };
+
+    // The compute stage of the output, at most one of them
+    FrameConverter _converter {};
+    FrameDownscaler _downscaler {};
+    FrameTensorizer _tensorizer {};
+    MosaicCompositor _compositor {};
+    FrameHasher _hasher {};
+    ConvertedFrameLayout _convert_layout {};
+    RenditionSet _renditions {};
+    TensorLayout _tensor_layout {};
+    MosaicLayout _mosaic_layout {};
+
+    ReadbackBufferPool _readback_pool;
+    std::mutex _readback_mutex; // frames are released from any thread
+    std::atomic<u32> _outstanding { 0 }; // frames handed out and not released yet
+    u64 _decoded { 0 };
+    util::Timer _first_frame_timer;
+
+    // The caller's thread sends access units to the parse stage, which demuxes them for the submit stage,
+    // which records and submits their decodes for the retire stage, which reads the frames back for
+    // ReceiveFrame. The parse and submit stages have their thread, a full queue holds back the stage before it.
+    // The retire stage is a coroutine resumed by the reactor of the device as decodes and readbacks complete.
+    util::SpscQueue<AccessUnit*> _sent_units { PipelineQueueDepth };
+    util::SpscQueue<AccessUnit*> _parsed_units { PipelineQueueDepth };
+    util::SpscQueue<DecodeSubmission*> _submitted { MaxDecodesInFlight };
+    util::SpscQueue<DecodeSubmission*> _free_submissions { MaxDecodesInFlight };
+    util::SpscQueue<DecodedFrame*> _output { PipelineQueueDepth };
+    DecodeSubmission _submissions[MaxDecodesInFlight];
+    PipelineStage _parse_stage { "parse" };
+    PipelineStage _submit_stage { "submit" };
+    PipelineStage _retire_stage { "retire" };
+    std::atomic<u32> _sent { 0 };
+    std::atomic<u32> _processed { 0 }; // access units decoded, dropped or failed
+    std::atomic<u32> _dropped { 0 }; // processed without a frame
+    u32 _received { 0 };
+    u32 _failed { 0 };
+
+    SemaphoreReactor* _reactor { nullptr }; // of the device, shared with the other streams placed on it
+    VkSemaphore _decode_done { VK_NULL_HANDLE }; // signalled by every decode submission, in order
+    u64 _decode_value { 0 };
+    VkSemaphore _readback_done { VK_NULL_HANDLE }; // signalled by the readback submissions of the retire stage
+    u64 _readback_value { 0 };
+    // Set by the retire stage once it is done with the decoder, its coroutine is freed on the reactor afterwards
+    std::mutex _retire_mutex;
+    std::condition_variable _retire_cv;
+    bool _retired_all { false };
+    // A coroutine awaiting NextFrame, resumed on the reactor
+    std::mutex _waiter_mutex;
+    std::coroutine_handle<> _frame_waiter;
+
+    // Set when the stream is decoded by openh264 instead, from the start without a device (_sys_vk is null), or
+    // from an IDR picture once _move_to_cpu is set by failed GPU decodes. Access units then skip the pipeline, the
+    // pool outputs their frames. Only the thread driving the decoder sets it.
+    CpuStream* _cpu_stream { nullptr };
+    DecoderOutput _cpu_output { DECODER_OUTPUT_NV12 };
+    std::atomic<bool> _move_to_cpu { false };
+};
+
+static VkFormat OutputFormat(const Decoder* d)
+{
+    return d->_dpb_and_dst_coincide ? d->_dpb_format.format : d->_dst_format.format;
+}
+
+static VkImageUsageFlags& OutputUsage(Decoder* d)
+{
+    return d->_dpb_and_dst_coincide ? d->_dpb_usage : d->_dst_usage;
+}
+
+// Picks the image formats and usages of the session, and falls back to NV12 when the device can't run the
+// compute stage of the requested output.
+static void ChooseImageFormats(Decoder* d)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    DecoderOutput& output = d->_options.output;
+
+    d->_dpb_and_dst_coincide = d->_decode_caps.flags & VK_VIDEO_DECODE_CAPABILITY_DPB_AND_OUTPUT_COINCIDE_BIT_KHR;
+    auto get_supported_formats = [d](VkImageUsageFlags usage_flags){
+        return GetVideoFormats(d->_sys_vk, &d->_profile_list, usage_flags);
+    };
+
+    // On UMA devices decode into linear output images the host reads in place, which needs distinct output
+    // images, even on implementations that could also decode to the DPB directly. Only once both the video
+    // format list and the image format properties have a linear format for the profile, the output images
+    // otherwise keep the transfer usage of the readback.
+    // Mosaics sample the NV12 frames of their sources in place, which linear images don't allow.
+    d->_mosaic_source = d->_options.mosaic_source && output == DECODER_OUTPUT_NV12 && MosaicSupported(sys_vk);
+    VkVideoFormatPropertiesKHR linear_dst_format = {};
+    if (output == DECODER_OUTPUT_NV12 && !d->_mosaic_source && sys_vk->use_linear_images &&
+        (d->_decode_caps.flags & VK_VIDEO_DECODE_CAPABILITY_DPB_AND_OUTPUT_DISTINCT_BIT_KHR))
+    {
+        for (const auto& f : get_supported_formats(VK_IMAGE_USAGE_VIDEO_DECODE_DST_BIT_KHR)) {
+            if (f.imageTiling == VK_IMAGE_TILING_LINEAR &&
+                LinearOutputSupported(sys_vk, f.format, VK_IMAGE_USAGE_VIDEO_DECODE_DST_BIT_KHR, &d->_profile_list)) {
+                linear_dst_format = f;
+                d->_linear_output = true;
+                d->_dpb_and_dst_coincide = false;
+                break;
+            }
+        }
+    }
+
+    d->_dpb_usage = VK_IMAGE_USAGE_VIDEO_DECODE_DPB_BIT_KHR;
+    d->_dst_usage = VK_IMAGE_USAGE_VIDEO_DECODE_DST_BIT_KHR|VK_IMAGE_USAGE_TRANSFER_SRC_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    if (d->_linear_output)
+        d->_dst_usage = VK_IMAGE_USAGE_VIDEO_DECODE_DST_BIT_KHR;
+    if (d->_dpb_and_dst_coincide)
+    {
+        d->_dpb_usage = d->_dst_usage | VK_IMAGE_USAGE_VIDEO_DECODE_DPB_BIT_KHR;
+        d->_dst_usage &= ~VK_IMAGE_USAGE_VIDEO_DECODE_DST_BIT_KHR;
+    }
+    auto supported_dpb_formats = get_supported_formats(d->_dpb_usage);
+    // Think of what to do for > 1 supported formats
+    ASSERT(supported_dpb_formats.size() == 1);
+    d->_dpb_format = supported_dpb_formats[0];
+    d->_dst_format = {};
+    d->_dst_format.sType = VK_STRUCTURE_TYPE_VIDEO_FORMAT_PROPERTIES_KHR;
+    d->_dst_format.format = d->_dpb_format.format;
+    if (d->_linear_output) {
+        d->_dst_format = linear_dst_format;
+    } else if (!d->_dpb_and_dst_coincide) {
+        auto supported_output_formats = get_supported_formats(d->_dst_usage);
+        ASSERT(supported_output_formats.size() == 1);
+        d->_dst_format = supported_output_formats[0];
+    };
+    // Everything asked of the driver before the session is created is cached by now
+    sys_vk->_caps_cache.Save();
+
+    if (d->_mosaic_source) {
+        if (FrameConversionSupported(sys_vk, OutputFormat(d), OutputUsage(d), &d->_profile_list))
+            OutputUsage(d) |= VK_IMAGE_USAGE_SAMPLED_BIT;
+        else
+            d->_mosaic_source = false;
+    }
+    if (d->_options.mosaic_source && !d->_mosaic_source)
+        printf("Frames of this decoder can't be composited into mosaics\n");
+
+    // Where the device allows it, decoded pictures are copied to host memory by the CPU with
+    // vkCopyImageToMemoryEXT, which skips the staging buffer and the transfer queue round trip.
+#ifdef VK_EXT_host_image_copy
+    if (!d->_linear_output && output == DECODER_OUTPUT_NV12)
+    {
+        if (HostImageCopySupported(sys_vk, OutputFormat(d), OutputUsage(d), &d->_profile_list))
+            OutputUsage(d) |= VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT;
+    }
+#endif
+
+    // Conversions, previews, tensors and mosaics sample the output images from a compute shader.
+    if (output == DECODER_OUTPUT_MOSAIC && !MosaicSupported(sys_vk)) {
+        printf("Mosaic compositing is not supported on this device, reading back NV12\n");
+        output = DECODER_OUTPUT_NV12;
+    }
+    if (output == DECODER_OUTPUT_MOSAIC && d->_options.mosaic_tiles > MosaicTileLimit(sys_vk)) {
+        printf("The device samples up to %u tiles at once, compositing %u rather than %u\n", MosaicTileLimit(sys_vk),
+            MosaicTileLimit(sys_vk), d->_options.mosaic_tiles);
+        d->_options.mosaic_tiles = MosaicTileLimit(sys_vk);
+    }
+    if (output == DECODER_OUTPUT_CHECKSUM && !FrameChecksumSupported(sys_vk, OutputFormat(d), OutputUsage(d), &d->_profile_list)) {
+        printf("GPU checksums are not supported for this output format, reading back NV12\n");
+        output = DECODER_OUTPUT_NV12;
+    }
+    if (output != DECODER_OUTPUT_NV12)
+    {
+        if (FrameConversionSupported(sys_vk, OutputFormat(d), OutputUsage(d), &d->_profile_list))
+            OutputUsage(d) |= VK_IMAGE_USAGE_SAMPLED_BIT;
+        else {
+            printf("GPU conversion is not supported for this output format, reading back NV12\n");
+            output = DECODER_OUTPUT_NV12;
+        }
+    }
+
+    // Listed with the rest of what --detect prints, a process with many streams doesn't get them for each one
+    if (d->_options.detect) {
+        printf("Linear output: %d, DPB and output coincide: %d\n", d->_linear_output, d->_dpb_and_dst_coincide);
+        printf("DPB usage: "); vk_print(d->_dpb_usage); printf("\n");
+        printf("Output usage: "); vk_print(d->_dst_usage); printf("\n");
+        printf("Bitstream buffer size alignment: %lu, offset alignment: %lu\n",
+            d->_video_caps.minBitstreamBufferSizeAlignment, d->_video_caps.minBitstreamBufferOffsetAlignment);
+    }
+}
+
+// Every output frame gets its own slot, so that frames held by consumers are never decoded over: the pictures
+// the stream reorders, the one being decoded and those the application holds. A Dpb has fewer than 16 slots.
+static u32 NumOutputFrames(const Decoder* d)
+{
+    u32 needed = d->_reorder_depth + 1 + d->_options.held_frames;
+    return std::min<u32>(std::max(needed, d->_options.output_frames), 15);
+}
+
+// Simulates adaptive bitrate switches down and up a ladder, as a live feed would do every few seconds, with the
+// DPB and output images the stream itself gets.
+static void MeasureStreamSwitch(Decoder* d)
+{
+    u32 num_frames = NumOutputFrames(d);
+    const VkExtent2D ladder[] = { {1920, 1080}, {1280, 720}, {854, 480}, {1280, 720} };
+    const int num_switches = 32;
+    for (ImagePool* pool : { (ImagePool*)nullptr, d->_image_pool })
+    {
+        u64 total_us = 0;
+        util::Timer t;
+        for (int i = 0; i < num_switches; i++)
+        {
+            VkExtent2D extent = ladder[i % ARRAY_ELEMS(ladder)];
+            extent.width = std::min(extent.width, d->_video_caps.maxCodedExtent.width);
+            extent.height = std::min(extent.height, d->_video_caps.maxCodedExtent.height);
+            t.GetCurrentTime();
+            auto switch_dpb = CreateDpbResource(d->_sys_vk, extent.width, extent.height, std::max(3u, num_frames), num_frames,
+                d->_dpb_and_dst_coincide,
+                d->_dpb_usage, d->_dpb_format.format, d->_dpb_format.componentMapping,
+                d->_dst_usage, d->_dst_format.format, d->_dst_format.componentMapping,
+                &d->_profile_list, pool, d->_linear_output);
+            DestroyDpbResource(d->_sys_vk, &switch_dpb);
+            total_us += t.ElapsedMicroseconds();
+        }
+        printf("Stream switch (%s): %" PRIu64 " us average over %d switches\n", pool ? "pooled" : "unpooled",
+            total_us / num_switches, num_switches);
+    }
+}
+
+// The DPB and output images for the coded size, taken from the device's pool, and the frames of their output slots.
+static void CreatePictures(Decoder* d)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    u32 num_frames = NumOutputFrames(d);
+    d->_dpb = CreateDpbResource(sys_vk, d->_width, d->_height, std::max(3u, num_frames), num_frames,
+        d->_dpb_and_dst_coincide,
+        d->_dpb_usage, d->_dpb_format.format, d->_dpb_format.componentMapping,
+        d->_dst_usage, d->_dst_format.format, d->_dst_format.componentMapping,
+        &d->_profile_list, d->_image_pool, d->_linear_output);
+    InitFramePool(sys_vk, &d->_frame_pool, &d->_dpb, num_frames, d->_width, d->_height,
+        d->_options.output == DECODER_OUTPUT_NV12, &d->_readback_pool);
+}
+
+// The layout of what the compute stage of the output writes, for the coded size.
+static void ComputeOutputLayouts(Decoder* d)
+{
+    const DecoderOptions& o = d->_options;
+    switch (o.output) {
+    case DECODER_OUTPUT_RGBA8:
+    case DECODER_OUTPUT_I420:
+        d->_convert_layout = ComputeConvertedFrameLayout(o.output == DECODER_OUTPUT_I420 ? CONVERT_I420 : CONVERT_RGBA8,
+            d->_width, d->_height);
+        break;
+    case DECODER_OUTPUT_PREVIEWS:
+        d->_renditions = ComputeRenditionSet(d->_width, d->_height, o.preview_divisors, o.num_previews);
+        break;
+    case DECODER_OUTPUT_TENSOR:
+        d->_tensor_layout = ComputeTensorLayout(d->_width, d->_height, o.tensor_width, o.tensor_height, o.tensor_fp16);
+        break;
+    case DECODER_OUTPUT_MOSAIC:
+        d->_mosaic_layout = ComputeMosaicLayout(o.mosaic_tiles, d->_width / 2, d->_height / 2);
+        break;
+    default:
+        break;
+    }
+}
+
+// The compute stage of the output and the layout of what it writes.
+static void CreateOutputStage(Decoder* d)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    const DecoderOptions& o = d->_options;
+    VkFormat format = OutputFormat(d);
+    ColorMatrix matrix = o.bt601 ? COLOR_MATRIX_BT601 : COLOR_MATRIX_BT709;
+
+    switch (o.output) {
+    case DECODER_OUTPUT_NV12:
+        return;
+    case DECODER_OUTPUT_RGBA8:
+    case DECODER_OUTPUT_I420:
+        d->_converter = CreateFrameConverter(sys_vk, matrix, o.full_range);
+        break;
+    case DECODER_OUTPUT_PREVIEWS:
+        d->_downscaler = CreateFrameDownscaler(sys_vk, format);
+        break;
+    case DECODER_OUTPUT_TENSOR: {
+        TensorNormalization norm;
+        memcpy(norm._mean, o.tensor_mean, sizeof(norm._mean));
+        memcpy(norm._std, o.tensor_std, sizeof(norm._std));
+        d->_tensorizer = CreateFrameTensorizer(sys_vk, format, matrix, o.full_range, norm);
+        break;
+    }
+    case DECODER_OUTPUT_MOSAIC:
+        d->_compositor = CreateMosaicCompositor(sys_vk, format, o.mosaic_tiles);
+        break;
+    case DECODER_OUTPUT_CHECKSUM:
+        d->_hasher = CreateFrameHasher(sys_vk);
+        break;
+    }
+    ComputeOutputLayouts(d);
+
+    auto& vk = sys_vk->_vfn;
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    cmd_pool_info.queueFamilyIndex = sys_vk->queue_family_comp_index;
+    VK_CHECK(vk.CreateCommandPool(sys_vk->_active_dev, &cmd_pool_info, nullptr, &d->_comp_cmd_pool));
+    VkCommandBufferAllocateInfo cmd_buf_alloc_info = {};
+    cmd_buf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buf_alloc_info.commandPool = d->_comp_cmd_pool;
+    cmd_buf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buf_alloc_info.commandBufferCount = 1;
+    VK_CHECK(vk.AllocateCommandBuffers(sys_vk->_active_dev, &cmd_buf_alloc_info, &d->_comp_cmd_buf));
+}
+
+static void DestroyOutputStage(Decoder* d)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    switch (d->_options.output) {
+    case DECODER_OUTPUT_NV12:
+        return;
+    case DECODER_OUTPUT_RGBA8:
+    case DECODER_OUTPUT_I420:
+        DestroyFrameConverter(sys_vk, &d->_converter);
+        break;
+    case DECODER_OUTPUT_PREVIEWS:
+        DestroyFrameDownscaler(sys_vk, &d->_downscaler);
+        break;
+    case DECODER_OUTPUT_TENSOR:
+        DestroyFrameTensorizer(sys_vk, &d->_tensorizer);
+        break;
+    case DECODER_OUTPUT_MOSAIC:
+        DestroyMosaicCompositor(sys_vk, &d->_compositor);
+        break;
+    case DECODER_OUTPUT_CHECKSUM:
+        DestroyFrameHasher(sys_vk, &d->_hasher);
+        break;
+    }
+    sys_vk->_vfn.DestroyCommandPool(sys_vk->_active_dev, d->_comp_cmd_pool, nullptr);
+}
+
+static void StartPipeline(Decoder* d);
+static void StopPipeline(Decoder* d);
+static void PrintPipelineStats(Decoder* d);
+static bool PlaceOnCpu(const DecoderOptions& options);
+static bool OpenOnCpu(Decoder* d);
+
+// The decoders opened with all_devices share the devices of the process. The group is opened by the first of
+// them, with its device selection, and destroyed with the last one.
+static std::mutex device_group_mutex;
+static DeviceGroup device_group;
+static u32 device_group_decoders { 0 };
+static mock::Config device_group_mock_config;
+
+// Places a new stream on the device group, opening it first when no decoder uses it.
+static SysVulkan* PlaceOnDeviceGroup(SysVulkan::UserOptions opts, const mock::Config& mock_config)
+{
+    std::lock_guard<std::mutex> lock(device_group_mutex);
+    if (device_group_decoders == 0) {
+        // The devices outlive the decoder that opened them
+        if (opts.mock_driver) {
+            device_group_mock_config = mock_config;
+            opts.mock_driver = &device_group_mock_config;
+        }
+        if (!InitDeviceGroup(&device_group, opts))
+            return nullptr;
+    }
+    device_group_decoders++;
+    return PlaceStream(&device_group);
+}
+
+// Gives the device back, to the device group with all_devices.
+static void ReleaseDevice(Decoder* d)
+{
+    if (d->_options.all_devices) {
+        std::lock_guard<std::mutex> lock(device_group_mutex);
+        ReleaseStream(&device_group, d->_sys_vk);
+        if (--device_group_decoders == 0)
+            DestroyDeviceGroup(&device_group);
+    } else {
+        delete d->_sys_vk;
+    }
+    d->_sys_vk = nullptr;
+}
+
+// When no device can take the stream.
+static Decoder* OpenOnCpuInstead(Decoder* d)
+{
+    if (d->_options.cpu_fallback && OpenOnCpu(d))
+        return d;
+    delete d;
+    return nullptr;
+}
+
+Decoder* OpenDecoder(const DecoderOptions& options)
+{
+    auto* d = new Decoder;
+    d->_options = options;
+    if (PlaceOnCpu(options)) {
+        if (OpenOnCpu(d))
+            return d;
+        if (options.cpu_only) {
+            delete d;
+            return nullptr;
+        }
+    }
+
+    SysVulkan::UserOptions opts;
+    opts.detect_env = options.detect;
+    opts.enable_validation = options.validate;
+    opts.requested_device_name = options.device_name;
+    opts.requested_device_major = options.device_major;
+    opts.requested_device_minor = options.device_minor;
+    opts.requested_driver_version_major = options.driver_major;
+    opts.requested_driver_version_minor = options.driver_minor;
+    opts.requested_driver_version_patch = options.driver_patch;
+    if (options.mock_driver) {
+        if (*options.mock_driver && !mock::ParseConfig(options.mock_driver, &d->_mock_config)) {
+            printf("Invalid mock driver configuration: %s\n", options.mock_driver);
+            delete d;
+            return nullptr;
+        }
+        // The mock driver has no layers
+        if (options.validate)
+            printf("Validation is not available with the mock driver, disabling it\n");
+        opts.enable_validation = false;
+        opts.mock_driver = &d->_mock_config;
+        if (!options.device_name && options.device_major == -1 && options.driver_major == -1)
+            opts.requested_device_name = "mock";
+    }
+
+    // With several devices every stream is placed on one of them, each device has its own contexts, shared by
+    // the streams placed on it.
+    if (options.all_devices) {
+        d->_sys_vk = PlaceOnDeviceGroup(opts, d->_mock_config);
+        if (!d->_sys_vk)
+            return OpenOnCpuInstead(d);
+        printf("Stream placed on %s\n", d->_sys_vk->_selected_physical_device_priv.props.properties.deviceName);
+    } else {
+        d->_sys_vk = new SysVulkan(opts);
+        if (!init_vulkan(*d->_sys_vk)) {
+            delete d->_sys_vk;
+            d->_sys_vk = nullptr;
+            return OpenOnCpuInstead(d);
+        }
+    }
+    SysVulkan* sys_vk = d->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+
+    // The profile would need to be sniffed from the stream in reality. The chain points into the struct, it is
+    // set again after the copy.
+    d->_profile = AvcProgressive420Profile();
+    d->_profile._profile_info.pNext = &d->_profile._decode_codec_profile.avc;
+    d->_profile_list.sType = VK_STRUCTURE_TYPE_VIDEO_PROFILE_LIST_INFO_KHR;
+    d->_profile_list.pNext = nullptr;
+    d->_profile_list.profileCount = 1;
+    d->_profile_list.pProfiles = &d->_profile._profile_info;
+
+    //;;;;;;;;;; Cap queries
+    d->_video_caps.sType = VK_STRUCTURE_TYPE_VIDEO_CAPABILITIES_KHR;
+    d->_decode_caps.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_CAPABILITIES_KHR;
+    d->_avc_caps.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_CAPABILITIES_KHR;
+    d->_decode_caps.pNext = &d->_avc_caps;
+    d->_video_caps.pNext = &d->_decode_caps;
+    VkResult caps_result = GetVideoCapabilities(sys_vk, &d->_profile._profile_info, &d->_video_caps);
+    if (caps_result != VK_SUCCESS) {
+        printf("The device does not decode this profile (%d)\n", caps_result);
+        ReleaseDevice(d);
+        return OpenOnCpuInstead(d);
+    }
+
+    // !(video_caps.flags & VK_VIDEO_CAPABILITY_SEPARATE_REFERENCE_IMAGES_BIT_KHR) -> image arrays for dpb
+    // This test uses an image array for the DPB in any case, since it's simpler, but potentially less efficient.
+
+    ChooseImageFormats(d);
+    //;;;;;;;;;; End of cap queries
+
+    // Time to first frame is measured from the start of the stream to the completion of its first decode, so it
+    // includes getting a session.
+    d->_first_frame_timer.GetCurrentTime();
+
+    // A stream sharing its device with others starts on a session warmed while the earlier ones were opening,
+    // and misses, creating its own, when none is ready.
+    d->_session_pool = AcquireVideoSessionPool(sys_vk, &d->_profile, d->_dst_format.format, d->_dpb_format.format,
+        &d->_video_caps, 1, 1, d->_options.all_devices ? 1 : 0);
+    d->_session = AcquireVideoSession(sys_vk, d->_session_pool, &d->_profile, d->_dst_format.format, d->_dpb_format.format,
+        &d->_video_caps, 1, 1);
+    AddSessionParameters(sys_vk, &d->_session);
+    AvcParameterSets parameter_sets;
+    InitAvcParameterSets(&parameter_sets);
+    d->_reorder_depth = AvcReorderDepth(parameter_sets._sps);
+
+    // Access units go through a staging ring and the transfer queue on discrete GPUs without resizable BAR,
+    // so the decoder always reads slice data from device local memory. Their regions are reused once their
+    // decode has signalled _decode_done.
+    d->_decode_done = CreateTimelineSemaphore(sys_vk);
+    d->_bitstream_ring = CreateBitstreamUploadRing(sys_vk, 4 * MegaByte, &d->_video_caps, &d->_profile_list,
+        d->_decode_done);
+
+    // DPB and output images are recycled across the streams of the device and resolution changes.
+    d->_image_pool = AcquireImagePool(sys_vk, d->_video_caps.maxCodedExtent);
+    if (options.measure_stream_switch)
+        MeasureStreamSwitch(d);
+    CreatePictures(d);
+
+    if (sys_vk->DecodeQueriesAreSupported())
+    {
+        VkQueryPoolCreateInfo query_pool_info = {};
+        query_pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        query_pool_info.pNext = &d->_profile._profile_info;
+        query_pool_info.flags = 0;
+        query_pool_info.queryType = VK_QUERY_TYPE_RESULT_STATUS_ONLY_KHR;
+        query_pool_info.queryCount = MaxDecodesInFlight; // one per decode in flight, per region decoding will change this
+        query_pool_info.pipelineStatistics = 0;
+        VK_CHECK(vk.CreateQueryPool(sys_vk->_active_dev, &query_pool_info, nullptr, &d->_query_pool));
+    }
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.pNext = nullptr;
+    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    cmd_pool_info.queueFamilyIndex = sys_vk->queue_family_decode_index;
+    VK_CHECK(vk.CreateCommandPool(sys_vk->_active_dev, &cmd_pool_info, nullptr, &d->_decode_cmd_pool));
+    cmd_pool_info.queueFamilyIndex = sys_vk->queue_family_tx_index;
+    VK_CHECK(vk.CreateCommandPool(sys_vk->_active_dev, &cmd_pool_info, nullptr, &d->_tx_cmd_pool));
+
+    VkCommandBufferAllocateInfo cmd_buf_alloc_info = {};
+    cmd_buf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buf_alloc_info.pNext = nullptr;
+    cmd_buf_alloc_info.commandPool = d->_decode_cmd_pool;
+    cmd_buf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buf_alloc_info.commandBufferCount = 1;
+    cmd_buf_alloc_info.commandPool = d->_tx_cmd_pool;
+    VK_CHECK(vk.AllocateCommandBuffers(sys_vk->_active_dev, &cmd_buf_alloc_info, &d->_tx_cmd_buf));
+
+    CreateOutputStage(d);
+
+    d->_reactor = AcquireSemaphoreReactor(sys_vk);
+    d->_readback_done = CreateTimelineSemaphore(sys_vk);
+
+    // The retire stage gives submissions back through _free_submissions, this thread fills it before the
+    // stages start.
+    cmd_buf_alloc_info.commandPool = d->_decode_cmd_pool;
+    for (u32 i = 0; i < MaxDecodesInFlight; i++) {
+        DecodeSubmission& sub = d->_submissions[i];
+        VK_CHECK(vk.AllocateCommandBuffers(sys_vk->_active_dev, &cmd_buf_alloc_info, &sub._cmd_buf));
+        sub._query = i;
+        d->_free_submissions.Push(&sub);
+    }
+    StartPipeline(d);
+    return d;
+}
+
+void CloseDecoder(Decoder* d)
+{
+    // Frames that were never received, the submit stage may be waiting for their slots
+    while (DecodedFrame* frame = ReceiveFrame(d, true))
+        ReleaseFrame(frame);
+    if (d->_cpu_stream)
+        CloseCpuStream(d->_cpu_stream);
+    if (!d->_sys_vk) {
+        ASSERT(d->_outstanding == 0);
+        PrintPipelineStats(d);
+        delete d;
+        return;
+    }
+
+    SysVulkan* sys_vk = d->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+    StopPipeline(d);
+    ASSERT(d->_outstanding == 0);
+    PrintPipelineStats(d);
+
+    ReleaseSemaphoreReactor(sys_vk);
+    vk.DestroySemaphore(sys_vk->_active_dev, d->_decode_done, nullptr);
+    vk.DestroySemaphore(sys_vk->_active_dev, d->_readback_done, nullptr);
+    DestroyOutputStage(d);
+
+    DestroyFramePool(sys_vk, &d->_frame_pool, &d->_readback_pool);
+    DestroyReadbackBufferPool(sys_vk, &d->_readback_pool);
+    DestroyBitstreamUploadRing(sys_vk, &d->_bitstream_ring);
+
+    if (d->_query_pool != VK_NULL_HANDLE)
+    {
+        vk.DestroyQueryPool(sys_vk->_active_dev, d->_query_pool, nullptr);
+        d->_query_pool = VK_NULL_HANDLE;
+    }
+    vk.DestroyCommandPool(sys_vk->_active_dev, d->_tx_cmd_pool, nullptr);
+    vk.DestroyCommandPool(sys_vk->_active_dev, d->_decode_cmd_pool, nullptr);
+
+    DestroyDpbResource(sys_vk, &d->_dpb);
+    ReleaseImagePool(sys_vk);
+
+    if (d->_sps_changes)
+        printf("SPS changes: %u, session kept for %u of them\n", d->_sps_changes, d->_sps_session_reuses);
+    ReleaseVideoSession(sys_vk, d->_session_pool, &d->_session);
+    ReleaseVideoSessionPool(sys_vk);
+    PrintSessionMemoryPoolStats(sys_vk);
+
+    ReleaseDevice(d);
+    delete d;
+}
+
+// Records the decode of au, at offset/range of the bitstream ring, into slot.
+static void RecordDecode(Decoder* d, const DecodeSubmission* sub, u32 slot, const AccessUnit* au,
+    VkDeviceSize slice_offset, VkDeviceSize slice_range, const VkBufferMemoryBarrier2& bitstream_barrier)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+    VkCommandBuffer decode_cmd_buf = sub->_cmd_buf;
+    Dpb& dpb = d->_dpb;
+
+    VkCommandBufferBeginInfo cmd_buf_begin_info = {};
+    cmd_buf_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    cmd_buf_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vk.BeginCommandBuffer(decode_cmd_buf, &cmd_buf_begin_info);
+
+    // Queries
+    if (sys_vk->DecodeQueriesAreSupported())
+    {
+        vk.CmdResetQueryPool(decode_cmd_buf, d->_query_pool, sub->_query, 1);
+    }
+
+    //;;;;;;;;;;; Video coding scope begin
+    VkVideoBeginCodingInfoKHR begin_coding_info = {};
+    begin_coding_info.sType = VK_STRUCTURE_TYPE_VIDEO_BEGIN_CODING_INFO_KHR;
+    begin_coding_info.pNext = nullptr;
+    begin_coding_info.flags = 0;
+    begin_coding_info.videoSession = d->_session._handle;
+    begin_coding_info.videoSessionParameters = d->_session._parameters;
+    VkVideoReferenceSlotInfoKHR reference_slot = {};
+    reference_slot.sType = VK_STRUCTURE_TYPE_VIDEO_REFERENCE_SLOT_INFO_KHR;
+    reference_slot.pNext = nullptr;
+    reference_slot.slotIndex = -1;
+    reference_slot.pPictureResource = &dpb._dpb_slot_picture_resource_infos[slot];
+    begin_coding_info.referenceSlotCount = 1;
+    begin_coding_info.pReferenceSlots = &reference_slot;
+    vk.CmdBeginVideoCodingKHR(decode_cmd_buf, &begin_coding_info);
+
+    if (d->_session._reset_pending)
+    {
+        VkVideoCodingControlInfoKHR coding_ctrl_info = {};
+        coding_ctrl_info.sType = VK_STRUCTURE_TYPE_VIDEO_CODING_CONTROL_INFO_KHR;
+        coding_ctrl_info.pNext = nullptr;
+        coding_ctrl_info.flags = VK_VIDEO_CODING_CONTROL_RESET_BIT_KHR;
+        vk.CmdControlVideoCodingKHR(decode_cmd_buf, &coding_ctrl_info);
+        d->_session._reset_pending = false;
+    }
+
+    VkDependencyInfoKHR out_dep_info = {};
+    out_dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+    out_dep_info.pNext = nullptr;
+    out_dep_info.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    out_dep_info.memoryBarrierCount = 0;
+    out_dep_info.pMemoryBarriers = nullptr;
+    out_dep_info.bufferMemoryBarrierCount = 1;
+    out_dep_info.pBufferMemoryBarriers = &bitstream_barrier;
+    std::vector<VkImageMemoryBarrier2> image_barriers = dpb.SlotBarriers(TRANSITION_IMAGE_INITIALIZE, slot);
+    out_dep_info.imageMemoryBarrierCount = image_barriers.size();
+    out_dep_info.pImageMemoryBarriers = image_barriers.data();
+    vk.CmdPipelineBarrier2KHR(decode_cmd_buf, &out_dep_info);
+
+    if (sys_vk->DecodeQueriesAreSupported())
+    {
+        vk.CmdBeginQuery(decode_cmd_buf, d->_query_pool, sub->_query, VkQueryControlFlags());
+    }
+
+    StdVideoDecodeH264PictureInfo avc_picture_info = {};
+    avc_picture_info.flags.field_pic_flag = 0;
+    avc_picture_info.flags.is_intra = 1;
+    avc_picture_info.flags.IdrPicFlag = 0;
+    avc_picture_info.flags.bottom_field_flag = 0;
+    avc_picture_info.flags.is_reference = 1;
+    avc_picture_info.flags.complementary_field_pair = 0;
+    avc_picture_info.seq_parameter_set_id = 0;
+    avc_picture_info.pic_parameter_set_id = 0;
+    avc_picture_info.frame_num = 0;
+    avc_picture_info.idr_pic_id = 0;
+    avc_picture_info.PicOrderCnt[0] = 0;
+    avc_picture_info.PicOrderCnt[1] = 0;
+    VkVideoDecodeH264PictureInfoKHR avc_decode_info = {};
+    avc_decode_info.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_PICTURE_INFO_KHR;
+    avc_decode_info.pNext = nullptr;
+    avc_decode_info.pStdPictureInfo = &avc_picture_info;
+    avc_decode_info.sliceCount = au->_num_slices;
+    avc_decode_info.pSliceOffsets = au->_slice_offsets;
+
+    VkVideoDecodeInfoKHR decode_info = {};
+    decode_info.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_INFO_KHR;
+    decode_info.pNext = &avc_decode_info;
+    decode_info.flags = 0;
+    decode_info.srcBuffer = d->_bitstream_ring._device._buffer;
+    decode_info.srcBufferOffset = slice_offset;
+    decode_info.srcBufferRange = slice_range;
+    decode_info.dstPictureResource = dpb.SlotDstPictureResource(slot);
+    VkVideoDecodeH264DpbSlotInfoKHR dpb_slot_info = {};
+    dpb_slot_info.sType = VK_STRUCTURE_TYPE_VIDEO_DECODE_H264_DPB_SLOT_INFO_KHR;
+    dpb_slot_info.pNext = nullptr;
+    StdVideoDecodeH264ReferenceInfo ref_info = {};
+    ref_info.flags.top_field_flag = 0;
+    ref_info.flags.bottom_field_flag = 0;
+    ref_info.flags.used_for_long_term_reference = 0;
+    ref_info.flags.is_non_existing = 0;
+    ref_info.FrameNum = 0;
+    ref_info.PicOrderCnt[0] = 0;
+    ref_info.PicOrderCnt[1] = 0;
+    dpb_slot_info.pStdReferenceInfo = &ref_info;
+    reference_slot.pNext = &dpb_slot_info;
+    reference_slot.slotIndex = slot;
+    decode_info.pSetupReferenceSlot = nullptr; // &reference_slot;
+    decode_info.referenceSlotCount = 0;
+    decode_info.pReferenceSlots = nullptr;
+    if (d->_dpb_and_dst_coincide && decode_info.pSetupReferenceSlot == nullptr)
+    {
+        VkDependencyInfoKHR dpb_to_dst_barrier = {};
+        dpb_to_dst_barrier.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+        dpb_to_dst_barrier.pNext = nullptr;
+        dpb_to_dst_barrier.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+        dpb_to_dst_barrier.memoryBarrierCount = 0;
+        dpb_to_dst_barrier.pMemoryBarriers = nullptr;
+        dpb_to_dst_barrier.bufferMemoryBarrierCount = 1;
+        dpb_to_dst_barrier.pBufferMemoryBarriers = &bitstream_barrier;
+        std::vector<VkImageMemoryBarrier2> image_barriers = dpb.SlotBarriers(TRANSITION_IMAGE_DPB_TO_DST, slot);
+        dpb_to_dst_barrier.imageMemoryBarrierCount = image_barriers.size();
+        dpb_to_dst_barrier.pImageMemoryBarriers = image_barriers.data();
+        vk.CmdPipelineBarrier2KHR(decode_cmd_buf, &dpb_to_dst_barrier);
+    }
+    vk.CmdDecodeVideoKHR(decode_cmd_buf, &decode_info);
+
+    if (sys_vk->DecodeQueriesAreSupported())
+    {
+        vk.CmdEndQuery(decode_cmd_buf, d->_query_pool, sub->_query);
+    }
+
+    VkVideoEndCodingInfoKHR end_coding_info = {};
+    end_coding_info.sType = VK_STRUCTURE_TYPE_VIDEO_END_CODING_INFO_KHR;
+    end_coding_info.pNext = nullptr;
+    end_coding_info.flags = 0;
+    vk.CmdEndVideoCodingKHR(decode_cmd_buf, &end_coding_info);
+    //;;;;;;;;;;; Video coding scope end
+
+    if (dpb._dst_linear || dpb._host_copy)
+    {
+        VkDependencyInfoKHR host_dep_info = {};
+        host_dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+        host_dep_info.pNext = nullptr;
+        std::vector<VkImageMemoryBarrier2> host_barriers = dpb.SlotBarriers(TRANSITION_IMAGE_DST_TO_HOST, slot);
+        host_dep_info.imageMemoryBarrierCount = host_barriers.size();
+        host_dep_info.pImageMemoryBarriers = host_barriers.data();
+        vk.CmdPipelineBarrier2KHR(decode_cmd_buf, &host_dep_info);
+    }
+
+    vk.EndCommandBuffer(decode_cmd_buf);
+}
+
+// Submits a readback of the retire stage. Returns the value of _readback_done signalled once it has run.
+static u64 SubmitReadback(Decoder* d, VkQueue queue, VkCommandBuffer cmd_buf)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+    u64 signal_value = ++d->_readback_value;
+    VkTimelineSemaphoreSubmitInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &signal_value;
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &cmd_buf;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &d->_readback_done;
+    std::lock_guard<std::mutex> lock(sys_vk->_queue_mutex);
+    VK_CHECK(vk.QueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE));
+    return signal_value;
+}
+
+static FramePicture PackedPicture(FrameFormat format, u32 width, u32 height, size_t size)
+{
+    FramePicture r = {};
+    r.format = format;
+    r.width = width;
+    r.height = height;
+    r.num_planes = 1;
+    r.planes[0] = { 0, (u32)size, (u32)size, 1 };
+    return r;
+}
+
+static FramePicture NV12Picture(const NV12ReadbackLayout& layout, size_t base)
+{
+    FramePicture r = {};
+    r.format = FRAME_FORMAT_NV12;
+    r.width = layout._width;
+    r.height = layout._height;
+    r.num_planes = 2;
+    r.planes[0] = { size_t(base + layout._luma_offset), layout.LumaPitch(), layout._width, layout._height };
+    r.planes[1] = { size_t(base + layout._chroma_offset), layout.ChromaPitch(), layout._width, layout._height / 2 };
+    return r;
+}
+
+static BufferResource AcquireFrameBuffer(Decoder* d, VkDeviceSize size)
+{
+    std::lock_guard<std::mutex> lock(d->_readback_mutex);
+    return AcquireReadbackBuffer(d->_sys_vk, &d->_readback_pool, size);
+}
+
+// Submits the compute stage on the decoded picture of out into a readback buffer owned by frame. Returns the
+// value of _readback_done to await before FinishComputedReadback.
+static u64 SubmitComputedReadback(Decoder* d, Frame* out, DecodedFrame* frame)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+    const DecoderOptions& o = d->_options;
+    VkCommandBuffer cmd_buf = d->_comp_cmd_buf;
+    u32 slot = out->slot;
+
+    VkDeviceSize size = 0;
+    switch (o.output) {
+    case DECODER_OUTPUT_RGBA8:
+    case DECODER_OUTPUT_I420: size = d->_convert_layout._frame_size; break;
+    case DECODER_OUTPUT_PREVIEWS: size = d->_renditions._total_size; break;
+    case DECODER_OUTPUT_TENSOR: size = d->_tensor_layout._frame_size; break;
+    case DECODER_OUTPUT_MOSAIC: size = d->_mosaic_layout._size; break;
+    case DECODER_OUTPUT_CHECKSUM: size = 3 * sizeof(u32); break;
+    case DECODER_OUTPUT_NV12: ASSERT(false); break;
+    }
+    frame->_buffer = AcquireFrameBuffer(d, size);
+    VkBuffer buffer = frame->_buffer._buffer;
+
+    VkCommandBufferBeginInfo cmd_buf_begin_info = {};
+    cmd_buf_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    cmd_buf_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vk.BeginCommandBuffer(cmd_buf, &cmd_buf_begin_info);
+    switch (o.output) {
+    case DECODER_OUTPUT_RGBA8:
+    case DECODER_OUTPUT_I420:
+        RecordFrameConversion(sys_vk, &d->_converter, cmd_buf, &d->_dpb, slot, 1, d->_convert_layout, buffer, 0);
+        break;
+    case DECODER_OUTPUT_PREVIEWS:
+        RecordDownscale(sys_vk, &d->_downscaler, cmd_buf, &d->_dpb, slot, d->_width, d->_height, d->_renditions,
+            o.preview_area_filter ? DOWNSCALE_FILTER_AREA : DOWNSCALE_FILTER_BILINEAR, buffer);
+        break;
+    case DECODER_OUTPUT_TENSOR:
+        RecordFrameTensors(sys_vk, &d->_tensorizer, cmd_buf, &d->_dpb, slot, 1, d->_tensor_layout, buffer, 0);
+        break;
+    case DECODER_OUTPUT_MOSAIC: {
+        // A video wall would pass the current picture of one Dpb per stream, here the decoded frame fills every tile.
+        std::vector<MosaicSource> sources(o.mosaic_tiles, MosaicSource { &d->_dpb, slot, out->layout });
+        RecordMosaic(sys_vk, &d->_compositor, cmd_buf, sources.data(), o.mosaic_tiles, d->_mosaic_layout, buffer);
+        break;
+    }
+    case DECODER_OUTPUT_CHECKSUM:
+        RecordFrameChecksums(sys_vk, &d->_hasher, cmd_buf, &d->_dpb, slot, 1, d->_width, d->_height, buffer, 0);
+        break;
+    case DECODER_OUTPUT_NV12:
+        break;
+    }
+    vk.EndCommandBuffer(cmd_buf);
+    // Every compute stage samples the picture, see RecordDecodeToComputeBarriers
+    out->layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    return SubmitReadback(d, sys_vk->_comp_queue0, cmd_buf);
+}
+
+static void FinishComputedReadback(Decoder* d, DecodedFrame* frame)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    const DecoderOptions& o = d->_options;
+
+    VK_CHECK(vmaInvalidateAllocation(sys_vk->_allocator, frame->_buffer._allocation, 0, VK_WHOLE_SIZE));
+    frame->_data = (const u8*)frame->_buffer._mapped;
+
+    switch (o.output) {
+    case DECODER_OUTPUT_RGBA8:
+        frame->_pictures[0] = PackedPicture(FRAME_FORMAT_RGBA8, d->_width, d->_height, 0);
+        frame->_pictures[0].planes[0] = { 0, (u32)d->_convert_layout._luma_pitch, d->_width * 4, d->_height };
+        frame->_num_pictures = 1;
+        break;
+    case DECODER_OUTPUT_I420: {
+        const ConvertedFrameLayout& l = d->_convert_layout;
+        FramePicture& p = frame->_pictures[0];
+        p = PackedPicture(FRAME_FORMAT_I420, d->_width, d->_height, 0);
+        p.num_planes = 3;
+        u32 chroma_width = (d->_width + 1) / 2;
+        u32 chroma_height = (d->_height + 1) / 2;
+        p.planes[0] = { 0, (u32)l._luma_pitch, d->_width, d->_height };
+        p.planes[1] = { (size_t)l._u_offset, (u32)l._chroma_pitch, chroma_width, chroma_height };
+        p.planes[2] = { (size_t)l._v_offset, (u32)l._chroma_pitch, chroma_width, chroma_height };
+        frame->_num_pictures = 1;
+        break;
+    }
+    case DECODER_OUTPUT_PREVIEWS:
+        for (u32 i = 0; i < d->_renditions._count; i++) {
+            const Rendition& rendition = d->_renditions._renditions[i];
+            FramePicture& p = frame->_pictures[i];
+            p = PackedPicture(FRAME_FORMAT_NV12, rendition._width, rendition._height, 0);
+            p.num_planes = 2;
+            p.planes[0] = { (size_t)rendition._luma_offset, rendition._width, rendition._width, rendition._height };
+            p.planes[1] = { (size_t)rendition._chroma_offset, rendition._width, rendition._width, rendition._height / 2 };
+        }
+        frame->_num_pictures = d->_renditions._count;
+        break;
+    case DECODER_OUTPUT_TENSOR:
+        frame->_pictures[0] = PackedPicture(o.tensor_fp16 ? FRAME_FORMAT_TENSOR_F16 : FRAME_FORMAT_TENSOR_F32,
+            o.tensor_width, o.tensor_height, d->_tensor_layout._frame_size);
+        frame->_num_pictures = 1;
+        break;
+    case DECODER_OUTPUT_MOSAIC: {
+        const MosaicLayout& l = d->_mosaic_layout;
+        FramePicture& p = frame->_pictures[0];
+        p = PackedPicture(FRAME_FORMAT_NV12, l._width, l._height, 0);
+        p.num_planes = 2;
+        p.planes[0] = { 0, l._width, l._width, l._height };
+        p.planes[1] = { (size_t)l._chroma_offset, l._width, l._width, l._height / 2 };
+        frame->_num_pictures = 1;
+        break;
+    }
+    case DECODER_OUTPUT_CHECKSUM:
+        frame->_pictures[0] = PackedPicture(FRAME_FORMAT_CHECKSUM, d->_width, d->_height, 3 * sizeof(u32));
+        frame->_num_pictures = 1;
+        break;
+    case DECODER_OUTPUT_NV12:
+        break;
+    }
+}
+
+// Makes the picture of out readable from the host. Linear output is read in place, otherwise the picture is
+// copied into the host memory of out, which is reused with the slot. Returns the value of _readback_done to
+// await before FinishNV12Readback, 0 when the picture is already readable.
+static u64 SubmitNV12Readback(Decoder* d, Frame* out)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+    Dpb& dpb = d->_dpb;
+
+    if (dpb._dst_linear)
+    {
+        // Without a transfer submission, or a copy
+        out->host = (void*)MapLinearOutputSlot(sys_vk, &dpb, out->slot, d->_width, d->_height, &out->host_layout);
+    }
+    else if (dpb._host_copy)
+    {
+        // Copied out on this thread by the implementation, without a buffer or a transfer submission.
+        CopySlotToHostMemory(sys_vk, &dpb, out->slot, out->host_layout, out->host);
+    }
+    else
+    {
+        // Both planes are read back into the frame's host memory, which was imported into Vulkan when
+        // VK_EXT_external_memory_host allows it, otherwise a staging buffer is copied out.
+        VkCommandBufferBeginInfo cmd_buf_begin_info = {};
+        cmd_buf_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        cmd_buf_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vk.BeginCommandBuffer(d->_tx_cmd_buf, &cmd_buf_begin_info);
+            auto out_image_barrier = dpb.SlotBarriers(TRANSITION_IMAGE_TRANSFER_TO_HOST, out->slot);
+
+            VkDependencyInfoKHR out_dep_info = {};
+            out_dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+            out_dep_info.pNext = nullptr;
+            out_dep_info.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+            out_dep_info.imageMemoryBarrierCount = out_image_barrier.size();
+            out_dep_info.pImageMemoryBarriers = out_image_barrier.data();
+            vk.CmdPipelineBarrier2KHR(d->_tx_cmd_buf, &out_dep_info);
+
+            RecordNV12Readback(sys_vk, d->_tx_cmd_buf, &dpb, out->slot, out->host_layout, out->readback.Buffer());
+            out->layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+
+            // Left ready for mosaics, which composite the frame once it is received
+            if (d->_mosaic_source) {
+                auto compute_barrier = dpb.SlotBarriers(TRANSITION_IMAGE_TRANSFER_TO_COMPUTE, out->slot);
+                out_dep_info.imageMemoryBarrierCount = compute_barrier.size();
+                out_dep_info.pImageMemoryBarriers = compute_barrier.data();
+                vk.CmdPipelineBarrier2KHR(d->_tx_cmd_buf, &out_dep_info);
+                out->layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+            }
+        vk.EndCommandBuffer(d->_tx_cmd_buf);
+        return SubmitReadback(d, sys_vk->_tx_queue0, d->_tx_cmd_buf);
+    }
+    return 0;
+}
+
+// Hands the reference on out to frame.
+static void FinishNV12Readback(Decoder* d, Frame* out, DecodedFrame* frame)
+{
+    const Dpb& dpb = d->_dpb;
+    if (!dpb._dst_linear && !dpb._host_copy)
+        FinishHostReadback(d->_sys_vk, &out->readback);
+    frame->_frame = out;
+    frame->_data = (const u8*)out->host;
+    frame->_pictures[0] = NV12Picture(out->host_layout, 0);
+    frame->_num_pictures = 1;
+}
+
+// Keeps the slice NAL units of an Annex B access unit, compacted in place behind 3 byte start codes.
+// Parameter sets are the ones of AddSessionParameters until they are parsed, SEI, delimiters and filler data
+// are dropped. An SPS other than the last one in *sps flags the access unit, except for the first of the stream,
+// and sets *coded_extent to its size.
+static void DemuxAccessUnit(AccessUnit* au, std::vector<u8>* sps, VkExtent2D* coded_extent)
+{
+    u8* data = au->Data();
+    size_t size = au->_size;
+    auto next_start_code = [data, size](size_t from) {
+        for (size_t i = from; i + 3 <= size; i++)
+            if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+                return i;
+        return size;
+    };
+
+    // The compacted units never overtake the ones still to be read.
+    size_t out = 0;
+    au->_num_slices = 0;
+    for (size_t start = next_start_code(0); start < size;) {
+        size_t nal = start + 3;
+        size_t next = next_start_code(nal);
+        size_t end = next;
+        // trailing_zero_8bits, and the leading zero of a 4 byte start code
+        while (end > nal && data[end - 1] == 0)
+            end--;
+        u32 nal_unit_type = end > nal ? data[nal] & 0x1f : 0;
+        if (nal_unit_type == 7 && !std::equal(data + nal, data + end, sps->begin(), sps->end())) {
+            au->_new_sps = !sps->empty();
+            sps->assign(data + nal, data + end);
+            if (!ReadAvcCodedExtent(sps->data(), sps->size(), coded_extent))
+                printf("Truncated SPS, the coded size stays %ux%u\n", coded_extent->width, coded_extent->height);
+        }
+        if (nal_unit_type == 1 || nal_unit_type == 5) {
+            if (au->_num_slices == MaxSlicesPerPicture) {
+                printf("More than %u slices in a picture, dropping the rest\n", MaxSlicesPerPicture);
+                break;
+            }
+            au->_slice_offsets[au->_num_slices++] = (u32)out;
+            memmove(data + out + 3, data + nal, end - nal);
+            data[out] = 0;
+            data[out + 1] = 0;
+            data[out + 2] = 1;
+            out += 3 + end - nal;
+        }
+        start = next;
+    }
+    au->_size = out;
+}
+
+// Wakes up the coroutine awaiting NextFrame, once there is a frame or once everything sent has been processed.
+static void FinishAccessUnit(Decoder* d, bool output)
+{
+    u32 processed = d->_processed.fetch_add(1, std::memory_order_release) + 1;
+    d->_processed.notify_all();
+    std::coroutine_handle<> waiter;
+    {
+        std::lock_guard<std::mutex> lock(d->_waiter_mutex);
+        if (d->_frame_waiter && (output || processed == d->_sent.load(std::memory_order_acquire))) {
+            waiter = d->_frame_waiter;
+            d->_frame_waiter = nullptr;
+        }
+    }
+    // CPU only streams have no reactor, the waiter resumes on the thread of the pool that output the picture.
+    if (waiter && d->_sys_vk)
+        PostToReactor(d->_reactor, waiter);
+    else if (waiter)
+        waiter.resume();
+}
+
+static u8 UnormByte(float x)
+{
+    return (u8)(std::clamp(x, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// The picture in the output format of the stream, in memory of its own, laid out like the output of the compute
+// stage without row padding. RGBA8 takes the nearest chroma sample, as nv12_convert.comp does. Chroma planes of
+// odd sizes are rounded up, like the planes openh264 outputs.
+static DecodedFrame* NewCpuFrame(Decoder* d, const CpuPicture* picture)
+{
+    u32 w = picture->_width;
+    u32 h = picture->_height;
+    u32 cw = (w + 1) / 2;
+    u32 ch = (h + 1) / 2;
+    const u8* const* src = picture->_planes;
+    const u32* pitch = picture->_pitches;
+    size_t luma_size = size_t(w) * h;
+    size_t chroma_size = size_t(cw) * ch;
+    size_t size = luma_size + 2 * chroma_size;
+    if (d->_cpu_output == DECODER_OUTPUT_RGBA8)
+        size = luma_size * 4;
+    else if (d->_cpu_output == DECODER_OUTPUT_CHECKSUM)
+        size = 3 * sizeof(u32);
+
+    auto* frame = new DecodedFrame;
+    frame->_decoder = d;
+    frame->_pts = picture->_pts;
+    frame->_host = (u8*)malloc(size);
+    if (!frame->_host)
+        XERROR(1, "Could not allocate frame\n");
+    frame->_data = frame->_host;
+    frame->_num_pictures = 1;
+    FramePicture& p = frame->_pictures[0];
+    u8* dst = frame->_host;
+
+    switch (d->_cpu_output) {
+    case DECODER_OUTPUT_RGBA8: {
+        float row_r[4], row_g[4], row_b[4];
+        ComputeConversionMatrix(d->_options.bt601 ? COLOR_MATRIX_BT601 : COLOR_MATRIX_BT709, d->_options.full_range,
+            row_r, row_g, row_b);
+        for (u32 y = 0; y < h; y++) {
+            const u8* luma = src[0] + size_t(y) * pitch[0];
+            const u8* cb = src[1] + size_t(y / 2) * pitch[1];
+            const u8* cr = src[2] + size_t(y / 2) * pitch[2];
+            u8* row = dst + size_t(y) * w * 4;
+            for (u32 x = 0; x < w; x++) {
+                float ycc[4] = { luma[x] / 255.0f, cb[x / 2] / 255.0f, cr[x / 2] / 255.0f, 1.0f };
+                auto dot = [&ycc](const float* m) { return m[0] * ycc[0] + m[1] * ycc[1] + m[2] * ycc[2] + m[3]; };
+                row[x * 4 + 0] = UnormByte(dot(row_r));
+                row[x * 4 + 1] = UnormByte(dot(row_g));
+                row[x * 4 + 2] = UnormByte(dot(row_b));
+                row[x * 4 + 3] = 255;
+            }
+        }
+        p = PackedPicture(FRAME_FORMAT_RGBA8, w, h, 0);
+        p.planes[0] = { 0, w * 4, w * 4, h };
+        break;
+    }
+    case DECODER_OUTPUT_I420:
+        for (u32 y = 0; y < h; y++)
+            memcpy(dst + size_t(y) * w, src[0] + size_t(y) * pitch[0], w);
+        for (u32 plane = 1; plane < 3; plane++) {
+            u8* chroma = dst + luma_size + (plane - 1) * chroma_size;
+            for (u32 y = 0; y < ch; y++)
+                memcpy(chroma + size_t(y) * cw, src[plane] + size_t(y) * pitch[plane], cw);
+        }
+        p = PackedPicture(FRAME_FORMAT_I420, w, h, 0);
+        p.num_planes = 3;
+        p.planes[0] = { 0, w, w, h };
+        p.planes[1] = { luma_size, cw, cw, ch };
+        p.planes[2] = { luma_size + chroma_size, cw, cw, ch };
+        break;
+    case DECODER_OUTPUT_CHECKSUM: {
+        u32 digests[3] = {
+            util::LaneHashPlane(src[0], w, h, pitch[0]),
+            util::LaneHashPlane(src[1], w / 2, h / 2, pitch[1]),
+            util::LaneHashPlane(src[2], w / 2, h / 2, pitch[2]),
+        };
+        memcpy(dst, digests, sizeof(digests));
+        p = PackedPicture(FRAME_FORMAT_CHECKSUM, w, h, sizeof(digests));
+        break;
+    }
+    default:
+        for (u32 y = 0; y < h; y++)
+            memcpy(dst + size_t(y) * w, src[0] + size_t(y) * pitch[0], w);
+        for (u32 y = 0; y < ch; y++) {
+            u8* chroma = dst + luma_size + size_t(y) * cw * 2;
+            const u8* cb = src[1] + size_t(y) * pitch[1];
+            const u8* cr = src[2] + size_t(y) * pitch[2];
+            for (u32 x = 0; x < cw; x++) {
+                chroma[x * 2] = cb[x];
+                chroma[x * 2 + 1] = cr[x];
+            }
+        }
+        p = PackedPicture(FRAME_FORMAT_NV12, w, h, 0);
+        p.num_planes = 2;
+        p.planes[0] = { 0, w, w, h };
+        p.planes[1] = { luma_size, cw * 2, cw * 2, ch };
+        break;
+    }
+    return frame;
+}
+
+// The output of the CPU stream of d, on a thread of the pool. Takes the place of the retire stage.
+static void ReceiveCpuPicture(void* user, const CpuPicture* picture)
+{
+    auto* d = (Decoder*)user;
+    if (!picture) {
+        d->_dropped++;
+        FinishAccessUnit(d, false);
+        return;
+    }
+    if (d->_decoded++ == 0)
+        printf("Time to first frame: %" PRIu64 " us\n", d->_first_frame_timer.ElapsedMicroseconds());
+    DecodedFrame* frame = NewCpuFrame(d, picture);
+    d->_outstanding++;
+    d->_output.Push(frame);
+    FinishAccessUnit(d, true);
+}
+
+// Placement of new streams, shared by the decoders of the process: a stream goes to the CPU when asked to, or
+// once the decodes in flight on the GPUs reach gpu_queue_limit and a core is left for it.
+static bool PlaceOnCpu(const DecoderOptions& options)
+{
+    if (options.cpu_only)
+        return true;
+    if (!options.cpu_fallback || options.gpu_queue_limit == 0)
+        return false;
+    u32 depth = gpu_decodes_in_flight.load(std::memory_order_relaxed);
+    if (depth < options.gpu_queue_limit)
+        return false;
+    float headroom = CpuHeadroom();
+    printf("%u decodes in flight on the GPUs, %.1f cores free\n", depth, headroom);
+    return headroom >= 1.0f;
+}
+
+// openh264 starts from the parameter sets the GPU session would have been given.
+static bool OpenOnCpu(Decoder* d)
+{
+    AvcParameterSets ps;
+    InitAvcParameterSets(&ps);
+    d->_cpu_stream = OpenCpuStream(d->_options.cpu_threads, WriteAvcParameterSets(ps), ReceiveCpuPicture, d);
+    if (!d->_cpu_stream)
+        return false;
+    switch (d->_options.output) {
+    case DECODER_OUTPUT_NV12:
+    case DECODER_OUTPUT_RGBA8:
+    case DECODER_OUTPUT_I420:
+    case DECODER_OUTPUT_CHECKSUM:
+        d->_cpu_output = d->_options.output;
+        break;
+    default:
+        printf("Previews, tensors and mosaics are only made on the GPU, the CPU outputs NV12\n");
+        d->_cpu_output = DECODER_OUTPUT_NV12;
+        break;
+    }
+    if (!d->_sys_vk)
+        d->_first_frame_timer.GetCurrentTime();
+    printf("Stream placed on the CPU\n");
+    return true;
+}
+
+static void ParseStage(Decoder* d)
+{
+    PipelineStage& stage = d->_parse_stage;
+    util::Timer busy;
+    bool new_sps = false; // carried over access units without slices
+    VkExtent2D coded_extent { d->_width, d->_height };
+    for (;;)
+    {
+        AccessUnit* au;
+        d->_sent_units.Pop(&au);
+        if (!au)
+            break;
+        busy.GetCurrentTime();
+        au->_new_sps = false;
+        DemuxAccessUnit(au, &d->_sps, &coded_extent);
+        new_sps |= au->_new_sps;
+        au->_new_sps = new_sps;
+        au->_coded_extent = coded_extent;
+        stage._items++;
+        stage._busy_ns += busy.ElapsedNanoseconds();
+        if (au->_num_slices == 0) {
+            free(au);
+            d->_dropped++;
+            FinishAccessUnit(d, false);
+            continue;
+        }
+        new_sps = false;
+        d->_parsed_units.Push(au);
+    }
+    d->_parsed_units.Push(nullptr);
+}
+
+// On the submit stage, before the first decode at a new coded size. Every frame of the old size must have been
+// released, by the retire stage and the application, the DPB and output images then go back to the device's
+// pool and those of the new size come from it.
+static void ResizePictures(Decoder* d, VkExtent2D extent)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    if (extent.width > d->_video_caps.maxCodedExtent.width || extent.height > d->_video_caps.maxCodedExtent.height) {
+        printf("%ux%u is larger than the device decodes, pictures stay %ux%u\n", extent.width, extent.height,
+            d->_width, d->_height);
+        return;
+    }
+    util::Timer t;
+    WaitFramePoolIdle(&d->_frame_pool);
+    DestroyFramePool(sys_vk, &d->_frame_pool, &d->_readback_pool);
+    DestroyDpbResource(sys_vk, &d->_dpb);
+    d->_width = extent.width;
+    d->_height = extent.height;
+    CreatePictures(d);
+    ComputeOutputLayouts(d);
+    printf("Pictures resized to %ux%u in %" PRIu64 " us\n", d->_width, d->_height, t.ElapsedMicroseconds());
+}
+
+// On the submit stage, before the first decode after an SPS change. The parameters are still made of the
+// parameter sets of AddSessionParameters until streams are parsed.
+static void ReconfigureSession(Decoder* d)
+{
+    d->_sps_changes++;
+    d->_sps_session_reuses += ReconfigureVideoSession(d->_sys_vk, &d->_session, &d->_profile, d->_dst_format.format, d->_dpb_format.format,
+        VkExtent2D { d->_width, d->_height }, &d->_video_caps, 1, 1, d->_decode_done, d->_decode_value);
+}
+
+// Uploads the slices of au and submits their decode into out, which signals sub->_value on _decode_done.
+static void SubmitDecode(Decoder* d, DecodeSubmission* sub, Frame* out, const AccessUnit* au)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+
+    VkDeviceSize slice_range = 0;
+    VkDeviceSize slice_offset = PushAccessUnit(sys_vk, &d->_bitstream_ring, au->Data(), au->_size, sub->_value,
+        &slice_range);
+    u64 bitstream_upload_value = 0;
+    {
+        std::lock_guard<std::mutex> lock(sys_vk->_queue_mutex);
+        bitstream_upload_value = SubmitBitstreamUploads(sys_vk, &d->_bitstream_ring);
+    }
+    VkBufferMemoryBarrier2 bitstream_barrier = BitstreamRingBarrier(&d->_bitstream_ring);
+
+    if (!d->_dpb._coincident_image_resources)
+        d->_dpb.BindOutputLayer(out->slot, out->layer);
+    RecordDecode(d, sub, out->slot, au, slice_offset, slice_range, bitstream_barrier);
+    out->layout = d->_dpb.DecodedOutputLayout();
+
+    // The decode waits for the upload of its access unit when the bitstream is staged.
+    VkPipelineStageFlags bitstream_wait_stage = VK_PIPELINE_STAGE_VIDEO_DECODE_BIT_KHR;
+    VkTimelineSemaphoreSubmitInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.waitSemaphoreValueCount = 0;
+    timeline_info.pWaitSemaphoreValues = &bitstream_upload_value;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &sub->_value;
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.waitSemaphoreCount = 0;
+    submit_info.pWaitSemaphores = nullptr;
+    submit_info.pWaitDstStageMask = 0;
+    if (bitstream_upload_value != 0)
+    {
+        timeline_info.waitSemaphoreValueCount = 1;
+        submit_info.waitSemaphoreCount = 1;
+        submit_info.pWaitSemaphores = &d->_bitstream_ring._uploaded;
+        submit_info.pWaitDstStageMask = &bitstream_wait_stage;
+    }
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &sub->_cmd_buf;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &d->_decode_done;
+    std::lock_guard<std::mutex> lock(sys_vk->_queue_mutex);
+    VK_CHECK(vk.QueueSubmit(sys_vk->_decode_queue0, 1, &submit_info, VK_NULL_HANDLE));
+}
+
+// Signals the value after the last decode on the decode queue, the retire stage finds the end of the stream
+// queued for it.
+static void SubmitEndOfStream(Decoder* d)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+    u64 signal_value = ++d->_decode_value;
+    VkTimelineSemaphoreSubmitInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &signal_value;
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &d->_decode_done;
+    std::lock_guard<std::mutex> lock(sys_vk->_queue_mutex);
+    VK_CHECK(vk.QueueSubmit(sys_vk->_decode_queue0, 1, &submit_info, VK_NULL_HANDLE));
+}
+
+static void SubmitStage(Decoder* d)
+{
+    PipelineStage& stage = d->_submit_stage;
+    util::Timer busy;
+    for (;;)
+    {
+        AccessUnit* au;
+        d->_parsed_units.Pop(&au);
+        if (!au)
+            break;
+        // Waits while consumers hold any frame of the old size
+        if (au->_coded_extent.width != d->_width || au->_coded_extent.height != d->_height)
+            ResizePictures(d, au->_coded_extent);
+        // Waits while consumers hold every output frame, then while MaxDecodesInFlight decodes are running
+        Frame* out = AcquireFrame(&d->_frame_pool);
+        DecodeSubmission* sub;
+        d->_free_submissions.Pop(&sub);
+
+        busy.GetCurrentTime();
+        if (au->_new_sps)
+            ReconfigureSession(d);
+        out->pts = au->_pts;
+        sub->_frame = out;
+        sub->_pts = au->_pts;
+        sub->_value = ++d->_decode_value;
+        // Queued before it can complete, the retire stage takes it once its value is signalled
+        d->_submitted.Push(sub);
+        gpu_decodes_in_flight++;
+        SubmitDecode(d, sub, out, au);
+        free(au);
+        stage._items++;
+        stage._busy_ns += busy.ElapsedNanoseconds();
+    }
+    d->_submitted.Push(nullptr);
+    SubmitEndOfStream(d);
+}
+
+// Returns false when the decode of sub failed.
+static bool DecodeSucceeded(Decoder* d, const DecodeSubmission* sub)
+{
+    SysVulkan* sys_vk = d->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+    if (!sys_vk->DecodeQueriesAreSupported())
+        return true;
+
+    VkQueryResultStatusKHR decode_status;
+    VK_CHECK(vk.GetQueryPoolResults(sys_vk->_active_dev,
+        d->_query_pool,
+        sub->_query,
+        1,
+        sizeof(decode_status),
+        &decode_status,
+        sizeof(decode_status),
+        VK_QUERY_RESULT_WITH_STATUS_BIT_KHR | VK_QUERY_RESULT_WAIT_BIT));
+    if (decode_status != VK_QUERY_RESULT_STATUS_COMPLETE_KHR) {
+        printf("Decode failed with status %d\n", decode_status);
+        return false;
+    }
+    return true;
+}
+
+// Resumed on the reactor thread as the decodes complete, in submission order, then as their readbacks do. An
+// access unit is retired before the next one, which reuses the readback command buffers. Never blocks: the
+// submissions are queued before their decode, and SendAccessUnit keeps _output from filling up.
+static DetachedCoroutine RetireStage(Decoder* d)
+{
+    PipelineStage& stage = d->_retire_stage;
+    util::Timer busy;
+    for (u64 value = 1;; value++)
+    {
+        co_await SemaphoreSignal { d->_reactor, d->_decode_done, value };
+        busy.GetCurrentTime();
+        DecodeSubmission* sub;
+        d->_submitted.Pop(&sub);
+        if (!sub)
+            break;
+        Frame* out = sub->_frame;
+        i64 pts = sub->_pts;
+        bool decoded = DecodeSucceeded(d, sub);
+        gpu_decodes_in_flight--;
+        sub->_frame = nullptr;
+        d->_free_submissions.Push(sub);
+        stage._items++;
+        if (!decoded) {
+            UnrefFrame(out);
+            d->_failed++;
+            d->_dropped++;
+            // The stream moves to the CPU from its next IDR picture
+            if (d->_options.cpu_fallback && d->_failed == d->_options.gpu_error_limit) {
+                printf("%u decodes failed on the GPU, moving the stream to the CPU\n", d->_failed);
+                d->_move_to_cpu.store(true, std::memory_order_relaxed);
+            }
+            stage._busy_ns += busy.ElapsedNanoseconds();
+            FinishAccessUnit(d, false);
+            continue;
+        }
+        if (d->_decoded++ == 0)
+            printf("Time to first frame: %" PRIu64 " us\n", d->_first_frame_timer.ElapsedMicroseconds());
+        out->coded_picture_number = out->display_picture_number = (int)d->_decoded - 1;
+
+        auto* frame = new DecodedFrame;
+        frame->_decoder = d;
+        frame->_pts = pts;
+        bool nv12 = d->_options.output == DECODER_OUTPUT_NV12;
+        u64 readback = nv12 ? SubmitNV12Readback(d, out) : SubmitComputedReadback(d, out, frame);
+        if (readback != 0) {
+            stage._busy_ns += busy.ElapsedNanoseconds();
+            co_await SemaphoreSignal { d->_reactor, d->_readback_done, readback };
+            busy.GetCurrentTime();
+        }
+        if (nv12) {
+            FinishNV12Readback(d, out, frame);
+        } else {
+            // Only the result of the compute stage leaves the GPU, the slot is free again once it has run.
+            FinishComputedReadback(d, frame);
+            UnrefFrame(out);
+        }
+        d->_outstanding++;
+        stage._busy_ns += busy.ElapsedNanoseconds();
+        d->_output.Push(frame);
+        FinishAccessUnit(d, true);
+    }
+    // The reactor outlives the decoder, which may be freed as soon as the mutex is released: nothing of it is
+    // touched after that.
+    std::lock_guard<std::mutex> lock(d->_retire_mutex);
+    d->_retired_all = true;
+    d->_retire_cv.notify_all();
+}
+
+static void StartPipeline(Decoder* d)
+{
+    for (PipelineStage* stage : { &d->_parse_stage, &d->_submit_stage, &d->_retire_stage })
+        stage->_lifetime.GetCurrentTime();
+    d->_parse_stage._thread = std::thread(ParseStage, d);
+    d->_submit_stage._thread = std::thread(SubmitStage, d);
+    RetireStage(d);
+}
+
+// The end of the stream goes down the pipeline as a null entry.
+static void StopPipeline(Decoder* d)
+{
+    d->_sent_units.Push(nullptr);
+    for (PipelineStage* stage : { &d->_parse_stage, &d->_submit_stage }) {
+        stage->_thread.join();
+        stage->_lifetime_ns = stage->_lifetime.ElapsedNanoseconds();
+    }
+    {
+        std::unique_lock<std::mutex> lock(d->_retire_mutex);
+        d->_retire_cv.wait(lock, [d] { return d->_retired_all; });
+    }
+    d->_retire_stage._lifetime_ns = d->_retire_stage._lifetime.ElapsedNanoseconds();
+}
+
+static void PrintPipelineStats(Decoder* d)
+{
+    printf("Pipeline: %u access units sent, %" PRIu64 " decoded, %u failed\n", d->_sent.load(), d->_decoded, d->_failed);
+    if (!d->_sys_vk)
+        return;
+    for (const PipelineStage* stage : { &d->_parse_stage, &d->_submit_stage, &d->_retire_stage })
+        printf("  %-6s stage: %" PRIu64 " items, busy %5.1f%% of %" PRIu64 " ms\n", stage->_name, stage->_items,
+            stage->_lifetime_ns ? 100.0 * stage->_busy_ns / stage->_lifetime_ns : 0.0, stage->_lifetime_ns / 1000000);
+
+    auto print_queue = [](const char* name, const auto& queue) {
+        printf("  %-16s queue: average %5.2f of %u, max %u, producer waited %u times, consumer %u times\n", name,
+            queue.AverageOccupancy(), queue.Capacity(), queue.MaxOccupancy(), queue.FullWaits(), queue.EmptyWaits());
+    };
+    print_queue("sent", d->_sent_units);
+    print_queue("parsed", d->_parsed_units);
+    print_queue("submitted", d->_submitted);
+    print_queue("free submissions", d->_free_submissions);
+    print_queue("output", d->_output);
+}
+
+bool SendAccessUnit(Decoder* d, const void* data, size_t size, int64_t pts)
+{
+    // Access units without a received frame are bounded by the capacity of _output, so the retire stage never
+    // waits for room in it.
+    u32 in_flight = d->_sent - d->_received - d->_dropped.load(std::memory_order_relaxed);
+    if (in_flight >= d->_output.Capacity())
+        return false;
+    // The pool takes over at an IDR picture once the GPU pipeline is drained, _output has one producer at a time.
+    if (!d->_cpu_stream && d->_move_to_cpu.load(std::memory_order_relaxed)
+        && (NalUnitTypes((const u8*)data, size) & NalUnitIdrSlice)) {
+        if (d->_processed.load(std::memory_order_acquire) != d->_sent)
+            return false;
+        if (!OpenOnCpu(d))
+            d->_move_to_cpu.store(false, std::memory_order_relaxed);
+    }
+    if (d->_cpu_stream) {
+        if (CpuStreamPending(d->_cpu_stream) >= PipelineQueueDepth)
+            return false;
+        d->_sent++;
+        QueueCpuAccessUnit(d->_cpu_stream, data, size, pts);
+        return true;
+    }
+    if (d->_sent_units.Full())
+        return false;
+    auto* au = (AccessUnit*)malloc(sizeof(AccessUnit) + size);
+    if (!au)
+        XERROR(1, "Could not allocate access unit\n");
+    au->_size = size;
+    au->_pts = pts;
+    au->_num_slices = 0;
+    memcpy(au->Data(), data, size);
+    d->_sent++;
+    d->_sent_units.Push(au);
+    return true;
+}
+
+DecodedFrame* ReceiveFrame(Decoder* d, bool wait)
+{
+    CpuStream* cpu = d->_cpu_stream;
+    for (;;)
+    {
+        // Frames are output before their access unit counts as processed
+        u32 cpu_finished = cpu ? CpuStreamFinished(cpu) : 0;
+        u32 processed = d->_processed.load(std::memory_order_acquire);
+        DecodedFrame* frame;
+        if (d->_output.TryPop(&frame)) {
+            d->_received++;
+            return frame;
+        }
+        if (!wait || processed == d->_sent)
+            return nullptr;
+        // Nothing more is sent while waiting, openh264 has to give up the pictures it holds back
+        if (cpu)
+            RequestCpuStreamFlush(cpu, cpu_finished);
+        d->_processed.wait(processed, std::memory_order_acquire);
+    }
+}
+
+bool FrameAwaiter::await_ready()
+{
+    u32 processed = decoder->_processed.load(std::memory_order_acquire);
+    frame = ReceiveFrame(decoder);
+    return frame || processed == decoder->_sent;
+}
+
+bool FrameAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    // Under the lock, the retire stage either finds the waiter or has output what await_ready finds
+    Decoder* d = decoder;
+    CpuStream* cpu = d->_cpu_stream;
+    std::lock_guard<std::mutex> lock(d->_waiter_mutex);
+    u32 cpu_finished = cpu ? CpuStreamFinished(cpu) : 0;
+    if (await_ready())
+        return false;
+    ASSERT(!d->_frame_waiter);
+    d->_frame_waiter = handle;
+    // Still under the lock, the pool resumes the waiter with it, which may close the decoder
+    if (cpu)
+        RequestCpuStreamFlush(cpu, cpu_finished);
+    return true;
+}
+
+DecodedFrame* FrameAwaiter::await_resume()
+{
+    if (!frame)
+        frame = ReceiveFrame(decoder);
+    return frame;
+}
+
+DecodedFrame* RetainFrame(DecodedFrame* frame)
+{
+    frame->_refs.fetch_add(1, std::memory_order_relaxed);
+    return frame;
+}
+
+static void ReleaseCanvas(DecodedFrame* frame);
+
+void ReleaseFrame(DecodedFrame* frame)
+{
+    if (frame->_refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    if (frame->_mosaic)
+        return ReleaseCanvas(frame);
+    Decoder* d = frame->_decoder;
+    if (frame->_buffer._buffer != VK_NULL_HANDLE) {
+        std::lock_guard<std::mutex> lock(d->_readback_mutex);
+        ReleaseReadbackBuffer(&d->_readback_pool, frame->_buffer);
+    }
+    if (frame->_frame)
+        UnrefFrame(frame->_frame);
+    free(frame->_host);
+    d->_outstanding--;
+    delete frame;
+}
+
+int64_t FramePts(const DecodedFrame* frame)
+{
+    return frame->_pts;
+}
+
+const uint8_t* FrameData(const DecodedFrame* frame)
+{
+    return frame->_data;
+}
+
+uint32_t FramePictureCount(const DecodedFrame* frame)
+{
+    return frame->_num_pictures;
+}
+
+const FramePicture& GetFramePicture(const DecodedFrame* frame, uint32_t index)
+{
+    ASSERT(index < frame->_num_pictures);
+    return frame->_pictures[index];
+}
+
+struct Mosaic
+{
+    SysVulkan* _sys_vk { nullptr };
+    VkFormat _format { VK_FORMAT_UNDEFINED }; // of the frames it samples
+    u32 _num_tiles { 0 };
+    MosaicCompositor _compositor {};
+    MosaicLayout _layout {};
+    VkCommandPool _cmd_pool { VK_NULL_HANDLE };
+    VkCommandBuffer _cmd_buf { VK_NULL_HANDLE };
+    VkSemaphore _done { VK_NULL_HANDLE }; // signalled by every composite, in order
+    u64 _value { 0 };
+
+    ReadbackBufferPool _readback_pool; // of the canvases
+    std::mutex _readback_mutex; // canvases are released from any thread
+    std::atomic<u32> _outstanding { 0 };
+    u64 _composites { 0 };
+    u64 _black_tiles { 0 }; // for frames it could not sample
+};
+
+Mosaic* OpenMosaic(const Decoder* decoder, uint32_t num_tiles, uint32_t tile_width, uint32_t tile_height)
+{
+    SysVulkan* sys_vk = decoder->_sys_vk;
+    if (!sys_vk || !MosaicSupported(sys_vk) || num_tiles == 0) {
+        printf("Mosaic compositing is not supported on this device\n");
+        return nullptr;
+    }
+    u32 limit = MosaicTileLimit(sys_vk);
+    if (num_tiles > limit) {
+        printf("The device samples up to %u tiles at once, compositing %u rather than %u\n", limit, limit, num_tiles);
+        num_tiles = limit;
+    }
+
+    auto& vk = sys_vk->_vfn;
+    auto* m = new Mosaic;
+    m->_sys_vk = sys_vk;
+    m->_format = OutputFormat(decoder);
+    m->_num_tiles = num_tiles;
+    m->_compositor = CreateMosaicCompositor(sys_vk, m->_format, num_tiles);
+    m->_layout = ComputeMosaicLayout(num_tiles, tile_width, tile_height);
+    m->_done = CreateTimelineSemaphore(sys_vk);
+
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    cmd_pool_info.queueFamilyIndex = sys_vk->queue_family_comp_index;
+    VK_CHECK(vk.CreateCommandPool(sys_vk->_active_dev, &cmd_pool_info, nullptr, &m->_cmd_pool));
+    VkCommandBufferAllocateInfo cmd_buf_alloc_info = {};
+    cmd_buf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buf_alloc_info.commandPool = m->_cmd_pool;
+    cmd_buf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buf_alloc_info.commandBufferCount = 1;
+    VK_CHECK(vk.AllocateCommandBuffers(sys_vk->_active_dev, &cmd_buf_alloc_info, &m->_cmd_buf));
+    printf("Mosaic of %u tiles, %ux%u canvas\n", num_tiles, m->_layout._width, m->_layout._height);
+    return m;
+}
+
+void CloseMosaic(Mosaic* m)
+{
+    SysVulkan* sys_vk = m->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+    ASSERT(m->_outstanding == 0);
+    printf("Mosaic: %" PRIu64 " composites, %" PRIu64 " tiles left black for frames it could not sample\n",
+        m->_composites, m->_black_tiles);
+    vk.DestroyCommandPool(sys_vk->_active_dev, m->_cmd_pool, nullptr);
+    vk.DestroySemaphore(sys_vk->_active_dev, m->_done, nullptr);
+    DestroyReadbackBufferPool(sys_vk, &m->_readback_pool);
+    DestroyMosaicCompositor(sys_vk, &m->_compositor);
+    delete m;
+}
+
+uint32_t MosaicTileCount(const Mosaic* m)
+{
+    return m->_num_tiles;
+}
+
+// Received frames of mosaic sources on the device of the mosaic, left sampleable by their readback.
+static bool MosaicCanSample(const Mosaic* m, const DecodedFrame* frame)
+{
+    const Frame* out = frame->_frame;
+    return out && frame->_decoder && frame->_decoder->_sys_vk == m->_sys_vk && frame->_decoder->_mosaic_source &&
+        out->format == m->_format;
+}
+
+DecodedFrame* ComposeMosaic(Mosaic* m, DecodedFrame* const* frames, uint32_t num_frames)
+{
+    SysVulkan* sys_vk = m->_sys_vk;
+    auto& vk = sys_vk->_vfn;
+    num_frames = std::min(num_frames, m->_num_tiles);
+    std::vector<MosaicSource> sources(num_frames, MosaicSource { nullptr, 0, VK_IMAGE_LAYOUT_UNDEFINED });
+    for (u32 i = 0; i < num_frames; i++) {
+        if (!frames[i])
+            continue;
+        if (!MosaicCanSample(m, frames[i])) {
+            m->_black_tiles++;
+            continue;
+        }
+        const Frame* out = frames[i]->_frame;
+        sources[i] = { &frames[i]->_decoder->_dpb, out->slot, out->layout };
+    }
+
+    const MosaicLayout& l = m->_layout;
+    auto* canvas = new DecodedFrame;
+    canvas->_decoder = nullptr;
+    canvas->_mosaic = m;
+    {
+        std::lock_guard<std::mutex> lock(m->_readback_mutex);
+        canvas->_buffer = AcquireReadbackBuffer(sys_vk, &m->_readback_pool, l._size);
+    }
+    canvas->_data = (const u8*)canvas->_buffer._mapped;
+    FramePicture& p = canvas->_pictures[0];
+    p = PackedPicture(FRAME_FORMAT_NV12, l._width, l._height, 0);
+    p.num_planes = 2;
+    p.planes[0] = { 0, l._width, l._width, l._height };
+    p.planes[1] = { (size_t)l._chroma_offset, l._width, l._width, l._height / 2 };
+    canvas->_num_pictures = 1;
+    m->_outstanding++;
+    m->_composites++;
+
+    // Without a single source the canvas is limited range black, written by the host.
+    if (std::none_of(sources.begin(), sources.end(), [](const MosaicSource& s) { return s._dpb != nullptr; })) {
+        memset(canvas->_buffer._mapped, 0x10, l._chroma_offset);
+        memset((u8*)canvas->_buffer._mapped + l._chroma_offset, 0x80, l._size - l._chroma_offset);
+        return canvas;
+    }
+
+    VkCommandBufferBeginInfo cmd_buf_begin_info = {};
+    cmd_buf_begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    cmd_buf_begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vk.BeginCommandBuffer(m->_cmd_buf, &cmd_buf_begin_info);
+    RecordMosaic(sys_vk, &m->_compositor, m->_cmd_buf, sources.data(), num_frames, l, canvas->_buffer._buffer);
+    vk.EndCommandBuffer(m->_cmd_buf);
+
+    u64 signal_value = ++m->_value;
+    VkTimelineSemaphoreSubmitInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.signalSemaphoreValueCount = 1;
+    timeline_info.pSignalSemaphoreValues = &signal_value;
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &m->_cmd_buf;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &m->_done;
+    {
+        std::lock_guard<std::mutex> lock(sys_vk->_queue_mutex);
+        VK_CHECK(vk.QueueSubmit(sys_vk->_comp_queue0, 1, &submit_info, VK_NULL_HANDLE));
+    }
+    VkSemaphoreWaitInfo wait_info = {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &m->_done;
+    wait_info.pValues = &signal_value;
+    VK_CHECK(vk.WaitSemaphores(sys_vk->_active_dev, &wait_info, UINT64_MAX));
+    VK_CHECK(vmaInvalidateAllocation(sys_vk->_allocator, canvas->_buffer._allocation, 0, VK_WHOLE_SIZE));
+    return canvas;
+}
+
+static void ReleaseCanvas(DecodedFrame* frame)
+{
+    Mosaic* m = frame->_mosaic;
+    {
+        std::lock_guard<std::mutex> lock(m->_readback_mutex);
+        ReleaseReadbackBuffer(&m->_readback_pool, frame->_buffer);
+    }
+    m->_outstanding--;
+    delete frame;
+}
+
+} // namespace vvb
@@ -0,0 +1,179 @@
+#pragma once
+/*
+* Copyright 2023 Igalia S.L.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+// The API of the vvb library, for embedding the decoder in another process. A decoder takes H.264 access units
+// and hands out decoded frames in host memory, through refcounted handles. Vulkan stays an implementation
+// detail, applications only include this header and link vvb.
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+
+namespace vvb {
+
+constexpr uint32_t DecoderMaxPreviews = 4;
+constexpr uint32_t DecoderMaxMosaicTiles = 64;
+
+// What a decoder makes of every decoded picture before it leaves the GPU.
+enum DecoderOutput
+{
+    DECODER_OUTPUT_NV12,
+    DECODER_OUTPUT_RGBA8,
+    DECODER_OUTPUT_I420,
+    DECODER_OUTPUT_PREVIEWS, // only NV12 renditions downscaled by each of preview_divisors
+    DECODER_OUTPUT_TENSOR, // a letterboxed, normalized 1x3xHxW RGB tensor
+    DECODER_OUTPUT_MOSAIC, // a canvas with the picture in mosaic_tiles half size tiles, see OpenMosaic for many streams
+    DECODER_OUTPUT_CHECKSUM, // the per-plane digests of util::LaneHashPlane
+};
+
+struct DecoderOptions
+{
+    // Device selection, see the flags of vvp
+    const char* device_name { nullptr }; // case insensitive substring of the device name
+    int device_major { -1 }; // primary DRM node
+    int device_minor { -1 };
+    int driver_major { -1 };
+    int driver_minor { -1 };
+    int driver_patch { -1 };
+    bool all_devices { false }; // open every matching device and place the stream on the least loaded
+    bool detect { false }; // list devices, layers, extensions and queue families, refresh the capability cache
+    bool validate { false };
+    const char* mock_driver { nullptr }; // key=value,... configuration of the mock driver, "" for its defaults
+
+    DecoderOutput output { DECODER_OUTPUT_NV12 };
+    bool bt601 { false }; // YCbCr to RGB matrix of RGBA8 and tensors, BT.709 otherwise
+    bool full_range { false };
+    uint32_t preview_divisors[DecoderMaxPreviews] {};
+    uint32_t num_previews { 0 };
+    bool preview_area_filter { false }; // box filter instead of bilinear
+    uint32_t tensor_width { 0 };
+    uint32_t tensor_height { 0 };
+    bool tensor_fp16 { false };
+    float tensor_mean[3] { 0.0f, 0.0f, 0.0f }; // in the [0, 1] range
+    float tensor_std[3] { 1.0f, 1.0f, 1.0f };
+    uint32_t mosaic_tiles { 0 }; // capped by the descriptor limits of the device
+    bool mosaic_source { false }; // NV12 frames stay on the GPU in a layout ComposeMosaic samples
+    bool measure_stream_switch { false }; // time DPB recreation across resolutions when opening
+    // Output pictures that can be decoded or held at once: the reorder depth of the stream plus one being decoded,
+    // plus held_frames, up to 15. output_frames only raises it. NV12 frames are read in place or from host memory
+    // owned by their output slot, which is only decoded into again once the frame is released.
+    uint32_t held_frames { 1 }; // received and not released yet, at most
+    uint32_t output_frames { 0 };
+
+    // Decoding with openh264 on a pool of CPU threads shared by the process, in the same frame formats, except
+    // for previews, tensors and mosaics which are output as NV12. With cpu_fallback, a stream goes to the pool when
+    // no device decodes it, when gpu_queue_limit decodes are already in flight on the GPUs of the process and a
+    // core is free, or from its next IDR picture once gpu_error_limit decodes have failed on the GPU.
+    bool cpu_fallback { true };
+    bool cpu_only { false };
+    uint32_t cpu_threads { 0 }; // of the pool when it starts, one per core for 0
+    uint32_t gpu_queue_limit { 16 }; // 0 to never place streams by load
+    uint32_t gpu_error_limit { 3 }; // 0 to never move streams
+};
+
+enum FrameFormat
+{
+    FRAME_FORMAT_NV12,
+    FRAME_FORMAT_RGBA8,
+    FRAME_FORMAT_I420,
+    FRAME_FORMAT_TENSOR_F32,
+    FRAME_FORMAT_TENSOR_F16,
+    FRAME_FORMAT_CHECKSUM, // three u32, Y then Cb then Cr
+};
+
+// rows rows of row_bytes bytes, pitch bytes apart, from offset in the frame data.
+struct FramePlane
+{
+    size_t offset;
+    uint32_t pitch;
+    uint32_t row_bytes;
+    uint32_t rows;
+};
+
+// A picture held by a frame: the decoded picture in the output format, or one of its previews.
+struct FramePicture
+{
+    FrameFormat format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t num_planes;
+    FramePlane planes[3];
+};
+
+struct Decoder;
+struct DecodedFrame;
+struct Mosaic;
+
+// Access units are parsed and submitted by threads of the decoder, then retired on the reactor thread of its
+// device, which waits for the GPU for every stream on it. Streams on the CPU are decoded and output by the threads of the pool instead. A decoder is driven by one thread or coroutine at a time, calling SendAccessUnit,
+// ReceiveFrame or NextFrame, and CloseDecoder.
+
+// Returns nullptr when neither a device nor, with cpu_fallback, the CPU can decode with these options.
+Decoder* OpenDecoder(const DecoderOptions& options);
+// Every frame received from the decoder has to be released first. Frames not received yet are dropped.
+void CloseDecoder(Decoder* decoder);
+
+// Queues one Annex B access unit for decoding, pts is handed back with its frame. Returns false, without
+// taking it, while the decoder is full: receive frames, then send it again. Decoding stalls while more than
+// held_frames NV12 frames are held.
+bool SendAccessUnit(Decoder* decoder, const void* data, size_t size, int64_t pts);
+// The next decoded frame in output order, with a reference for the caller. Returns nullptr when none is ready,
+// or with wait, once every access unit sent so far has been decoded and its frame received.
+DecodedFrame* ReceiveFrame(Decoder* decoder, bool wait = false);
+
+// co_await NextFrame(decoder) is ReceiveFrame(decoder, true) for coroutines. Instead of blocking a thread, the
+// coroutine is suspended and resumed on the reactor thread, or on a thread of the CPU pool for streams that
+// started on the CPU, where it must not block either. CloseDecoder is not called from there.
+struct FrameAwaiter
+{
+    Decoder* decoder;
+    DecodedFrame* frame;
+
+    bool await_ready();
+    bool await_suspend(std::coroutine_handle<> handle);
+    DecodedFrame* await_resume();
+};
+
+inline FrameAwaiter NextFrame(Decoder* decoder)
+{
+    return FrameAwaiter { decoder, nullptr };
+}
+
+// Frames stay valid and unchanged while referenced, the decoder reuses their memory once the last one is gone.
+DecodedFrame* RetainFrame(DecodedFrame* frame);
+void ReleaseFrame(DecodedFrame* frame);
+
+int64_t FramePts(const DecodedFrame* frame);
+const uint8_t* FrameData(const DecodedFrame* frame);
+uint32_t FramePictureCount(const DecodedFrame* frame);
+const FramePicture& GetFramePicture(const DecodedFrame* frame, uint32_t index);
+
+// Video walls: a mosaic composites the NV12 frames of many decoders into the tiles of one NV12 canvas, in a
+// single dispatch, and only the canvas is read back. It runs on the device of decoder, which it must be closed
+// before, and takes the frames of the decoders opened with mosaic_source on that device: decoder itself, or
+// every stream placed on it with all_devices. num_tiles is capped by the descriptor limits of the device, tiles
+// are rounded down to a multiple of 4x2. Returns nullptr when the device can't composite.
+Mosaic* OpenMosaic(const Decoder* decoder, uint32_t num_tiles, uint32_t tile_width, uint32_t tile_height);
+// Every canvas must have been released first.
+void CloseMosaic(Mosaic* mosaic);
+uint32_t MosaicTileCount(const Mosaic* mosaic);
+// Scales frames[i] into tile i, row by row, and returns the canvas, a frame with a reference for the caller.
+// Tiles past num_frames, null frames and frames the mosaic can't sample are black. Waits for the GPU. A mosaic
+// is driven by one thread at a time.
+DecodedFrame* ComposeMosaic(Mosaic* mosaic, DecodedFrame* const* frames, uint32_t num_frames);
+
+} // namespace vvb
@@ -9,6 +9,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <vector>
 
 #include "util.hpp"
 
@@ -210,67 +211,30 @@ int EncodeBitstream(char **args, int numArgs)
 }
 
 #if HAVE_OPENH264
-void logDecodingState(DECODING_STATE st)
+// DecodeFrameNoDelay results are bit flags, the name of the lowest one set.
+static const char* DecodingStateName(DECODING_STATE st)
 {
-    switch (st) {
-        /**
-         * Errors derived from bitstream parsing
-         */
-    case dsErrorFree: //  = 0x00,   ///< bit stream error-free
-        fprintf(stderr, "DecodeFrameNoDelay -> dsErrorFree\n");
-        fflush(stderr);
-        break;
-    case dsFramePending: //  = 0x01,   ///< need more throughput to generate a frame output,
-        fprintf(stderr, "DecodeFrameNoDelay -> dsFramePending\n");
-        fflush(stderr);
-        break;
-    case dsRefLost: //  = 0x02,   ///< layer lost at reference frame with temporal id 0
-        fprintf(stderr, "DecodeFrameNoDelay -> dsRefLost\n");
-        fflush(stderr);
-        break;
-    case dsBitstreamError: //  = 0x04,   ///< error bitstreams(maybe broken internal frame) the decoder cared
-        fprintf(stderr, "DecodeFrameNoDelay -> dsBitstreamError\n");
-        fflush(stderr);
-        break;
-    case dsDepLayerLost: //  = 0x08,   ///< dependented layer is ever lost
-        fprintf(stderr, "DecodeFrameNoDelay -> dsDepLayerLost\n");
-        fflush(stderr);
-        break;
-    case dsNoParamSets: //  = 0x10,   ///< no parameter set NALs involved
-        fprintf(stderr, "DecodeFrameNoDelay -> dsNoParamSets\n");
-        fflush(stderr);
-        break;
-    case dsDataErrorConcealed: //  = 0x20,   ///< current data error concealed specified
-        fprintf(stderr, "DecodeFrameNoDelay -> dsDataErrorConcealed\n");
-        fflush(stderr);
-        break;
-    case dsRefListNullPtrs: //  = 0x40, ///<ref picure list contains null ptrs within uiRefCount range
-        fprintf(stderr, "DecodeFrameNoDelay -> dsRefListNullPtrs\n");
-        fflush(stderr);
-        break;
-        /**
-         * Errors derived from logic level
-         */
-    case dsInvalidArgument: //      = 0x1000, ///< invalid argument specified
-        fprintf(stderr, "DecodeFrameNoDelay -> dsInvalidArgument\n");
-        fflush(stderr);
-        break;
-    case dsInitialOptExpected: //   = 0x2000, ///< initializing operation is expected
-        fprintf(stderr, "DecodeFrameNoDelay -> dsInitialOptExpected\n");
-        fflush(stderr);
-        break;
-    case dsOutOfMemory: //          = 0x4000, ///< out of memory due to new request
-        fprintf(stderr, "DecodeFrameNoDelay -> dsOutOfMemory\n");
-        fflush(stderr);
-        break;
-        /**
-         * ANY OTHERS?
-         */
-    case dsDstBufNeedExpan: //      = 0x8000  ///< actual picture size exceeds size of dst pBuffer feed in decoder, so need expand its size
-        fprintf(stderr, "DecodeFrameNoDelay -> dsDstBufNeedExpan\n");
-        fflush(stderr);
-        break;
+    static const struct {
+        int state;
+        const char* name;
+    } names[] = {
+        { dsFramePending, "dsFramePending" }, // need more throughput to generate a frame output
+        { dsRefLost, "dsRefLost" }, // layer lost at reference frame with temporal id 0
+        { dsBitstreamError, "dsBitstreamError" }, // broken internal frame the decoder cared about
+        { dsDepLayerLost, "dsDepLayerLost" },
+        { dsNoParamSets, "dsNoParamSets" },
+        { dsDataErrorConcealed, "dsDataErrorConcealed" },
+        { dsRefListNullPtrs, "dsRefListNullPtrs" },
+        { dsInvalidArgument, "dsInvalidArgument" },
+        { dsInitialOptExpected, "dsInitialOptExpected" },
+        { dsOutOfMemory, "dsOutOfMemory" },
+        { dsDstBufNeedExpan, "dsDstBufNeedExpan" }, // picture larger than the destination buffer
+    };
+    for (const auto& n : names) {
+        if (st & n.state)
+            return n.name;
     }
+    return "dsErrorFree";
 }
 #endif
 
@@ -284,8 +248,6 @@ void Write2File(FILE* pFp, unsigned char* pData[3], int iStride[2], u32 iWidth,
         fwrite(pPtr, 1, iWidth, pFp);
         pPtr += iStride[0];
     }
-    fprintf(stderr, "WelsXXX:iHeight=%d iWidth=%d iStride[0]=%d %ld\n", iHeight, iWidth, iStride[0], (pPtr - pData[0]));
-    fflush(stderr);
 
     iHeight = iHeight / 2;
     iWidth = iWidth / 2;
@@ -302,126 +264,91 @@ void Write2File(FILE* pFp, unsigned char* pData[3], int iStride[2], u32 iWidth,
     }
 }
 
+#if HAVE_OPENH264
+// Writes a decoded picture to output, if any, and prints its checksums.
+static void ConsumeFrame(FILE* output, u32 index, const SBufferInfo& info)
+{
+    if (info.iBufferStatus != 1)
+        return;
+    u8* planes[3] = { info.pDst[0], info.pDst[1], info.pDst[2] };
+    int width = info.UsrData.sSystemBuffer.iWidth;
+    int height = info.UsrData.sSystemBuffer.iHeight;
+    int stride[2] = { info.UsrData.sSystemBuffer.iStride[0], info.UsrData.sSystemBuffer.iStride[1] };
+    if (output)
+        Write2File(output, planes, stride, width, height);
+    // Same digests as vvp --checksum, to compare against GPU decodes of the stream.
+    printf("frame %u checksum Y:%08x U:%08x V:%08x\n", index,
+        util::LaneHashPlane(planes[0], width, height, stride[0]),
+        util::LaneHashPlane(planes[1], width / 2, height / 2, stride[1]),
+        util::LaneHashPlane(planes[2], width / 2, height / 2, stride[1]));
+}
+#endif
+
+// Decodes the bitstream with openh264 and writes every frame to the output, "-" for none, printing their checksums.
+// Throughput on many streams is measured by vvp --cpu --streams=<n>, on the decode pool of vvb.
 int DecodeH264(char **args, int numArgs)
 {
 #if HAVE_OPENH264
-    int ret = -1;
-
-    if (numArgs != 2) XERROR(0, "-decode <input H264 bitstream> <output I420 YUV filename>\n");
+    if (numArgs != 2)
+        XERROR(0, "-decode <input H264 bitstream> <output I420 YUV filename|->\n");
     const char* h264BitstreamFilename = args[0];
     const char* yuvOutputFilename = args[1];
 
-    u8 uiStartCode[4] = { 0, 0, 0, 1 };
-
-    ISVCDecoder* h264Decoder;
-
-    SBufferInfo sDstBufInfo;
-    util::ZeroMemory((u8*)&sDstBufInfo, sizeof(SBufferInfo));
-
-    WelsCreateDecoder(&h264Decoder);
+    util::sized_buffer bitstream = util::ReadWholeBinaryFileIntoMemory(h264BitstreamFilename);
+    assert(!bitstream.has_error);
+    std::vector<size_t> units = util::SplitAccessUnits(bitstream.bytes, bitstream.len);
 
-    SDecodingParam sDecParam = { 0 };
+    ISVCDecoder* h264Decoder = nullptr;
+    if (WelsCreateDecoder(&h264Decoder) != 0 || !h264Decoder)
+        XERROR(0, "Could not create an openh264 decoder\n");
+    SDecodingParam sDecParam = {};
     sDecParam.uiTargetDqLayer = (u8)-1;
     sDecParam.eEcActiveIdc = ERROR_CON_SLICE_COPY;
     sDecParam.sVideoProperty.eVideoBsType = VIDEO_BITSTREAM_DEFAULT;
-
-    int levelSetting = 4;
-    int32_t iThreadCount = 0;
-    h264Decoder->SetOption(DECODER_OPTION_NUM_OF_THREADS, &iThreadCount);
+    int levelSetting = WELS_LOG_ERROR;
     h264Decoder->SetOption(DECODER_OPTION_TRACE_LEVEL, &levelSetting);
-    h264Decoder->Initialize(&sDecParam);
-
-    // Load h264 bitstream
-    util::sized_buffer bitstream = util::ReadWholeBinaryFileIntoMemory(h264BitstreamFilename);
-    assert(!bitstream.has_error);
-
-    u8* pBuf = new u8[bitstream.len + 4];
-    memcpy(pBuf, bitstream.bytes, bitstream.len);
-    memcpy(pBuf + bitstream.len, &uiStartCode[0], 4);
-
-    uint8_t* pData[3] = { NULL };
-    uint8_t* pDst[3] = { NULL };
-
-    DECODING_STATE st;
-
-    i32 iBufPos = 0;
-    i32 iFrameCount = 0;
-    i32 iSliceSize = 0;
-    i32 iSliceIndex = 0;
-    i32 iWidth = 0;
-    i32 iHeight = 0;
-
-    bool bEndOfStreamFlag = false;
+    if (h264Decoder->Initialize(&sDecParam) != cmResultSuccess)
+        XERROR(0, "Could not initialize an openh264 decoder\n");
+
+    // Opened once, frames are appended as they come out
+    FILE* output = nullptr;
+    if (strcmp(yuvOutputFilename, "-") != 0) {
+        output = fopen(yuvOutputFilename, "wb");
+        if (!output)
+            XERROR(errno, "opening %s", yuvOutputFilename);
+    }
 
-    unsigned long long uiTimeStamp = 0;
+    u32 frames = 0;
+    u32 errors = 0;
+    for (size_t unit = 0; unit + 1 < units.size(); unit++) {
+        u8* planes[3] = {};
+        SBufferInfo info = {};
+        info.uiInBsTimeStamp = unit;
+        DECODING_STATE st = h264Decoder->DecodeFrameNoDelay(bitstream.bytes + units[unit],
+            int(units[unit + 1] - units[unit]), planes, &info);
+        if ((st & ~dsFramePending) && errors++ == 0)
+            fprintf(stderr, "access unit %zu: DecodeFrameNoDelay -> %s\n", unit, DecodingStateName(st));
+        ConsumeFrame(output, frames, info);
+        frames += info.iBufferStatus == 1;
+    }
 
-    while (true) {
-        if (iBufPos >= bitstream.len) {
-            bEndOfStreamFlag = true;
-            h264Decoder->SetOption(DECODER_OPTION_END_OF_STREAM, (void*)&bEndOfStreamFlag);
+    // The pictures openh264 holds back
+    bool bEndOfStreamFlag = true;
+    h264Decoder->SetOption(DECODER_OPTION_END_OF_STREAM, &bEndOfStreamFlag);
+    for (;;) {
+        u8* planes[3] = {};
+        SBufferInfo info = {};
+        h264Decoder->FlushFrame(planes, &info);
+        if (info.iBufferStatus != 1)
             break;
-        }
-
-        // Find end of next slice.
-        int i = 0;
-        for (i = 0; i < bitstream.len; i++) {
-            if ((pBuf[iBufPos + i] == 0 && pBuf[iBufPos + i + 1] == 0 && pBuf[iBufPos + i + 2] == 0 && pBuf[iBufPos + i + 3] == 1
-                    && i > 0)
-                || (pBuf[iBufPos + i] == 0 && pBuf[iBufPos + i + 1] == 0 && pBuf[iBufPos + i + 2] == 1 && i > 0)) {
-                break;
-            }
-        }
-        iSliceSize = i;
-
-        if (iSliceSize < 4) {
-            iBufPos += iSliceSize;
-            continue;
-        }
-
-        pData[0] = NULL;
-        pData[1] = NULL;
-        pData[2] = NULL;
-
-        uiTimeStamp++;
-
-        memset(&sDstBufInfo, 0, sizeof(SBufferInfo));
-
-        sDstBufInfo.uiInBsTimeStamp = uiTimeStamp;
-
-        st = h264Decoder->DecodeFrameNoDelay(pBuf + iBufPos, iSliceSize, pData, &sDstBufInfo);
-        logDecodingState(st);
-
-        if (sDstBufInfo.iBufferStatus == 1) {
-            ++iFrameCount;
-
-            pDst[0] = sDstBufInfo.pDst[0];
-            pDst[1] = sDstBufInfo.pDst[1];
-            pDst[2] = sDstBufInfo.pDst[2];
-
-            DEBUG(1, "New frame! %d\n", iFrameCount);
-
-            iWidth = sDstBufInfo.UsrData.sSystemBuffer.iWidth;
-            iHeight = sDstBufInfo.UsrData.sSystemBuffer.iHeight;
-            int iStride[2];
-            iStride[0] = sDstBufInfo.UsrData.sSystemBuffer.iStride[0];
-            iStride[1] = sDstBufInfo.UsrData.sSystemBuffer.iStride[1];
-
-            FILE* decodedFrame = fopen(yuvOutputFilename, "wb");
-            if (!decodedFrame) XERROR(errno, "opening %s", yuvOutputFilename);
-
-            Write2File(decodedFrame, (unsigned char**)pDst, iStride, iWidth, iHeight);
-
-            fclose(decodedFrame);
-        }
-
-        iBufPos += iSliceSize;
-        ++iSliceIndex;
+        ConsumeFrame(output, frames++, info);
     }
 
-    if (h264Decoder) {
-        h264Decoder->Uninitialize();
-        WelsDestroyDecoder(h264Decoder);
-    }
+    h264Decoder->Uninitialize();
+    WelsDestroyDecoder(h264Decoder);
+    if (output)
+        fclose(output);
+    printf("%zu access units: %u frames, %u errors\n", units.size() - 1, frames, errors);
 
     util::FreeSizedBuffer(&bitstream);
     return 0;
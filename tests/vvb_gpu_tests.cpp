@@ -0,0 +1,177 @@
+/*
+* Copyright 2023 Igalia S.L.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+// Checks the compute shaders against their CPU references on a real Vulkan implementation, lavapipe in ctest. It
+// has no video queues, so pictures are uploaded rather than decoded; exits with 77 (skipped) without a device.
+#include "vvb.cpp"
+
+static int failures = 0;
+
+#define CHECK(expr)                                                        \
+    do {                                                                   \
+        if (!(expr)) {                                                     \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+static void SubmitAndWait(SysVulkan* sys_vk, VkCommandBuffer cmd_buf)
+{
+    auto& vk = sys_vk->_vfn;
+    VK_CHECK(vk.EndCommandBuffer(cmd_buf));
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &cmd_buf;
+    VK_CHECK(vk.QueueSubmit(sys_vk->_comp_queue0, 1, &submit_info, VK_NULL_HANDLE));
+    VK_CHECK(vk.DeviceWaitIdle(sys_vk->_active_dev));
+}
+
+// The digests RecordFrameChecksums reads back for NV12 pictures in the layers of a DPB have to be those
+// util::LaneHashPlane gives for the same samples, which the CPU decoder reports.
+static void TestFrameChecksums(SysVulkan* sys_vk)
+{
+    auto& vk = sys_vk->_vfn;
+    // Chroma rows end in a partial word, the frames hashed don't start at the first layer.
+    const u32 width = 70, height = 38, num_layers = 3, first_slot = 1, num_frames = 2;
+    const size_t luma_size = size_t(width) * height, layer_size = luma_size * 3 / 2;
+
+    Dpb dpb = {};
+    dpb._coincident_image_resources = true;
+    dpb._dpb_image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    dpb._dpb_image_info.flags = VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT | VK_IMAGE_CREATE_EXTENDED_USAGE_BIT;
+    dpb._dpb_image_info.imageType = VK_IMAGE_TYPE_2D;
+    dpb._dpb_image_info.format = VK_FORMAT_G8_B8R8_2PLANE_420_UNORM;
+    dpb._dpb_image_info.extent = { width, height, 1 };
+    dpb._dpb_image_info.mipLevels = 1;
+    dpb._dpb_image_info.arrayLayers = num_layers;
+    dpb._dpb_image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    dpb._dpb_image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    dpb._dpb_image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    dpb._dpb_image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    dpb._dpb_image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    dpb._dpb_alloc_create_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    VK_CHECK(vmaCreateImage(sys_vk->_allocator, &dpb._dpb_image_info, &dpb._dpb_alloc_create_info, &dpb._dpb_images,
+        &dpb._dpb_allocation, nullptr));
+
+    BufferResource staging = CreateBufferResource(sys_vk, layer_size * num_layers, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    BufferResource digests = CreateBufferResource(sys_vk, num_frames * 3 * sizeof(u32),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+        VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT);
+    ASSERT(staging._mapped && digests._mapped);
+    u8* pictures = (u8*)staging._mapped;
+    for (size_t i = 0; i < layer_size * num_layers; i++)
+        pictures[i] = u8(i * 7 + (i >> 5));
+
+    VkCommandPoolCreateInfo cmd_pool_info = {};
+    cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cmd_pool_info.queueFamilyIndex = sys_vk->queue_family_comp_index;
+    VkCommandPool cmd_pool = VK_NULL_HANDLE;
+    VK_CHECK(vk.CreateCommandPool(sys_vk->_active_dev, &cmd_pool_info, nullptr, &cmd_pool));
+    VkCommandBufferAllocateInfo cmd_buf_alloc_info = {};
+    cmd_buf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buf_alloc_info.commandPool = cmd_pool;
+    cmd_buf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd_buf_alloc_info.commandBufferCount = 2;
+    VkCommandBuffer cmd_bufs[2] = {};
+    VK_CHECK(vk.AllocateCommandBuffers(sys_vk->_active_dev, &cmd_buf_alloc_info, cmd_bufs));
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    // Upload the pictures in place of a decode. lavapipe ignores layouts, the DPB layout the hasher transitions
+    // from stands for whatever the copy left the layers in.
+    VK_CHECK(vk.BeginCommandBuffer(cmd_bufs[0], &begin_info));
+    VkImageMemoryBarrier2 upload_barrier = {};
+    upload_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    upload_barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE_KHR;
+    upload_barrier.dstStageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT_KHR;
+    upload_barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT_KHR;
+    upload_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    upload_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    upload_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    upload_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    upload_barrier.image = dpb._dpb_images;
+    upload_barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, num_layers };
+    VkDependencyInfoKHR dep_info = {};
+    dep_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR;
+    dep_info.imageMemoryBarrierCount = 1;
+    dep_info.pImageMemoryBarriers = &upload_barrier;
+    vk.CmdPipelineBarrier2KHR(cmd_bufs[0], &dep_info);
+    std::vector<VkBufferImageCopy> regions;
+    for (u32 layer = 0; layer < num_layers; layer++) {
+        VkBufferImageCopy region = {};
+        region.bufferOffset = layer_size * layer;
+        region.imageSubresource = { VK_IMAGE_ASPECT_PLANE_0_BIT, 0, layer, 1 };
+        region.imageExtent = { width, height, 1 };
+        regions.push_back(region);
+        region.bufferOffset += luma_size;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_PLANE_1_BIT;
+        region.imageExtent = { width / 2, height / 2, 1 };
+        regions.push_back(region);
+    }
+    vk.CmdCopyBufferToImage(cmd_bufs[0], staging._buffer, dpb._dpb_images, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        regions.size(), regions.data());
+    SubmitAndWait(sys_vk, cmd_bufs[0]);
+
+    FrameHasher hasher = CreateFrameHasher(sys_vk);
+    VK_CHECK(vk.BeginCommandBuffer(cmd_bufs[1], &begin_info));
+    RecordFrameChecksums(sys_vk, &hasher, cmd_bufs[1], &dpb, first_slot, num_frames, width, height, digests._buffer, 0);
+    SubmitAndWait(sys_vk, cmd_bufs[1]);
+
+    const u32* gpu = (const u32*)digests._mapped;
+    for (u32 i = 0; i < num_frames; i++) {
+        const u8* luma = pictures + layer_size * (first_slot + i);
+        const u8* cbcr = luma + luma_size;
+        u32 cpu[3] = {
+            util::LaneHashPlane(luma, width, height, width),
+            util::LaneHashPlane(cbcr, width / 2, height / 2, width, 2),
+            util::LaneHashPlane(cbcr + 1, width / 2, height / 2, width, 2),
+        };
+        for (u32 p = 0; p < 3; p++)
+            CHECK(gpu[3 * i + p] == cpu[p]);
+    }
+
+    DestroyFrameHasher(sys_vk, &hasher);
+    vk.DestroyCommandPool(sys_vk->_active_dev, cmd_pool, nullptr);
+    DestroyBufferResource(sys_vk, &digests);
+    DestroyBufferResource(sys_vk, &staging);
+    vmaDestroyImage(sys_vk->_allocator, dpb._dpb_images, dpb._dpb_allocation);
+}
+
+int main()
+{
+    SysVulkan::UserOptions options;
+    options.enable_validation = false;
+    options.physical_device_index = 0; // ctest only lists lavapipe
+    options.compute_only = true;
+    SysVulkan sys_vk(options);
+    if (!init_vulkan(sys_vk) ||
+        !FrameChecksumSupported(&sys_vk, VK_FORMAT_G8_B8R8_2PLANE_420_UNORM, VK_IMAGE_USAGE_TRANSFER_DST_BIT, nullptr)) {
+        printf("No Vulkan device that samples NV12 pictures from a compute queue, skipped\n");
+        return 77;
+    }
+
+    TestFrameChecksums(&sys_vk);
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
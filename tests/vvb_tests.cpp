@@ -0,0 +1,371 @@
+/*
+* Copyright 2023 Igalia S.L.
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*    http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+// Unit tests of the parts of vvb that don't need a device. They are internal to its translation unit, so it is
+// compiled in here rather than linked.
+#include "vvb.cpp"
+
+#include <thread>
+
+#include <sys/stat.h>
+
+static int failures = 0;
+
+#define CHECK(expr)                                                        \
+    do {                                                                   \
+        if (!(expr)) {                                                     \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+// A deterministic NV12 picture, rows pitch bytes apart, with the CbCr plane right after the luma plane.
+static std::vector<u8> TestPicture(u32 height, u32 pitch)
+{
+    std::vector<u8> nv12(size_t(pitch) * height * 3 / 2);
+    for (size_t i = 0; i < nv12.size(); i++)
+        nv12[i] = u8(i * 7 + (i >> 5));
+    return nv12;
+}
+
+// The two passes of shaders/nv12_checksum.comp over an NV12 picture: every row hashed into the rows buffer at
+// RowBase, each plane sampled from the interleaved CbCr plane like its texelFetch, then the rows folded.
+static void ShaderChecksums(const u8* nv12, u32 width, u32 height, u32 pitch, u32 digests[3])
+{
+    const u32 P1 = util::LaneHashP1, P2 = util::LaneHashP2, P3 = util::LaneHashP3, P4 = util::LaneHashP4,
+        P5 = util::LaneHashP5;
+    auto sample = [&](u32 plane, u32 x, u32 y) -> u32 {
+        if (plane == 0)
+            return nv12[size_t(y) * pitch + x];
+        return nv12[size_t(height) * pitch + size_t(y) * pitch + 2 * x + (plane - 1)];
+    };
+    auto row_base = [&](u32 plane) { return plane == 0 ? 0 : height + (plane - 1) * (height / 2); };
+
+    std::vector<u32> rows(2 * height);
+    for (u32 plane = 0; plane < 3; plane++) {
+        u32 plane_width = plane == 0 ? width : width / 2;
+        u32 plane_height = plane == 0 ? height : height / 2;
+        for (u32 row = 0; row < plane_height; row++) {
+            u32 acc = P5 + plane_width;
+            for (u32 x = 0; x < plane_width; x += 4) {
+                u32 word = 0;
+                for (u32 i = 0; i < 4 && x + i < plane_width; i++)
+                    word |= sample(plane, x + i, row) << (8 * i);
+                acc = util::LaneHashRotl(acc + word * P2, 13) * P1;
+            }
+            rows[row_base(plane) + row] = util::LaneHashAvalanche(acc);
+        }
+    }
+    for (u32 plane = 0; plane < 3; plane++) {
+        u32 plane_height = plane == 0 ? height : height / 2;
+        u32 digest = P5 + plane_height;
+        for (u32 row = 0; row < plane_height; row++)
+            digest = util::LaneHashRotl(digest + rows[row_base(plane) + row] * P3, 17) * P4;
+        digests[plane] = util::LaneHashAvalanche(digest);
+    }
+}
+
+// util::LaneHashPlane has to give the digests of the checksum shader, on the interleaved CbCr plane with a step
+// and on the I420 planes the CPU decoder outputs, and keep giving the same ones: the pinned values change with
+// both or neither.
+static void TestLaneHashPlane()
+{
+    struct {
+        u32 width, height;
+        u32 digests[3];
+    } cases[] = {
+        { 64, 32, { 0x0fc81147, 0xf35a565f, 0xf67762a6 } },
+        { 36, 18, { 0x3125fd76, 0x6ccdf1c6, 0xb026230e } }, // chroma rows end in a partial word
+    };
+    for (const auto& c : cases) {
+        u32 pitch = c.width + 12;
+        std::vector<u8> nv12 = TestPicture(c.height, pitch);
+        const u8* cbcr = nv12.data() + size_t(pitch) * c.height;
+
+        u32 shader[3];
+        ShaderChecksums(nv12.data(), c.width, c.height, pitch, shader);
+        u32 nv12_digests[3] = {
+            util::LaneHashPlane(nv12.data(), c.width, c.height, pitch),
+            util::LaneHashPlane(cbcr, c.width / 2, c.height / 2, pitch, 2),
+            util::LaneHashPlane(cbcr + 1, c.width / 2, c.height / 2, pitch, 2),
+        };
+
+        u32 chroma_pitch = c.width / 2 + 3;
+        std::vector<u8> cb(size_t(chroma_pitch) * c.height / 2), cr(cb.size());
+        for (u32 y = 0; y < c.height / 2; y++) {
+            for (u32 x = 0; x < c.width / 2; x++) {
+                cb[size_t(y) * chroma_pitch + x] = cbcr[size_t(y) * pitch + 2 * x];
+                cr[size_t(y) * chroma_pitch + x] = cbcr[size_t(y) * pitch + 2 * x + 1];
+            }
+        }
+        u32 i420_digests[3] = {
+            nv12_digests[0],
+            util::LaneHashPlane(cb.data(), c.width / 2, c.height / 2, chroma_pitch),
+            util::LaneHashPlane(cr.data(), c.width / 2, c.height / 2, chroma_pitch),
+        };
+
+        for (u32 p = 0; p < 3; p++) {
+            CHECK(nv12_digests[p] == shader[p]);
+            CHECK(i420_digests[p] == shader[p]);
+            CHECK(nv12_digests[p] == c.digests[p]);
+        }
+    }
+
+    // Padding is not hashed, any change of a sample is
+    u32 pitch = 64 + 12;
+    std::vector<u8> nv12 = TestPicture(32, pitch);
+    u32 digest = util::LaneHashPlane(nv12.data(), 64, 32, pitch);
+    nv12[64] ^= 0xff;
+    CHECK(util::LaneHashPlane(nv12.data(), 64, 32, pitch) == digest);
+    nv12[pitch + 63] ^= 1;
+    CHECK(util::LaneHashPlane(nv12.data(), 64, 32, pitch) != digest);
+}
+
+static void TestComputeRenditionSet()
+{
+    using namespace vvb;
+
+    const u32 divisors[] = { 4, 8 };
+    RenditionSet r = ComputeRenditionSet(1920, 1080, divisors, 2);
+    CHECK(r._count == 2);
+    CHECK(r._renditions[0]._width == 480 && r._renditions[0]._height == 270);
+    CHECK(r._renditions[0]._luma_offset == 0);
+    CHECK(r._renditions[0]._chroma_offset == 480 * 270);
+    CHECK(r._renditions[0]._size == 480 * 270 * 3 / 2);
+    // 135 rows rounded down to 134, renditions are packed back to back
+    CHECK(r._renditions[1]._width == 240 && r._renditions[1]._height == 134);
+    CHECK(r._renditions[1]._luma_offset == r._renditions[0]._size);
+    CHECK(r._renditions[1]._chroma_offset == r._renditions[0]._size + 240 * 134);
+    CHECK(r._renditions[1]._size == 240 * 134 * 3 / 2);
+    CHECK(r._total_size == r._renditions[0]._size + r._renditions[1]._size);
+
+    // Widths are multiples of 4 and heights of 2, of at least one 4x2 block
+    const u32 odd[] = { 3 };
+    r = ComputeRenditionSet(1278, 718, odd, 1);
+    CHECK(r._renditions[0]._width == 424 && r._renditions[0]._height == 238);
+    const u32 tiny[] = { 8, 16 };
+    r = ComputeRenditionSet(16, 8, tiny, 2);
+    for (u32 i = 0; i < 2; i++)
+        CHECK(r._renditions[i]._width == 4 && r._renditions[i]._height == 2);
+    CHECK(r._total_size == 2 * 12);
+
+    r = ComputeRenditionSet(1920, 1080, divisors, 0);
+    CHECK(r._count == 0 && r._total_size == 0);
+}
+
+static void TestRbspWriter()
+{
+    using namespace vvb;
+
+    // ue(v) and se(v) of H.264 9.1, with the last byte completed by rbsp_trailing_bits
+    RbspWriter w;
+    w.UE(0); // 1
+    w.UE(1); // 010
+    w.UE(2); // 011
+    w.UE(3); // 00100
+    w.SE(1); // 010
+    w.SE(-1); // 011
+    w.TrailingBits();
+    CHECK((w._bytes == std::vector<u8> { 0b10100110, 0b01000100, 0b11100000 }));
+
+    // Emulation prevention after two zero bytes followed by a byte of 3 or less
+    std::vector<u8> nal;
+    AppendNalUnit(&nal, 0x67, { 0, 0, 1, 0, 0, 0, 0, 0, 4 });
+    CHECK((nal == std::vector<u8> { 0, 0, 0, 1, 0x67, 0, 0, 3, 1, 0, 0, 3, 0, 0, 3, 0, 4 }));
+
+    // Constrained baseline 1080p, POC type 0, cropped from 1088 rows, no VUI
+    StdVideoH264SequenceParameterSet sps = {};
+    sps.profile_idc = STD_VIDEO_H264_PROFILE_IDC_BASELINE;
+    sps.flags.constraint_set1_flag = 1;
+    sps.level_idc = STD_VIDEO_H264_LEVEL_IDC_4_0;
+    sps.pic_order_cnt_type = STD_VIDEO_H264_POC_TYPE_0;
+    sps.log2_max_pic_order_cnt_lsb_minus4 = 2;
+    sps.max_num_ref_frames = 1;
+    sps.pic_width_in_mbs_minus1 = 119;
+    sps.pic_height_in_map_units_minus1 = 67;
+    sps.flags.frame_mbs_only_flag = 1;
+    sps.flags.direct_8x8_inference_flag = 1;
+    sps.flags.frame_cropping_flag = 1;
+    sps.frame_crop_bottom_offset = 4;
+    RbspWriter baseline;
+    WriteSps(&baseline, sps);
+    CHECK((baseline._bytes == std::vector<u8> { 0x42, 0x40, 0x28, 0xed, 0x00, 0xf0, 0x04, 0x4f, 0xca, 0x80 }));
+
+    // The parameter sets of the test stream are those of data/clip-a.h264, except for the bitstream restriction
+    // of the VUI: StdVideoH264SequenceParameterSetVui only has the reorder and buffering fields, the others are
+    // written with their inferred values.
+    AvcParameterSets ps;
+    InitAvcParameterSets(&ps);
+    std::vector<u8> expected = {
+        0, 0, 0, 1, 0x67, 0x64, 0x00, 0x0b, 0xac, 0xb2, 0x05, 0x89, 0xd0, 0x80, 0x00, 0x00, 0x03, 0x00, 0x80,
+        0x00, 0x00, 0x1e, 0x06, 0xd0, 0x44, 0x23, 0x24,
+        0, 0, 0, 1, 0x68, 0xeb, 0xc0, 0x43, 0x2c, 0x8b,
+    };
+    CHECK(WriteAvcParameterSets(ps) == expected);
+}
+
+static void TestReadAvcCodedExtent()
+{
+    using namespace vvb;
+
+    // High profile with an emulation prevention byte, the SPS of the test stream
+    const u8 high[] = { 0x67, 0x64, 0x00, 0x0b, 0xac, 0xb2, 0x05, 0x89, 0xd0, 0x80, 0x00, 0x00, 0x03, 0x00, 0x80,
+        0x00, 0x00, 0x1e, 0x06, 0xd0, 0x44, 0x23, 0x24 };
+    VkExtent2D extent = {};
+    CHECK(ReadAvcCodedExtent(high, sizeof(high), &extent));
+    CHECK(extent.width == 176 && extent.height == 144);
+
+    // The baseline 1080p SPS of TestRbspWriter, coded with 1088 rows
+    const u8 baseline[] = { 0x67, 0x42, 0x40, 0x28, 0xed, 0x00, 0xf0, 0x04, 0x4f, 0xca, 0x80 };
+    CHECK(ReadAvcCodedExtent(baseline, sizeof(baseline), &extent));
+    CHECK(extent.width == 1920 && extent.height == 1088);
+
+    // Truncated before the picture size
+    extent = {};
+    CHECK(!ReadAvcCodedExtent(baseline, 6, &extent));
+    CHECK(extent.width == 0 && extent.height == 0);
+}
+
+static void TestSpscQueue()
+{
+    // Capacities are not rounded up to the slots
+    util::SpscQueue<u32> queue(3);
+    CHECK(queue.Capacity() == 3);
+    u32 item = 0;
+    CHECK(!queue.TryPop(&item));
+    for (u32 round = 0; round < 10; round++) {
+        for (u32 i = 0; i < 3; i++)
+            CHECK(queue.TryPush(round * 3 + i));
+        CHECK(queue.Full());
+        CHECK(!queue.TryPush(~0u));
+        for (u32 i = 0; i < 3; i++) {
+            CHECK(queue.TryPop(&item));
+            CHECK(item == round * 3 + i);
+        }
+        CHECK(!queue.TryPop(&item));
+    }
+    CHECK(queue.Pushes() == 30);
+    CHECK(queue.MaxOccupancy() == 3);
+    CHECK(queue.AverageOccupancy() == 2.0f);
+
+    // In order across threads, with both sides blocking
+    constexpr u32 Count = 1 << 16;
+    util::SpscQueue<u32> pipe(4);
+    std::thread producer([&pipe] {
+        for (u32 i = 0; i < Count; i++)
+            pipe.Push(i);
+    });
+    u32 in_order = 0;
+    for (u32 i = 0; i < Count; i++) {
+        pipe.Pop(&item);
+        in_order += item == i;
+    }
+    producer.join();
+    CHECK(in_order == Count);
+    CHECK(pipe.Pushes() == Count);
+    CHECK(pipe.MaxOccupancy() <= 4);
+    CHECK(!pipe.TryPop(&item));
+}
+
+static void TestCapabilityCache()
+{
+    using namespace vvb;
+
+    char dir[] = "/tmp/vvb_tests.XXXXXX";
+    CHECK(mkdtemp(dir));
+    setenv("XDG_CACHE_HOME", dir, 1);
+
+    CapabilityCache::Key key = {};
+    for (u32 i = 0; i < VK_UUID_SIZE; i++)
+        key.driver_uuid[i] = u8(i);
+    key.vendor_id = 0x10de;
+    key.device_id = 0x2684;
+    key.driver_version = 1;
+    key.header_version = VK_HEADER_VERSION;
+
+    // Nothing is stored before a device is opened
+    CapabilityCache cache;
+    u64 value = 0x0123456789abcdef;
+    cache.Store(CapabilityCache::RECORD_FEATURES, 0, &value, sizeof(value));
+    CHECK(!cache.Enabled());
+
+    cache.Open(key, false);
+    CHECK(cache.Enabled());
+    CHECK(cache.Path().starts_with(std::string(dir) + "/vvb/"));
+    const u32 formats[] = { 1, 2, 3 };
+    cache.Store(CapabilityCache::RECORD_FEATURES, 0, &value, sizeof(value));
+    cache.Store(CapabilityCache::RECORD_VIDEO_FORMATS, 7, formats, sizeof(formats));
+    cache.Save();
+
+    CapabilityCache reopened;
+    reopened.Open(key, false);
+    u64 found = 0;
+    CHECK(reopened.FindValue(CapabilityCache::RECORD_FEATURES, 0, &found) && found == value);
+    u32 wrong_size = 0;
+    CHECK(!reopened.FindValue(CapabilityCache::RECORD_FEATURES, 0, &wrong_size));
+    CHECK(!reopened.FindValue(CapabilityCache::RECORD_FEATURES, 1, &found));
+    std::vector<u32> found_formats;
+    CHECK(reopened.FindArray(CapabilityCache::RECORD_VIDEO_FORMATS, 7, &found_formats));
+    CHECK((found_formats == std::vector<u32> { 1, 2, 3 }));
+
+    // A record stored again replaces the first one
+    u64 updated = 42;
+    reopened.Store(CapabilityCache::RECORD_FEATURES, 0, &updated, sizeof(updated));
+    reopened.Save();
+    CapabilityCache third;
+    third.Open(key, false);
+    CHECK(third.FindValue(CapabilityCache::RECORD_FEATURES, 0, &found) && found == updated);
+    CHECK(third.FindArray(CapabilityCache::RECORD_VIDEO_FORMATS, 7, &found_formats));
+
+    // A driver update changes the key, refresh ignores what is there
+    CapabilityCache::Key updated_driver = key;
+    updated_driver.driver_version = 2;
+    CapabilityCache other;
+    other.Open(updated_driver, false);
+    CHECK(!other.FindValue(CapabilityCache::RECORD_FEATURES, 0, &found));
+    CapabilityCache refreshed;
+    refreshed.Open(key, true);
+    CHECK(!refreshed.FindValue(CapabilityCache::RECORD_FEATURES, 0, &found));
+
+    // A truncated file loses every record
+    struct stat st;
+    CHECK(stat(third.Path().c_str(), &st) == 0);
+    CHECK(truncate(third.Path().c_str(), st.st_size - 1) == 0);
+    CapabilityCache truncated;
+    truncated.Open(key, false);
+    CHECK(!truncated.FindValue(CapabilityCache::RECORD_FEATURES, 0, &found));
+    CHECK(!truncated.FindArray(CapabilityCache::RECORD_VIDEO_FORMATS, 7, &found_formats));
+
+    unlink(third.Path().c_str());
+    rmdir((std::string(dir) + "/vvb").c_str());
+    rmdir(dir);
+}
+
+int main()
+{
+    TestLaneHashPlane();
+    TestComputeRenditionSet();
+    TestRbspWriter();
+    TestReadAvcCodedExtent();
+    TestSpscQueue();
+    TestCapabilityCache();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}